@@ -0,0 +1,188 @@
+#include "instance.h"
+#include "mesh.h"
+#include "primitives.h"
+#include "bvh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+/* Measure a field of instances of one group: a sphere tessellated into
+   about 20,000 triangles, placed 10,000 times, turned and scaled at
+   random.  Report the memory the instances take up against what copies of
+   the mesh would take, the time to build the scene's primitives and to
+   refit their BVH once every instance has moved, and the rate at which it
+   traces closest hit and shadow rays. */
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+#define NUM_INSTANCES 10000
+#define NUM_RAYS 1000000
+
+static const int segments = 100;
+
+static float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+static vector random_vector (float min, float max)
+{
+    return (vector){ random_float(min, max), random_float(min, max), random_float(min, max) };
+}
+
+static double seconds (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static triangle_mesh * tessellated_sphere (int segments)
+/*! Make a sphere of radius 1 at the origin from a grid of "segments" by
+    "segments" cells of latitude and longitude, two triangles each */
+{
+    int rows = segments + 1, columns = segments;
+    vector * vertices = malloc(sizeof(vector) * rows * columns);
+    int * indices = malloc(sizeof(int) * 6 * segments * columns);
+    int row, column, next, * triangle = indices;
+    float latitude, longitude;
+
+    if (vertices == NULL || indices == NULL)
+    {
+        free(vertices);
+        free(indices);
+        return NULL;
+    }
+    for (row = 0; row < rows; row++)
+    {
+        latitude = M_PI * row / segments;
+        for (column = 0; column < columns; column++)
+        {
+            longitude = 2 * M_PI * column / columns;
+            vertices[row * columns + column] =
+                (vector){ sinf(latitude) * cosf(longitude), cosf(latitude),
+                          sinf(latitude) * sinf(longitude) };
+        }
+    }
+    for (row = 0; row < segments; row++)
+    {
+        for (column = 0; column < columns; column++)
+        {
+            next = (column + 1) % columns;
+            triangle[0] = row * columns + column;
+            triangle[1] = row * columns + next;
+            triangle[2] = (row + 1) * columns + next;
+            triangle[3] = row * columns + column;
+            triangle[4] = (row + 1) * columns + next;
+            triangle[5] = (row + 1) * columns + column;
+            triangle += 6;
+        }
+    }
+    return mesh_create(vertices, rows * columns, indices, 2 * segments * columns);
+}
+
+int main ()
+{
+    surface group_surfaces[2] = {{ .class = NULL }, { .class = NULL }};
+    surface * instances = calloc(NUM_INSTANCES + 1, sizeof(surface));
+    instance_transform * transforms = malloc(sizeof(instance_transform) * NUM_INSTANCES);
+    vector * origins = malloc(sizeof(vector) * NUM_RAYS);
+    vector * rays = malloc(sizeof(vector) * NUM_RAYS);
+    triangle_mesh * triangles = tessellated_sphere(segments);
+    instance_group group;
+    instance * cur_instance;
+    primitives * primitives;
+    affine_transform * to_object;
+    vector intersection, normal, position;
+    int index, hits = 0, blocked = 0;
+    float scale;
+    double start, elapsed;
+
+    srand(1);
+    if (triangles == NULL || instances == NULL || transforms == NULL || origins == NULL ||
+        rays == NULL)
+    {
+        perror("Instances");
+        return 1;
+    }
+    group_surfaces[0].class = surface_mesh;
+    ((mesh *)group_surfaces[0].geometry)->triangles = triangles;
+    instance_group_create(&group, group_surfaces);
+
+    /* Spheres of radius 0.5 to 2 scattered through a cube of side 200, some
+       squashed along one axis */
+    for (index = 0; index < NUM_INSTANCES; index++)
+    {
+        scale = random_float(0.5, 2);
+        instance_transform_make((vector){ scale, scale * random_float(0.5, 1), scale },
+                                random_vector(-M_PI, M_PI), random_vector(-100, 100),
+                                &transforms[index]);
+        instances[index].class = surface_instance;
+        cur_instance = (instance *)instances[index].geometry;
+        cur_instance->group = &group;
+        cur_instance->transform = &transforms[index];
+    }
+
+    start = seconds();
+    primitives = primitives_create(instances);
+    printf("%-30s %7.3f s\n", "Build scene primitives", seconds() - start);
+    printf("%d instances of %d triangles\n", NUM_INSTANCES, triangles->num_triangles);
+    printf("%-30s %7.1f MB\n", "Group mesh", mesh_memory_size(triangles) * 1e-6);
+    printf("%-30s %7.1f MB, %d bytes per instance\n", "Instances",
+           NUM_INSTANCES * (sizeof(surface) + sizeof(instance_transform)) * 1e-6,
+           (int)(sizeof(surface) + sizeof(instance_transform)));
+    printf("%-30s %7.1f MB\n\n", "As copies of the mesh",
+           (double)NUM_INSTANCES * mesh_memory_size(triangles) * 1e-6);
+
+    /* Move every instance a little, as a frame of an animation would */
+    for (index = 0; index < NUM_INSTANCES; index++)
+    {
+        to_object = &transforms[index].to_object;
+        position = vector_add(transforms[index].to_world.translation, random_vector(-1, 1));
+        transforms[index].to_world.translation = position;
+        to_object->translation =
+            vector_negate(vector_add(vector_add(vector_multiply(position.x, to_object->columns[0]),
+                                                vector_multiply(position.y, to_object->columns[1])),
+                                     vector_multiply(position.z, to_object->columns[2])));
+    }
+    start = seconds();
+    primitives_refit(primitives);
+    printf("%-30s %7.3f s\n\n", "Refit after moving", seconds() - start);
+
+    for (index = 0; index < NUM_RAYS; index++)
+    {
+        origins[index] = random_vector(-120, 120);
+        rays[index] = vector_normalize(vector_sub(random_vector(-100, 100), origins[index]));
+    }
+
+    start = seconds();
+    for (index = 0; index < NUM_RAYS; index++)
+    {
+        hits += primitives_hit_surface(primitives, origins[index], rays[index],
+                                       &intersection, &normal) != NULL;
+    }
+    elapsed = seconds() - start;
+    printf("%-30s %7.3f s  %6.2f Mrays/s\n", "Closest hits", elapsed, NUM_RAYS / elapsed * 1e-6);
+
+    start = seconds();
+    for (index = 0; index < NUM_RAYS; index++)
+    {
+        blocked += primitives_is_occluded(primitives, origins[index], rays[index], INFINITY, NULL);
+    }
+    elapsed = seconds() - start;
+    printf("%-30s %7.3f s  %6.2f Mrays/s\n", "Shadow rays", elapsed, NUM_RAYS / elapsed * 1e-6);
+    printf("\n%d rays hit an instance, %d shadow rays blocked\n", hits, blocked);
+
+    primitives_free(primitives);
+    instance_group_free(&group);
+    mesh_free(triangles);
+    free(instances);
+    free(transforms);
+    free(origins);
+    free(rays);
+    return hits == blocked ? 0 : 1;
+}
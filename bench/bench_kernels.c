@@ -0,0 +1,560 @@
+#define _GNU_SOURCE
+
+#include "surface.h"
+#include "intersect.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+
+/* Time the ray/primitive intersection code on its own, away from any
+   acceleration structure: the intersection and occlusion functions of the
+   surface classes of surface.c, called through each surface's class as the
+   renderer calls them, with and without the normal, and the kernels of
+   intersect.h, given primitives baked beforehand as primitives.h bakes them.
+
+   Each class is timed on three sets of tests, each test a ray and one of the
+   class's primitives: rays aimed to hit, rays aimed to just miss, and a mix
+   of the two hitting at the given rate.  Each measurement is warmed up,
+   which also finds how many runs over the set take at least the minimum
+   time, and then repeated.  It reports the median and the least nanoseconds
+   per test, the tests per second at the median, and the spread of the
+   middle half of the repetitions as a fraction of the median, which a
+   repetition slowed by other work doesn't change.  The least time is the
+   steadiest to compare kernels by.  The process is pinned to one
+   processor, the one it starts on unless given, so that it isn't moved
+   between processors in the middle of a measurement:
+
+     bench_kernels [--repetitions N] [--hit-rate P] [--min-time S] [--cpu C] */
+
+#define NUM_PRIMITIVES 1024
+#define NUM_TESTS 4096
+#define DEFAULT_REPETITIONS 11
+#define MAX_REPETITIONS 101
+
+/* Rays start this far from the point they are aimed at */
+#define RAY_LENGTH 20.0f
+
+/* The class of primitives, and the code timed on them */
+typedef enum
+{
+    CLASS_SPHERE,
+    CLASS_FRUSTUM,
+    CLASS_CIRCLE,
+    CLASS_QUAD,
+    NUM_CLASSES
+} primitive_class;
+
+typedef enum
+{
+    KERNEL_INTERSECT_NORMAL,
+    KERNEL_INTERSECT,
+    KERNEL_OCCLUDES,
+    KERNEL_HIT,
+    KERNEL_BLOCKS,
+    NUM_KERNELS
+} kernel;
+
+static const char * class_names[NUM_CLASSES] = { "sphere", "frustum", "circle", "quad" };
+static const char * kernel_names[NUM_KERNELS] =
+    { "intersect+normal", "intersect", "occludes", "hit (baked)", "blocks (baked)" };
+static const char * set_names[3] = { "hit", "miss", "mixed" };
+
+/* Tests of rays against primitives of the class being timed */
+typedef struct
+{
+    vector origins[NUM_TESTS];
+    vector rays[NUM_TESTS];
+    float max_distances[NUM_TESTS];
+    int primitives[NUM_TESTS];
+} test_set;
+
+/* The primitives of the class being timed, as surfaces and as the plain
+   values the kernels take, with their baked values */
+static surface surfaces[NUM_PRIMITIVES];
+static sphere spheres[NUM_PRIMITIVES];
+static frustum frustums[NUM_PRIMITIVES];
+static circle circles[NUM_PRIMITIVES];
+static quad quads[NUM_PRIMITIVES];
+static float squared_radii[NUM_PRIMITIVES];
+static frustum_frame frustum_frames[NUM_PRIMITIVES];
+static quad_frame quad_frames[NUM_PRIMITIVES];
+
+static test_set sets[3];
+
+/* The coordinates of the intersections and normals found are added up here,
+   so that the compiler can't leave out calculating them */
+static volatile float sink;
+
+static float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+static vector random_vector (float min, float max)
+{
+    return (vector){ random_float(min, max), random_float(min, max), random_float(min, max) };
+}
+
+static vector random_direction (void)
+{
+    return vector_normalize(random_vector(-1, 1));
+}
+
+static vector random_perpendicular (vector direction)
+/*! A random unit vector perpendicular to the unit vector "direction" */
+{
+    return vector_normalize(vector_orth(random_vector(-1, 1), direction));
+}
+
+static double seconds (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void make_primitives (primitive_class class)
+{
+    int index;
+
+    for (index = 0; index < NUM_PRIMITIVES; index++)
+    {
+        surface * surface = &surfaces[index];
+        switch (class)
+        {
+            case CLASS_SPHERE:
+                spheres[index].center = random_vector(-3, 3);
+                spheres[index].radius = random_float(0.5f, 1.5f);
+                squared_radii[index] = square(spheres[index].radius);
+                surface->class = surface_sphere;
+                memcpy(surface->geometry, &spheres[index], sizeof(sphere));
+                break;
+            case CLASS_FRUSTUM:
+                frustums[index].centers[0] = random_vector(-3, 3);
+                frustums[index].centers[1] =
+                    vector_add(frustums[index].centers[0],
+                               vector_multiply(random_float(1, 3), random_direction()));
+                frustums[index].radii[0] = random_float(0.5f, 1.5f);
+                frustums[index].radii[1] = random_float(0.5f, 1.5f);
+                frustum_frames[index] = frustum_bake(frustums[index].centers[0],
+                                                     frustums[index].centers[1],
+                                                     frustums[index].radii[0],
+                                                     frustums[index].radii[1]);
+                surface->class = surface_frustum;
+                memcpy(surface->geometry, &frustums[index], sizeof(frustum));
+                break;
+            case CLASS_CIRCLE:
+                circles[index].center = random_vector(-3, 3);
+                circles[index].normal = random_direction();
+                circles[index].radius = random_float(1, 3);
+                squared_radii[index] = square(circles[index].radius);
+                surface->class = surface_circle;
+                memcpy(surface->geometry, &circles[index], sizeof(circle));
+                break;
+            default:
+                quads[index].vertices[1] = random_vector(-3, 3);
+                quads[index].vertices[0] = vector_add(quads[index].vertices[1],
+                                                      random_vector(-3, 3));
+                quads[index].vertices[2] = vector_add(quads[index].vertices[1],
+                                                      random_vector(-3, 3));
+                quad_frames[index] = quad_bake(quads[index].vertices[0], quads[index].vertices[1],
+                                               quads[index].vertices[2]);
+                surface->class = surface_quad;
+                memcpy(surface->geometry, &quads[index], sizeof(quad));
+                break;
+        }
+    }
+}
+
+static vector aim_at_plane (vector target, vector normal)
+/*! The origin of a ray aimed at "target", on a plane with the given normal,
+    from either side of the plane and at most about 55 degrees from the
+    normal */
+{
+    vector side = vector_multiply(rand() % 2 ? 1.0f : -1.0f, normal);
+    vector slant = vector_multiply(random_float(0, 1.4f), random_perpendicular(normal));
+
+    return vector_add(target,
+                      vector_multiply(RAY_LENGTH, vector_normalize(vector_add(side, slant))));
+}
+
+static void aim_ray (primitive_class class, int index, bool hit, vector * origin_out,
+                     vector * ray_out)
+/*! A ray aimed to hit the primitive, or to pass close by it */
+{
+    vector direction, target, center, axis, offset, edges[2];
+    float reach, along;
+    int edge;
+
+    switch (class)
+    {
+        case CLASS_SPHERE:
+            /* Aimed beside the center, within or beyond the radius */
+            direction = random_direction();
+            reach = spheres[index].radius * (hit ? random_float(0, 0.9f) : random_float(1.1f, 2));
+            target = vector_add(spheres[index].center,
+                                vector_multiply(reach, random_perpendicular(direction)));
+            *origin_out = vector_add(spheres[index].center,
+                                     vector_multiply(RAY_LENGTH, direction));
+            break;
+        case CLASS_FRUSTUM:
+            /* Aimed across the axis, through it or wider than either radius
+               beside it */
+            axis = frustum_frames[index].axis;
+            center = vector_multiply(0.5f, vector_add(frustums[index].centers[0],
+                                                      frustums[index].centers[1]));
+            along = random_float(-0.4f, 0.4f) *
+                    vector_distance(frustums[index].centers[0], frustums[index].centers[1]);
+            direction = random_perpendicular(axis);
+            reach = hit ? 0 : random_float(1.1f, 2) * fmaxf(frustums[index].radii[0],
+                                                            frustums[index].radii[1]);
+            offset = vector_normalize(cross_product(axis, direction));
+            target = vector_add(vector_add(center, vector_multiply(along, axis)),
+                                vector_multiply(reach, offset));
+            *origin_out = vector_add(center, vector_multiply(RAY_LENGTH, direction));
+            break;
+        case CLASS_CIRCLE:
+            /* Aimed at a point of the circle's plane within or beyond the
+               radius */
+            reach = circles[index].radius * (hit ? random_float(0, 0.9f) : random_float(1.1f, 2));
+            offset = random_perpendicular(circles[index].normal);
+            target = vector_add(circles[index].center, vector_multiply(reach, offset));
+            *origin_out = aim_at_plane(target, circles[index].normal);
+            break;
+        default:
+            /* Aimed at a point of the quad's plane, inside it or just past
+               one of its edges */
+            edges[0] = vector_sub(quads[index].vertices[0], quads[index].vertices[1]);
+            edges[1] = vector_sub(quads[index].vertices[2], quads[index].vertices[1]);
+            along = hit ? random_float(0.05f, 0.95f) : random_float(1.05f, 1.5f);
+            if (rand() % 2)
+            {
+                along = 1 - along;
+            }
+            edge = rand() % 2;
+            target = vector_add(quads[index].vertices[1],
+                                vector_add(vector_multiply(along, edges[edge]),
+                                           vector_multiply(random_float(0.05f, 0.95f),
+                                                           edges[1 - edge])));
+            *origin_out = aim_at_plane(target, quad_frames[index].normal);
+            break;
+    }
+    *ray_out = vector_normalize(vector_sub(target, *origin_out));
+}
+
+static void make_sets (primitive_class class, float hit_rate)
+/*! Make the hit, miss and mixed sets of tests for the class's primitives.
+    Rays are aimed again, at another primitive, until the surface agrees
+    that they hit or miss, so that the rare ray that grazes a primitive
+    doesn't change the hit rate. */
+{
+    test_set * set;
+    vector intersection;
+    surface * surface;
+    bool hit;
+    int index, test;
+
+    for (set = &sets[0]; set < &sets[3]; set++)
+    {
+        for (test = 0; test < NUM_TESTS; test++)
+        {
+            hit = set == &sets[0] || (set == &sets[2] && random_float(0, 1) < hit_rate);
+            do
+            {
+                index = rand() % NUM_PRIMITIVES;
+                surface = &surfaces[index];
+                aim_ray(class, index, hit, &set->origins[test], &set->rays[test]);
+            }
+            while (surface->class->calculate_intersection(set->origins[test], set->rays[test],
+                                                          surface->geometry, &intersection,
+                                                          NULL) != hit);
+            set->primitives[test] = index;
+            /* Farther than any hit, so that each hit blocks */
+            set->max_distances[test] = 2 * RAY_LENGTH;
+        }
+    }
+}
+
+static long run_baked_hits (primitive_class class, const test_set * set)
+/*! Run the intersect.h hit kernel of the class over the set, returning the
+    number of hits */
+{
+    vector intersection;
+    float sum = 0;
+    long hits = 0;
+    int test, index;
+
+    for (test = 0; test < NUM_TESTS; test++)
+    {
+        const vector origin = set->origins[test], ray = set->rays[test];
+        bool hit;
+
+        index = set->primitives[test];
+        switch (class)
+        {
+            case CLASS_SPHERE:
+                hit = sphere_hit(origin, ray, ray, spheres[index].center, squared_radii[index],
+                                 &intersection);
+                break;
+            case CLASS_FRUSTUM:
+                hit = frustum_hit(origin, ray, ray, frustums[index].centers[0],
+                                  frustums[index].centers[1], frustums[index].radii[0],
+                                  frustum_frames[index], &intersection);
+                break;
+            case CLASS_CIRCLE:
+                hit = circle_hit(origin, ray, circles[index].center, circles[index].normal,
+                                 circles[index].radius, &intersection);
+                break;
+            default:
+                hit = quad_hit(origin, ray, quads[index].vertices[1], quad_frames[index],
+                               &intersection);
+                break;
+        }
+        if (hit)
+        {
+            hits++;
+            sum += intersection.x;
+        }
+    }
+    sink = sum;
+    return hits;
+}
+
+static long run_baked_blocks (primitive_class class, const test_set * set)
+/*! Run the intersect.h blocks kernel of the class over the set, returning
+    the number of rays blocked */
+{
+    long hits = 0;
+    int test, index;
+
+    for (test = 0; test < NUM_TESTS; test++)
+    {
+        const vector origin = set->origins[test], ray = set->rays[test];
+        float max_distance = set->max_distances[test];
+
+        index = set->primitives[test];
+        switch (class)
+        {
+            case CLASS_SPHERE:
+                hits += sphere_blocks(origin, ray, spheres[index].center, squared_radii[index],
+                                      max_distance);
+                break;
+            case CLASS_FRUSTUM:
+                hits += frustum_blocks(origin, ray, frustums[index].centers[0],
+                                       frustums[index].radii[0], frustum_frames[index],
+                                       max_distance);
+                break;
+            case CLASS_CIRCLE:
+                hits += circle_blocks(origin, ray, circles[index].center, circles[index].normal,
+                                      squared_radii[index], max_distance);
+                break;
+            default:
+                hits += quad_blocks(origin, ray, quads[index].vertices[1], quad_frames[index],
+                                    max_distance);
+                break;
+        }
+    }
+    return hits;
+}
+
+static long run_tests (primitive_class class, kernel kernel, const test_set * set)
+/*! Run the kernel over the set once, returning the number of hits */
+{
+    vector intersection, normal;
+    surface * surface;
+    float sum = 0;
+    long hits = 0;
+    int test;
+
+    switch (kernel)
+    {
+        case KERNEL_INTERSECT_NORMAL:
+            for (test = 0; test < NUM_TESTS; test++)
+            {
+                surface = &surfaces[set->primitives[test]];
+                if (surface->class->calculate_intersection(set->origins[test], set->rays[test],
+                                                           surface->geometry, &intersection,
+                                                           &normal))
+                {
+                    hits++;
+                    sum += intersection.x + normal.x;
+                }
+            }
+            break;
+        case KERNEL_INTERSECT:
+            for (test = 0; test < NUM_TESTS; test++)
+            {
+                surface = &surfaces[set->primitives[test]];
+                if (surface->class->calculate_intersection(set->origins[test], set->rays[test],
+                                                           surface->geometry, &intersection,
+                                                           NULL))
+                {
+                    hits++;
+                    sum += intersection.x;
+                }
+            }
+            break;
+        case KERNEL_OCCLUDES:
+            for (test = 0; test < NUM_TESTS; test++)
+            {
+                surface = &surfaces[set->primitives[test]];
+                hits += surface->class->test_occlusion(set->origins[test], set->rays[test],
+                                                       surface->geometry,
+                                                       set->max_distances[test]);
+            }
+            break;
+        case KERNEL_HIT:
+            hits = run_baked_hits(class, set);
+            break;
+        default:
+            hits = run_baked_blocks(class, set);
+            break;
+    }
+    sink = sum;
+    return hits;
+}
+
+static int compare_doubles (const void * a, const void * b)
+{
+    double difference = *(const double *)a - *(const double *)b;
+    return (difference > 0) - (difference < 0);
+}
+
+static void measure (primitive_class class, kernel kernel, int set, int repetitions,
+                     double min_time)
+/*! Time the kernel on the set and print a line of the report */
+{
+    double times[MAX_REPETITIONS], start, elapsed, median;
+    long passes, pass, hits = 0;
+    int repetition;
+
+    /* The warm up doubles the runs over the set until they take half the
+       minimum time, and each repetition then runs enough for all of it */
+    for (passes = 1;; passes *= 2)
+    {
+        start = seconds();
+        for (pass = 0; pass < passes; pass++)
+        {
+            run_tests(class, kernel, &sets[set]);
+        }
+        elapsed = seconds() - start;
+        if (elapsed >= min_time / 2)
+        {
+            break;
+        }
+    }
+    passes = (long)(passes * min_time / elapsed) + 1;
+
+    for (repetition = 0; repetition < repetitions; repetition++)
+    {
+        start = seconds();
+        for (pass = 0; pass < passes; pass++)
+        {
+            hits = run_tests(class, kernel, &sets[set]);
+        }
+        times[repetition] = (seconds() - start) / ((double)passes * NUM_TESTS);
+    }
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+    median = times[repetitions / 2];
+    printf("%-8s %-17s %-6s %8.2f %8.2f %9.1f %7.1f%% %6.1f%%\n", class_names[class],
+           kernel_names[kernel], set_names[set], median * 1e9, times[0] * 1e9, 1e-6 / median,
+           100.0 * (times[3 * repetitions / 4] - times[repetitions / 4]) / median,
+           100.0 * hits / NUM_TESTS);
+}
+
+static int pin_to_cpu (int cpu)
+/*! Keep the process on the processor "cpu", or if it is -1, on the one it
+    runs on now.  Return the processor, or -1 if it can't be pinned. */
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+
+    if (cpu < 0)
+    {
+        cpu = sched_getcpu();
+    }
+    CPU_ZERO(&cpus);
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+    {
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == 0)
+        {
+            return cpu;
+        }
+    }
+#endif
+    return -1;
+}
+
+int main (int argc, char * argv[])
+{
+    int repetitions = DEFAULT_REPETITIONS, cpu = -1, index, set;
+    float hit_rate = 0.5f;
+    double min_time = 0.02;
+    primitive_class class;
+    kernel kernel;
+
+    for (index = 1; index + 1 < argc; index += 2)
+    {
+        if (strcmp(argv[index], "--repetitions") == 0)
+        {
+            repetitions = atoi(argv[index + 1]);
+        }
+        else if (strcmp(argv[index], "--hit-rate") == 0)
+        {
+            hit_rate = atof(argv[index + 1]);
+        }
+        else if (strcmp(argv[index], "--min-time") == 0)
+        {
+            min_time = atof(argv[index + 1]);
+        }
+        else if (strcmp(argv[index], "--cpu") == 0)
+        {
+            cpu = atoi(argv[index + 1]);
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (index < argc || repetitions < 1 || repetitions > MAX_REPETITIONS || hit_rate < 0 ||
+        hit_rate > 1 || min_time <= 0)
+    {
+        fprintf(stderr, "Usage: %s [--repetitions N (1 to %d)] [--hit-rate P (0 to 1)] "
+                        "[--min-time S] [--cpu C]\n", argv[0], MAX_REPETITIONS);
+        return 1;
+    }
+
+    cpu = pin_to_cpu(cpu);
+    if (cpu < 0)
+    {
+        printf("Not pinned to a processor\n");
+    }
+    else
+    {
+        printf("Pinned to processor %d\n", cpu);
+    }
+    printf("%d tests per set, the mixed set hitting %.0f%%, median of %d repetitions\n",
+           NUM_TESTS, 100.0 * hit_rate, repetitions);
+    printf("%-8s %-17s %-6s %8s %8s %9s %8s %7s\n", "class", "kernel", "set", "ns/test",
+           "least", "Mtests/s", "spread", "hits");
+
+    srand(1);
+    for (class = 0; class < NUM_CLASSES; class++)
+    {
+        make_primitives(class);
+        make_sets(class, hit_rate);
+        for (kernel = 0; kernel < NUM_KERNELS; kernel++)
+        {
+            for (set = 0; set < 3; set++)
+            {
+                measure(class, kernel, set, repetitions, min_time);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include "surface.h"
+#include "bvh.h"
+#include "primitives.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Compare the two ways the ray tracer can store a scene for tracing: the
+   surface array searched through a single BVH, calling each surface's
+   class functions through pointers (bvh.h), and the packed per-class arrays
+   of primitives.h, tested class by class at each leaf of the same BVH.
+
+   The scene is a large random one made mostly of spheres, like a particle
+   system or a pile of balls.  Rays start at random points among the
+   surfaces, as reflected and shadow rays do, and both layouts must agree on
+   every result. */
+
+static const int num_surfaces = 200000;
+static const float scene_size = 1000.0f;
+static const int num_rays = 1000000;
+
+static float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+static vector random_vector (float min, float max)
+{
+    return (vector){ random_float(min, max), random_float(min, max), random_float(min, max) };
+}
+
+static surface * sphere_heavy_scene (int count)
+/*! Make a sentinel terminated array of "count" surfaces, 85% of them spheres
+    and the rest split between the other classes */
+{
+    surface * surfaces = calloc(count + 1, sizeof(surface));
+    vector center;
+    int index;
+
+    for (index = 0; index < count; index++)
+    {
+        center = random_vector(-scene_size / 2, scene_size / 2);
+        switch (index % 20)
+        {
+            case 0:
+                surfaces[index].class = surface_frustum;
+                *(frustum *)surfaces[index].geometry =
+                    (frustum){ { center, vector_add(center, random_vector(-5, 5)) },
+                               { random_float(0, 2), random_float(0, 2) } };
+                break;
+            case 1:
+                surfaces[index].class = surface_circle;
+                *(circle *)surfaces[index].geometry =
+                    (circle){ center, vector_normalize(random_vector(-1, 1)), random_float(1, 4) };
+                break;
+            case 2:
+                surfaces[index].class = surface_quad;
+                *(quad *)surfaces[index].geometry =
+                    (quad){ { vector_add(center, random_vector(-4, 4)), center,
+                              vector_add(center, random_vector(-4, 4)) } };
+                break;
+            default:
+                surfaces[index].class = surface_sphere;
+                *(sphere *)surfaces[index].geometry = (sphere){ center, random_float(1, 4) };
+                break;
+        }
+    }
+    surfaces[count].class = NULL;
+    return surfaces;
+}
+
+static double seconds (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void report (char * label, double elapsed)
+{
+    printf("%-30s %7.3f s  %6.2f Mrays/s\n", label, elapsed, num_rays / elapsed * 1e-6);
+}
+
+int main ()
+{
+    surface * surfaces;
+    surface ** bvh_hits;
+    bool * bvh_blocked;
+    vector * origins;
+    vector * rays;
+    float * distances;
+    bvh * bvh;
+    primitives * primitives;
+    vector intersection, normal;
+    double start;
+    int index, hits = 0, blocked = 0, mismatches = 0;
+
+    srand(1);
+    surfaces = sphere_heavy_scene(num_surfaces);
+    origins = malloc(sizeof(vector) * num_rays);
+    rays = malloc(sizeof(vector) * num_rays);
+    distances = malloc(sizeof(float) * num_rays);
+    bvh_hits = malloc(sizeof(surface *) * num_rays);
+    bvh_blocked = malloc(sizeof(bool) * num_rays);
+    for (index = 0; index < num_rays; index++)
+    {
+        origins[index] = random_vector(-scene_size / 2, scene_size / 2);
+        rays[index] = vector_normalize(random_vector(-1, 1));
+        distances[index] = random_float(0, scene_size / 4);
+    }
+
+    start = seconds();
+    bvh = bvh_create(surfaces);
+    printf("%-30s %7.3f s\n", "Build, surface array", seconds() - start);
+    start = seconds();
+    primitives = primitives_create(surfaces);
+    printf("%-30s %7.3f s\n", "Build, packed arrays", seconds() - start);
+    printf("%d surfaces, %d rays\n\n", num_surfaces, num_rays);
+
+    start = seconds();
+    for (index = 0; index < num_rays; index++)
+    {
+        bvh_hits[index] = bvh_hit_surface(bvh, surfaces, origins[index], rays[index],
+                                          &intersection, &normal);
+    }
+    report("Closest hit, surface array", seconds() - start);
+
+    start = seconds();
+    for (index = 0; index < num_rays; index++)
+    {
+        surface * hit = primitives_hit_surface(primitives, origins[index], rays[index],
+                                               &intersection, &normal);
+        mismatches += hit != bvh_hits[index];
+        hits += hit != NULL;
+    }
+    report("Closest hit, packed arrays", seconds() - start);
+
+    start = seconds();
+    for (index = 0; index < num_rays; index++)
+    {
+        bvh_blocked[index] = bvh_is_occluded(bvh, surfaces, origins[index], rays[index],
+                                             distances[index], NULL);
+    }
+    report("Shadow rays, surface array", seconds() - start);
+
+    start = seconds();
+    for (index = 0; index < num_rays; index++)
+    {
+        bool is_blocked = primitives_is_occluded(primitives, origins[index], rays[index],
+                                                 distances[index], NULL);
+        mismatches += is_blocked != bvh_blocked[index];
+        blocked += is_blocked;
+    }
+    report("Shadow rays, packed arrays", seconds() - start);
+
+    printf("\n%d rays hit a surface, %d shadow rays blocked, %d mismatches\n",
+           hits, blocked, mismatches);
+
+    primitives_free(primitives);
+    bvh_free(bvh);
+    free(surfaces);
+    free(origins);
+    free(rays);
+    free(distances);
+    free(bvh_hits);
+    free(bvh_blocked);
+    return mismatches != 0;
+}
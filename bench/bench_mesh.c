@@ -0,0 +1,141 @@
+#include "mesh.h"
+#include "surface.h"
+#include "bvh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+/* Measure a triangle mesh the size of a scanned model: a sphere tessellated
+   into about a million triangles.  Report the memory its arrays take up,
+   against what the same triangles would take as separate surfaces with a
+   BVH node each, the time to build its BVH, and the rate at which it traces
+   closest hit and shadow rays from points around it. */
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+#define NUM_RAYS 1000000
+
+static const int segments = 708;
+
+static float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+static vector random_vector (float min, float max)
+{
+    return (vector){ random_float(min, max), random_float(min, max), random_float(min, max) };
+}
+
+static double seconds (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static triangle_mesh * tessellated_sphere (int segments)
+/*! Make a sphere of radius 10 at the origin from a grid of "segments" by
+    "segments" cells of latitude and longitude, two triangles each */
+{
+    int rows = segments + 1, columns = segments;
+    vector * vertices = malloc(sizeof(vector) * rows * columns);
+    int * indices = malloc(sizeof(int) * 6 * segments * columns);
+    int row, column, next, * triangle = indices;
+    float latitude, longitude;
+
+    if (vertices == NULL || indices == NULL)
+    {
+        free(vertices);
+        free(indices);
+        return NULL;
+    }
+    for (row = 0; row < rows; row++)
+    {
+        latitude = M_PI * row / segments;
+        for (column = 0; column < columns; column++)
+        {
+            longitude = 2 * M_PI * column / columns;
+            vertices[row * columns + column] =
+                (vector){ 10 * sinf(latitude) * cosf(longitude), 10 * cosf(latitude),
+                          10 * sinf(latitude) * sinf(longitude) };
+        }
+    }
+    for (row = 0; row < segments; row++)
+    {
+        for (column = 0; column < columns; column++)
+        {
+            next = (column + 1) % columns;
+            triangle[0] = row * columns + column;
+            triangle[1] = row * columns + next;
+            triangle[2] = (row + 1) * columns + next;
+            triangle[3] = row * columns + column;
+            triangle[4] = (row + 1) * columns + next;
+            triangle[5] = (row + 1) * columns + column;
+            triangle += 6;
+        }
+    }
+    return mesh_create(vertices, rows * columns, indices, 2 * segments * columns);
+}
+
+int main ()
+{
+    triangle_mesh * mesh;
+    vector * origins = malloc(sizeof(vector) * NUM_RAYS);
+    vector * rays = malloc(sizeof(vector) * NUM_RAYS);
+    int index, triangle, hits = 0, blocked = 0;
+    float t;
+    double start, elapsed;
+
+    srand(1);
+    start = seconds();
+    mesh = tessellated_sphere(segments);
+    if (mesh == NULL || origins == NULL || rays == NULL)
+    {
+        perror("Mesh");
+        return 1;
+    }
+    printf("%-30s %7.3f s\n", "Tessellate and build", seconds() - start);
+    printf("%d triangles, %d vertices, %d BVH nodes\n",
+           mesh->num_triangles, mesh->num_vertices, mesh->num_nodes);
+    printf("%-30s %7.1f MB, %.1f bytes per triangle\n", "Mesh memory",
+           mesh_memory_size(mesh) * 1e-6, (double)mesh_memory_size(mesh) / mesh->num_triangles);
+    printf("%-30s %7.1f MB\n\n", "As separate surfaces",
+           (double)mesh->num_triangles * (sizeof(surface) + sizeof(quad) + 2 * sizeof(bvh_node)) *
+           1e-6);
+
+    /* Rays start outside the sphere and head for points within it, so most
+       of them hit it */
+    for (index = 0; index < NUM_RAYS; index++)
+    {
+        origins[index] = vector_multiply(random_float(12, 30),
+                                         vector_normalize(random_vector(-1, 1)));
+        rays[index] = vector_normalize(vector_sub(random_vector(-8, 8), origins[index]));
+    }
+
+    start = seconds();
+    for (index = 0; index < NUM_RAYS; index++)
+    {
+        hits += mesh_hit(mesh, origins[index], rays[index], INFINITY, &triangle, &t);
+    }
+    elapsed = seconds() - start;
+    printf("%-30s %7.3f s  %6.2f Mrays/s\n", "Closest hits", elapsed, NUM_RAYS / elapsed * 1e-6);
+
+    start = seconds();
+    for (index = 0; index < NUM_RAYS; index++)
+    {
+        blocked += mesh_blocks(mesh, origins[index], rays[index], INFINITY);
+    }
+    elapsed = seconds() - start;
+    printf("%-30s %7.3f s  %6.2f Mrays/s\n", "Shadow rays", elapsed, NUM_RAYS / elapsed * 1e-6);
+    printf("\n%d rays hit the mesh, %d shadow rays blocked\n", hits, blocked);
+
+    mesh_free(mesh);
+    free(origins);
+    free(rays);
+    return hits == blocked ? 0 : 1;
+}
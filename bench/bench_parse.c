@@ -0,0 +1,224 @@
+#include "input_file.h"
+#include "compiled_scene.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/* Time load_scene on a generated scene of millions of lines, mixing every
+   kind of object with properties written the ways scene files write them,
+   with 1 to 32 threads, and time parse_float against strtof on the decimals
+   alone.  Then time building the scene's BVH, and loading the scene compiled
+   with it, which skips both parsing and building.  The number of lines can
+   be given as an argument. */
+
+#define NUM_LINES 2000000
+#define MAX_THREADS 32
+#define NUM_DECIMALS 4000000
+#define REPETITIONS 3
+
+bool parse_float (char ** cursor, float * value_out);
+
+static float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+static double seconds (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static long page_faults (void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+static void write_scene (FILE * file, int num_lines)
+{
+    int line;
+
+    fprintf(file, "# Generated scene\n"
+                  "camera position:(0, 0, -100) direction:(0, 0) view_angle:60 resolution:(640, 480)\n"
+                  "background color:(0.1, 0.1, 0.2)\n");
+    for (line = 0; line < num_lines; line++)
+    {
+        switch (line % 8)
+        {
+        case 0:
+            fprintf(file, "light position:(%.2f, %.2f, %.2f) color:(0.2, 0.2, 0.2)\n",
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100));
+            break;
+        case 1:
+        case 2:
+        case 3:
+            fprintf(file, "sphere center:(%.3f, %.3f, %.3f) radius:%.2f diffuse:(%.2f, %.2f, %.2f) "
+                          "specular:(0.1, 0.1, 0.1)\n",
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100),
+                    random_float(0.5, 5), random_float(0, 1), random_float(0, 1), random_float(0, 1));
+            break;
+        case 4:
+            fprintf(file, "quad vertices:((%.3f, %.3f, %.3f), (%.3f, %.3f, %.3f), (%.3f, %.3f, %.3f)) "
+                          "diffuse:(0.5, 0.5, 0.5)   # a wall\n",
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100),
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100),
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100));
+            break;
+        case 5:
+            fprintf(file, "frustum centers:((%.3f, %.3f, %.3f), (%.3f, %.3f, %.3f)) radii:(%.2f, %.2f) "
+                          "specular:(0.9, 0.9, 0.9) refraction_index:1.5\n",
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100),
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100),
+                    random_float(0, 5), random_float(0, 5));
+            break;
+        case 6:
+            fprintf(file, "circle center:(%.3f, %.3f, %.3f) radius:%.2f normal:(%.3f, %.3f, %.3f) "
+                          "diffuse:(1, 1, 1)\n",
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100),
+                    random_float(0.5, 5), random_float(-1, 1), random_float(-1, 1), random_float(-1, 1));
+            break;
+        default:
+            fprintf(file, "\n");
+        }
+    }
+}
+
+int main (int argc, char * argv[])
+{
+    int num_lines = argc > 1 ? atoi(argv[1]) : NUM_LINES;
+    thread_pool * pool;
+    int threads;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    double single_thread = 0;
+    FILE * file = tmpfile();
+    FILE * compiled;
+    long faults = 0;
+    char * decimals = malloc(NUM_DECIMALS * 16);
+    char * cursor;
+    float value, sum = 0;
+    double start, elapsed, best = 1e9, megabytes;
+    long size;
+    int repetition, index, num_surfaces = 0;
+    scene loaded;
+
+    if (file == NULL || decimals == NULL)
+    {
+        perror("bench_parse");
+        return 1;
+    }
+    write_scene(file, num_lines);
+    fflush(file);
+    size = ftell(file);
+    megabytes = size / 1e6;
+
+    /* Threads beyond the processors only take turns, so their speedups say
+       what splitting and joining cost rather than how parsing scales */
+    printf("Scene of %d lines, %.1f MB, best of %d, %ld processors\n", num_lines, megabytes,
+           REPETITIONS, processors);
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        pool = thread_pool_create(threads);
+        if (pool == NULL)
+        {
+            perror("thread_pool_create");
+            return 1;
+        }
+        for (repetition = 0, best = 1e9; repetition < REPETITIONS; repetition++)
+        {
+            rewind(file);
+            start = seconds();
+            if (load_scene(file, NULL, &loaded, pool))
+            {
+                perror("load_scene");
+                return 1;
+            }
+            elapsed = seconds() - start;
+            best = elapsed < best ? elapsed : best;
+            free_scene(&loaded);
+        }
+        thread_pool_destroy(pool);
+        single_thread = threads == 1 ? best : single_thread;
+        printf("load_scene, %2d threads %8.1f ms  %7.1f MB/s  %5.2fx%s\n",
+               threads, best * 1e3, megabytes / best, single_thread / best,
+               threads > processors ? "  (more threads than processors)" : "");
+    }
+
+    cursor = decimals;
+    for (index = 0; index < NUM_DECIMALS; index++)
+    {
+        cursor += sprintf(cursor, "%.3f ", random_float(-100, 100));
+    }
+    for (repetition = 0, best = 1e9; repetition < REPETITIONS; repetition++)
+    {
+        start = seconds();
+        for (cursor = decimals, index = 0; index < NUM_DECIMALS; index++)
+        {
+            sum += strtof(cursor, &cursor);
+        }
+        elapsed = seconds() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    printf("strtof            %8.1f ns/decimal\n", best / NUM_DECIMALS * 1e9);
+    for (repetition = 0, best = 1e9; repetition < REPETITIONS; repetition++)
+    {
+        start = seconds();
+        for (cursor = decimals, index = 0; index < NUM_DECIMALS; index++)
+        {
+            parse_float(&cursor, &value);
+            sum += value;
+        }
+        elapsed = seconds() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    printf("parse_float       %8.1f ns/decimal  (checksum %g)\n", best / NUM_DECIMALS * 1e9, sum);
+
+
+    rewind(file);
+    if (load_scene(file, NULL, &loaded, NULL))
+    {
+        perror("load_scene");
+        return 1;
+    }
+    while (loaded.surfaces[num_surfaces].class != NULL)
+    {
+        num_surfaces++;
+    }
+    start = seconds();
+    loaded.primitives = primitives_create(loaded.surfaces);
+    printf("primitives_create %8.1f ms for %d surfaces\n", (seconds() - start) * 1e3, num_surfaces);
+    compiled = tmpfile();
+    if (loaded.primitives == NULL || compiled == NULL || save_compiled_scene(&loaded, compiled) ||
+        fflush(compiled))
+    {
+        perror("bench_parse");
+        return 1;
+    }
+    free_scene(&loaded);
+    for (repetition = 0, best = 1e9; repetition < REPETITIONS; repetition++)
+    {
+        faults = page_faults();
+        start = seconds();
+        if (load_scene(compiled, NULL, &loaded, NULL))
+        {
+            perror("load_scene");
+            return 1;
+        }
+        elapsed = seconds() - start;
+        faults = page_faults() - faults;
+        best = elapsed < best ? elapsed : best;
+        free_scene(&loaded);
+    }
+    printf("compiled scene of %.1f MB: load_scene %.1f ms, %ld page faults\n",
+           ftell(compiled) / 1e6, best * 1e3, faults);
+
+    fclose(compiled);
+    fclose(file);
+    free(decimals);
+    return 0;
+}
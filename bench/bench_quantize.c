@@ -0,0 +1,119 @@
+#include "output_file.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Time the conversion of a rendered image to PPM bytes: the scalar
+   convert_to_8_bit, the vector quantize_colors, and save_image as a whole
+   on one thread and on every processor, against the one fwrite per pixel
+   that save_image used to do. */
+
+#define WIDTH 4096
+#define HEIGHT 4096
+#define REPETITIONS 5
+
+static double seconds (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void report (char * label, double elapsed)
+{
+    printf("%-26s %7.2f ms  %6.2f ns/pixel\n", label, elapsed * 1e3,
+           elapsed / ((double)WIDTH * HEIGHT) * 1e9);
+}
+
+static void save_per_pixel (color image[], FILE * file)
+/*! save_image as it was, with one fwrite per pixel */
+{
+    unsigned char output[3];
+    size_t index;
+
+    fprintf(file, "P6\n%d %d\n%d\n", WIDTH, HEIGHT, 0xff);
+    for (index = 0; index < (size_t)WIDTH * HEIGHT; index++)
+    {
+        output[0] = convert_to_8_bit(image[index].r);
+        output[1] = convert_to_8_bit(image[index].g);
+        output[2] = convert_to_8_bit(image[index].b);
+        fwrite(output, 1, 3, file);
+    }
+}
+
+int main ()
+{
+    size_t num_values = (size_t)WIDTH * HEIGHT * 3, index;
+    color * image = malloc(sizeof(color) * WIDTH * HEIGHT);
+    unsigned char * scalar_bytes = malloc(num_values);
+    unsigned char * vector_bytes = malloc(num_values);
+    float * values = &image[0].r;
+    thread_pool * pool = thread_pool_create(0);
+    FILE * null_file = fopen("/dev/null", "w");
+    double start, best[5] = { 1e9, 1e9, 1e9, 1e9, 1e9 }, elapsed;
+    int repetition, mismatches = 0;
+
+    if (image == NULL || scalar_bytes == NULL || vector_bytes == NULL || pool == NULL ||
+        null_file == NULL)
+    {
+        perror("bench_quantize");
+        return 1;
+    }
+    /* Mostly in range, with some overexposed and negative components */
+    for (index = 0; index < num_values; index++)
+    {
+        values[index] = -0.1f + 1.3f * (float)rand() / (float)RAND_MAX;
+    }
+
+    for (repetition = 0; repetition < REPETITIONS; repetition++)
+    {
+        start = seconds();
+        for (index = 0; index < num_values; index++)
+        {
+            scalar_bytes[index] = convert_to_8_bit(values[index]);
+        }
+        elapsed = seconds() - start;
+        best[0] = elapsed < best[0] ? elapsed : best[0];
+
+        start = seconds();
+        quantize_colors(image, (size_t)WIDTH * HEIGHT, vector_bytes);
+        elapsed = seconds() - start;
+        best[1] = elapsed < best[1] ? elapsed : best[1];
+
+        start = seconds();
+        save_per_pixel(image, null_file);
+        elapsed = seconds() - start;
+        best[2] = elapsed < best[2] ? elapsed : best[2];
+
+        start = seconds();
+        save_image(image, WIDTH, HEIGHT, null_file, NULL);
+        elapsed = seconds() - start;
+        best[3] = elapsed < best[3] ? elapsed : best[3];
+
+        start = seconds();
+        save_image(image, WIDTH, HEIGHT, null_file, pool);
+        elapsed = seconds() - start;
+        best[4] = elapsed < best[4] ? elapsed : best[4];
+    }
+
+    for (index = 0; index < num_values; index++)
+    {
+        mismatches += scalar_bytes[index] != vector_bytes[index];
+    }
+    printf("%dx%d image, best of %d, %d workers, %d mismatched bytes\n", WIDTH, HEIGHT,
+           REPETITIONS, thread_pool_size(pool), mismatches);
+    report("convert_to_8_bit", best[0]);
+    report("quantize_colors", best[1]);
+    report("fwrite per pixel", best[2]);
+    report("save_image, 1 thread", best[3]);
+    report("save_image, all threads", best[4]);
+
+    fclose(null_file);
+    thread_pool_destroy(pool);
+    free(image);
+    free(scalar_bytes);
+    free(vector_bytes);
+    return mismatches != 0;
+}
@@ -0,0 +1,417 @@
+#include "input_file.h"
+#include "animation.h"
+#include "primitives.h"
+#include "packet.h"
+#include "render.h"
+#include "thread_pool.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Render every scene file given, and generated stress scenes, at several
+   widths and numbers of threads, and report as JSON the median wall time of
+   each render, the primary (camera) and total rays traced per second, and
+   the peak resident memory.  Each render is repeated, after a warm up, and
+   the spread of its times gives the noise of the measurement:
+
+     bench_render [--repetitions N] [--widths W,...] [--threads T,...] SCENE_FILE...
+
+   Every case runs in a process of its own, so that its peak memory is its
+   own.  The generated scenes are "stress:spheres", 200,000 small spheres,
+   and "stress:mirrors", a grid of mirrored and glass spheres between two
+   mirrors, lit by many lights.  Compare mode reads two reports, and prints
+   the cases whose rays per second changed by more than the noise of either,
+   returning 1 if any got slower:
+
+     bench_render --compare BASELINE_JSON CURRENT_JSON */
+
+#define MAX_SETTINGS 8
+#define DEFAULT_REPETITIONS 5
+#define MAX_REPETITIONS 100
+#define NUM_STRESS_SPHERES 200000
+/* The least change in speed reported, however steady the renders */
+#define MIN_NOISE 0.03
+
+typedef struct
+{
+    char scene[256];
+    int width, height, threads;
+    /* The median time of a render, and the spread of the times, slowest less
+       fastest, as a fraction of it */
+    double seconds;
+    double noise;
+    unsigned long long primary_rays;
+    unsigned long long total_rays;
+    long peak_rss_kb;
+} bench_case;
+
+static const char * stress_scenes[] = { "stress:spheres", "stress:mirrors" };
+
+static float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+static FILE * open_scene (const char * name)
+/*! Open a scene file, or generate the stress scene of that name */
+{
+    FILE * file;
+    int index, row, column;
+
+    if (strncmp(name, "stress:", 7) != 0)
+    {
+        return fopen(name, "r");
+    }
+    file = tmpfile();
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    srand(1);
+    if (strcmp(name, "stress:spheres") == 0)
+    {
+        fprintf(file, "camera position:(-250, 0, 0) direction:(0, 0) view_angle:60 "
+                      "resolution:(640, 480)\n"
+                      "light position:(-200, 100, 100) color:(0.6, 0.6, 0.6)\n"
+                      "light position:(-200, -50, -100) color:(0.3, 0.3, 0.3)\n");
+        for (index = 0; index < NUM_STRESS_SPHERES; index++)
+        {
+            fprintf(file, "sphere center:(%.2f, %.2f, %.2f) radius:%.2f diffuse:(%.2f, %.2f, %.2f)\n",
+                    random_float(-100, 100), random_float(-100, 100), random_float(-100, 100),
+                    random_float(0.2, 1.5), random_float(0, 1), random_float(0, 1),
+                    random_float(0, 1));
+        }
+    }
+    else if (strcmp(name, "stress:mirrors") == 0)
+    {
+        fprintf(file, "camera position:(-12, 0, 4) direction:(0, -15) view_angle:70 "
+                      "resolution:(640, 480)\n"
+                      "background color:(0.2, 0.3, 0.5)\n"
+                      "quad vertices:((-20, 10, -1), (20, 10, -1), (20, -10, -1)) "
+                      "diffuse:(0.5, 0.5, 0.5)\n"
+                      "quad vertices:((-20, 10, -1), (20, 10, -1), (20, 10, 10)) "
+                      "specular:(0.9, 0.9, 0.9)\n"
+                      "quad vertices:((-20, -10, -1), (20, -10, -1), (20, -10, 10)) "
+                      "specular:(0.9, 0.9, 0.9)\n");
+        for (index = 0; index < 16; index++)
+        {
+            fprintf(file, "light position:(%.2f, %.2f, 8) color:(0.06, 0.06, 0.06)\n",
+                    random_float(-15, 15), random_float(-8, 8));
+        }
+        for (row = 0; row < 8; row++)
+        {
+            for (column = 0; column < 8; column++)
+            {
+                fprintf(file, "sphere center:(%d, %d, 0) radius:0.9 diffuse:(0.1, 0.1, 0.1) "
+                              "specular:(0.8, 0.8, 0.8)%s\n",
+                        2 * row - 4, 2 * column - 7,
+                        (row + column) % 2 ? " refraction_index:1.5" : "");
+            }
+        }
+    }
+    rewind(file);
+    return file;
+}
+
+static int compare_seconds (const void * first, const void * second)
+{
+    double difference = *(const double *)first - *(const double *)second;
+    return (difference > 0) - (difference < 0);
+}
+
+static int run_case (const char * name, int width, int threads, int repetitions,
+                     bench_case * case_out)
+/*! Load the scene and time its renders at the width, in the scene's aspect
+    ratio, filling in "case_out".  Return 0, or -1 if the scene can't be
+    loaded or memory runs out. */
+{
+    FILE * file = open_scene(name);
+    thread_pool * pool = thread_pool_create(threads);
+    render_settings settings = { ENGINE_RECURSIVE, packet_width_supported(), ANTIALIAS_NONE, 4,
+                                 0.1f, 0 };
+    scene scene = {};
+    resolution * res = &scene.camera.resolution;
+    ray_stats stats = { 0 };
+    struct rusage usage;
+    double times[MAX_REPETITIONS], start;
+    color * image;
+    int repetition;
+
+    if (file == NULL || pool == NULL || load_scene(file, name, &scene, pool))
+    {
+        return -1;
+    }
+    fclose(file);
+    if (scene.animation)
+    {
+        animation_apply(scene.animation, 0, &scene);
+    }
+    if (scene.primitives == NULL)
+    {
+        scene.primitives = primitives_create(scene.surfaces);
+    }
+    res->height = (int)((double)width * res->height / res->width + 0.5);
+    res->width = width;
+    image = malloc(sizeof(color) * (size_t)res->width * res->height);
+    if (scene.primitives == NULL || image == NULL)
+    {
+        return -1;
+    }
+
+    /* The warm up render fills the caches, and counts the rays every render
+       traces */
+    render(&scene, pool, &settings, image, &stats);
+    for (repetition = 0; repetition < repetitions; repetition++)
+    {
+        start = render_clock();
+        render(&scene, pool, &settings, image, NULL);
+        times[repetition] = render_clock() - start;
+    }
+    qsort(times, repetitions, sizeof(double), compare_seconds);
+    getrusage(RUSAGE_SELF, &usage);
+
+    snprintf(case_out->scene, sizeof(case_out->scene), "%s", name);
+    case_out->width = res->width;
+    case_out->height = res->height;
+    case_out->threads = threads;
+    case_out->seconds = times[repetitions / 2];
+    case_out->noise = (times[repetitions - 1] - times[0]) / case_out->seconds;
+    case_out->primary_rays = stats.camera_rays + stats.antialias_rays;
+    case_out->total_rays = case_out->primary_rays + stats.secondary_rays + stats.shadow_rays;
+    case_out->peak_rss_kb = usage.ru_maxrss;
+
+    free(image);
+    free_scene(&scene);
+    thread_pool_destroy(pool);
+    return 0;
+}
+
+static int measure (const char * name, int width, int threads, int repetitions,
+                    bench_case * case_out)
+/*! Run a case in a child process.  Return 0, or -1 if it fails. */
+{
+    int fds[2], status;
+    pid_t child;
+    bool received;
+
+    if (pipe(fds))
+    {
+        return -1;
+    }
+    fflush(NULL);
+    child = fork();
+    if (child == 0)
+    {
+        close(fds[0]);
+        _exit(run_case(name, width, threads, repetitions, case_out) ||
+              write(fds[1], case_out, sizeof(bench_case)) != sizeof(bench_case));
+    }
+    close(fds[1]);
+    received = child > 0 && read(fds[0], case_out, sizeof(bench_case)) == sizeof(bench_case);
+    close(fds[0]);
+    if (child > 0)
+    {
+        waitpid(child, &status, 0);
+    }
+    return received ? 0 : -1;
+}
+
+static void print_case (const bench_case * bench_case, bool first)
+{
+    printf("%s    { \"scene\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, "
+           "\"seconds\": %.6f, \"noise\": %.4f, \"primary_rays\": %llu, \"total_rays\": %llu, "
+           "\"primary_mrays_per_second\": %.3f, \"total_mrays_per_second\": %.3f, "
+           "\"peak_rss_kb\": %ld }",
+           first ? "" : ",\n", bench_case->scene, bench_case->width, bench_case->height,
+           bench_case->threads, bench_case->seconds, bench_case->noise, bench_case->primary_rays,
+           bench_case->total_rays, bench_case->primary_rays / bench_case->seconds * 1e-6,
+           bench_case->total_rays / bench_case->seconds * 1e-6, bench_case->peak_rss_kb);
+}
+
+static int parse_list (const char * text, int values_out[])
+/*! Parse a list of positive numbers separated by commas.  Return how many
+    there are, or 0 if the list is bad. */
+{
+    int count = 0, length;
+
+    while (count < MAX_SETTINGS && sscanf(text, "%d%n", &values_out[count], &length) == 1 &&
+           values_out[count] > 0)
+    {
+        count++;
+        text += length;
+        if (*text != ',')
+        {
+            return *text == '\0' ? count : 0;
+        }
+        text++;
+    }
+    return 0;
+}
+
+static bench_case * read_report (const char * filename, int * num_cases_out)
+/*! Read the cases of a report printed by this program, one per line */
+{
+    FILE * file = fopen(filename, "r");
+    bench_case * cases = NULL, * grown, read;
+    char line[1024];
+    int capacity = 0;
+
+    *num_cases_out = 0;
+    if (file == NULL)
+    {
+        perror(filename);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, " { \"scene\": \"%255[^\"]\", \"width\": %d, \"height\": %d, "
+                         "\"threads\": %d, \"seconds\": %lf, \"noise\": %lf, "
+                         "\"primary_rays\": %llu, \"total_rays\": %llu,",
+                   read.scene, &read.width, &read.height, &read.threads, &read.seconds,
+                   &read.noise, &read.primary_rays, &read.total_rays) != 8)
+        {
+            continue;
+        }
+        if (*num_cases_out == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            grown = realloc(cases, sizeof(bench_case) * capacity);
+            if (grown == NULL)
+            {
+                break;
+            }
+            cases = grown;
+        }
+        cases[(*num_cases_out)++] = read;
+    }
+    fclose(file);
+    return cases;
+}
+
+static int compare (const char * baseline_file, const char * current_file)
+/*! Print the cases of the current report that changed speed from the
+    baseline by more than the noise.  Return 1 if any got slower, else 0. */
+{
+    int num_baseline, num_current, index, other, regressions = 0;
+    bench_case * baseline = read_report(baseline_file, &num_baseline);
+    bench_case * current = read_report(current_file, &num_current), * before, * after;
+    double noise, change;
+
+    for (index = 0; index < num_current; index++)
+    {
+        after = &current[index];
+        before = NULL;
+        for (other = 0; other < num_baseline && before == NULL; other++)
+        {
+            if (strcmp(baseline[other].scene, after->scene) == 0 &&
+                baseline[other].width == after->width && baseline[other].threads == after->threads)
+            {
+                before = &baseline[other];
+            }
+        }
+        if (before == NULL)
+        {
+            printf("New:         %s %dx%d, %d threads\n", after->scene, after->width,
+                   after->height, after->threads);
+            continue;
+        }
+
+        /* The same rays at a different speed, unless the renderer changed
+           what it traces */
+        noise = before->noise > after->noise ? before->noise : after->noise;
+        noise = noise > MIN_NOISE ? noise : MIN_NOISE;
+        change = (after->total_rays / after->seconds) / (before->total_rays / before->seconds) - 1;
+        if (change < -noise || change > noise || before->total_rays != after->total_rays)
+        {
+            printf("%-12s %s %dx%d, %d threads: %.2f to %.2f Mrays/s (%+.1f%%, noise %.1f%%)",
+                   change < -noise ? "Regression:" : change > noise ? "Improvement:" : "Changed:",
+                   after->scene, after->width, after->height, after->threads,
+                   before->total_rays / before->seconds * 1e-6,
+                   after->total_rays / after->seconds * 1e-6, 100 * change, 100 * noise);
+            if (before->total_rays != after->total_rays)
+            {
+                printf(", %llu rays instead of %llu", after->total_rays, before->total_rays);
+            }
+            printf("\n");
+            regressions += change < -noise;
+        }
+    }
+    printf("%d of %d cases slower than the baseline\n", regressions, num_current);
+    free(baseline);
+    free(current);
+    return regressions > 0;
+}
+
+int main (int argc, char * argv[])
+{
+    int widths[MAX_SETTINGS] = { 160, 320, 640 }, threads[MAX_SETTINGS] = { 1 };
+    int num_widths = 3, num_threads = 1, repetitions = DEFAULT_REPETITIONS;
+    int num_scenes, index = 1, scene, width, thread, cases = 0, failed = 0;
+    const char * name;
+    bench_case measured;
+
+    if (argc == 4 && strcmp(argv[1], "--compare") == 0)
+    {
+        return compare(argv[2], argv[3]);
+    }
+    threads[1] = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = threads[1] > 1 ? 2 : 1;
+    for (; index + 1 < argc && strncmp(argv[index], "--", 2) == 0; index += 2)
+    {
+        if (strcmp(argv[index], "--repetitions") == 0)
+        {
+            repetitions = atoi(argv[index + 1]);
+        }
+        else if (strcmp(argv[index], "--widths") == 0)
+        {
+            num_widths = parse_list(argv[index + 1], widths);
+        }
+        else if (strcmp(argv[index], "--threads") == 0)
+        {
+            num_threads = parse_list(argv[index + 1], threads);
+        }
+        else
+        {
+            break;
+        }
+    }
+    if ((index < argc && strncmp(argv[index], "--", 2) == 0) || repetitions < 1 ||
+        repetitions > MAX_REPETITIONS || num_widths == 0 || num_threads == 0)
+    {
+        fprintf(stderr, "Usage: %s [--repetitions N] [--widths W,...] [--threads T,...] "
+                        "<scene_file>...\n"
+                        "       %s --compare <baseline_json> <current_json>\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    num_scenes = argc - index + sizeof(stress_scenes) / sizeof(stress_scenes[0]);
+    printf("{\n  \"repetitions\": %d,\n  \"cases\": [\n", repetitions);
+    for (scene = 0; scene < num_scenes; scene++)
+    {
+        name = index + scene < argc ? argv[index + scene] : stress_scenes[index + scene - argc];
+        for (width = 0; width < num_widths; width++)
+        {
+            for (thread = 0; thread < num_threads; thread++)
+            {
+                if (measure(name, widths[width], threads[thread], repetitions, &measured))
+                {
+                    fprintf(stderr, "Unable to render %s\n", name);
+                    failed++;
+                    continue;
+                }
+                fprintf(stderr, "%-30s %4dx%-4d %2d threads %8.4f s %8.2f Mrays/s\n",
+                        measured.scene, measured.width, measured.height, measured.threads,
+                        measured.seconds, measured.total_rays / measured.seconds * 1e-6);
+                print_case(&measured, cases++ == 0);
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return failed > 0;
+}
@@ -0,0 +1,250 @@
+#include "animation.h"
+#include "instance.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+animated_object * animation_add_object (animation * animation, animated_kind kind, int index,
+                                        const keyframe * base)
+{
+    int capacity = animation->object_capacity > 0 ? 2 * animation->object_capacity : 16;
+    animated_object * objects = animation->objects;
+    animated_object * object;
+
+    if (animation->num_objects == animation->object_capacity)
+    {
+        objects = realloc(objects, sizeof(animated_object) * capacity);
+        if (objects == NULL)
+        {
+            return NULL;
+        }
+        animation->objects = objects;
+        animation->object_capacity = capacity;
+    }
+    object = &objects[animation->num_objects];
+    object->keys = malloc(sizeof(keyframe) * 4);
+    if (object->keys == NULL)
+    {
+        return NULL;
+    }
+    object->kind = kind;
+    object->index = index;
+    object->keys[0] = *base;
+    object->keys[0].frame = 0;
+    object->num_keys = 1;
+    object->key_capacity = 4;
+    animation->num_objects++;
+    if (animation->num_frames < 1)
+    {
+        animation->num_frames = 1;
+    }
+    return object;
+}
+
+static void merge_key (keyframe * target, const keyframe * key)
+/*! Replace the properties of "target" that "key" gives */
+{
+    if (key->properties & KEY_POSITION)
+    {
+        target->position = key->position;
+    }
+    if (key->properties & KEY_ROTATION)
+    {
+        target->rotation = key->rotation;
+    }
+    if (key->properties & KEY_SCALE)
+    {
+        target->scale = key->scale;
+    }
+    if (key->properties & KEY_COLOR)
+    {
+        target->color = key->color;
+    }
+    if (key->properties & KEY_DIRECTION)
+    {
+        target->direction = key->direction;
+    }
+    if (key->properties & KEY_VIEW_ANGLE)
+    {
+        target->view_angle = key->view_angle;
+    }
+    target->properties |= key->properties;
+}
+
+bool animation_add_key (animation * animation, animated_object * object, const keyframe * key)
+{
+    keyframe * keys = object->keys;
+    int position = object->num_keys;
+
+    /* Keys mostly come in order, so the place for a new one is found from
+       the end */
+    while (position > 0 && keys[position - 1].frame > key->frame)
+    {
+        position--;
+    }
+    if (position > 0 && keys[position - 1].frame == key->frame)
+    {
+        merge_key(&keys[position - 1], key);
+        return true;
+    }
+    if (object->num_keys == object->key_capacity)
+    {
+        keys = realloc(keys, sizeof(keyframe) * object->key_capacity * 2);
+        if (keys == NULL)
+        {
+            return false;
+        }
+        object->keys = keys;
+        object->key_capacity *= 2;
+    }
+    memmove(&keys[position + 1], &keys[position], sizeof(keyframe) * (object->num_keys - position));
+    keys[position] = *key;
+    object->num_keys++;
+    if (key->frame >= animation->num_frames)
+    {
+        animation->num_frames = key->frame + 1;
+    }
+    return true;
+}
+
+static float mix (float a, float b, float t)
+{
+    return a + (b - a) * t;
+}
+
+static vector mix_vectors (vector a, vector b, float t)
+{
+    return (vector){ mix(a.x, b.x, t), mix(a.y, b.y, t), mix(a.z, b.z, t) };
+}
+
+static void interpolate_property (const animated_object * object, int frame, int property,
+                                  keyframe * result)
+/*! Set one property of "result" to its value at "frame" */
+{
+    const keyframe * before = NULL;
+    const keyframe * after = NULL;
+    float t;
+    int index;
+
+    /* The first key gives every property, so there is always one before */
+    for (index = 0; index < object->num_keys; index++)
+    {
+        if (!(object->keys[index].properties & property))
+        {
+            continue;
+        }
+        if (object->keys[index].frame <= frame)
+        {
+            before = &object->keys[index];
+        }
+        else
+        {
+            after = &object->keys[index];
+            break;
+        }
+    }
+    if (after == NULL)
+    {
+        after = before;
+        t = 0;
+    }
+    else
+    {
+        t = (float)(frame - before->frame) / (float)(after->frame - before->frame);
+    }
+    switch (property)
+    {
+        case KEY_POSITION:
+            result->position = mix_vectors(before->position, after->position, t);
+            break;
+        case KEY_ROTATION:
+            result->rotation = mix_vectors(before->rotation, after->rotation, t);
+            break;
+        case KEY_SCALE:
+            result->scale = mix_vectors(before->scale, after->scale, t);
+            break;
+        case KEY_COLOR:
+            result->color = (color){ mix(before->color.r, after->color.r, t),
+                                     mix(before->color.g, after->color.g, t),
+                                     mix(before->color.b, after->color.b, t) };
+            break;
+        case KEY_DIRECTION:
+            result->direction =
+                (direction){ mix(before->direction.theta, after->direction.theta, t),
+                             mix(before->direction.phi, after->direction.phi, t) };
+            break;
+        default:
+            result->view_angle = mix(before->view_angle, after->view_angle, t);
+    }
+    result->properties |= property;
+}
+
+keyframe animation_interpolate (const animated_object * object, int frame)
+{
+    keyframe result = { frame, 0 };
+    int property;
+
+    for (property = KEY_POSITION; property <= KEY_VIEW_ANGLE; property <<= 1)
+    {
+        if (object->keys[0].properties & property)
+        {
+            interpolate_property(object, frame, property, &result);
+        }
+    }
+    return result;
+}
+
+bool animation_apply (const animation * animation, int frame, scene * scene)
+{
+    const animated_object * object;
+    keyframe pose;
+    instance_transform transform, * current;
+    light_source * light;
+    bool moved = false;
+    int index;
+
+    for (index = 0; index < animation->num_objects; index++)
+    {
+        object = &animation->objects[index];
+        pose = animation_interpolate(object, frame);
+        switch (object->kind)
+        {
+            case ANIMATED_CAMERA:
+                scene->camera.position = pose.position;
+                scene->camera.direction = pose.direction;
+                scene->camera.view_angle = pose.view_angle;
+                break;
+            case ANIMATED_LIGHT:
+                light = &scene->light_sources[object->index];
+                light->position = pose.position;
+                light->color = pose.color;
+                break;
+            case ANIMATED_INSTANCE:
+                current = ((instance *)scene->surfaces[object->index].geometry)->transform;
+                if (instance_transform_make(pose.scale, pose.rotation, pose.position, &transform) &&
+                    memcmp(&transform, current, sizeof(transform)) != 0)
+                {
+                    *current = transform;
+                    moved = true;
+                }
+                break;
+        }
+    }
+    return moved;
+}
+
+void animation_free (animation * animation)
+{
+    int index;
+
+    if (animation == NULL)
+    {
+        return;
+    }
+    for (index = 0; index < animation->num_objects; index++)
+    {
+        free(animation->objects[index].keys);
+    }
+    free(animation->objects);
+    free(animation);
+}
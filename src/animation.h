@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "scene.h"
+#include "vector.h"
+#include "color.h"
+
+/* This module moves the camera, light sources and instances of a scene
+   from frame to frame of an animation.
+
+   An animated object has a series of keys, each giving some of its
+   properties at a frame.  The object's own properties, as the scene file
+   gives them, make its key at frame 0.  At any other frame, each property
+   is interpolated linearly between the nearest keys before and after the
+   frame that give it, and holds the value of the last key that gives it
+   after that.  A key only needs to give the properties that change.
+
+   Frames change the scene in place: the camera, the light sources and the
+   transforms of instances (see instance.h).  Instances move without their
+   surfaces changing, so the scene's BVH can be refit to the moved boxes
+   (see primitives_refit) rather than built again. */
+
+/* The properties that a key can give */
+typedef enum
+{
+    KEY_POSITION = 1,
+    KEY_ROTATION = 2,
+    KEY_SCALE = 4,
+    KEY_COLOR = 8,
+    KEY_DIRECTION = 16,
+    KEY_VIEW_ANGLE = 32
+} key_property;
+
+/* The properties that each kind of object has */
+#define KEY_CAMERA_PROPERTIES (KEY_POSITION | KEY_DIRECTION | KEY_VIEW_ANGLE)
+#define KEY_LIGHT_PROPERTIES (KEY_POSITION | KEY_COLOR)
+#define KEY_INSTANCE_PROPERTIES (KEY_POSITION | KEY_ROTATION | KEY_SCALE)
+
+/* Some of the properties of an object at a frame.  Angles are in radians. */
+typedef struct
+{
+    int frame;
+    /* The key_property flags of the properties given */
+    int properties;
+    vector position;
+    /* An instance's rotation and scale, as for instance_transform_make */
+    vector rotation;
+    vector scale;
+    color color;
+    direction direction;
+    float view_angle;
+} keyframe;
+
+typedef enum
+{
+    ANIMATED_CAMERA,
+    ANIMATED_LIGHT,
+    ANIMATED_INSTANCE
+} animated_kind;
+
+typedef struct
+{
+    animated_kind kind;
+    /* The index of a light source or of an instance's surface in the scene */
+    int index;
+    /* The object's keys in order of frame, one per frame at most, the first
+       being the object's own properties at frame 0 */
+    keyframe * keys;
+    int num_keys;
+    int key_capacity;
+} animated_object;
+
+typedef struct animation
+{
+    animated_object * objects;
+    int num_objects;
+    int object_capacity;
+    /* One more than the frame of the last key */
+    int num_frames;
+} animation;
+
+/*! Add an object to an animation, with "base", which gives every property
+    of its kind, as its key at frame 0.  Return the object, or NULL if memory
+    runs out. */
+animated_object * animation_add_object (animation * animation, animated_kind kind, int index,
+                                        const keyframe * base);
+
+/*! Add a key to an object of an animation.  The properties a key gives
+    replace those of an earlier key at the same frame.  Return false if
+    memory runs out. */
+bool animation_add_key (animation * animation, animated_object * object, const keyframe * key);
+
+/*! Interpolate the properties of an object at a frame */
+keyframe animation_interpolate (const animated_object * object, int frame);
+
+/*! Move the animated objects of "scene" to where they are at "frame".
+    Return true if any instance moved, so that the scene's BVH needs to be
+    refit.  An instance whose scale passes through 0 keeps its last
+    transform. */
+bool animation_apply (const animation * animation, int frame, scene * scene);
+
+/*! Release an animation and its objects */
+void animation_free (animation * animation);
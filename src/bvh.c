@@ -0,0 +1,509 @@
+#include "bvh.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+/* Number of candidate split bins along each axis */
+#define NUM_BINS 16
+
+/* Nodes with this many surfaces or fewer, or one group of surfaces where
+   the leaves are tested in groups, become leaves when splitting them would
+   not reduce the estimated cost */
+static const int max_leaf_size = 4;
+
+/* Cost of visiting a node relative to the cost of testing one surface */
+static const float traversal_cost = 0.5f;
+
+/* Below this depth nodes are halved instead of split with the SAH, which
+   bounds the depth of the tree (and the traversal stack below) for any
+   arrangement of surfaces */
+static const int max_sah_depth = 64;
+
+/* Boxes are padded by this fraction of their largest coordinate so that
+   rays grazing flat or tangent surfaces still enter their boxes despite
+   rounding error in the intersection calculations */
+static const float box_padding = 1e-4f;
+
+typedef struct
+{
+    bounds * primitive_bounds;
+    vector * centroids;
+    int * primitives;
+    bvh_node * nodes;
+    int num_nodes;
+    /* Number of surfaces of a leaf tested together, and the largest leaf */
+    int group_width;
+    int leaf_limit;
+} builder;
+
+typedef struct
+{
+    bounds box;
+    int count;
+} bin;
+
+static bounds bounds_empty (void)
+{
+    return (bounds){ { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+}
+
+static bounds bounds_add_point (bounds a, vector point)
+{
+    return bvh_bounds_union(a, (bounds){ point, point });
+}
+
+static float bounds_area (bounds a)
+{
+    vector extent = vector_sub(a.max, a.min);
+    if (extent.x < .0f || extent.y < .0f || extent.z < .0f)
+    {
+        return .0f;
+    }
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+static float axis_component (vector v, int axis)
+{
+    return ((float *)&v)[axis];
+}
+
+static void make_leaf (builder * builder, int node_index, int first, int count)
+{
+    builder->nodes[node_index].first = first;
+    builder->nodes[node_index].count = count;
+}
+
+static int group_count (builder * builder, int count)
+/*! The number of tests it takes to test "count" surfaces of a leaf */
+{
+    return (count + builder->group_width - 1) / builder->group_width;
+}
+
+static void build_node (builder * builder, int node_index, int first, int count, int depth)
+/*! Fill in the node at "node_index" for the primitives at positions first to
+    first + count - 1 of the primitives array, splitting them among child
+    nodes recursively and reordering them so that each child's primitives
+    are consecutive.
+*/
+{
+    bvh_node * node = &builder->nodes[node_index];
+    bounds centroid_bounds = bounds_empty();
+    bin bins[NUM_BINS];
+    bounds left_boxes[NUM_BINS];
+    int left_counts[NUM_BINS];
+    bounds right_box;
+    int right_count;
+    int index, axis, split, bin_index, best_axis = -1, best_split = 0, middle;
+    float cost, best_cost, scale, axis_min, axis_extent;
+    int * primitives = builder->primitives;
+
+    node->box = bounds_empty();
+    for (index = first; index < first + count; index++)
+    {
+        node->box = bvh_bounds_union(node->box, builder->primitive_bounds[primitives[index]]);
+        centroid_bounds = bounds_add_point(centroid_bounds, builder->centroids[primitives[index]]);
+    }
+
+    if (count == 1)
+    {
+        make_leaf(builder, node_index, first, count);
+        return;
+    }
+
+    best_cost = group_count(builder, count);
+    if (depth < max_sah_depth)
+    {
+        for (axis = 0; axis < 3; axis++)
+        {
+            axis_min = axis_component(centroid_bounds.min, axis);
+            axis_extent = axis_component(centroid_bounds.max, axis) - axis_min;
+            if (axis_extent <= .0f)
+            {
+                continue;
+            }
+            scale = NUM_BINS / axis_extent;
+
+            for (bin_index = 0; bin_index < NUM_BINS; bin_index++)
+            {
+                bins[bin_index].box = bounds_empty();
+                bins[bin_index].count = 0;
+            }
+            for (index = first; index < first + count; index++)
+            {
+                bin_index = (axis_component(builder->centroids[primitives[index]], axis) - axis_min) * scale;
+                bin_index = bin_index < NUM_BINS ? bin_index : NUM_BINS - 1;
+                bins[bin_index].box = bvh_bounds_union(bins[bin_index].box,
+                                                   builder->primitive_bounds[primitives[index]]);
+                bins[bin_index].count++;
+            }
+
+            /* Sweep from the left to accumulate boxes and counts left of each split,
+               then from the right to evaluate the cost of each split */
+            left_boxes[0] = bins[0].box;
+            left_counts[0] = bins[0].count;
+            for (bin_index = 1; bin_index < NUM_BINS; bin_index++)
+            {
+                left_boxes[bin_index] = bvh_bounds_union(left_boxes[bin_index - 1], bins[bin_index].box);
+                left_counts[bin_index] = left_counts[bin_index - 1] + bins[bin_index].count;
+            }
+            right_box = bounds_empty();
+            right_count = 0;
+            for (split = NUM_BINS - 1; split > 0; split--)
+            {
+                right_box = bvh_bounds_union(right_box, bins[split].box);
+                right_count += bins[split].count;
+                if (right_count == 0 || left_counts[split - 1] == 0)
+                {
+                    continue;
+                }
+                cost = traversal_cost + (bounds_area(left_boxes[split - 1]) *
+                                         group_count(builder, left_counts[split - 1]) +
+                                         bounds_area(right_box) * group_count(builder, right_count)) / bounds_area(node->box);
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = split;
+                }
+            }
+        }
+    }
+
+    if (best_axis < 0)
+    {
+        if (count <= builder->leaf_limit)
+        {
+            make_leaf(builder, node_index, first, count);
+            return;
+        }
+        /* No useful split was found, divide the primitives in half as they are */
+        middle = first + count / 2;
+    }
+    else
+    {
+        /* Partition the primitives so the ones left of the split come first */
+        axis_min = axis_component(centroid_bounds.min, best_axis);
+        scale = NUM_BINS / (axis_component(centroid_bounds.max, best_axis) - axis_min);
+        middle = first;
+        for (index = first; index < first + count; index++)
+        {
+            int primitive = primitives[index];
+            bin_index = (axis_component(builder->centroids[primitive], best_axis) - axis_min) * scale;
+            if (bin_index < best_split)
+            {
+                primitives[index] = primitives[middle];
+                primitives[middle++] = primitive;
+            }
+        }
+    }
+
+    build_node(builder, builder->num_nodes++, first, middle - first, depth + 1);
+    node = &builder->nodes[node_index];
+    node->first = builder->num_nodes++;
+    node->count = 0;
+    build_node(builder, node->first, middle, first + count - middle, depth + 1);
+}
+
+bool bvh_build (bvh * bvh_out, bounds primitive_bounds[], int count, int group_width)
+{
+    builder builder;
+    int index;
+
+    bvh_out->num_nodes = 0;
+    bvh_out->num_primitives = count;
+    bvh_out->nodes = malloc(sizeof(bvh_node) * (2 * count + 1));
+    bvh_out->primitives = malloc(sizeof(int) * (count + 1));
+    builder.centroids = malloc(sizeof(vector) * (count + 1));
+    if (bvh_out->nodes == NULL || bvh_out->primitives == NULL || builder.centroids == NULL)
+    {
+        free(bvh_out->nodes);
+        free(bvh_out->primitives);
+        free(builder.centroids);
+        return false;
+    }
+
+    for (index = 0; index < count; index++)
+    {
+        bvh_out->primitives[index] = index;
+        builder.centroids[index] = vector_multiply(0.5f, vector_add(primitive_bounds[index].min,
+                                                                    primitive_bounds[index].max));
+    }
+    builder.primitive_bounds = primitive_bounds;
+    builder.primitives = bvh_out->primitives;
+    builder.nodes = bvh_out->nodes;
+    builder.num_nodes = 0;
+    builder.group_width = group_width;
+    builder.leaf_limit = group_width > max_leaf_size ? group_width : max_leaf_size;
+
+    if (count > 0)
+    {
+        builder.num_nodes = 1;
+        build_node(&builder, 0, 0, count, 0);
+    }
+    bvh_out->num_nodes = builder.num_nodes;
+    free(builder.centroids);
+    return true;
+}
+
+bounds bvh_surface_bounds (surface * surface)
+{
+    return bvh_pad_bounds(surface->class->calculate_bounds(surface->geometry));
+}
+
+bounds bvh_pad_bounds (bounds box)
+{
+    float magnitude = max_float(max_float(max_float(fabsf(box.min.x), fabsf(box.max.x)),
+                                          max_float(fabsf(box.min.y), fabsf(box.max.y))),
+                                max_float(fabsf(box.min.z), fabsf(box.max.z)));
+    float padding = box_padding * (magnitude + 1.0f);
+    vector pad = { padding, padding, padding };
+    return (bounds){ vector_sub(box.min, pad), vector_add(box.max, pad) };
+}
+
+bvh * bvh_create (surface surfaces[])
+{
+    return bvh_create_grouped(surfaces, 1);
+}
+
+bvh * bvh_create_grouped (surface surfaces[], int group_width)
+{
+    bvh * result;
+    bounds * primitive_bounds;
+    int index, count = 0;
+
+    while (surfaces[count].class)
+    {
+        count++;
+    }
+
+    result = malloc(sizeof(bvh));
+    primitive_bounds = malloc(sizeof(bounds) * (count + 1));
+    if (result == NULL || primitive_bounds == NULL)
+    {
+        free(result);
+        free(primitive_bounds);
+        return NULL;
+    }
+    for (index = 0; index < count; index++)
+    {
+        primitive_bounds[index] = bvh_surface_bounds(&surfaces[index]);
+    }
+
+    if (!bvh_build(result, primitive_bounds, count, group_width))
+    {
+        free(result);
+        result = NULL;
+    }
+    free(primitive_bounds);
+    return result;
+}
+
+void bvh_free (bvh * bvh)
+{
+    if (bvh)
+    {
+        free(bvh->nodes);
+        free(bvh->primitives);
+        free(bvh);
+    }
+}
+
+void bvh_refit (bvh * bvh)
+{
+    bvh_node * node;
+    int index;
+
+    /* Children follow their parents in depth first order, so going backwards
+       reaches every child before its parent */
+    for (index = bvh->num_nodes - 1; index >= 0; index--)
+    {
+        node = &bvh->nodes[index];
+        if (node->count == 0)
+        {
+            node->box = bvh_bounds_union(bvh->nodes[index + 1].box, bvh->nodes[node->first].box);
+        }
+    }
+}
+
+static int check_subtree (const bvh_node nodes[], int num_nodes, int node_index, int depth)
+/*! Return the index following the subtree at "node_index" if it is laid
+    out in depth first order within the first "num_nodes" nodes, or -1 */
+{
+    const bvh_node * node;
+    int end;
+
+    if (node_index >= num_nodes || depth >= BVH_MAX_STACK_DEPTH)
+    {
+        return -1;
+    }
+    node = &nodes[node_index];
+    if (node->count != 0)
+    {
+        return node->count > 0 ? node_index + 1 : -1;
+    }
+    end = check_subtree(nodes, num_nodes, node_index + 1, depth + 1);
+    if (end < 0 || end != node->first)
+    {
+        return -1;
+    }
+    return check_subtree(nodes, num_nodes, node->first, depth + 1);
+}
+
+bool bvh_nodes_valid (const bvh_node nodes[], int num_nodes)
+{
+    return num_nodes == 0 || check_subtree(nodes, num_nodes, 0, 0) == num_nodes;
+}
+
+surface * bvh_hit_surface (bvh * bvh, surface surfaces[], vector origin, vector ray,
+                           vector * intersection_out, vector * normal_out)
+{
+    int stack_nodes[BVH_MAX_STACK_DEPTH];
+    float stack_distances[BVH_MAX_STACK_DEPTH];
+    int top = 0;
+    int node_index = 0;
+    int index, left, right;
+    bvh_node * node;
+    surface * cur_surface;
+    surface * closest_surface = NULL;
+    vector intersection, normal;
+    vector inverse = bvh_inverse_direction(ray);
+    float ray_length = vector_magnitude(ray);
+    float distance, closest_distance = INFINITY, max_t = INFINITY;
+    float t_left, t_right, t_root;
+    bool hit_left, hit_right;
+
+    if (bvh->num_nodes == 0 || !bvh_ray_hits_box(&bvh->nodes[0].box, origin, inverse, max_t, &t_root))
+    {
+        return NULL;
+    }
+
+    while (true)
+    {
+        node = &bvh->nodes[node_index];
+        if (node->count > 0)
+        {
+            for (index = node->first; index < node->first + node->count; index++)
+            {
+                cur_surface = &surfaces[bvh->primitives[index]];
+                if (cur_surface->class->calculate_intersection(origin, ray, cur_surface->geometry,
+                                                               &intersection, &normal))
+                {
+                    distance = vector_distance(origin, intersection);
+                    if (distance < closest_distance ||
+                        (distance == closest_distance && cur_surface < closest_surface))
+                    {
+                        closest_distance = distance;
+                        closest_surface = cur_surface;
+                        *intersection_out = intersection;
+                        *normal_out = normal;
+                        max_t = distance / ray_length * bvh_distance_slack;
+                    }
+                }
+            }
+        }
+        else
+        {
+            left = node_index + 1;
+            right = node->first;
+            hit_left = bvh_ray_hits_box(&bvh->nodes[left].box, origin, inverse, max_t, &t_left);
+            hit_right = bvh_ray_hits_box(&bvh->nodes[right].box, origin, inverse, max_t, &t_right);
+            if (hit_left && hit_right)
+            {
+                /* Visit the nearer child first, it is more likely to hold the closest hit */
+                if (t_right < t_left)
+                {
+                    stack_nodes[top] = left;
+                    stack_distances[top++] = t_left;
+                    node_index = right;
+                }
+                else
+                {
+                    stack_nodes[top] = right;
+                    stack_distances[top++] = t_right;
+                    node_index = left;
+                }
+                continue;
+            }
+            else if (hit_left || hit_right)
+            {
+                node_index = hit_left ? left : right;
+                continue;
+            }
+        }
+
+        /* Resume with a node left on the stack, unless a closer hit has been found since */
+        do
+        {
+            if (top == 0)
+            {
+                return closest_surface;
+            }
+            node_index = stack_nodes[--top];
+        } while (stack_distances[top] > max_t);
+    }
+}
+
+bool bvh_is_occluded (bvh * bvh, surface surfaces[], vector origin, vector ray,
+                      float max_distance, surface ** occluder_cache)
+{
+    int stack[BVH_MAX_STACK_DEPTH];
+    int top = 0;
+    int node_index, index;
+    bvh_node * node;
+    surface * cur_surface;
+    vector inverse = bvh_inverse_direction(ray);
+    float max_t = max_distance * bvh_distance_slack;
+    float t_near;
+
+    if (occluder_cache && *occluder_cache)
+    {
+        cur_surface = *occluder_cache;
+        stats_count(occluder_cache_tests);
+        /* The cache may be left over from another scene */
+        if (cur_surface >= surfaces && cur_surface < surfaces + bvh->num_primitives &&
+            cur_surface->class->test_occlusion(origin, ray, cur_surface->geometry, max_distance))
+        {
+            stats_count(occluder_cache_hits);
+            return true;
+        }
+    }
+
+    if (bvh->num_nodes == 0)
+    {
+        return false;
+    }
+
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        node_index = stack[--top];
+        node = &bvh->nodes[node_index];
+        if (!bvh_ray_hits_box(&node->box, origin, inverse, max_t, &t_near))
+        {
+            continue;
+        }
+        if (node->count > 0)
+        {
+            for (index = node->first; index < node->first + node->count; index++)
+            {
+                cur_surface = &surfaces[bvh->primitives[index]];
+                if (cur_surface->class->test_occlusion(origin, ray, cur_surface->geometry,
+                                                       max_distance))
+                {
+                    if (occluder_cache)
+                    {
+                        *occluder_cache = cur_surface;
+                    }
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            stack[top++] = node->first;
+            stack[top++] = node_index + 1;
+        }
+    }
+    return false;
+}
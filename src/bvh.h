@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "surface.h"
+#include "vector.h"
+
+/* This module implements a bounding volume hierarchy (BVH), a binary tree of
+   axis aligned bounding boxes used to find the surfaces a ray hits without
+   testing the ray against every surface in the scene.
+
+   Each node of the tree has a box enclosing all the surfaces below it.  A ray
+   that misses a node's box cannot hit any surface below that node, so whole
+   subtrees are skipped at the cost of a single ray/box test.  Leaf nodes hold
+   a short run of surfaces which are tested individually.
+
+   The tree is built top down with the surface area heuristic (SAH): a node's
+   surfaces are split in two along the axis and position that minimizes the
+   expected cost of tracing a ray through the children, estimated as the number
+   of surfaces in each child weighted by the child's surface area (the
+   probability that a random ray hitting the parent also hits the child).
+   Candidate split positions are taken from a fixed number of bins along each
+   axis, which keeps the build time linear in the number of surfaces per level.
+
+   The nodes are stored in a flat array in depth first order, so the first
+   child of an interior node always directly follows it, and child and surface
+   references are array indices.  This makes the tree independent of where it
+   is stored in memory.
+*/
+
+typedef struct
+{
+    bounds box;
+    /* For a leaf, "first" is the position of the leaf's first surface in the
+       primitives array.  For an interior node, it is the index of the second
+       child; the first child is the node that follows this one. */
+    int first;
+    /* Number of surfaces in a leaf, 0 for an interior node */
+    int count;
+} bvh_node;
+
+typedef struct
+{
+    bvh_node * nodes;
+    int num_nodes;
+    /* Indices into the array of primitives the tree was built for,
+       ordered so that the surfaces of each leaf are consecutive */
+    int * primitives;
+    int num_primitives;
+} bvh;
+
+/*! Build a BVH over "count" primitives with the given bounding boxes, for
+    leaves whose primitives are tested "group_width" at a time (1 if they
+    are tested one by one).  The cost of a leaf is counted in groups, so
+    leaves of up to a full group are made where they save nodes.
+    Return false if memory could not be allocated. */
+bool bvh_build (bvh * bvh_out, bounds primitive_bounds[], int count, int group_width);
+
+/*! Build a BVH over a sentinel terminated surface array, as defined in
+    scene.h, using the bounding function of each surface class.  Return NULL
+    if memory could not be allocated. */
+bvh * bvh_create (surface surfaces[]);
+
+/*! bvh_create, for leaves tested "group_width" surfaces at a time, as bvh_build */
+bvh * bvh_create_grouped (surface surfaces[], int group_width);
+
+/*! Release a BVH returned by bvh_create */
+void bvh_free (bvh * bvh);
+
+/*! Calculate the box a BVH uses for the given surface: the bounds of the
+    surface, padded to allow for rounding error in intersection calculations */
+bounds bvh_surface_bounds (surface * surface);
+
+/*! Pad a box as bvh_surface_bounds does */
+bounds bvh_pad_bounds (bounds box);
+
+/*! Recompute the boxes of the interior nodes of a BVH from the boxes of
+    their children, once the boxes of its leaves have been changed to fit
+    primitives that moved.  The tree keeps its shape, so it may be slower to
+    trace than one built again, but it finds the same surfaces. */
+void bvh_refit (bvh * bvh);
+
+/*! Determine whether "num_nodes" nodes, read from somewhere they may have
+    been corrupted, are laid out as bvh_build lays them out: every node is
+    reached once from the root in depth first order, no deeper than a
+    traversal stack can go.  Where the leaves point isn't checked. */
+bool bvh_nodes_valid (const bvh_node nodes[], int num_nodes);
+
+/* The deepest a traversal stack can get, given the depth limit of the build */
+#define BVH_MAX_STACK_DEPTH 128
+
+/* Node boxes are tested with this much slack beyond the closest hit so that
+   surfaces at exactly the same distance are still found */
+static const float bvh_distance_slack = 1.0f + 1e-4f;
+
+/* Minimum and maximum written as comparisons, which compile to single
+   instructions where fminf and fmaxf become library calls under -ansi */
+static __inline float min_float (float a, float b)
+{
+    return a < b ? a : b;
+}
+
+static __inline float max_float (float a, float b)
+{
+    return a > b ? a : b;
+}
+
+/*! The smallest box enclosing boxes "a" and "b" */
+static __inline bounds bvh_bounds_union (bounds a, bounds b)
+{
+    return (bounds){ { min_float(a.min.x, b.min.x), min_float(a.min.y, b.min.y),
+                       min_float(a.min.z, b.min.z) },
+                     { max_float(a.max.x, b.max.x), max_float(a.max.y, b.max.y),
+                       max_float(a.max.z, b.max.z) } };
+}
+
+/*! Calculate the reciprocal components of a ray direction, for bvh_ray_hits_box */
+static __inline vector bvh_inverse_direction (vector ray)
+{
+    return (vector){ 1.0f / ray.x, 1.0f / ray.y, 1.0f / ray.z };
+}
+
+/*! Determine whether a ray with the given origin and direction, whose
+    reciprocal components are given by "inverse", enters the box before
+    parameter max_t.  If it does, output the entry parameter to "t_out". */
+static __inline bool bvh_ray_hits_box (const bounds * box, vector origin, vector inverse,
+                                       float max_t, float * t_out)
+{
+    float t0, t1, t_near, t_far;
+
+    t0 = (box->min.x - origin.x) * inverse.x;
+    t1 = (box->max.x - origin.x) * inverse.x;
+    t_near = min_float(t0, t1);
+    t_far = max_float(t0, t1);
+    t0 = (box->min.y - origin.y) * inverse.y;
+    t1 = (box->max.y - origin.y) * inverse.y;
+    t_near = max_float(t_near, min_float(t0, t1));
+    t_far = min_float(t_far, max_float(t0, t1));
+    t0 = (box->min.z - origin.z) * inverse.z;
+    t1 = (box->max.z - origin.z) * inverse.z;
+    t_near = max_float(t_near, min_float(t0, t1));
+    t_far = min_float(t_far, max_float(t0, t1));
+
+    *t_out = t_near;
+    return t_far >= max_float(t_near, .0f) && t_near <= max_t;
+}
+
+/*! Find the closest surface hit by a ray, as hit_surface in ray_trace.c does,
+    using a BVH built for the given surface array.  The same surface is found
+    as with a linear search; ties in distance go to the earlier surface. */
+surface * bvh_hit_surface (bvh * bvh, surface surfaces[], vector origin, vector ray,
+                           vector * intersection_out, vector * normal_out);
+
+/*! Determine if any surface is hit by a ray with the given origin and
+    normalized direction at a distance less than max_distance from the origin,
+    using a BVH built for the given surface array.  The search stops at the
+    first such surface found, in no particular order.
+
+    "occluder_cache", if not NULL, points to the surface that blocked the
+    previous similar ray, or NULL.  That surface is tested before the tree is
+    traversed, and the cache is updated with the blocking surface found. */
+bool bvh_is_occluded (bvh * bvh, surface surfaces[], vector origin, vector ray,
+                      float max_distance, surface ** occluder_cache);
@@ -0,0 +1,784 @@
+#include "compiled_scene.h"
+#include "primitives.h"
+#include "mesh.h"
+#include "instance.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Changed whenever the layout of compiled scenes changes */
+#define COMPILED_SCENE_VERSION 4
+/* Each section starts at a multiple of this many bytes */
+#define SECTION_ALIGNMENT 64
+/* The class number that ends a group in the group classes section */
+#define GROUP_END 0xff
+/* Written in the header to tell byte orders apart */
+#define BYTE_ORDER_MARK 0x01020304
+
+static const char compiled_scene_magic[8] = "RTSCENE";
+
+/* The sections of a compiled scene, in the order they are written */
+typedef enum
+{
+    SECTION_LIGHT_SOURCES,
+    SECTION_SURFACES,
+    /* The class number of each surface, one byte each */
+    SECTION_SURFACE_CLASSES,
+    /* The arrays of each mesh surface, in the order of the surfaces */
+    SECTION_MESHES,
+    /* The surfaces of every group, each group followed by its sentinel */
+    SECTION_GROUP_SURFACES,
+    /* The class number of each group surface, and GROUP_END for sentinels */
+    SECTION_GROUP_CLASSES,
+    /* The arrays of each mesh among the group surfaces */
+    SECTION_GROUP_MESHES,
+    /* An instance_record for each instance surface, in the order of the
+       surfaces */
+    SECTION_INSTANCES,
+    /* The blocks output by primitives_blocks, in their order */
+    SECTION_PRIMITIVES,
+    NUM_SECTIONS = SECTION_PRIMITIVES + PRIMITIVES_NUM_BLOCKS,
+} section;
+
+typedef struct
+{
+    unsigned long long offset;
+    unsigned long long size;
+} section_extent;
+
+typedef struct
+{
+    char magic[sizeof(compiled_scene_magic)];
+    int version;
+    unsigned int byte_order;
+    /* The sizes of the structures saved, which depend on the build */
+    int header_size;
+    int light_source_size;
+    int surface_size;
+    int bvh_node_size;
+    int primitive_leaf_size;
+    int primitive_padding;
+    color background_color;
+    camera camera;
+    section_extent sections[NUM_SECTIONS];
+} compiled_header;
+
+/* The arrays of a mesh in the meshes section follow this header, in the
+   order of its members, each aligned for its type, and the next mesh
+   starts at the next multiple of SECTION_ALIGNMENT */
+typedef struct
+{
+    int num_nodes;
+    int num_vertices;
+    int num_triangles;
+    int padding;
+} mesh_record;
+
+/* What an instance surface points to, used in place.  The groups are
+   rebuilt at load, so instances refer to them by number. */
+typedef struct
+{
+    int group;
+    instance_transform transform;
+} instance_record;
+
+/* The surface classes, in the order of the class numbers saved */
+static surface_class ** const surface_classes[] =
+{
+    &surface_sphere, &surface_frustum, &surface_circle, &surface_quad, &surface_mesh,
+    &surface_instance
+};
+
+#define NUM_SURFACE_CLASSES (sizeof(surface_classes) / sizeof(surface_classes[0]))
+
+static void describe_build (compiled_header * header)
+/*! Fill in the parts of a header that identify the format and the build */
+{
+    memcpy(header->magic, compiled_scene_magic, sizeof(header->magic));
+    header->version = COMPILED_SCENE_VERSION;
+    header->byte_order = BYTE_ORDER_MARK;
+    header->header_size = sizeof(compiled_header);
+    header->light_source_size = sizeof(light_source);
+    header->surface_size = sizeof(surface);
+    header->bvh_node_size = sizeof(bvh_node);
+    header->primitive_leaf_size = sizeof(primitive_leaf);
+    header->primitive_padding = PRIMITIVE_PADDING;
+}
+
+bool is_compiled_scene (FILE * file)
+{
+    char magic[sizeof(compiled_scene_magic)];
+    return pread(fileno(file), magic, sizeof(magic), 0) == sizeof(magic) &&
+           memcmp(magic, compiled_scene_magic, sizeof(magic)) == 0;
+}
+
+static unsigned long long align_section (unsigned long long position)
+{
+    return (position + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+static bool write_padding (unsigned long long * position, unsigned long long end, FILE * file)
+/*! Write zeros from "*position" up to "end", advancing the position */
+{
+    for (; *position < end; (*position)++)
+    {
+        if (fputc(0, file) == EOF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static mesh_record describe_mesh (triangle_mesh * triangles)
+{
+    mesh_record record = { triangles->num_nodes, triangles->num_vertices,
+                           triangles->num_triangles, 0 };
+    return record;
+}
+
+static void lay_out_record (const mesh_record * record, size_t offsets_out[3])
+/*! Output the offsets of a mesh's vertices and indices from the start of
+    its record in the meshes section, and the size of the record to
+    offsets_out[2] */
+{
+    offsets_out[0] = sizeof(mesh_record) + sizeof(bvh_node) * record->num_nodes;
+    offsets_out[1] = offsets_out[0] + sizeof(vector) * record->num_vertices;
+    offsets_out[2] = align_section(offsets_out[1] + sizeof(int) * 3 * record->num_triangles);
+}
+
+static size_t meshes_size (surface surfaces[], int count)
+/*! Return the size of the records of the meshes among "count" surfaces */
+{
+    mesh_record record;
+    size_t offsets[3], size = 0;
+    int index;
+
+    for (index = 0; index < count; index++)
+    {
+        if (surfaces[index].class == surface_mesh)
+        {
+            record = describe_mesh(((mesh *)surfaces[index].geometry)->triangles);
+            lay_out_record(&record, offsets);
+            size += offsets[2];
+        }
+    }
+    return size;
+}
+
+static bool write_meshes (surface surfaces[], int count, FILE * file)
+/*! Write the records of the meshes among "count" surfaces */
+{
+    triangle_mesh * triangles;
+    mesh_record record;
+    size_t offsets[3];
+    unsigned long long position;
+    int index;
+
+    for (index = 0; index < count; index++)
+    {
+        if (surfaces[index].class != surface_mesh)
+        {
+            continue;
+        }
+        triangles = ((mesh *)surfaces[index].geometry)->triangles;
+        record = describe_mesh(triangles);
+        lay_out_record(&record, offsets);
+        position = offsets[1] + sizeof(int) * 3 * record.num_triangles;
+        if (fwrite(&record, sizeof(record), 1, file) != 1 ||
+            (record.num_nodes > 0 &&
+             fwrite(triangles->nodes, sizeof(bvh_node), record.num_nodes, file) !=
+                 record.num_nodes) ||
+            fwrite(triangles->vertices, sizeof(vector), record.num_vertices, file) !=
+                record.num_vertices ||
+            fwrite(triangles->indices, sizeof(int) * 3, record.num_triangles, file) !=
+                record.num_triangles ||
+            !write_padding(&position, offsets[2], file))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool write_surfaces (surface surfaces[], int count, FILE * file)
+/*! Write "count" surfaces without their class pointers, the pointers to
+    the triangles of meshes, or the pointers of instances, which mean
+    nothing outside of this process */
+{
+    surface copy;
+    int index;
+    for (index = 0; index < count; index++)
+    {
+        copy = surfaces[index];
+        copy.class = NULL;
+        if (surfaces[index].class == surface_mesh)
+        {
+            ((mesh *)copy.geometry)->triangles = NULL;
+        }
+        else if (surfaces[index].class == surface_instance)
+        {
+            ((instance *)copy.geometry)->group = NULL;
+            ((instance *)copy.geometry)->transform = NULL;
+        }
+        if (fwrite(&copy, sizeof(surface), 1, file) != 1)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool write_instances (scene * scene, int num_surfaces, FILE * file)
+/*! Write the records of the instances among the surfaces of a scene */
+{
+    instance_record record;
+    instance * cur_instance;
+    int index;
+
+    memset(&record, 0, sizeof(record));
+    for (index = 0; index < num_surfaces; index++)
+    {
+        if (scene->surfaces[index].class != surface_instance)
+        {
+            continue;
+        }
+        cur_instance = (instance *)scene->surfaces[index].geometry;
+        record.group = cur_instance->group - scene->groups;
+        record.transform = *cur_instance->transform;
+        if (fwrite(&record, sizeof(record), 1, file) != 1)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static unsigned char class_number (surface_class * class)
+{
+    unsigned char number = 0;
+    while (*surface_classes[number] != class)
+    {
+        number++;
+    }
+    return number;
+}
+
+static int count_surfaces (const surface surfaces[])
+/*! Return the number of surfaces before the sentinel */
+{
+    int count = 0;
+    while (surfaces[count].class)
+    {
+        count++;
+    }
+    return count;
+}
+
+static bool write_groups (scene * scene, section section, FILE * file)
+/*! Write one of the group sections of a scene */
+{
+    surface * surfaces;
+    int group, count, index;
+    bool written = true;
+
+    for (group = 0; group < scene->num_groups && written; group++)
+    {
+        surfaces = scene->groups[group].surfaces;
+        count = count_surfaces(surfaces);
+        for (index = 0; index < count && section == SECTION_GROUP_CLASSES && written; index++)
+        {
+            written = fputc(class_number(surfaces[index].class), file) != EOF;
+        }
+        if (section == SECTION_GROUP_SURFACES)
+        {
+            written = write_surfaces(surfaces, count + 1, file);
+        }
+        else if (section == SECTION_GROUP_CLASSES)
+        {
+            written = written && fputc(GROUP_END, file) != EOF;
+        }
+        else
+        {
+            written = write_meshes(surfaces, count, file);
+        }
+    }
+    return written;
+}
+
+int save_compiled_scene (scene * scene, FILE * file)
+{
+    compiled_header header;
+    primitives_block sections[NUM_SECTIONS];
+    unsigned char * classes;
+    int num_lights = 0, num_surfaces, num_instances = 0, num_group_surfaces = 0, index;
+    unsigned long long position;
+    section section;
+    bool written;
+
+    while (scene->light_sources[num_lights].type != LIGHT_SOURCE_SENTINEL)
+    {
+        num_lights++;
+    }
+    num_surfaces = count_surfaces(scene->surfaces);
+    classes = malloc(num_surfaces + 1);
+    if (classes == NULL)
+    {
+        return -1;
+    }
+    for (index = 0; index < num_surfaces; index++)
+    {
+        classes[index] = class_number(scene->surfaces[index].class);
+        num_instances += scene->surfaces[index].class == surface_instance;
+    }
+
+    /* The sentinels of both arrays are saved along with them */
+    sections[SECTION_LIGHT_SOURCES].data = scene->light_sources;
+    sections[SECTION_LIGHT_SOURCES].size = sizeof(light_source) * (num_lights + 1);
+    sections[SECTION_SURFACES].data = scene->surfaces;
+    sections[SECTION_SURFACES].size = sizeof(surface) * (num_surfaces + 1);
+    sections[SECTION_SURFACE_CLASSES].data = classes;
+    sections[SECTION_SURFACE_CLASSES].size = num_surfaces;
+    sections[SECTION_MESHES].size = meshes_size(scene->surfaces, num_surfaces);
+    sections[SECTION_GROUP_MESHES].size = 0;
+    for (index = 0; index < scene->num_groups; index++)
+    {
+        num_group_surfaces += count_surfaces(scene->groups[index].surfaces) + 1;
+        sections[SECTION_GROUP_MESHES].size +=
+            meshes_size(scene->groups[index].surfaces,
+                        count_surfaces(scene->groups[index].surfaces));
+    }
+    sections[SECTION_GROUP_SURFACES].size = sizeof(surface) * num_group_surfaces;
+    sections[SECTION_GROUP_CLASSES].size = num_group_surfaces;
+    sections[SECTION_INSTANCES].size = sizeof(instance_record) * num_instances;
+    primitives_blocks(scene->primitives, &sections[SECTION_PRIMITIVES]);
+
+    /* Zeroed first so that the padding between members is written as zeros */
+    memset(&header, 0, sizeof(header));
+    describe_build(&header);
+    header.background_color = scene->background_color;
+    header.camera = scene->camera;
+    position = sizeof(header);
+    for (section = 0; section < NUM_SECTIONS; section++)
+    {
+        position = align_section(position);
+        header.sections[section].offset = position;
+        header.sections[section].size = sections[section].size;
+        position += sections[section].size;
+    }
+
+    written = fwrite(&header, sizeof(header), 1, file) == 1;
+    position = sizeof(header);
+    for (section = 0; section < NUM_SECTIONS && written; section++)
+    {
+        written = write_padding(&position, header.sections[section].offset, file);
+        if (section == SECTION_SURFACES)
+        {
+            written = written && write_surfaces(scene->surfaces, num_surfaces + 1, file);
+        }
+        else if (section == SECTION_MESHES)
+        {
+            written = written && write_meshes(scene->surfaces, num_surfaces, file);
+        }
+        else if (section == SECTION_GROUP_SURFACES || section == SECTION_GROUP_CLASSES ||
+                 section == SECTION_GROUP_MESHES)
+        {
+            written = written && write_groups(scene, section, file);
+        }
+        else if (section == SECTION_INSTANCES)
+        {
+            written = written && write_instances(scene, num_surfaces, file);
+        }
+        else if (sections[section].size > 0)
+        {
+            written = written &&
+                      fwrite(sections[section].data, sections[section].size, 1, file) == 1;
+        }
+        position += sections[section].size;
+    }
+    free(classes);
+    return written ? 0 : -1;
+}
+
+static bool header_matches_build (const compiled_header * header)
+/*! Determine if a compiled scene was saved by a build like this one */
+{
+    compiled_header expected;
+    memset(&expected, 0, sizeof(expected));
+    describe_build(&expected);
+    return memcmp(header->magic, expected.magic, sizeof(expected.magic)) == 0 &&
+           header->version == expected.version &&
+           header->byte_order == expected.byte_order &&
+           header->header_size == expected.header_size &&
+           header->light_source_size == expected.light_source_size &&
+           header->surface_size == expected.surface_size &&
+           header->bvh_node_size == expected.bvh_node_size &&
+           header->primitive_leaf_size == expected.primitive_leaf_size &&
+           header->primitive_padding == expected.primitive_padding;
+}
+
+static int reject (char * mapping, size_t size, char * reason)
+/*! Give up loading a compiled scene, unmapping it */
+{
+    fprintf(stderr, "Compiled scene %s\n", reason);
+    munmap(mapping, size);
+    errno = EINVAL;
+    return -1;
+}
+
+static void free_meshes (surface surfaces[], int count)
+/*! Free the meshes made for the first "count" surfaces by load_meshes */
+{
+    int index;
+    for (index = 0; index < count; index++)
+    {
+        if (surfaces[index].class == surface_mesh)
+        {
+            mesh_free(((mesh *)surfaces[index].geometry)->triangles);
+        }
+    }
+}
+
+static bool mesh_arrays_valid (const char * record_start, const mesh_record * record,
+                               const size_t offsets[3])
+/*! Determine whether the BVH of a mesh record is well formed, with its
+    leaves within the triangles, and whether its triangles' vertex indices
+    are within the vertices */
+{
+    const bvh_node * nodes = (const bvh_node *)(record_start + sizeof(mesh_record));
+    const int * indices = (const int *)(record_start + offsets[1]);
+    int index;
+
+    if (!bvh_nodes_valid(nodes, record->num_nodes))
+    {
+        return false;
+    }
+    for (index = 0; index < record->num_nodes; index++)
+    {
+        if (nodes[index].count > 0 &&
+            (nodes[index].first < 0 ||
+             nodes[index].first > record->num_triangles - nodes[index].count))
+        {
+            return false;
+        }
+    }
+    for (index = 0; index < 3 * record->num_triangles; index++)
+    {
+        if (indices[index] < 0 || indices[index] >= record->num_vertices)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool load_meshes (surface surfaces[], int count, primitives_block section)
+/*! Point each of the "count" surfaces that is a mesh at a mesh using its
+    arrays in the meshes section in place, or free those made and return
+    false if the section is too short or corrupt, or memory runs out */
+{
+    char * record_start = section.data;
+    size_t remaining = section.size, offsets[3];
+    triangle_mesh * triangles;
+    mesh_record record;
+    int index;
+
+    for (index = 0; index < count; index++)
+    {
+        if (surfaces[index].class != surface_mesh)
+        {
+            continue;
+        }
+        if (remaining < sizeof(mesh_record))
+        {
+            break;
+        }
+        memcpy(&record, record_start, sizeof(record));
+        if (record.num_nodes <= 0 || record.num_vertices < 0 || record.num_triangles < 0)
+        {
+            break;
+        }
+        lay_out_record(&record, offsets);
+        if (offsets[2] > remaining || !mesh_arrays_valid(record_start, &record, offsets))
+        {
+            break;
+        }
+        triangles = mesh_from_arrays((vector *)(record_start + offsets[0]), record.num_vertices,
+                                     (int *)(record_start + offsets[1]), record.num_triangles,
+                                     (bvh_node *)(record_start + sizeof(mesh_record)),
+                                     record.num_nodes);
+        if (triangles == NULL)
+        {
+            break;
+        }
+        ((mesh *)surfaces[index].geometry)->triangles = triangles;
+        record_start += offsets[2];
+        remaining -= offsets[2];
+    }
+    if (index < count)
+    {
+        free_meshes(surfaces, index);
+        return false;
+    }
+    return true;
+}
+
+static bool load_groups (primitives_block sections[], scene * scene_out)
+/*! Set the classes and meshes of the surfaces in the group sections, and
+    make the groups of "scene_out" over them, or return false if the
+    sections are corrupt or memory runs out */
+{
+    surface * surfaces = sections[SECTION_GROUP_SURFACES].data;
+    unsigned char * classes = sections[SECTION_GROUP_CLASSES].data;
+    size_t count = sections[SECTION_GROUP_SURFACES].size / sizeof(surface), index;
+    int num_groups = 0, group;
+    instance_group * groups;
+
+    if (sections[SECTION_GROUP_SURFACES].size % sizeof(surface) != 0 ||
+        sections[SECTION_GROUP_CLASSES].size != count ||
+        (count > 0 && classes[count - 1] != GROUP_END))
+    {
+        return false;
+    }
+    for (index = 0; index < count; index++)
+    {
+        if (classes[index] == GROUP_END)
+        {
+            surfaces[index].class = NULL;
+            num_groups++;
+        }
+        else if (classes[index] < NUM_SURFACE_CLASSES &&
+                 *surface_classes[classes[index]] != surface_instance)
+        {
+            surfaces[index].class = *surface_classes[classes[index]];
+        }
+        else
+        {
+            return false;
+        }
+    }
+    if (!load_meshes(surfaces, count, sections[SECTION_GROUP_MESHES]))
+    {
+        return false;
+    }
+
+    /* Groups are small next to the scenes that place them many times, so
+       their primitives are built again rather than saved */
+    groups = calloc(num_groups + 1, sizeof(instance_group));
+    for (group = 0, index = 0; groups && group < num_groups; group++)
+    {
+        if (!instance_group_create(&groups[group], &surfaces[index]))
+        {
+            while (group-- > 0)
+            {
+                instance_group_free(&groups[group]);
+            }
+            free(groups);
+            groups = NULL;
+            break;
+        }
+        index += count_surfaces(&surfaces[index]) + 1;
+    }
+    if (groups == NULL)
+    {
+        free_meshes(surfaces, count);
+        return false;
+    }
+    scene_out->groups = groups;
+    scene_out->num_groups = num_groups;
+    return true;
+}
+
+static void free_groups (scene * scene)
+/*! Free the groups made by load_groups, and their meshes */
+{
+    int group;
+    for (group = 0; group < scene->num_groups; group++)
+    {
+        free_meshes(scene->groups[group].surfaces, count_surfaces(scene->groups[group].surfaces));
+        instance_group_free(&scene->groups[group]);
+    }
+    free(scene->groups);
+    scene->groups = NULL;
+    scene->num_groups = 0;
+}
+
+static bool load_instances (surface surfaces[], int count, primitives_block section,
+                            scene * scene_out)
+/*! Point each of the "count" surfaces that is an instance at its record in
+    the instances section, used in place, and at its group, or return false
+    if the section doesn't match the surfaces */
+{
+    instance_record * records = section.data;
+    size_t num_records = section.size / sizeof(instance_record), record = 0;
+    instance * cur_instance;
+    int index;
+
+    for (index = 0; index < count; index++)
+    {
+        if (surfaces[index].class != surface_instance)
+        {
+            continue;
+        }
+        if (record == num_records || records[record].group < 0 ||
+            records[record].group >= scene_out->num_groups)
+        {
+            return false;
+        }
+        cur_instance = (instance *)surfaces[index].geometry;
+        cur_instance->group = &scene_out->groups[records[record].group];
+        cur_instance->transform = &records[record].transform;
+        record++;
+    }
+    return record == num_records && section.size % sizeof(instance_record) == 0;
+}
+
+static bool lights_valid (primitives_block section)
+/*! Determine whether the light sources section holds standard lights
+    ended by a sentinel */
+{
+    light_source * lights = section.data;
+    size_t count = section.size / sizeof(light_source), index;
+
+    if (section.size % sizeof(light_source) != 0 || count == 0 ||
+        lights[count - 1].type != LIGHT_SOURCE_SENTINEL)
+    {
+        return false;
+    }
+    for (index = 0; index + 1 < count; index++)
+    {
+        if (lights[index].type != LIGHT_SOURCE_STANDARD)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool camera_valid (const camera * camera)
+/*! Determine whether a camera has finite coordinates and angles and an image
+    of at least a pixel */
+{
+    return isfinite(camera->position.x) && isfinite(camera->position.y) &&
+           isfinite(camera->position.z) && isfinite(camera->direction.theta) &&
+           isfinite(camera->direction.phi) && isfinite(camera->view_angle) &&
+           camera->resolution.width > 0 && camera->resolution.height > 0;
+}
+
+int load_compiled_scene (FILE * file, scene * scene_out)
+{
+    struct stat file_status;
+    size_t size;
+    char * mapping;
+    compiled_header * header;
+    primitives_block sections[NUM_SECTIONS];
+    const section_extent * extent;
+    surface * surfaces;
+    unsigned char * classes;
+    int index, num_surfaces;
+    section section;
+
+    if (fstat(fileno(file), &file_status) != 0)
+    {
+        return -1;
+    }
+    if (!S_ISREG(file_status.st_mode) || file_status.st_size < (off_t)sizeof(compiled_header))
+    {
+        fprintf(stderr, "Compiled scenes must be loaded from complete, regular files\n");
+        errno = EINVAL;
+        return -1;
+    }
+    /* Private and writable, so that setting the class pointers only copies
+       the pages of surfaces, and never changes the file */
+    size = file_status.st_size;
+    mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    if (mapping == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    header = (compiled_header *)mapping;
+    if (!header_matches_build(header))
+    {
+        return reject(mapping, size, "was saved by another version of the ray tracer; "
+                                     "compile it again");
+    }
+    if (!camera_valid(&header->camera))
+    {
+        return reject(mapping, size, "is corrupt");
+    }
+    for (section = 0; section < NUM_SECTIONS; section++)
+    {
+        extent = &header->sections[section];
+        if (extent->offset > size || extent->size > size - extent->offset)
+        {
+            return reject(mapping, size, "is truncated");
+        }
+        sections[section].data = mapping + extent->offset;
+        sections[section].size = extent->size;
+    }
+    num_surfaces = sections[SECTION_SURFACES].size / sizeof(surface) - 1;
+    if (sections[SECTION_SURFACES].size % sizeof(surface) != 0 || num_surfaces < 0 ||
+        sections[SECTION_SURFACE_CLASSES].size != num_surfaces ||
+        !lights_valid(sections[SECTION_LIGHT_SOURCES]))
+    {
+        return reject(mapping, size, "is corrupt");
+    }
+
+    surfaces = sections[SECTION_SURFACES].data;
+    if (surfaces[num_surfaces].class != NULL)
+    {
+        return reject(mapping, size, "is corrupt");
+    }
+    classes = sections[SECTION_SURFACE_CLASSES].data;
+    for (index = 0; index < num_surfaces; index++)
+    {
+        if (classes[index] >= NUM_SURFACE_CLASSES)
+        {
+            return reject(mapping, size, "is corrupt");
+        }
+        surfaces[index].class = *surface_classes[classes[index]];
+    }
+    if (!load_meshes(surfaces, num_surfaces, sections[SECTION_MESHES]))
+    {
+        return reject(mapping, size, "is corrupt");
+    }
+    if (!load_groups(sections, scene_out))
+    {
+        free_meshes(surfaces, num_surfaces);
+        return reject(mapping, size, "is corrupt");
+    }
+    if (!load_instances(surfaces, num_surfaces, sections[SECTION_INSTANCES], scene_out))
+    {
+        free_groups(scene_out);
+        free_meshes(surfaces, num_surfaces);
+        return reject(mapping, size, "is corrupt");
+    }
+
+    if (!primitives_blocks_valid(surfaces, &sections[SECTION_PRIMITIVES]))
+    {
+        free_groups(scene_out);
+        free_meshes(surfaces, num_surfaces);
+        return reject(mapping, size, "is corrupt");
+    }
+    scene_out->primitives = primitives_from_blocks(surfaces, &sections[SECTION_PRIMITIVES]);
+    if (scene_out->primitives == NULL)
+    {
+        free_groups(scene_out);
+        free_meshes(surfaces, num_surfaces);
+        munmap(mapping, size);
+        return -1;
+    }
+    scene_out->background_color = header->background_color;
+    scene_out->camera = header->camera;
+    scene_out->light_sources = sections[SECTION_LIGHT_SOURCES].data;
+    scene_out->surfaces = surfaces;
+    scene_out->mapping = mapping;
+    scene_out->mapping_size = size;
+    return 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "scene.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/* This module saves scenes in a binary form that is used in place once
+   loaded, so that a scene rendered many times is parsed, and has its BVH
+   built, only once.
+
+   A compiled scene file starts with a header holding the camera, the
+   background color and the position and size of each of the sections that
+   follow it: the light sources, the surfaces, the vertices, triangles and
+   BVH of each mesh (see mesh.h), and the blocks of the primitive arrays and
+   BVH (see primitives.h), each aligned to a cache line.  The sections hold
+   the arrays exactly as they are laid out in memory, so loading a compiled
+   scene maps the file and points the scene at them without parsing or
+   copying anything.  The only work done per surface is to set its class
+   pointer, which can't be saved, from a class number saved in a section of
+   its own, and to point each mesh at its arrays.  Loading a large scene
+   mostly costs the page faults of touching the memory it is mapped to.
+
+   The layout of the arrays depends on how the ray tracer was built, so the
+   header records a format version and the sizes of the structures saved.
+   Files that don't match are rejected, and must be compiled again from the
+   text scene.  Files that match are checked before they are used, and
+   rejected as corrupt unless:
+   - each section lies within the file, and the surface and light source
+     arrays end with their sentinels
+   - the camera's coordinates and angles are finite, and its resolution is
+     at least a pixel each way
+   - every surface class number, and every index in the meshes, groups,
+     instances and primitive arrays, is within the array it indexes
+   - every BVH is laid out depth first, no deeper than it can be traversed,
+     with its leaves covering ranges within the primitives they index
+   The positions, normals and colors of the surfaces themselves are used as
+   they are.
+*/
+
+/*! Determine if "file" is a compiled scene, by the magic number it starts with */
+bool is_compiled_scene (FILE * file);
+
+/*! Save a scene, whose primitives must have been made, to "file" as a
+    compiled scene.  Return 0 on success, or -1 with errno set on error. */
+int save_compiled_scene (scene * scene, FILE * file);
+
+/*! Load a compiled scene from "file", which must be a regular file, mapping
+    it to memory and pointing the arrays and the primitives of "scene_out" at
+    it.  The mapping holds the arrays until free_scene (see input_file.h)
+    releases them.  Return 0 on success, or -1 with errno set on error. */
+int load_compiled_scene (FILE * file, scene * scene_out);
@@ -0,0 +1,636 @@
+#include "farm.h"
+#include "output_file.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* Bands are whole rows of tiles (see render.c), at least this many rows */
+#define BAND_ROWS 16
+
+/* The longest line of the protocol */
+#define LINE_MAX_LENGTH 128
+
+typedef enum
+{
+    BAND_WAITING,
+    BAND_RENDERING,
+    BAND_DONE
+} band_state;
+
+typedef struct
+{
+    /* Rows y0 up to y1 of the image */
+    int y0, y1;
+    band_state state;
+    int attempts;
+} band;
+
+typedef struct farm_worker
+{
+    int fd;
+    /* Whether the worker has said it is ready */
+    bool ready;
+    /* The band the worker is rendering, or -1, and when it was handed out */
+    int band;
+    double started;
+    /* The line being received, and while pixels are being received, where
+       the rest of them go and how many bytes are left */
+    char line[LINE_MAX_LENGTH];
+    size_t line_length;
+    unsigned char * pixels;
+    size_t pixels_left;
+    struct farm_worker * next;
+} farm_worker;
+
+typedef struct
+{
+    scene * scene;
+    const render_settings * settings;
+    const farm_settings * farm;
+    unsigned char * image;
+    int listener;
+    band * bands;
+    int num_bands;
+    int bands_done;
+    farm_worker * workers;
+    /* Local worker processes, with 0 for none, and the number forked */
+    pid_t * processes;
+    int forks;
+    /* When a worker last connected or finished a band */
+    double last_activity;
+    bool failed;
+} coordinator;
+
+static int send_all (int fd, const void * data, size_t size)
+/*! Send all of "data".  Return 0, or -1 if the connection fails. */
+{
+    const char * bytes = data;
+    ssize_t sent;
+
+    while (size > 0)
+    {
+        sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+static void set_no_delay (int fd)
+/*! Send short lines at once, rather than waiting to fill a packet */
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static int connect_to (const char * host, const char * port)
+/*! Connect to a TCP port.  Return the socket, or -1. */
+{
+    struct addrinfo hints, * addresses, * address;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addresses))
+    {
+        return -1;
+    }
+    for (address = addresses; address && fd < 0; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0)
+    {
+        set_no_delay(fd);
+    }
+    return fd;
+}
+
+static int send_region (scene * scene, thread_pool * pool, const render_settings * settings,
+                        int fd, long id, render_region region)
+/*! Render a region and send its pixels.  Return 0, or -1 if memory runs
+    out or sending fails. */
+{
+    render_settings region_settings = *settings;
+    size_t num_pixels = (size_t)(region.x1 - region.x0) * (region.y1 - region.y0);
+    color * image = malloc(sizeof(color) * num_pixels);
+    unsigned char * bytes = malloc(LINE_MAX_LENGTH + 3 * num_pixels);
+    int length, result = -1;
+
+    if (image && bytes)
+    {
+        region_settings.region = region;
+        render(scene, pool, &region_settings, image, NULL);
+        /* The pixels follow their line in one send */
+        length = sprintf((char *)bytes, "pixels %ld %lu\n", id, (unsigned long)(3 * num_pixels));
+        quantize_colors(image, num_pixels, bytes + length);
+        result = send_all(fd, bytes, length + 3 * num_pixels);
+    }
+    free(image);
+    free(bytes);
+    return result;
+}
+
+static int work (scene * scene, thread_pool * pool, const render_settings * settings,
+                 const char * host, const char * port)
+/*! Render the regions the coordinator hands out until it is done.  Return
+    0, or -1 if the connection fails or the coordinator sends something
+    else. */
+{
+    resolution * res = &scene->camera.resolution;
+    char line[LINE_MAX_LENGTH];
+    render_region region;
+    long id;
+    int fd = connect_to(host, port), result = -1;
+    FILE * requests;
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to connect to the coordinator at %s:%s\n", host, port);
+        return -1;
+    }
+    requests = fdopen(dup(fd), "r");
+    sprintf(line, "ready %d %d\n", res->width, res->height);
+    if (requests == NULL || send_all(fd, line, strlen(line)))
+    {
+        result = -1;
+    }
+    else
+    {
+        while (fgets(line, sizeof(line), requests))
+        {
+            if (strcmp(line, "done\n") == 0)
+            {
+                result = 0;
+                break;
+            }
+            if (sscanf(line, "region %ld %d %d %d %d", &id, &region.x0, &region.y0, &region.x1,
+                       &region.y1) != 5 ||
+                region.x0 < 0 || region.y0 < 0 || region.x0 >= region.x1 ||
+                region.y0 >= region.y1 || region.x1 > res->width || region.y1 > res->height ||
+                send_region(scene, pool, settings, fd, id, region))
+            {
+                break;
+            }
+        }
+    }
+    if (requests)
+    {
+        fclose(requests);
+    }
+    close(fd);
+    return result;
+}
+
+static pid_t fork_worker (scene * scene, const render_settings * settings, int threads,
+                          const char * host, const char * port, const int fds_to_close[],
+                          int num_fds)
+/*! Fork a worker process, which shares the scene with this one, closing the
+    given descriptors of this one in it.  Return its process ID, or -1. */
+{
+    thread_pool * pool;
+    pid_t pid = fork();
+    int index;
+
+    if (pid != 0)
+    {
+        return pid;
+    }
+    /* Only the thread that forked carries on in the child, so it needs
+       workers of its own */
+    for (index = 0; index < num_fds; index++)
+    {
+        close(fds_to_close[index]);
+    }
+    pool = thread_pool_create(threads);
+    _exit(pool && work(scene, pool, settings, host, port) == 0 ? 0 : 1);
+}
+
+int farm_join (scene * scene, const render_settings * settings, const farm_settings * farm,
+               const char * host, const char * port)
+{
+    pid_t * pids = malloc(sizeof(pid_t) * farm->processes);
+    int index, status, result = 0;
+
+    if (pids == NULL)
+    {
+        return -1;
+    }
+    for (index = 0; index < farm->processes; index++)
+    {
+        pids[index] = fork_worker(scene, settings, farm->threads, host, port, NULL, 0);
+        if (pids[index] < 0)
+        {
+            result = -1;
+        }
+    }
+    for (index = 0; index < farm->processes; index++)
+    {
+        if (pids[index] > 0 &&
+            (waitpid(pids[index], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)))
+        {
+            result = -1;
+        }
+    }
+    free(pids);
+    return result;
+}
+
+static void drop_worker (coordinator * coordinator, farm_worker * worker, const char * reason)
+/*! Disconnect a worker, handing its band to the next */
+{
+    farm_worker ** link = &coordinator->workers;
+    band * band;
+
+    while (*link != worker)
+    {
+        link = &(*link)->next;
+    }
+    *link = worker->next;
+    if (worker->band >= 0)
+    {
+        band = &coordinator->bands[worker->band];
+        fprintf(stderr, "Dropped the worker rendering rows %d to %d: %s\n", band->y0, band->y1,
+                reason);
+        band->state = BAND_WAITING;
+        if (band->attempts >= FARM_MAX_ATTEMPTS)
+        {
+            fprintf(stderr, "Rows %d to %d failed %d times\n", band->y0, band->y1,
+                    band->attempts);
+            coordinator->failed = true;
+        }
+    }
+    close(worker->fd);
+    free(worker);
+}
+
+static bool hand_out_band (coordinator * coordinator, farm_worker * worker)
+/*! Hand the next waiting band, if there is one, to an idle worker.  Return
+    false if sending it fails. */
+{
+    char line[LINE_MAX_LENGTH];
+    band * band;
+    int index;
+
+    for (index = 0; index < coordinator->num_bands; index++)
+    {
+        band = &coordinator->bands[index];
+        if (band->state == BAND_WAITING)
+        {
+            band->state = BAND_RENDERING;
+            band->attempts++;
+            worker->band = index;
+            worker->started = render_clock();
+            sprintf(line, "region %d 0 %d %d %d\n", index, band->y0,
+                    coordinator->scene->camera.resolution.width, band->y1);
+            return send_all(worker->fd, line, strlen(line)) == 0;
+        }
+    }
+    return true;
+}
+
+static bool handle_line (coordinator * coordinator, farm_worker * worker)
+/*! Act on a line the worker sent.  Return false if it is out of place. */
+{
+    resolution * res = &coordinator->scene->camera.resolution;
+    band * band;
+    unsigned long size;
+    int width, height;
+    long id;
+
+    if (!worker->ready)
+    {
+        worker->ready = sscanf(worker->line, "ready %d %d", &width, &height) == 2 &&
+                        width == res->width && height == res->height;
+        coordinator->last_activity = render_clock();
+        return worker->ready;
+    }
+    if (worker->band < 0 || sscanf(worker->line, "pixels %ld %lu", &id, &size) != 2 ||
+        id != worker->band)
+    {
+        return false;
+    }
+    band = &coordinator->bands[worker->band];
+    worker->pixels = &coordinator->image[(size_t)3 * res->width * band->y0];
+    worker->pixels_left = (size_t)3 * res->width * (band->y1 - band->y0);
+    return size == worker->pixels_left;
+}
+
+static bool receive (coordinator * coordinator, farm_worker * worker, const char ** reason_out)
+/*! Take in what a worker has sent.  Return false if it is to be dropped,
+    with the reason why. */
+{
+    unsigned char buffer[65536];
+    ssize_t received = recv(worker->fd, buffer, sizeof(buffer), 0);
+    size_t offset = 0, size;
+
+    *reason_out = "hung up";
+    if (received < 0 && errno == EINTR)
+    {
+        return true;
+    }
+    if (received <= 0)
+    {
+        return false;
+    }
+    *reason_out = "bad reply";
+    while (offset < (size_t)received)
+    {
+        if (worker->pixels_left > 0)
+        {
+            size = received - offset < worker->pixels_left ? received - offset
+                                                           : worker->pixels_left;
+            memcpy(worker->pixels, buffer + offset, size);
+            worker->pixels += size;
+            worker->pixels_left -= size;
+            offset += size;
+            if (worker->pixels_left == 0)
+            {
+                coordinator->bands[worker->band].state = BAND_DONE;
+                coordinator->bands_done++;
+                coordinator->last_activity = render_clock();
+                worker->band = -1;
+            }
+        }
+        else if (buffer[offset] == '\n')
+        {
+            worker->line[worker->line_length] = '\0';
+            worker->line_length = 0;
+            offset++;
+            if (!handle_line(coordinator, worker))
+            {
+                return false;
+            }
+        }
+        else if (worker->line_length + 1 < LINE_MAX_LENGTH)
+        {
+            worker->line[worker->line_length++] = buffer[offset++];
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void fork_local_workers (coordinator * coordinator)
+/*! Replace the local worker processes that have exited, as long as the
+    number forked allows */
+{
+    const farm_settings * farm = coordinator->farm;
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    char port[16];
+    int * fds, num_fds = 1, index, status;
+    farm_worker * worker;
+
+    for (index = 0; index < farm->processes; index++)
+    {
+        if (coordinator->processes[index] > 0 &&
+            waitpid(coordinator->processes[index], &status, WNOHANG) > 0)
+        {
+            coordinator->processes[index] = 0;
+        }
+    }
+    for (worker = coordinator->workers; worker; worker = worker->next)
+    {
+        num_fds++;
+    }
+    fds = malloc(sizeof(int) * num_fds);
+    if (fds == NULL || getsockname(coordinator->listener, (struct sockaddr *)&address, &length))
+    {
+        free(fds);
+        return;
+    }
+    /* The workers close their copies of the coordinator's connections, so
+       that dropping a worker closes its connection */
+    fds[0] = coordinator->listener;
+    num_fds = 1;
+    for (worker = coordinator->workers; worker; worker = worker->next)
+    {
+        fds[num_fds++] = worker->fd;
+    }
+    sprintf(port, "%d", ntohs(address.sin_port));
+    for (index = 0; index < farm->processes; index++)
+    {
+        if (coordinator->processes[index] == 0 &&
+            coordinator->forks < farm->processes * FARM_MAX_ATTEMPTS)
+        {
+            coordinator->processes[index] =
+                fork_worker(coordinator->scene, coordinator->settings, farm->threads,
+                            "127.0.0.1", port, fds, num_fds);
+            coordinator->forks++;
+            if (coordinator->processes[index] < 0)
+            {
+                coordinator->processes[index] = 0;
+            }
+        }
+    }
+    free(fds);
+}
+
+static int open_listener (const farm_settings * farm)
+/*! Listen for workers on the farm's port.  Return the socket, or -1. */
+{
+    struct sockaddr_in address;
+    int fd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(farm->port);
+    address.sin_addr.s_addr = htonl(farm->port ? INADDR_ANY : INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) || listen(fd, 64))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void coordinate (coordinator * coordinator)
+/*! Hand out the bands until they are all done or the render fails */
+{
+    const farm_settings * farm = coordinator->farm;
+    struct pollfd * polled = NULL, * grown;
+    farm_worker * worker, * next;
+    const char * reason;
+    int num_polled, capacity = 0, index, fd;
+    bool alive;
+
+    while (coordinator->bands_done < coordinator->num_bands && !coordinator->failed)
+    {
+        fork_local_workers(coordinator);
+        num_polled = 1;
+        for (worker = coordinator->workers; worker; worker = next)
+        {
+            next = worker->next;
+            if (worker->ready && worker->band < 0 && !hand_out_band(coordinator, worker))
+            {
+                drop_worker(coordinator, worker, "hung up");
+                continue;
+            }
+            num_polled++;
+        }
+        if (num_polled > capacity)
+        {
+            grown = realloc(polled, sizeof(struct pollfd) * num_polled * 2);
+            if (grown == NULL)
+            {
+                coordinator->failed = true;
+                break;
+            }
+            polled = grown;
+            capacity = num_polled * 2;
+        }
+        polled[0] = (struct pollfd){ coordinator->listener, POLLIN };
+        index = 1;
+        for (worker = coordinator->workers; worker; worker = worker->next)
+        {
+            polled[index++] = (struct pollfd){ worker->fd, POLLIN };
+        }
+        poll(polled, num_polled, 100);
+
+        /* The workers are in the order they were polled */
+        index = 1;
+        for (worker = coordinator->workers; worker; worker = next)
+        {
+            next = worker->next;
+            if (polled[index++].revents && !receive(coordinator, worker, &reason))
+            {
+                drop_worker(coordinator, worker, reason);
+            }
+            else if (worker->band >= 0 && render_clock() - worker->started > farm->timeout)
+            {
+                drop_worker(coordinator, worker, "timed out");
+            }
+        }
+        if (polled[0].revents & POLLIN)
+        {
+            fd = accept(coordinator->listener, NULL, NULL);
+            worker = fd >= 0 ? calloc(1, sizeof(farm_worker)) : NULL;
+            if (worker)
+            {
+                set_no_delay(fd);
+                worker->fd = fd;
+                worker->band = -1;
+                worker->next = coordinator->workers;
+                coordinator->workers = worker;
+            }
+            else if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+
+        /* Without a port, only local workers can come, and once they can't
+           be replaced, none will */
+        alive = coordinator->workers != NULL;
+        for (index = 0; index < farm->processes; index++)
+        {
+            alive = alive || coordinator->processes[index] > 0;
+        }
+        if (!alive && (farm->port == 0 ||
+                       render_clock() - coordinator->last_activity > farm->timeout))
+        {
+            fprintf(stderr, "No workers left to render the image\n");
+            coordinator->failed = true;
+        }
+    }
+    free(polled);
+}
+
+int farm_render (scene * scene, const render_settings * settings, const farm_settings * farm,
+                 unsigned char image_out[])
+{
+    resolution * res = &scene->camera.resolution;
+    coordinator coordinator = { scene, settings, farm, image_out };
+    int bands_wanted = 4 * (farm->processes > 4 ? farm->processes : 4);
+    int rows = (res->height + bands_wanted - 1) / bands_wanted;
+    int index, status;
+    farm_worker * worker;
+
+    rows = (rows + BAND_ROWS - 1) / BAND_ROWS * BAND_ROWS;
+    coordinator.num_bands = (res->height + rows - 1) / rows;
+    coordinator.bands = calloc(coordinator.num_bands, sizeof(band));
+    coordinator.processes = calloc(farm->processes > 0 ? farm->processes : 1, sizeof(pid_t));
+    coordinator.listener = open_listener(farm);
+    if (coordinator.bands == NULL || coordinator.processes == NULL || coordinator.listener < 0)
+    {
+        free(coordinator.bands);
+        free(coordinator.processes);
+        if (coordinator.listener >= 0)
+        {
+            close(coordinator.listener);
+        }
+        return -1;
+    }
+    for (index = 0; index < coordinator.num_bands; index++)
+    {
+        coordinator.bands[index].y0 = index * rows;
+        coordinator.bands[index].y1 = (index + 1) * rows < res->height ? (index + 1) * rows
+                                                                       : res->height;
+    }
+    coordinator.last_activity = render_clock();
+    coordinate(&coordinator);
+
+    /* The workers still connected are told the image is done, and local
+       ones that don't finish with them are stopped */
+    while ((worker = coordinator.workers))
+    {
+        coordinator.workers = worker->next;
+        if (!coordinator.failed)
+        {
+            send_all(worker->fd, "done\n", 5);
+        }
+        close(worker->fd);
+        free(worker);
+    }
+    close(coordinator.listener);
+    for (index = 0; index < farm->processes; index++)
+    {
+        if (coordinator.processes[index] > 0)
+        {
+            if (coordinator.failed)
+            {
+                kill(coordinator.processes[index], SIGTERM);
+            }
+            waitpid(coordinator.processes[index], &status, 0);
+        }
+    }
+    free(coordinator.bands);
+    free(coordinator.processes);
+    return coordinator.failed ? -1 : 0;
+}
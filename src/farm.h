@@ -0,0 +1,63 @@
+#pragma once
+
+#include "scene.h"
+#include "render.h"
+
+/* This module renders an image with a farm of worker processes, on this
+   host and others, each rendering the regions of the image that a
+   coordinator hands out to it.
+
+   The coordinator splits the image into bands of rows and listens for
+   workers on a TCP port.  It forks its local workers once the scene is
+   loaded and its BVH built, so that they share the scene's memory, copy on
+   write, instead of each loading it again.  Workers on other hosts load
+   the scene file themselves, and fork their processes in the same way.
+
+   Each band is handed to one worker at a time.  A worker that hangs up,
+   replies with anything but the band's pixels or takes longer than the
+   timeout to render it is dropped, and the band goes to another worker.
+   Local workers that fail are replaced.  A band that fails
+   FARM_MAX_ATTEMPTS times fails the render.  Every pixel is rendered the
+   same way by any worker, so the image is identical to one rendered by a
+   single process.
+
+   The workers and the coordinator exchange lines of text, and pixels:
+
+     ready WIDTH HEIGHT        worker, once connected, with the resolution
+                               of its scene, which must be the coordinator's
+     region ID X0 Y0 X1 Y1     coordinator, handing out region ID, from
+                               column X0, row Y0 up to column X1, row Y1
+     pixels ID SIZE            worker, followed by the region's SIZE bytes
+                               of 8 bit RGB, 3 per pixel, from the top row
+     done                      coordinator, once the image is complete
+*/
+
+/* The number of times a band is handed out before the render fails */
+#define FARM_MAX_ATTEMPTS 3
+
+typedef struct
+{
+    /* The number of worker processes forked on this host */
+    int processes;
+    /* The number of threads each of those workers renders with */
+    int threads;
+    /* The TCP port to listen on for workers on all interfaces, or 0 to
+       take only local workers, on any free port of the loopback interface */
+    int port;
+    /* The seconds a worker has to render a band, and the coordinator waits
+       for workers while it has none */
+    double timeout;
+} farm_settings;
+
+/*! Render the scene with a farm of workers, into "image_out" as 8 bit RGB,
+    3 bytes per pixel from the top row of the image down.  The scene must
+    have its primitives.  Return 0, or -1 if the render fails. */
+int farm_render (scene * scene, const render_settings * settings, const farm_settings * farm,
+                 unsigned char image_out[]);
+
+/*! Work for the coordinator at "host" and "port", rendering the regions it
+    hands out until the image is done, with the farm's number of processes,
+    each with its number of threads.  Return 0 once the coordinator is done
+    with all of them, or -1 if any fails. */
+int farm_join (scene * scene, const render_settings * settings, const farm_settings * farm,
+               const char * host, const char * port);
@@ -1,10 +1,20 @@
 #include "input_file.h"
+#include "compiled_scene.h"
+#include "mesh.h"
+#include "instance.h"
+#include "animation.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* Apparently ANSI C99 refuses to provide M_PI:
    http://ubuntuforums.org/showthread.php?t=583094 */
@@ -37,37 +47,45 @@
 
    The following object names are allowed:
 
-   "camera", "light", "sphere", "frustum", "circle", "quad"
+   "camera", "light", "sphere", "frustum", "circle", "quad", "mesh", "instance", "key"
 
    Each object has a set of allowed properties:
 
    camera: "position", "direction", "view_angle", "resolution"
-   light:    "position", "color"
+   light:    "position", "color", "name"
    sphere:   "center", "radius"
    frustum:  "centers", "radii"
    circle:   "center", "radius", "normal"
    quad:     "vertices"
+   mesh:     "file"
+   instance: "group", "scale", "rotation", "position", "name"
+   key:      "name", "frame", and the properties of the object named that
+             change: "position", "direction", "view_angle", "color",
+             "rotation", "scale"
 
-   "sphere", "frustum", "circle", and "quad" objects have additional surface properties.
-   surface properties: "diffuse", "specular", "refraction_index"
+   "sphere", "frustum", "circle", "quad" and "mesh" objects have additional surface properties.
+   surface properties: "diffuse", "specular", "refraction_index", "group"
 
    Properties can be declared in any order, but will not be repeated.  Properties
    can be absent, in which case a default value of 0 is used for data associated
-   with that property.
+   with that property, except for an instance's scale, which is 1 by default.
 
    The format of the value associated with each property is property dependent.
    They are defined as follows:
 
-   position, center, normal: <vector>
+   position, center, normal, scale: <vector>
    direction: <2-tuple of decimals> (theta, phi)
+   rotation: <3-tuple of decimals> (about x, about y, about z)
    resolution: <2-tuple of decimals> (pixels wide, pixels high)
    color, diffuse, specular: <color>
-   radius, refraction_index, view_angle: <decimal>
+   radius, refraction_index, view_angle, frame: <decimal>
    centers: <2-tuple of vectors>
    vertices: <3-tuple of vectors>
    radii: <2-tuple of decimals>
+   file: <file name>
+   group, name: <name>
 
-   The decimal values associated with "direction", and "view_angle"
+   The decimal values associated with "direction", "rotation" and "view_angle"
    are angles given in degrees.  These must be converted to radians so that
    they are compatible with the math library.
 
@@ -98,10 +116,35 @@
    A "decimal" is a decimal number as defined and interpreted by the strtof function:
    http://linux.die.net/man/3/strtof
 
+   A "file name" is the name of a file, which can't contain spaces.  It is
+   taken relative to the directory of the scene file, unless it starts
+   with "/".  A mesh's file is an OBJ or binary PLY file of triangles (see
+   mesh.h), all of which have the mesh's surface properties.
+
+   A "name" is any word without spaces.  A surface with a "group" property
+   isn't part of the scene by itself, but of the named group of surfaces,
+   which instances place copies of (see instance.h).  An instance scales the
+   group by the components of "scale", then rotates it about the x, y and z
+   axes in turn, then moves it by "position".  Groups can be given before or
+   after the instances that use them, and can't hold instances.
+
+   A light or an instance with a "name" can be animated by keys, which give
+   some of its properties at a "frame", counted from 0, and the camera by
+   keys named "camera" (see animation.h).  The object's own properties are
+   its key at frame 0, and its properties at other frames are interpolated
+   between its keys.  The frames of a key are whole numbers.  Keys can be
+   given anywhere in the file, in any order.
+
 
    =====================================================================================
    Implementation notes
    =====================================================================================
+
+   The whole input file is read at once.  Where it is a regular file it is
+   mapped into memory with mmap, and otherwise, as for a pipe, it is read
+   into one buffer.  Either way the text ends with a null character.  Each
+   line ends at its newline character, at a "#" that starts a comment, or
+   at the end of the text.
    
    The parsing problem is systematically decomposed into a series of parsing functions
    in a way that mimics the hierchical description of the input file format given above.
@@ -117,16 +160,112 @@
    is also filled in with the information parsed.  Thus the cursor is used to
    keep track of what has been parsed, and what remains to be parsed.
    
-   Parsing is destructive, meaning that the string being parsed is altered as the cursor
-   runs over it.  The parsing algorithm is like cutting pieces of a tape.  The string
-   is "cut" after each name or value is parsed by the insertion of null sentinels.
-   A reference to the newly cut string is returned from the low-level parsing function
-   while the cursor is advanced to point to the rest of the "tape".
+   Parsing never alters the text, which may be a read only mapping of the file.
+   Object and property names are found as a pointer and a length, and looked up
+   in a sorted table of the file format's keywords.  Each object is then
+   handled by a switch on its keyword rather than a chain of string
+   comparisons.  Decimals are parsed by parse_float, which gets the same values
+   as strtof, with a faster path for the plain decimal numbers that make up
+   nearly all of a scene file.
+
+   Light sources and surfaces go to arrays that double in size whenever they
+   fill up, so a scene can have any number of them.  The surfaces of groups
+   go to an array of their own, with the names of their groups, and are
+   sorted into groups once the whole file is parsed, when the names of the
+   groups of instances are looked up.  Keys and the names of lights and
+   instances are likewise collected, and matched up with each other once
+   the camera's line has been parsed too.
 
    Parsing functions also have return values which indicate if a parse error has occurred.
    For the purposes of this project, handling parse errors is not a concern.
 */
 
+/* The names of objects and properties in the input file, in the order of
+   their names for find_keyword's binary search */
+typedef enum
+{
+    KEYWORD_UNKNOWN,
+    KEYWORD_BACKGROUND,
+    KEYWORD_CAMERA,
+    KEYWORD_CENTER,
+    KEYWORD_CENTERS,
+    KEYWORD_CIRCLE,
+    KEYWORD_COLOR,
+    KEYWORD_DIFFUSE,
+    KEYWORD_DIRECTION,
+    KEYWORD_FILE,
+    KEYWORD_FRAME,
+    KEYWORD_FRUSTUM,
+    KEYWORD_GROUP,
+    KEYWORD_INSTANCE,
+    KEYWORD_KEY,
+    KEYWORD_LIGHT,
+    KEYWORD_MESH,
+    KEYWORD_NAME,
+    KEYWORD_NORMAL,
+    KEYWORD_POSITION,
+    KEYWORD_QUAD,
+    KEYWORD_RADII,
+    KEYWORD_RADIUS,
+    KEYWORD_REFRACTION_INDEX,
+    KEYWORD_RESOLUTION,
+    KEYWORD_ROTATION,
+    KEYWORD_SCALE,
+    KEYWORD_SPECULAR,
+    KEYWORD_SPHERE,
+    KEYWORD_VERTICES,
+    KEYWORD_VIEW_ANGLE,
+} keyword;
+
+#define KEYWORD_NAME(name) { name, sizeof(name) - 1 }
+
+static const struct
+{
+    const char * name;
+    size_t length;
+} keyword_names[] =
+{
+    KEYWORD_NAME(""),
+    KEYWORD_NAME("background"),
+    KEYWORD_NAME("camera"),
+    KEYWORD_NAME("center"),
+    KEYWORD_NAME("centers"),
+    KEYWORD_NAME("circle"),
+    KEYWORD_NAME("color"),
+    KEYWORD_NAME("diffuse"),
+    KEYWORD_NAME("direction"),
+    KEYWORD_NAME("file"),
+    KEYWORD_NAME("frame"),
+    KEYWORD_NAME("frustum"),
+    KEYWORD_NAME("group"),
+    KEYWORD_NAME("instance"),
+    KEYWORD_NAME("key"),
+    KEYWORD_NAME("light"),
+    KEYWORD_NAME("mesh"),
+    KEYWORD_NAME("name"),
+    KEYWORD_NAME("normal"),
+    KEYWORD_NAME("position"),
+    KEYWORD_NAME("quad"),
+    KEYWORD_NAME("radii"),
+    KEYWORD_NAME("radius"),
+    KEYWORD_NAME("refraction_index"),
+    KEYWORD_NAME("resolution"),
+    KEYWORD_NAME("rotation"),
+    KEYWORD_NAME("scale"),
+    KEYWORD_NAME("specular"),
+    KEYWORD_NAME("sphere"),
+    KEYWORD_NAME("vertices"),
+    KEYWORD_NAME("view_angle"),
+};
+
+/* A name in the text, with the keyword it matches */
+typedef struct word
+{
+    char * start;
+    int length;
+    keyword keyword;
+} word;
+
 typedef bool char_filter (char value);
 
 bool char_printable (char value)
@@ -159,17 +298,22 @@ bool property_value_seperator (char value)
     return value == ':';
 }
 
+bool line_end (char value)
+{
+    return value == '\0' || value == '\n' || value == '#';
+}
+
 bool find_next (char_filter predicate, char ** cursor)
 /*! Advance the cursor to the next character that satisfies the given
     predicate, which is one of the predicate functions defined above.
 
     Return true if a desired character is found, false if the end of
-    the string is reached and a desired character is not found.
+    the line is reached and a desired character is not found.
 */
 {
     while (true)
     {
-        if (**cursor == '\0')
+        if (line_end(**cursor))
         {
             return false;
         }
@@ -184,89 +328,214 @@ bool find_next (char_filter predicate, char ** cursor)
     }
 }
 
-char * strip_comments (char * string)
-/*! Strip a '#' character and any characters that follow by
-    cutting at the first '#'
-*/
+keyword find_keyword (const char * name, size_t length)
+/*! Return the keyword spelled by the "length" characters at "name",
+    or KEYWORD_UNKNOWN if there is none */
 {
-    char * hash_ptr = strchr(string, '#');
-    if (hash_ptr)
+    int low = KEYWORD_UNKNOWN + 1;
+    int high = sizeof(keyword_names) / sizeof(keyword_names[0]) - 1;
+    int middle, order;
+    size_t keyword_length;
+
+    while (low <= high)
     {
-        *hash_ptr = '\0';
+        middle = (low + high) / 2;
+        keyword_length = keyword_names[middle].length;
+        order = memcmp(name, keyword_names[middle].name,
+                       length < keyword_length ? length : keyword_length);
+        if (order == 0)
+        {
+            order = length < keyword_length ? -1 : length > keyword_length;
+        }
+        if (order == 0)
+        {
+            return middle;
+        }
+        else if (order < 0)
+        {
+            high = middle - 1;
+        }
+        else
+        {
+            low = middle + 1;
+        }
     }
-    return string;
+    return KEYWORD_UNKNOWN;
 }
 
-char * strip_whitespace (char * string)
-/*! Strip leading and trailing whitespace in "string" by cutting
-    off trailing whitespace, and returning a pointer to the
-    first printable character
+bool get_next_word (char ** cursor, word * word_out)
+/*! Find the next word (sequence of printable characters) on the line,
+    advance the cursor past it, and output it to "word_out".  Return false
+    if there are no more words on the line.
 */
 {
-    char * cursor = string;
-    find_next(char_printable, &cursor);
-    string = cursor;
-    find_next(char_whitespace, &cursor);
-    *cursor = '\0';
-    return string;
+    if (!find_next(char_printable, cursor))
+    {
+        return false;
+    }
+    word_out->start = *cursor;
+    find_next(char_whitespace, cursor);
+    word_out->length = *cursor - word_out->start;
+    word_out->keyword = find_keyword(word_out->start, word_out->length);
+    return true;
 }
 
-char * get_next_word (char ** cursor)
-/*! Find the next word (sequence of printable character) in the
-    string, cut it from the string, advance the cursor, and
-    return the word
+bool get_next_property (char ** cursor, word * property_out)
+/*! Get the next property name on the line, assumming the following format:
+    <property_name>:<property_value>
+    Once found, output the property name to "property_out" and advance the
+    cursor to the property value.
 */
 {
-    char * word;
-    if (find_next(char_printable, cursor))
+    char * name_end;
+    if (!find_next(char_printable, cursor))
     {
-        word = *cursor;
-        find_next(char_whitespace, cursor);
-        **cursor = '\0';
-        (*cursor)++;
-        return word;
+        return false;
     }
-    else
+    property_out->start = *cursor;
+    if (!find_next(property_value_seperator, cursor))
     {
-        return NULL;
+        fprintf(stderr, "Expected \":\" after property \"%.*s\"\n",
+                (int)(*cursor - property_out->start), property_out->start);
+        return false;
+    }
+    name_end = *cursor;
+    while (name_end > property_out->start && isspace(name_end[-1]))
+    {
+        name_end--;
     }
+    (*cursor)++;
+    property_out->length = name_end - property_out->start;
+    property_out->keyword = find_keyword(property_out->start, property_out->length);
+    return true;
 }
 
-bool get_next_property (char ** cursor, char ** property_out)
-/*! Get the next property name in the string, assumming the following format:
-    <property_name>:<property_value>
-    Once found, cut the property name from the string, advance the cursor
-    to the property value, and return the property name.
+/* The powers of 10 that doubles hold exactly */
+static const double exact_powers_of_10[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAX_EXACT_EXPONENT 22
+/* Decimals with more significant digits might not fit in 64 bits */
+#define MAX_FAST_DIGITS 19
+/* Integers up to 2^53 are exact in a double */
+#define MAX_EXACT_INTEGER (1ULL << 53)
+
+bool parse_float (char ** cursor, float * value_out)
+/*! Parse a decimal value as strtof does: http://linux.die.net/man/3/strtof
+    Output the floating point value parsed to "value_out" and advance
+    "cursor" to the next character after the value parsed.
+
+    Plain decimals are parsed here.  Their digits make an integer that a
+    double holds exactly, and one multiplication or division by an exact
+    power of 10 rounds it to the closest double.  Rounding that to a float
+    gives the same value strtof does, unless the double landed exactly
+    halfway between two floats.  Those decimals are left to strtof, along
+    with long or very large or small ones, and anything else strtof accepts,
+    such as "inf" or hexadecimal.
 */
 {
-    char * property;
-    if (find_next(char_printable, cursor))
+    char * string = *cursor;
+    char * number;
+    unsigned long long digits = 0;
+    int num_digits = 0;
+    int exponent = 0;
+    int exponent_value = 0;
+    int exponent_sign = 1;
+    bool negative = false;
+    bool any_digits = false;
+    char * exponent_digits;
+    double value;
+    unsigned long long bits;
+
+    /* strtof skips leading whitespace, but the value must be on this line */
+    while (isspace(*string) && *string != '\n')
     {
-        property = *cursor;
-        if (!find_next(property_value_seperator, cursor))
+        string++;
+    }
+    number = string;
+    if (*string == '-' || *string == '+')
+    {
+        negative = *string == '-';
+        string++;
+    }
+    if (isalpha(*string) || (string[0] == '0' && (string[1] == 'x' || string[1] == 'X')))
+    {
+        *value_out = strtof(number, cursor);
+        return true;
+    }
+    for (; isdigit(*string); string++)
+    {
+        any_digits = true;
+        if (digits > 0 || *string != '0')
         {
-            **cursor = '\0';
-            fprintf(stderr, "Expected \":\" after property \"%s\"", property);
-            return false;
+            digits = digits * 10 + (*string - '0');
+            num_digits++;
         }
-        **cursor = '\0';
-        (*cursor)++;
-        *property_out = strip_whitespace(property);
+    }
+    if (*string == '.')
+    {
+        for (string++; isdigit(*string); string++)
+        {
+            any_digits = true;
+            if (digits > 0 || *string != '0')
+            {
+                digits = digits * 10 + (*string - '0');
+                num_digits++;
+            }
+            exponent--;
+        }
+    }
+    if (!any_digits)
+    {
+        /* No conversion: the cursor stays where it was */
+        *value_out = 0;
         return true;
     }
-    else
+    if (*string == 'e' || *string == 'E')
     {
-        return false;
+        exponent_digits = string + 1;
+        if (*exponent_digits == '-' || *exponent_digits == '+')
+        {
+            exponent_sign = *exponent_digits == '-' ? -1 : 1;
+            exponent_digits++;
+        }
+        if (isdigit(*exponent_digits))
+        {
+            for (string = exponent_digits; isdigit(*string); string++)
+            {
+                if (exponent_value < 10000)
+                {
+                    exponent_value = exponent_value * 10 + (*string - '0');
+                }
+            }
+            exponent += exponent_sign * exponent_value;
+        }
     }
-}
 
-bool parse_float (char ** cursor, float * value_out)
-/*! Parse a decimal value using strtof: http://linux.die.net/man/3/strtof
-    Output the floating point value parsed to "value_out" and advance
-    "cursor" to the next character after the value parsed.
-*/
-{
-    *value_out = strtof(*cursor, cursor);
+    if (digits == 0)
+    {
+        *value_out = negative ? -0.0f : 0.0f;
+        *cursor = string;
+        return true;
+    }
+    if (num_digits <= MAX_FAST_DIGITS && digits <= MAX_EXACT_INTEGER &&
+        exponent >= -MAX_EXACT_EXPONENT && exponent <= MAX_EXACT_EXPONENT)
+    {
+        value = exponent < 0 ? digits / exact_powers_of_10[-exponent]
+                             : digits * exact_powers_of_10[exponent];
+        memcpy(&bits, &value, sizeof(bits));
+        /* A double has 29 more bits of mantissa than a float */
+        if (value >= FLT_MIN && value <= FLT_MAX && (bits & 0x1fffffff) != 0x10000000)
+        {
+            *value_out = negative ? -(float)value : (float)value;
+            *cursor = string;
+            return true;
+        }
+    }
+    *value_out = strtof(number, cursor);
     return true;
 }
 
@@ -279,10 +548,10 @@ bool parse_angle (char ** cursor, float * radians_out)
     http://linux.die.net/man/3/m_pi
 */
 {
-    /* Implement me! */
+    parse_float(cursor, radians_out);
+    *radians_out *= M_PI / 180.0f;
     return true;
 }
-
 bool parse_tuple_float (char ** cursor, float tuple_out[], int size)
 /*! Parse an <n-tuple of decimal> as defined in the input file format with n
     being "size".  Output array "tuple_out" is populated with the floating
@@ -353,8 +622,7 @@ bool parse_vector (char ** cursor, vector * vector_out)
     the cursor to the next character after the vector tuple.
 */
 {
-    /* Implement me! */
-    return true;
+    return parse_tuple_float(cursor, (float *)vector_out, 3);
 }
 
 bool parse_normal (char ** cursor, vector * normal_out)
@@ -364,7 +632,11 @@ bool parse_normal (char ** cursor, vector * normal_out)
     and advance the cursor.
 */
 {
-    /* Implement me! */
+    if (!parse_vector(cursor, normal_out))
+    {
+        return false;
+    }
+    *normal_out = vector_normalize(*normal_out);
     return true;
 }
 
@@ -402,7 +674,13 @@ bool parse_resolution (char ** cursor, resolution * resolution_out)
     and advance the cursor.
 */
 {
-    /* Implement me! */
+    float tuple[2];
+    if (!parse_tuple_float(cursor, tuple, 2))
+    {
+        return false;
+    }
+    resolution_out->width = (int)tuple[0];
+    resolution_out->height = (int)tuple[1];
     return true;
 }
 
@@ -419,7 +697,27 @@ int parse_camera (char ** cursor, camera * camera_out)
     Note that the camera data has already been zeroed; there is no
     need to initialize the struct members */
 {
-    /* Implement me! */
+    word property;
+    while (get_next_property(cursor, &property))
+    {
+        switch (property.keyword)
+        {
+        case KEYWORD_POSITION:
+            parse_vector(cursor, &camera_out->position);
+            break;
+        case KEYWORD_DIRECTION:
+            parse_direction(cursor, &camera_out->direction);
+            break;
+        case KEYWORD_VIEW_ANGLE:
+            parse_angle(cursor, &camera_out->view_angle);
+            break;
+        case KEYWORD_RESOLUTION:
+            parse_resolution(cursor, &camera_out->resolution);
+            break;
+        default:
+            fprintf(stderr, "Unknown camera property: %.*s\n", property.length, property.start);
+        }
+    }
     return 0;
 }
 
@@ -427,27 +725,42 @@ int parse_background (char ** cursor, color * background_color_out)
 /*! Parse a <background>, output its background color to "background_color_out",
     advance the cursor */
 {
-    /* Implement me! */
+    word property;
+    while (get_next_property(cursor, &property))
+    {
+        switch (property.keyword)
+        {
+        case KEYWORD_COLOR:
+            parse_color(cursor, background_color_out);
+            break;
+        default:
+            fprintf(stderr, "Unknown background property: %.*s\n", property.length, property.start);
+        }
+    }
     return 0;
 }
 
-int parse_light (char ** cursor, light_source * light_out)
-/*! Parse a <light>, output it to "light_out", advance the cursor. */
+int parse_light (char ** cursor, light_source * light_out, word * name_out)
+/*! Parse a <light>, output it to "light_out" and its name, if it has one,
+    to "name_out", advance the cursor. */
 {
-    char * property;
+    word property;
+    name_out->length = 0;
     while (get_next_property(cursor, &property))
     {
-        if (strcmp(property, "position") == 0)
+        switch (property.keyword)
         {
+        case KEYWORD_POSITION:
             parse_vector(cursor, &light_out->position);
-        }
-        else if (strcmp(property, "color") == 0)
-        {
+            break;
+        case KEYWORD_COLOR:
             parse_color(cursor, &light_out->color);
-        }
-        else
-        {
-            fprintf(stderr, "Unknown light property: %s\n", property);
+            break;
+        case KEYWORD_NAME:
+            get_next_word(cursor, name_out);
+            break;
+        default:
+            fprintf(stderr, "Unknown light property: %.*s\n", property.length, property.start);
         }
     }
     return 0;
@@ -457,170 +770,1361 @@ int parse_light (char ** cursor, light_source * light_out)
    passed will be zeroed, so there is no need to initialize
    default values that are zero */
 
-int parse_sphere (char ** cursor, surface * surface_out)
+bool parse_surface_property (char ** cursor, word property, surface * surface_out,
+                             word * group_out)
+/*! Parse the value of "property" if it is one of the properties every
+    surface has, storing it to "surface_out", or the name of the surface's
+    group to "group_out", and advancing the cursor.  Return false if it
+    isn't, or if it is a group and "group_out" is NULL. */
+{
+    switch (property.keyword)
+    {
+    case KEYWORD_GROUP:
+        return group_out && get_next_word(cursor, group_out);
+    case KEYWORD_SPECULAR:
+        parse_color(cursor, &surface_out->specular_part);
+        return true;
+    case KEYWORD_DIFFUSE:
+        parse_color(cursor, &surface_out->diffuse_part);
+        return true;
+    case KEYWORD_REFRACTION_INDEX:
+        parse_float(cursor, &surface_out->refraction_index);
+        return true;
+    default:
+        return false;
+    }
+}
+
+int parse_sphere (char ** cursor, surface * surface_out, word * group_out)
 /*! Parse a <sphere>, populating the members of "surface_out" to
-    represent a sphere as specified in "surface.h", advance cursor.
+    represent a sphere as specified in "surface.h", and output the name of
+    its group, if it has one, to "group_out", advance cursor.
 */
 {
-    char * property;
+    word property;
     sphere * cur_sphere = (sphere *)surface_out->geometry;
     surface_out->class = surface_sphere;
     while (get_next_property(cursor, &property))
     {
-        if (strcmp(property, "specular") == 0)
-        {
-            parse_color(cursor, &surface_out->specular_part);
-        }
-        else if (strcmp(property, "diffuse") == 0)
-        {
-            parse_color(cursor, &surface_out->diffuse_part);
-        }
-        else if (strcmp(property, "refraction_index") == 0)
-        {
-            parse_float(cursor, &surface_out->refraction_index);
-        }
-        else if (strcmp(property, "center") == 0)
+        switch (property.keyword)
         {
+        case KEYWORD_CENTER:
             parse_vector(cursor, &cur_sphere->center);
-        }
-        else if (strcmp(property, "radius") == 0)
-        {
+            break;
+        case KEYWORD_RADIUS:
             parse_float(cursor, &cur_sphere->radius);
-        }
-        else 
-        {
-            fprintf(stderr, "Unknown sphere property: %s\n", property);
+            break;
+        default:
+            if (!parse_surface_property(cursor, property, surface_out, group_out))
+            {
+                fprintf(stderr, "Unknown sphere property: %.*s\n", property.length, property.start);
+            }
         }
     }
     return 0;
 }
 
-int parse_frustum (char ** cursor, surface * surface_out)
+int parse_frustum (char ** cursor, surface * surface_out, word * group_out)
 /*! Parse a <frustum>, populating the members of "surface_out" to
-    represent a frustum as specified in "surface.h", advance cursor.
+    represent a frustum as specified in "surface.h", and output the name of
+    its group, if it has one, to "group_out", advance cursor.
 */
 {
-    /* Implement me! */
+    word property;
+    frustum * cur_frustum = (frustum *)surface_out->geometry;
+    surface_out->class = surface_frustum;
+    while (get_next_property(cursor, &property))
+    {
+        switch (property.keyword)
+        {
+        case KEYWORD_CENTERS:
+            parse_tuple_vector(cursor, cur_frustum->centers, 2);
+            break;
+        case KEYWORD_RADII:
+            parse_tuple_float(cursor, cur_frustum->radii, 2);
+            break;
+        default:
+            if (!parse_surface_property(cursor, property, surface_out, group_out))
+            {
+                fprintf(stderr, "Unknown frustum property: %.*s\n", property.length, property.start);
+            }
+        }
+    }
     return 0;
 }
 
-int parse_circle (char ** cursor, surface * surface_out)
+int parse_circle (char ** cursor, surface * surface_out, word * group_out)
 /*! Parse a <circle>, populating the members of "surface_out" to
-    represent a circle as specified in "surface.h", advance cursor.
+    represent a circle as specified in "surface.h", and output the name of
+    its group, if it has one, to "group_out", advance cursor.
 */
 {
-    /* Implement me! */
+    word property;
+    circle * cur_circle = (circle *)surface_out->geometry;
+    surface_out->class = surface_circle;
+    while (get_next_property(cursor, &property))
+    {
+        switch (property.keyword)
+        {
+        case KEYWORD_CENTER:
+            parse_vector(cursor, &cur_circle->center);
+            break;
+        case KEYWORD_RADIUS:
+            parse_float(cursor, &cur_circle->radius);
+            break;
+        case KEYWORD_NORMAL:
+            parse_normal(cursor, &cur_circle->normal);
+            break;
+        default:
+            if (!parse_surface_property(cursor, property, surface_out, group_out))
+            {
+                fprintf(stderr, "Unknown circle property: %.*s\n", property.length, property.start);
+            }
+        }
+    }
     return 0;
 }
 
-int parse_quad (char ** cursor, surface * surface_out)
+int parse_quad (char ** cursor, surface * surface_out, word * group_out)
 /*! Parse a <quad>, populating the members of "surface_out" to
-    represent a quad as specified in "surface.h", advance cursor.
+    represent a quad as specified in "surface.h", and output the name of
+    its group, if it has one, to "group_out", advance cursor.
 */
 {
-    char * property;
+    word property;
     quad * cur_quad = (quad *)surface_out->geometry;
     surface_out->class = surface_quad;
     while (get_next_property(cursor, &property))
     {
-        if (strcmp(property, "specular") == 0)
-        {
-            parse_color(cursor, &surface_out->specular_part);
-        }
-        else if (strcmp(property, "diffuse") == 0)
+        switch (property.keyword)
         {
-            parse_color(cursor, &surface_out->diffuse_part);
+        case KEYWORD_VERTICES:
+            parse_tuple_vector(cursor, cur_quad->vertices, 3);
+            break;
+        default:
+            if (!parse_surface_property(cursor, property, surface_out, group_out))
+            {
+                fprintf(stderr, "Unknown quad property: %.*s\n", property.length, property.start);
+            }
         }
-        else if (strcmp(property, "refraction_index") == 0)
+    }
+    return 0;
+}
+
+int parse_mesh (char ** cursor, const char * scene_filename, surface * surface_out,
+                word * group_out)
+/*! Parse a <mesh>, loading the triangles of its file, whose name is taken
+    relative to the directory of "scene_filename" if it isn't NULL,
+    populating the members of "surface_out" to represent a mesh as specified
+    in "surface.h", and output the name of its group, if it has one, to
+    "group_out", advance cursor.  Return 0, or an errno value if the
+    mesh can't be loaded, leaving the surface's class NULL.
+*/
+{
+    word property;
+    mesh * cur_mesh = (mesh *)surface_out->geometry;
+    const char * directory_end = scene_filename ? strrchr(scene_filename, '/') : NULL;
+    char * name = NULL, * path;
+    int name_length = 0, directory_length = 0;
+
+    while (get_next_property(cursor, &property))
+    {
+        switch (property.keyword)
         {
-            parse_float(cursor, &surface_out->refraction_index);
+        case KEYWORD_FILE:
+            find_next(char_printable, cursor);
+            name = *cursor;
+            find_next(char_whitespace, cursor);
+            name_length = *cursor - name;
+            break;
+        default:
+            if (!parse_surface_property(cursor, property, surface_out, group_out))
+            {
+                fprintf(stderr, "Unknown mesh property: %.*s\n", property.length, property.start);
+            }
         }
-        else if (strcmp(property, "vertices") == 0)
+    }
+    if (name_length == 0)
+    {
+        fprintf(stderr, "Mesh without a file\n");
+        return EINVAL;
+    }
+
+    if (name[0] != '/' && directory_end)
+    {
+        directory_length = directory_end + 1 - scene_filename;
+    }
+    path = malloc(directory_length + name_length + 1);
+    if (path == NULL)
+    {
+        return ENOMEM;
+    }
+    memcpy(path, scene_filename, directory_length);
+    memcpy(path + directory_length, name, name_length);
+    path[directory_length + name_length] = '\0';
+    cur_mesh->triangles = mesh_load(path);
+    free(path);
+    if (cur_mesh->triangles == NULL)
+    {
+        return errno;
+    }
+    surface_out->class = surface_mesh;
+    return 0;
+}
+
+int parse_instance (char ** cursor, surface * surface_out, word * group_out, word * name_out,
+                    keyframe * pose_out)
+/*! Parse an <instance>, populating the members of "surface_out" to
+    represent an instance as specified in "surface.h", except for its group,
+    whose name is output to "group_out", advance cursor.  Its name, if it
+    has one, is output to "name_out", and its position, rotation and scale
+    to "pose_out".  Return 0, or an errno value if the instance can't be
+    made, leaving the surface's class NULL.
+*/
+{
+    word property;
+    instance * cur_instance = (instance *)surface_out->geometry;
+    vector scale = { 1, 1, 1 }, position = { 0, 0, 0 };
+    float rotation[3] = { 0, 0, 0 };
+
+    group_out->length = 0;
+    name_out->length = 0;
+    while (get_next_property(cursor, &property))
+    {
+        switch (property.keyword)
         {
-            parse_tuple_vector(cursor, cur_quad->vertices, 3);
+        case KEYWORD_GROUP:
+            get_next_word(cursor, group_out);
+            break;
+        case KEYWORD_NAME:
+            get_next_word(cursor, name_out);
+            break;
+        case KEYWORD_SCALE:
+            parse_vector(cursor, &scale);
+            break;
+        case KEYWORD_ROTATION:
+            parse_tuple_angle(cursor, rotation, 3);
+            break;
+        case KEYWORD_POSITION:
+            parse_vector(cursor, &position);
+            break;
+        default:
+            fprintf(stderr, "Unknown instance property: %.*s\n", property.length, property.start);
         }
-        else
+    }
+    if (group_out->length == 0)
+    {
+        fprintf(stderr, "Instance without a group\n");
+        return EINVAL;
+    }
+
+    cur_instance->transform = malloc(sizeof(instance_transform));
+    if (cur_instance->transform == NULL)
+    {
+        return ENOMEM;
+    }
+    if (!instance_transform_make(scale, (vector){ rotation[0], rotation[1], rotation[2] },
+                                 position, cur_instance->transform))
+    {
+        fprintf(stderr, "Instance of group %.*s with a scale of 0\n",
+                group_out->length, group_out->start);
+        free(cur_instance->transform);
+        return EINVAL;
+    }
+    surface_out->class = surface_instance;
+    pose_out->properties = KEY_INSTANCE_PROPERTIES;
+    pose_out->position = position;
+    pose_out->rotation = (vector){ rotation[0], rotation[1], rotation[2] };
+    pose_out->scale = scale;
+    return 0;
+}
+
+int parse_key (char ** cursor, keyframe * key_out, word * name_out)
+/*! Parse a <key>, output it to "key_out" and the name of the object it
+    moves to "name_out", advance cursor.  Return 0, or EINVAL if it has no
+    name or a frame before 0.
+*/
+{
+    word property;
+    float frame = 0;
+
+    name_out->length = 0;
+    while (get_next_property(cursor, &property))
+    {
+        switch (property.keyword)
         {
-            fprintf(stderr, "Unknown quad property: %s\n", property);
+        case KEYWORD_NAME:
+            get_next_word(cursor, name_out);
+            break;
+        case KEYWORD_FRAME:
+            parse_float(cursor, &frame);
+            break;
+        case KEYWORD_POSITION:
+            parse_vector(cursor, &key_out->position);
+            key_out->properties |= KEY_POSITION;
+            break;
+        case KEYWORD_ROTATION:
+            parse_tuple_angle(cursor, (float *)&key_out->rotation, 3);
+            key_out->properties |= KEY_ROTATION;
+            break;
+        case KEYWORD_SCALE:
+            parse_vector(cursor, &key_out->scale);
+            key_out->properties |= KEY_SCALE;
+            break;
+        case KEYWORD_COLOR:
+            parse_color(cursor, &key_out->color);
+            key_out->properties |= KEY_COLOR;
+            break;
+        case KEYWORD_DIRECTION:
+            parse_direction(cursor, &key_out->direction);
+            key_out->properties |= KEY_DIRECTION;
+            break;
+        case KEYWORD_VIEW_ANGLE:
+            parse_angle(cursor, &key_out->view_angle);
+            key_out->properties |= KEY_VIEW_ANGLE;
+            break;
+        default:
+            fprintf(stderr, "Unknown key property: %.*s\n", property.length, property.start);
         }
     }
+    if (name_out->length == 0)
+    {
+        fprintf(stderr, "Key without a name\n");
+        return EINVAL;
+    }
+    /* Clamped so that frame numbers, and the count of frames, fit in an int */
+    if (!(frame >= 0))
+    {
+        fprintf(stderr, "Key for %.*s at frame %g, before frame 0\n",
+                name_out->length, name_out->start, frame);
+        return EINVAL;
+    }
+    key_out->frame = frame < INT_MAX / 2 ? (int)frame : INT_MAX / 2;
     return 0;
 }
 
-int load_scene (FILE * file, scene * scene_out)
+void free_surface (surface * cur_surface, bool free_transform)
+/*! Free what a surface points to: the triangles of a mesh, or the transform
+    of an instance if "free_transform" */
 {
-/*! Reads a input "file" stream, parsing it according to the file format
-    defined above, and populate "scene_out" with the information parsed,
-    dynamically allocating memory for the light source and surfaces array.
-    The caller is responsible for calling "free" to release the memory
-    allocated for the arrays.
-*/
-    const int max_light_sources = 256;
-    const int max_surfaces = 256;
-    const int buf_size = 256;
-    char buffer[buf_size];
-    char * object_name;
-    char * cursor;
-    int line = 0;
+    if (cur_surface->class == surface_mesh)
+    {
+        mesh_free(((mesh *)cur_surface->geometry)->triangles);
+    }
+    else if (cur_surface->class == surface_instance && free_transform)
+    {
+        free(((instance *)cur_surface->geometry)->transform);
+    }
+}
+
+void * grow_array (void * array, int * capacity, int count, size_t element_size)
+/*! Return "array", which has room for "*capacity" elements of element_size
+    bytes, reallocated if need be to double its capacity until it has room
+    for element number "count".  New elements are zeroed.  Return NULL, and
+    leave the array as it was, if memory runs out. */
+{
+    int new_capacity = *capacity > 0 ? *capacity : 64;
+    char * grown;
+
+    if (count < *capacity)
+    {
+        return array;
+    }
+    while (new_capacity <= count)
+    {
+        new_capacity *= 2;
+    }
+    grown = realloc(array, new_capacity * element_size);
+    if (grown == NULL)
+    {
+        return NULL;
+    }
+    memset(grown + *capacity * element_size, 0, (new_capacity - *capacity) * element_size);
+    *capacity = new_capacity;
+    return grown;
+}
+
+/* Text files larger than this are split into chunks, about this many per
+   worker so that workers that finish early can take over chunks from the
+   others */
+#define MIN_CHUNK_SIZE (1 << 16)
+#define CHUNKS_PER_WORKER 4
 
-    light_source * cur_light;
+/* A surface of a group, with the name of the group */
+typedef struct
+{
+    surface surface;
+    word group;
+} group_member;
+
+/* An instance among the surfaces of a chunk, with the name of its group */
+typedef struct
+{
+    int surface;
+    word group;
+} group_reference;
+
+/* A named light source or instance, by its index among the chunk's light
+   sources or surfaces, with an instance's position, rotation and scale */
+typedef struct
+{
+    word name;
+    animated_kind kind;
+    int index;
+    keyframe pose;
+} named_object;
+
+/* A key, with the name of the object it moves */
+typedef struct
+{
+    word name;
+    keyframe key;
+} named_key;
+
+/* A run of whole lines of the text, and the objects parsed from it.  The
+   chunks of a file are parsed in parallel, each into its own arrays, which
+   are then joined in the order of the file. */
+typedef struct
+{
+    char * start;
+    char * end;
+    light_source * light_sources;
+    int num_lights;
+    int light_capacity;
+    surface * surfaces;
+    int num_surfaces;
+    int surface_capacity;
+    /* The lines of the camera and background objects.  Each of those lines
+       only sets the properties it gives, so they are parsed after the chunks
+       are joined, in the order of the file. */
+    char ** settings;
+    int num_settings;
+    int settings_capacity;
+    group_member * members;
+    int num_members;
+    int member_capacity;
+    group_reference * references;
+    int num_references;
+    int reference_capacity;
+    named_object * names;
+    int num_names;
+    int name_capacity;
+    named_key * keys;
+    int num_keys;
+    int key_capacity;
+    /* The name of the scene file, which mesh files are found relative to */
+    const char * filename;
+    /* The line of the first unknown object in the chunk, or NULL */
+    char * bad_line;
+    bool out_of_memory;
+    /* The errno value of the first object that couldn't be made, such as a
+       mesh that couldn't be loaded, or 0 */
+    int object_error;
+    /* Index of the chunk's first light source and surface in the scene */
+    int first_light;
+    int first_surface;
+} scene_chunk;
+
+light_source * add_light (scene_chunk * chunk)
+/*! Return a new, zeroed light source at the end of the chunk's array, or
+    NULL if memory runs out */
+{
+    light_source * lights = grow_array(chunk->light_sources, &chunk->light_capacity,
+                                       chunk->num_lights, sizeof(light_source));
+    if (lights == NULL)
+    {
+        return NULL;
+    }
+    chunk->light_sources = lights;
+    return &lights[chunk->num_lights++];
+}
+
+surface * add_surface (scene_chunk * chunk)
+/*! Return a new, zeroed surface at the end of the chunk's array, or NULL
+    if memory runs out */
+{
+    surface * surfaces = grow_array(chunk->surfaces, &chunk->surface_capacity,
+                                    chunk->num_surfaces, sizeof(surface));
+    if (surfaces == NULL)
+    {
+        return NULL;
+    }
+    chunk->surfaces = surfaces;
+    return &surfaces[chunk->num_surfaces++];
+}
+
+bool move_to_group (scene_chunk * chunk, word group)
+/*! Move the last surface of the chunk to its array of group members, with
+    the name of its group, returning false if memory runs out */
+{
+    group_member * members = grow_array(chunk->members, &chunk->member_capacity,
+                                        chunk->num_members, sizeof(group_member));
+    if (members == NULL)
+    {
+        return false;
+    }
+    chunk->members = members;
+    members[chunk->num_members].surface = chunk->surfaces[--chunk->num_surfaces];
+    members[chunk->num_members++].group = group;
+    /* add_surface hands out zeroed surfaces */
+    memset(&chunk->surfaces[chunk->num_surfaces], 0, sizeof(surface));
+    return true;
+}
+
+bool add_reference (scene_chunk * chunk, word group)
+/*! Note that the chunk's last surface is an instance of "group", returning
+    false if memory runs out */
+{
+    group_reference * references = grow_array(chunk->references, &chunk->reference_capacity,
+                                              chunk->num_references, sizeof(group_reference));
+    if (references == NULL)
+    {
+        return false;
+    }
+    chunk->references = references;
+    references[chunk->num_references].surface = chunk->num_surfaces - 1;
+    references[chunk->num_references++].group = group;
+    return true;
+}
+
+bool add_name (scene_chunk * chunk, word name, animated_kind kind, int index,
+               const keyframe * pose)
+/*! Note the name of a light source or instance of the chunk, returning
+    false if memory runs out */
+{
+    named_object * names = grow_array(chunk->names, &chunk->name_capacity, chunk->num_names,
+                                      sizeof(named_object));
+    if (names == NULL)
+    {
+        return false;
+    }
+    chunk->names = names;
+    names[chunk->num_names++] = (named_object){ name, kind, index, *pose };
+    return true;
+}
+
+named_key * add_key (scene_chunk * chunk)
+/*! Return a new, zeroed key at the end of the chunk's array, or NULL if
+    memory runs out */
+{
+    named_key * keys = grow_array(chunk->keys, &chunk->key_capacity, chunk->num_keys,
+                                  sizeof(named_key));
+    if (keys == NULL)
+    {
+        return NULL;
+    }
+    chunk->keys = keys;
+    return &keys[chunk->num_keys++];
+}
+
+bool add_setting (scene_chunk * chunk, char * line)
+/*! Add a camera or background line to the chunk's list, returning false if
+    memory runs out */
+{
+    char ** settings = grow_array(chunk->settings, &chunk->settings_capacity,
+                                  chunk->num_settings, sizeof(char *));
+    if (settings == NULL)
+    {
+        return false;
+    }
+    chunk->settings = settings;
+    settings[chunk->num_settings++] = line;
+    return true;
+}
+
+void parse_chunk (scene_chunk * chunk)
+/*! Parse the light sources and surfaces on the lines of a chunk, noting
+    the camera and background lines, up to the first unknown object */
+{
+    char * cursor = chunk->start;
+    char * line;
+    word object;
+    light_source * light;
     surface * cur_surface;
+    named_key * key;
+    keyframe pose = { 0 };
+    word group, name;
 
-    cur_light = scene_out->light_sources = calloc(max_light_sources, sizeof(light_source));
-    cur_surface = scene_out->surfaces = calloc(max_surfaces, sizeof(surface));
+    while (cursor != NULL && cursor < chunk->end)
+    {
+        line = cursor;
+        if (get_next_word(&cursor, &object))
+        {
+            switch (object.keyword)
+            {
+            case KEYWORD_CAMERA:
+            case KEYWORD_BACKGROUND:
+                if (!add_setting(chunk, line))
+                {
+                    chunk->out_of_memory = true;
+                    return;
+                }
+                break;
+            case KEYWORD_LIGHT:
+                if ((light = add_light(chunk)) == NULL)
+                {
+                    chunk->out_of_memory = true;
+                    return;
+                }
+                parse_light(&cursor, light, &name);
+                if (name.length > 0 &&
+                    !add_name(chunk, name, ANIMATED_LIGHT, chunk->num_lights - 1, &pose))
+                {
+                    chunk->out_of_memory = true;
+                    return;
+                }
+                break;
+            case KEYWORD_INSTANCE:
+                if ((cur_surface = add_surface(chunk)) == NULL)
+                {
+                    chunk->out_of_memory = true;
+                    return;
+                }
+                chunk->object_error = parse_instance(&cursor, cur_surface, &group, &name, &pose);
+                if (chunk->object_error)
+                {
+                    chunk->num_surfaces--;
+                    return;
+                }
+                if (!add_reference(chunk, group) ||
+                    (name.length > 0 &&
+                     !add_name(chunk, name, ANIMATED_INSTANCE, chunk->num_surfaces - 1, &pose)))
+                {
+                    chunk->out_of_memory = true;
+                    return;
+                }
+                break;
+            case KEYWORD_KEY:
+                if ((key = add_key(chunk)) == NULL)
+                {
+                    chunk->out_of_memory = true;
+                    return;
+                }
+                chunk->object_error = parse_key(&cursor, &key->key, &key->name);
+                if (chunk->object_error)
+                {
+                    return;
+                }
+                break;
+            case KEYWORD_MESH:
+            case KEYWORD_SPHERE:
+            case KEYWORD_FRUSTUM:
+            case KEYWORD_CIRCLE:
+            case KEYWORD_QUAD:
+                if ((cur_surface = add_surface(chunk)) == NULL)
+                {
+                    chunk->out_of_memory = true;
+                    return;
+                }
+                group.length = 0;
+                if (object.keyword == KEYWORD_MESH)
+                {
+                    chunk->object_error = parse_mesh(&cursor, chunk->filename, cur_surface, &group);
+                    if (chunk->object_error)
+                    {
+                        /* The surface is left out, so the meshes before it are
+                           all that free_chunks has to free */
+                        chunk->num_surfaces--;
+                        return;
+                    }
+                }
+                else if (object.keyword == KEYWORD_SPHERE)
+                {
+                    parse_sphere(&cursor, cur_surface, &group);
+                }
+                else if (object.keyword == KEYWORD_FRUSTUM)
+                {
+                    parse_frustum(&cursor, cur_surface, &group);
+                }
+                else if (object.keyword == KEYWORD_CIRCLE)
+                {
+                    parse_circle(&cursor, cur_surface, &group);
+                }
+                else
+                {
+                    parse_quad(&cursor, cur_surface, &group);
+                }
+                if (group.length > 0 && !move_to_group(chunk, group))
+                {
+                    chunk->out_of_memory = true;
+                    return;
+                }
+                break;
+            default:
+                chunk->bad_line = line;
+                return;
+            }
+        }
+        cursor = strchr(cursor, '\n');
+        if (cursor != NULL)
+        {
+            cursor++;
+        }
+    }
+}
+
+void parse_chunk_task (void * context, int task, int worker)
+{
+    scene_chunk * chunks = context;
+    parse_chunk(&chunks[task]);
+}
+
+int split_chunks (char * text, size_t size, int max_chunks, scene_chunk chunks_out[])
+/*! Split the "size" bytes of "text" into at most max_chunks chunks of about
+    the same size, ending each after a newline character.  Return the number
+    of chunks, which is at least 1. */
+{
+    char * start = text;
+    char * end;
+    int count = 0;
 
-    while (fgets(buffer, buf_size, file))
+    do
     {
-        line++;
-        strip_comments(buffer);
-        cursor = buffer;
-        object_name = get_next_word(&cursor);
-        if (object_name == NULL)
+        end = text + size * (count + 1) / max_chunks;
+        if (end < start)
         {
-            continue;
+            end = start;
         }
+        end = end < text + size ? memchr(end, '\n', text + size - end) : NULL;
+        end = end ? end + 1 : text + size;
+        chunks_out[count].start = start;
+        chunks_out[count].end = end;
+        count++;
+        start = end;
+    }
+    while (count < max_chunks && start < text + size);
+    return count;
+}
 
-        if (strcmp(object_name, "camera") == 0)
+void free_chunks (scene_chunk chunks[], int num_chunks, bool free_objects)
+/*! Free the arrays of the chunks, and if "free_objects", the meshes and
+    instance transforms of their surfaces, which once joined belong to the
+    scene instead */
+{
+    int index, surface_index;
+    for (index = 0; index < num_chunks; index++)
+    {
+        for (surface_index = 0; free_objects && surface_index < chunks[index].num_surfaces;
+             surface_index++)
         {
-            parse_camera(&cursor, &scene_out->camera);
+            free_surface(&chunks[index].surfaces[surface_index], true);
         }
-        else if (strcmp(object_name, "background") == 0)
+        for (surface_index = 0; free_objects && surface_index < chunks[index].num_members;
+             surface_index++)
         {
-            parse_background(&cursor, &scene_out->background_color);
+            free_surface(&chunks[index].members[surface_index].surface, true);
         }
-        else if (strcmp(object_name, "light") == 0)
+        free(chunks[index].light_sources);
+        free(chunks[index].surfaces);
+        free(chunks[index].settings);
+        free(chunks[index].members);
+        free(chunks[index].references);
+        free(chunks[index].names);
+        free(chunks[index].keys);
+    }
+}
+
+int line_number (const char * text, const char * position)
+/*! Return the number of the line of "text" that "position" is on */
+{
+    int line = 1;
+    for (; text < position; text++)
+    {
+        line += *text == '\n';
+    }
+    return line;
+}
+
+int report_chunk_error (char * text, scene_chunk * chunk)
+/*! Report the error that stopped parsing a chunk, returning -1 */
+{
+    char * cursor = chunk->bad_line;
+    word object;
+
+    if (chunk->out_of_memory)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (chunk->object_error)
+    {
+        errno = chunk->object_error;
+        return -1;
+    }
+    get_next_word(&cursor, &object);
+    fprintf(stderr, "Line %d: Unknown object type: \"%.*s\"\n", line_number(text, chunk->bad_line),
+            object.length, object.start);
+    errno = EINVAL;
+    return -1;
+}
+
+/* The chunks being joined into a scene */
+typedef struct
+{
+    scene_chunk * chunks;
+    scene * scene;
+} chunk_join;
+
+void join_chunk_task (void * context, int task, int worker)
+/*! Copy the objects of chunk task + 1 to their place in the scene.  The
+    first chunk's arrays become the scene's. */
+{
+    chunk_join * join = context;
+    scene_chunk * chunk = &join->chunks[task + 1];
+
+    if (chunk->num_lights > 0)
+    {
+        memcpy(&join->scene->light_sources[chunk->first_light], chunk->light_sources,
+               sizeof(light_source) * chunk->num_lights);
+    }
+    if (chunk->num_surfaces > 0)
+    {
+        memcpy(&join->scene->surfaces[chunk->first_surface], chunk->surfaces,
+               sizeof(surface) * chunk->num_surfaces);
+    }
+}
+
+bool same_word (word a, word b)
+{
+    return a.length == b.length && memcmp(a.start, b.start, a.length) == 0;
+}
+
+int find_group (const word names[], int num_names, word name)
+/*! Return the index of "name" among "names", or -1 */
+{
+    int index;
+    for (index = 0; index < num_names; index++)
+    {
+        if (same_word(names[index], name))
         {
-            parse_light(&cursor, cur_light);
-            cur_light++;
+            return index;
         }
-        else if (strcmp(object_name, "sphere") == 0)
+    }
+    return -1;
+}
+
+void free_groups (instance_group groups[], int num_groups)
+/*! Free the primitives and surface arrays of groups, but not what their
+    surfaces point to */
+{
+    int index;
+    for (index = 0; groups && index < num_groups; index++)
+    {
+        if (groups[index].primitives)
         {
-            parse_sphere(&cursor, cur_surface);
-            cur_surface++;
+            instance_group_free(&groups[index]);
         }
-        else if (strcmp(object_name, "frustum") == 0)
+        free(groups[index].surfaces);
+    }
+    free(groups);
+}
+
+int join_groups (char * text, scene_chunk chunks[], int num_chunks, scene * scene_out)
+/*! Sort the group members of the chunks into the groups of "scene_out",
+    named in the order of the file, build their primitives and point the
+    chunks' instances at them.  Return 0, or -1 leaving the scene without
+    groups. */
+{
+    word * names = NULL;
+    int * sizes;
+    int num_groups = 0, capacity = 0, index, member, group;
+    instance_group * groups;
+    group_reference * reference;
+    group_member * cur_member;
+    void * grown;
+    bool made;
+
+    for (index = 0; index < num_chunks; index++)
+    {
+        for (member = 0; member < chunks[index].num_members; member++)
         {
-            parse_frustum(&cursor, cur_surface);
-            cur_surface++;
+            cur_member = &chunks[index].members[member];
+            if (find_group(names, num_groups, cur_member->group) >= 0)
+            {
+                continue;
+            }
+            if ((grown = grow_array(names, &capacity, num_groups, sizeof(word))) == NULL)
+            {
+                free(names);
+                return -1;
+            }
+            names = grown;
+            names[num_groups++] = cur_member->group;
         }
-        else if (strcmp(object_name, "circle") == 0)
+    }
+
+    groups = calloc(num_groups + 1, sizeof(instance_group));
+    sizes = calloc(num_groups + 1, sizeof(int));
+    made = groups != NULL && sizes != NULL;
+    for (index = 0; made && index < num_chunks; index++)
+    {
+        for (member = 0; member < chunks[index].num_members; member++)
         {
-            parse_circle(&cursor, cur_surface);
-            cur_surface++;
+            sizes[find_group(names, num_groups, chunks[index].members[member].group)]++;
         }
-        else if (strcmp(object_name, "quad") == 0)
+    }
+    for (group = 0; made && group < num_groups; group++)
+    {
+        /* Zeroed, for the sentinel */
+        groups[group].surfaces = calloc(sizes[group] + 1, sizeof(surface));
+        made = groups[group].surfaces != NULL;
+        sizes[group] = 0;
+    }
+    for (index = 0; made && index < num_chunks; index++)
+    {
+        for (member = 0; member < chunks[index].num_members; member++)
         {
-            parse_quad(&cursor, cur_surface);
-            cur_surface++;
+            cur_member = &chunks[index].members[member];
+            group = find_group(names, num_groups, cur_member->group);
+            groups[group].surfaces[sizes[group]++] = cur_member->surface;
         }
-        else
+    }
+    for (group = 0; made && group < num_groups; group++)
+    {
+        made = instance_group_create(&groups[group], groups[group].surfaces);
+    }
+
+    for (index = 0; made && index < num_chunks; index++)
+    {
+        for (member = 0; made && member < chunks[index].num_references; member++)
         {
-            fprintf(stderr, "Line %d: Unknown object type: \"%s\"", line, object_name);
-            return -1;
+            reference = &chunks[index].references[member];
+            group = find_group(names, num_groups, reference->group);
+            if (group < 0)
+            {
+                fprintf(stderr, "Line %d: Unknown group: \"%.*s\"\n",
+                        line_number(text, reference->group.start), reference->group.length,
+                        reference->group.start);
+                errno = EINVAL;
+                made = false;
+                break;
+            }
+            ((instance *)chunks[index].surfaces[reference->surface].geometry)->group =
+                &groups[group];
         }
     }
 
-    cur_light->type = LIGHT_SOURCE_SENTINEL;
-    cur_surface->class = NULL;
+    free(names);
+    free(sizes);
+    if (!made)
+    {
+        free_groups(groups, num_groups);
+        return -1;
+    }
+    scene_out->groups = groups;
+    scene_out->num_groups = num_groups;
     return 0;
 }
+
+int find_named (const named_object objects[], int num_objects, word name)
+/*! Return the index of the object called "name" among "objects", or -1 */
+{
+    int index;
+    for (index = 0; index < num_objects; index++)
+    {
+        if (same_word(objects[index].name, name))
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+int gather_names (char * text, scene_chunk chunks[], int num_chunks, scene * scene,
+                  named_object ** objects_out)
+/*! Output an array of the objects that keys can name: the camera, then the
+    named light sources and instances of the chunks, with their indices in
+    the scene and their properties at frame 0.  Return the number of
+    objects, or -1 if a name is used twice or memory runs out. */
+{
+    static char camera_name[] = "camera";
+    int num_objects = 1, index, name;
+    named_object * objects, * object;
+    camera * camera = &scene->camera;
+    light_source * light;
+
+    for (index = 0; index < num_chunks; index++)
+    {
+        num_objects += chunks[index].num_names;
+    }
+    objects = malloc(sizeof(named_object) * num_objects);
+    if (objects == NULL)
+    {
+        return -1;
+    }
+    objects[0] = (named_object){ { camera_name, sizeof(camera_name) - 1, KEYWORD_CAMERA },
+                                 ANIMATED_CAMERA, 0,
+                                 { .properties = KEY_CAMERA_PROPERTIES,
+                                   .position = camera->position,
+                                   .direction = camera->direction,
+                                   .view_angle = camera->view_angle } };
+    num_objects = 1;
+    for (index = 0; index < num_chunks; index++)
+    {
+        for (name = 0; name < chunks[index].num_names; name++)
+        {
+            object = &objects[num_objects];
+            *object = chunks[index].names[name];
+            if (find_named(objects, num_objects, object->name) >= 0)
+            {
+                fprintf(stderr, "Line %d: Name used twice: \"%.*s\"\n",
+                        line_number(text, object->name.start), object->name.length,
+                        object->name.start);
+                free(objects);
+                errno = EINVAL;
+                return -1;
+            }
+            if (object->kind == ANIMATED_LIGHT)
+            {
+                object->index += chunks[index].first_light;
+                light = &scene->light_sources[object->index];
+                object->pose = (keyframe){ .properties = KEY_LIGHT_PROPERTIES,
+                                           .position = light->position, .color = light->color };
+            }
+            else
+            {
+                object->index += chunks[index].first_surface;
+            }
+            num_objects++;
+        }
+    }
+    *objects_out = objects;
+    return num_objects;
+}
+
+int join_animation (char * text, scene_chunk chunks[], int num_chunks, scene * scene_out)
+/*! Match the keys of the chunks up with the objects they name, and make
+    the scene's animation of them, which is NULL without keys.  Return 0, or
+    -1 leaving the scene without an animation. */
+{
+    named_object * objects;
+    animation * result;
+    animated_object * animated;
+    named_key * key;
+    int * animated_index = NULL;
+    int num_objects, num_keys = 0, index, key_index, object;
+    bool made;
+
+    for (index = 0; index < num_chunks; index++)
+    {
+        num_keys += chunks[index].num_keys;
+    }
+    if (num_keys == 0)
+    {
+        return 0;
+    }
+    num_objects = gather_names(text, chunks, num_chunks, scene_out, &objects);
+    if (num_objects < 0)
+    {
+        return -1;
+    }
+
+    /* The index of each named object among the animation's objects, once
+       a key names it */
+    result = calloc(1, sizeof(animation));
+    animated_index = malloc(sizeof(int) * num_objects);
+    made = result != NULL && animated_index != NULL;
+    for (object = 0; made && object < num_objects; object++)
+    {
+        animated_index[object] = -1;
+    }
+    for (index = 0; made && index < num_chunks; index++)
+    {
+        for (key_index = 0; made && key_index < chunks[index].num_keys; key_index++)
+        {
+            key = &chunks[index].keys[key_index];
+            object = find_named(objects, num_objects, key->name);
+            if (object < 0 || (key->key.properties & ~objects[object].pose.properties))
+            {
+                fprintf(stderr, object < 0
+                                ? "Line %d: Key for an unknown name: \"%.*s\"\n"
+                                : "Line %d: Key gives a property that \"%.*s\" doesn't have\n",
+                        line_number(text, key->name.start), key->name.length, key->name.start);
+                errno = EINVAL;
+                made = false;
+                break;
+            }
+            if (animated_index[object] < 0)
+            {
+                if (animation_add_object(result, objects[object].kind, objects[object].index,
+                                         &objects[object].pose) == NULL)
+                {
+                    made = false;
+                    break;
+                }
+                animated_index[object] = result->num_objects - 1;
+            }
+            animated = &result->objects[animated_index[object]];
+            made = animation_add_key(result, animated, &key->key);
+        }
+    }
+
+    free(objects);
+    free(animated_index);
+    if (!made)
+    {
+        animation_free(result);
+        return -1;
+    }
+    scene_out->animation = result;
+    return 0;
+}
+
+int join_chunks (char * text, scene_chunk chunks[], int num_chunks, scene * scene_out,
+                 thread_pool * pool)
+/*! Join the objects parsed from the chunks of "text" into "scene_out",
+    in the order of the file, then parse its camera and background lines */
+{
+    scene_chunk * first = &chunks[0];
+    chunk_join join = { chunks, scene_out };
+    int num_lights = 0, num_surfaces = 0, index, setting;
+    light_source * lights;
+    surface * surfaces;
+    char * cursor;
+    word object;
+
+    for (index = 0; index < num_chunks; index++)
+    {
+        if (chunks[index].bad_line || chunks[index].out_of_memory || chunks[index].object_error)
+        {
+            free_chunks(chunks, num_chunks, true);
+            return report_chunk_error(text, &chunks[index]);
+        }
+        chunks[index].first_light = num_lights;
+        chunks[index].first_surface = num_surfaces;
+        num_lights += chunks[index].num_lights;
+        num_surfaces += chunks[index].num_surfaces;
+    }
+    if (join_groups(text, chunks, num_chunks, scene_out) != 0)
+    {
+        free_chunks(chunks, num_chunks, true);
+        return -1;
+    }
+
+    /* The first chunk's arrays grow to hold every chunk's objects and the
+       sentinels that terminate them.  They aren't zeroed, since the copies
+       fill them, and they are first touched by the workers that copy. */
+    lights = realloc(first->light_sources, sizeof(light_source) * (num_lights + 1));
+    first->light_sources = lights ? lights : first->light_sources;
+    surfaces = realloc(first->surfaces, sizeof(surface) * (num_surfaces + 1));
+    first->surfaces = surfaces ? surfaces : first->surfaces;
+    if (lights == NULL || surfaces == NULL)
+    {
+        free_groups(scene_out->groups, scene_out->num_groups);
+        scene_out->groups = NULL;
+        scene_out->num_groups = 0;
+        free_chunks(chunks, num_chunks, true);
+        return -1;
+    }
+    scene_out->light_sources = lights;
+    scene_out->surfaces = surfaces;
+    if (num_chunks > 1)
+    {
+        thread_pool_run(pool, join_chunk_task, &join, num_chunks - 1);
+    }
+    memset(&lights[num_lights], 0, sizeof(light_source));
+    memset(&surfaces[num_surfaces], 0, sizeof(surface));
+    lights[num_lights].type = LIGHT_SOURCE_SENTINEL;
+
+    for (index = 0; index < num_chunks; index++)
+    {
+        for (setting = 0; setting < chunks[index].num_settings; setting++)
+        {
+            cursor = chunks[index].settings[setting];
+            if (get_next_word(&cursor, &object) && object.keyword == KEYWORD_CAMERA)
+            {
+                parse_camera(&cursor, &scene_out->camera);
+            }
+            else
+            {
+                parse_background(&cursor, &scene_out->background_color);
+            }
+        }
+    }
+
+    /* The scene owns the first chunk's arrays now */
+    first->light_sources = NULL;
+    first->surfaces = NULL;
+    if (join_animation(text, chunks, num_chunks, scene_out) != 0)
+    {
+        free_chunks(chunks, num_chunks, false);
+        free_scene(scene_out);
+        return -1;
+    }
+    free_chunks(chunks, num_chunks, false);
+    return 0;
+}
+
+int parse_scene (char * text, size_t size, const char * filename, scene * scene_out,
+                 thread_pool * pool)
+/*! Parse the null terminated input file "text" of "size" bytes to
+    "scene_out", as load_scene does, splitting it into chunks parsed by the
+    workers of "pool" if it isn't NULL */
+{
+    size_t max_chunks = pool ? thread_pool_size(pool) * CHUNKS_PER_WORKER : 1;
+    scene_chunk * chunks;
+    int num_chunks, index, result;
+
+    if (max_chunks > size / MIN_CHUNK_SIZE + 1)
+    {
+        max_chunks = size / MIN_CHUNK_SIZE + 1;
+    }
+    chunks = calloc(max_chunks, sizeof(scene_chunk));
+    if (chunks == NULL)
+    {
+        return -1;
+    }
+    num_chunks = split_chunks(text, size, max_chunks, chunks);
+    for (index = 0; index < num_chunks; index++)
+    {
+        chunks[index].filename = filename;
+    }
+    if (num_chunks > 1)
+    {
+        thread_pool_run(pool, parse_chunk_task, chunks, num_chunks);
+    }
+    else
+    {
+        parse_chunk(&chunks[0]);
+    }
+    result = join_chunks(text, chunks, num_chunks, scene_out, pool);
+    free(chunks);
+    return result;
+}
+
+char * read_text (FILE * file, size_t * size_out)
+/*! Read the rest of "file" into a buffer, ending it with a null character,
+    and output its size without the null character.  Return the buffer, which
+    the caller frees, or NULL on error. */
+{
+    size_t capacity = 1 << 16;
+    size_t size = 0;
+    char * text = malloc(capacity);
+    char * grown;
+
+    while (text != NULL)
+    {
+        size += fread(text + size, 1, capacity - size - 1, file);
+        if (size < capacity - 1)
+        {
+            if (ferror(file))
+            {
+                free(text);
+                return NULL;
+            }
+            text[size] = '\0';
+            *size_out = size;
+            return text;
+        }
+        grown = realloc(text, capacity * 2);
+        if (grown == NULL)
+        {
+            free(text);
+        }
+        text = grown;
+        capacity *= 2;
+    }
+    return NULL;
+}
+
+int load_scene (FILE * file, const char * filename, scene * scene_out, thread_pool * pool)
+{
+/*! Reads a input "file" stream, parsing it according to the file format
+    defined above, and populate "scene_out" with the information parsed,
+    dynamically allocating memory for the light source and surfaces array.
+    The caller is responsible for calling free_scene to release the memory
+    allocated for the arrays.
+
+    Mesh files are found relative to the directory of "filename", or to the
+    working directory if it is NULL.
+
+    Large files are parsed in chunks by the workers of "pool", if it isn't
+    NULL.  The scene is the same however many workers there are.
+
+    Compiled scenes are recognized by their magic number, and loaded with
+    load_compiled_scene instead.
+*/
+    struct stat file_status;
+    long page_size = sysconf(_SC_PAGESIZE);
+    char * text = NULL;
+    size_t size = 0;
+    bool mapped = false;
+    int result;
+
+    scene_out->primitives = NULL;
+    scene_out->mapping = NULL;
+    scene_out->groups = NULL;
+    scene_out->num_groups = 0;
+    scene_out->animation = NULL;
+    if (is_compiled_scene(file))
+    {
+        return load_compiled_scene(file, scene_out);
+    }
+
+    /* The rest of the last page of a mapping is filled with zeros, which end
+       the text, unless the file fills the page */
+    if (fstat(fileno(file), &file_status) == 0 && S_ISREG(file_status.st_mode) &&
+        file_status.st_size > 0 && page_size > 0 && file_status.st_size % page_size != 0)
+    {
+        size = file_status.st_size;
+        text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        mapped = text != MAP_FAILED;
+        if (mapped)
+        {
+            posix_madvise(text, size, POSIX_MADV_SEQUENTIAL);
+        }
+    }
+    if (!mapped)
+    {
+        text = read_text(file, &size);
+        if (text == NULL)
+        {
+            return -1;
+        }
+    }
+    result = parse_scene(text, size, filename, scene_out, pool);
+    if (mapped)
+    {
+        munmap(text, size);
+    }
+    else
+    {
+        free(text);
+    }
+    return result;
+}
+
+void free_scene (scene * scene)
+{
+    surface * cur_surface;
+    int group;
+
+    primitives_free(scene->primitives);
+    for (cur_surface = scene->surfaces; cur_surface->class; cur_surface++)
+    {
+        free_surface(cur_surface, scene->mapping == NULL);
+    }
+    for (group = 0; group < scene->num_groups; group++)
+    {
+        for (cur_surface = scene->groups[group].surfaces; cur_surface->class; cur_surface++)
+        {
+            free_surface(cur_surface, false);
+        }
+        instance_group_free(&scene->groups[group]);
+        if (scene->mapping == NULL)
+        {
+            free(scene->groups[group].surfaces);
+        }
+    }
+    free(scene->groups);
+    animation_free(scene->animation);
+    if (scene->mapping)
+    {
+        munmap(scene->mapping, scene->mapping_size);
+    }
+    else
+    {
+        free(scene->light_sources);
+        free(scene->surfaces);
+    }
+}
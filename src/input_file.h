@@ -1,7 +1,18 @@
 #pragma once
 
 #include "scene.h"
+#include "thread_pool.h"
 
 #include <stdio.h>
 
-int load_scene (FILE * file, scene * scene_out);
+/*! Load a scene from "file": a text scene file in the format described in
+    input_file.c, or a compiled scene (see compiled_scene.h).  "filename" is
+    the file's name, which the mesh files it names are relative to, or NULL
+    if it has none.  If "pool" is not NULL, its workers parse large text
+    files in parallel.  Return 0 on success, or -1 on error.  The scene is
+    released with free_scene. */
+int load_scene (FILE * file, const char * filename, scene * scene_out, thread_pool * pool);
+
+/*! Release the light sources, surfaces, meshes, groups, animation and
+    primitives of a scene loaded with load_scene */
+void free_scene (scene * scene);
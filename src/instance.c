@@ -0,0 +1,210 @@
+#include "instance.h"
+#include "bvh.h"
+
+#include <math.h>
+
+static intersection_function instance_intersect;
+static occlusion_function instance_occludes;
+static bounding_function instance_bounds;
+
+static surface_class instance_class = { instance_intersect, instance_occludes, instance_bounds };
+
+surface_class * surface_instance = &instance_class;
+
+static vector transform_direction (const affine_transform * transform, vector direction)
+{
+    return vector_add(vector_add(vector_multiply(direction.x, transform->columns[0]),
+                                 vector_multiply(direction.y, transform->columns[1])),
+                      vector_multiply(direction.z, transform->columns[2]));
+}
+
+static vector transform_point (const affine_transform * transform, vector point)
+{
+    return vector_add(transform_direction(transform, point), transform->translation);
+}
+
+static vector transform_normal (const affine_transform * to_object, vector normal)
+/*! Transform a normal in object space to world space, by the transpose of
+    the linear part of to_object */
+{
+    return vector_normalize((vector){ dot_product(to_object->columns[0], normal),
+                                      dot_product(to_object->columns[1], normal),
+                                      dot_product(to_object->columns[2], normal) });
+}
+
+static vector object_ray (const affine_transform * to_object, vector ray, float * scale_out)
+/*! Transform a normalized direction to object space and normalize it again,
+    outputting the factor by which distances along it grow.  The primitives
+    take normalized rays. */
+{
+    vector local_ray = transform_direction(to_object, ray);
+    *scale_out = vector_magnitude(local_ray);
+    return vector_multiply(1 / *scale_out, local_ray);
+}
+
+static affine_transform compose (const affine_transform * outer, const affine_transform * inner)
+/*! The transform applying "inner", then "outer" */
+{
+    affine_transform result;
+    int column;
+
+    for (column = 0; column < 3; column++)
+    {
+        result.columns[column] = transform_direction(outer, inner->columns[column]);
+    }
+    result.translation = transform_point(outer, inner->translation);
+    return result;
+}
+
+static affine_transform linear (vector x_column, vector y_column, vector z_column)
+{
+    return (affine_transform){ { x_column, y_column, z_column }, { 0, 0, 0 } };
+}
+
+static affine_transform rotation_about (int axis, float angle)
+/*! The rotation by "angle" radians about axis 0, 1 or 2, counterclockwise
+    looking down the axis */
+{
+    float c = cosf(angle), s = sinf(angle);
+
+    switch (axis)
+    {
+        case 0:
+            return linear((vector){ 1, 0, 0 }, (vector){ 0, c, s }, (vector){ 0, -s, c });
+        case 1:
+            return linear((vector){ c, 0, -s }, (vector){ 0, 1, 0 }, (vector){ s, 0, c });
+        default:
+            return linear((vector){ c, s, 0 }, (vector){ -s, c, 0 }, (vector){ 0, 0, 1 });
+    }
+}
+
+bool instance_transform_make (vector scale, vector rotation, vector position,
+                              instance_transform * transform_out)
+{
+    float angles[3] = { rotation.x, rotation.y, rotation.z };
+    affine_transform step;
+    int axis;
+
+    if (scale.x == 0 || scale.y == 0 || scale.z == 0)
+    {
+        return false;
+    }
+
+    /* Built up a step at a time, each inverse from the inverses of the steps
+       in the opposite order, so that nothing is inverted numerically */
+    transform_out->to_world = linear((vector){ scale.x, 0, 0 }, (vector){ 0, scale.y, 0 },
+                                     (vector){ 0, 0, scale.z });
+    transform_out->to_object = linear((vector){ 1 / scale.x, 0, 0 }, (vector){ 0, 1 / scale.y, 0 },
+                                      (vector){ 0, 0, 1 / scale.z });
+    for (axis = 0; axis < 3; axis++)
+    {
+        step = rotation_about(axis, angles[axis]);
+        transform_out->to_world = compose(&step, &transform_out->to_world);
+        step = rotation_about(axis, -angles[axis]);
+        transform_out->to_object = compose(&transform_out->to_object, &step);
+    }
+    transform_out->to_world.translation = position;
+    transform_out->to_object.translation =
+        vector_negate(transform_direction(&transform_out->to_object, position));
+    return true;
+}
+
+bool instance_group_create (instance_group * group_out, surface surfaces[])
+{
+    group_out->surfaces = surfaces;
+    group_out->primitives = primitives_create(surfaces);
+    return group_out->primitives != NULL;
+}
+
+void instance_group_free (instance_group * group)
+{
+    primitives_free(group->primitives);
+}
+
+bool instance_hit (const instance * instance, vector origin, vector ray, float max_t,
+                   vector * intersection_out)
+{
+    const affine_transform * to_object = &instance->transform->to_object;
+    vector intersection;
+    float scale;
+    vector local_ray = object_ray(to_object, ray, &scale);
+
+    if (primitives_closest_hit(instance->group->primitives, transform_point(to_object, origin),
+                               local_ray, max_t * scale, &intersection) < 0)
+    {
+        return false;
+    }
+    *intersection_out = transform_point(&instance->transform->to_world, intersection);
+    return true;
+}
+
+surface * instance_hit_surface (const instance * instance, vector origin, vector ray,
+                                vector * intersection_out, vector * normal_out)
+{
+    const affine_transform * to_object = &instance->transform->to_object;
+    vector intersection, normal;
+    float scale;
+    vector local_ray = object_ray(to_object, ray, &scale);
+    surface * hit = primitives_hit_surface(instance->group->primitives,
+                                           transform_point(to_object, origin), local_ray,
+                                           &intersection, &normal);
+
+    if (hit == NULL)
+    {
+        return NULL;
+    }
+    if (intersection_out)
+    {
+        *intersection_out = transform_point(&instance->transform->to_world, intersection);
+    }
+    if (normal_out)
+    {
+        *normal_out = transform_normal(to_object, normal);
+    }
+    return hit;
+}
+
+bool instance_blocks (const instance * instance, vector origin, vector ray, float max_distance)
+{
+    const affine_transform * to_object = &instance->transform->to_object;
+    float scale;
+    vector local_ray = object_ray(to_object, ray, &scale);
+
+    return primitives_is_occluded(instance->group->primitives, transform_point(to_object, origin),
+                                  local_ray, max_distance * scale, NULL);
+}
+
+static bool instance_intersect (vector origin, vector ray, void * geometry,
+                                vector * intersection_out, vector * normal_out)
+{
+    return instance_hit_surface((instance *)geometry, origin, ray, intersection_out,
+                                normal_out) != NULL;
+}
+
+static bool instance_occludes (vector origin, vector ray, void * geometry, float max_distance)
+{
+    return instance_blocks((instance *)geometry, origin, ray, max_distance);
+}
+
+static bounds instance_bounds (void * geometry)
+/*! The box around the corners of the box of the group, moved into place */
+{
+    instance * self = (instance *)geometry;
+    bounds box = self->group->primitives->bvh->nodes[0].box;
+    bounds result = { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+    vector corner;
+    int index;
+
+    for (index = 0; index < 8; index++)
+    {
+        corner = transform_point(&self->transform->to_world,
+                                 (vector){ index & 1 ? box.max.x : box.min.x,
+                                           index & 2 ? box.max.y : box.min.y,
+                                           index & 4 ? box.max.z : box.min.z });
+        result.min = (vector){ min_float(result.min.x, corner.x), min_float(result.min.y, corner.y),
+                               min_float(result.min.z, corner.z) };
+        result.max = (vector){ max_float(result.max.x, corner.x), max_float(result.max.y, corner.y),
+                               max_float(result.max.z, corner.z) };
+    }
+    return result;
+}
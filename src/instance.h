@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "surface.h"
+#include "primitives.h"
+#include "vector.h"
+
+/* This module places copies of a group of surfaces around a scene without
+   copying the surfaces.
+
+   A group is a sentinel terminated array of surfaces, with primitives of
+   its own (see primitives.h) built over them in the group's own coordinates,
+   its object space.  An instance is a surface that refers to a group and to
+   an affine transform from object space to the scene, the world space.  The
+   scene's BVH sees each instance as one primitive, with the box of its
+   transformed group, and a ray that reaches it is transformed into object
+   space and traced through the group's BVH.  The two levels make a thousand
+   copies of a group cost a thousand small records and BVH entries, plus one
+   copy of the group.
+
+   The primitives take rays with normalized directions, so a ray is
+   normalized again in object space, where distances along it are scaled by
+   the length of its transformed direction.  The points of the ray map to
+   the same points either way, so the closest hit in object space is the
+   closest in world space, and the group is searched with the bound on
+   distance that the scene's search has reached.  Normals are transformed by
+   the transposed inverse of the transform's linear part, so that they stay
+   perpendicular to surfaces under non-uniform scaling.
+
+   A ray that hits an instance hits one of its group's surfaces, whose
+   material it takes, so a group's surfaces keep their own materials in
+   every copy.  Groups can't hold instances.
+*/
+
+/* The affine transform x -> x.x * columns[0] + x.y * columns[1] +
+   x.z * columns[2] + translation */
+typedef struct
+{
+    vector columns[3];
+    vector translation;
+} affine_transform;
+
+/* An instance's transform both ways.  It is allocated for each instance,
+   and not in its surface, which has no room for it. */
+typedef struct instance_transform
+{
+    affine_transform to_world;
+    affine_transform to_object;
+} instance_transform;
+
+typedef struct instance_group
+{
+    surface * surfaces;
+    primitives * primitives;
+} instance_group;
+
+/*! Make the transform that scales by the components of "scale", then
+    rotates by rotation.x radians about the x axis, rotation.y about y and
+    rotation.z about z, and then moves by "position".  Return false if a
+    component of "scale" is 0, so that the transform can't be inverted. */
+bool instance_transform_make (vector scale, vector rotation, vector position,
+                              instance_transform * transform_out);
+
+/*! Make the primitives of a group of surfaces, which must outlive it, and
+    contain no instances.  Return false if memory could not be allocated. */
+bool instance_group_create (instance_group * group_out, surface surfaces[]);
+
+/*! Release the primitives of a group, leaving its surfaces */
+void instance_group_free (instance_group * group);
+
+/*! Find the closest hit of a ray with a normalized direction on an
+    instance, searching its group for hits at a distance of at most max_t,
+    though farther ones may be found too.  Output the intersection in world
+    space, or return false if there is none. */
+bool instance_hit (const instance * instance, vector origin, vector ray, float max_t,
+                   vector * intersection_out);
+
+/*! Find the surface of its group that a ray with a normalized direction
+    hits first on an instance, outputting the intersection and its normal in
+    world space, or return NULL if there is none.  "intersection_out" may be
+    NULL. */
+surface * instance_hit_surface (const instance * instance, vector origin, vector ray,
+                                vector * intersection_out, vector * normal_out);
+
+/*! Determine if a ray with the given origin and normalized direction hits
+    an instance at a distance less than max_distance */
+bool instance_blocks (const instance * instance, vector origin, vector ray, float max_distance);
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <stdbool.h>
+#include <math.h>
+
+#include "vector.h"
+
+/* Ray/surface intersection kernels.
+
+   These are the calculations behind the surface classes of surface.c, taking
+   each primitive's geometry as plain values rather than as a surface.  That
+   way the same code serves both the surface classes and the packed primitive
+   arrays of primitives.h, and is inlined into the loops of both, so every
+   path through the renderer finds exactly the same intersections.
+
+   The "hit" kernels find the first intersection of a ray with a primitive,
+   and the "blocks" kernels answer shadow ray queries: whether a ray with a
+   normalized direction hits the primitive closer than a given distance.
+   The quadric (sphere and frustum) kernels measure intersection points along
+   the normalized ray direction, which is passed in as "unit_ray".
+
+   Quantities that depend only on a primitive, such as the axis of a frustum
+   or the normal of a quad, are calculated ahead of time by the "bake"
+   functions and passed to the kernels, which are left with the arithmetic
+   that depends on the ray.  primitives.h bakes every primitive once, when
+   the scene is loaded.  The baked values are calculated exactly as the
+   kernels would calculate them, so baking changes no results.
+*/
+
+/* Intersections closer than this to the ray origin are ignored, so that rays
+   leaving a surface don't intersect that same surface at their origin */
+static const float f_min = 1e-2f;
+
+static __inline bool solve_linear (vector origin, vector ray, vector plane_point, vector plane_normal,
+                                   vector * intersection_out)
+{
+    float t;
+    t = dot_product(vector_sub(plane_point, origin), plane_normal) / dot_product(ray, plane_normal);
+    if (t < f_min)
+    {
+        return false;
+    }
+    else
+    {
+        *intersection_out = vector_add(origin, vector_multiply(t, ray));
+        return true;
+    }
+}
+
+static __inline int solve_quadratic_distances (float a, float k, float c, float distances_out[2])
+/* Solve a t^2 + 2 k t + c = 0, outputting the roots beyond f_min in increasing order */
+{
+    float root;
+    float base, delta;
+    float determinant = square(k) - a * c;
+
+    if (determinant < .0f)
+    {
+        return 0;
+    }
+
+    root = sqrtf(determinant);
+
+    base = -k / a;
+    delta = fabsf(root / a);
+
+    if (base - delta > f_min)
+    {
+        distances_out[0] = base - delta;
+        distances_out[1] = base + delta;
+        return 2;
+    }
+    else if (base + delta > f_min)
+    {
+        distances_out[0] = base + delta;
+        return 1;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+static __inline int solve_quadratic (vector origin, vector unit_ray, float a, float k, float c,
+                                     vector intersections_out[2])
+{
+    float distances[2];
+    int index, num_roots = solve_quadratic_distances(a, k, c, distances);
+    for (index = 0; index < num_roots; index++)
+    {
+        intersections_out[index] = vector_add(origin, vector_multiply(distances[index], unit_ray));
+    }
+    return num_roots;
+}
+
+static __inline bool sphere_hit (vector origin, vector ray, vector unit_ray,
+                                 vector center, float squared_radius, vector * intersection_out)
+{
+    vector intersections[2];
+    vector relative_origin = vector_sub(origin, center);
+    float k = dot_product(ray, relative_origin);
+    float c = squared_magnitude(relative_origin) - squared_radius;
+
+    if (solve_quadratic(origin, unit_ray, 1.0f, k, c, intersections) > 0)
+    {
+        *intersection_out = intersections[0];
+        return true;
+    }
+    return false;
+}
+
+/* A frustum's axis, as seen from its first end */
+typedef struct
+{
+    /* Unit vector from the first end to the second */
+    vector axis;
+    /* Distance between the ends */
+    float length;
+    /* Change in radius per unit of length along the axis */
+    float slope;
+} frustum_frame;
+
+static __inline frustum_frame frustum_bake (vector center0, vector center1,
+                                            float radius0, float radius1)
+{
+    frustum_frame frame;
+    vector relative_center = vector_sub(center1, center0);
+    frame.axis = vector_normalize(relative_center);
+    frame.length = vector_magnitude(relative_center);
+    frame.slope = (radius1 - radius0) / frame.length;
+    return frame;
+}
+
+static __inline bool frustum_hit (vector origin, vector ray, vector unit_ray,
+                                  vector center0, vector center1, float radius0,
+                                  frustum_frame frame, vector * intersection_out)
+{
+    vector relative_origin;
+    vector ray_orth, origin_orth;
+    vector intersections[2];
+    float a,k,c;
+    float radius_linear, radius_constant;
+    int index, num_hits;
+
+    relative_origin = vector_sub(origin, center0);
+    origin_orth = vector_orth(relative_origin, frame.axis);
+    ray_orth = vector_orth(ray, frame.axis);
+    radius_linear = frame.slope * dot_product(ray, frame.axis);
+    radius_constant = frame.slope * dot_product(relative_origin, frame.axis) + radius0;
+
+    a = squared_magnitude(ray_orth) - square(radius_linear);
+    k = dot_product(ray_orth, origin_orth) - radius_linear * radius_constant;
+    c = squared_magnitude(origin_orth) - square(radius_constant);
+
+    num_hits = solve_quadratic(origin, unit_ray, a, k, c, intersections);
+    for (index = 0; index < num_hits; index++)
+    {
+        if (dot_product(vector_sub(intersections[index], center0), frame.axis) >= .0f &&
+            dot_product(vector_sub(intersections[index], center1), frame.axis) <= .0f)
+        {
+            *intersection_out = intersections[index];
+            return true;
+        }
+    }
+    return false;
+}
+
+static __inline bool circle_hit (vector origin, vector ray, vector center, vector normal,
+                                 float radius, vector * intersection_out)
+{
+    return solve_linear(origin, ray, center, normal, intersection_out) &&
+           vector_distance(*intersection_out, center) <= radius;
+}
+
+/* The plane of a quad, and the directions across it */
+typedef struct
+{
+    /* Unit normal of the quad's plane */
+    vector normal;
+    /* Unit vectors in the plane orthogonal to each of the two edges that meet
+       at the middle vertex, pointing into the quad, and the width of the quad
+       along each of them */
+    vector across[2];
+    float widths[2];
+} quad_frame;
+
+static __inline quad_frame quad_bake (vector vertex0, vector vertex1, vector vertex2)
+{
+    quad_frame frame;
+    vector axis1 = vector_sub(vertex0, vertex1);
+    vector axis2 = vector_sub(vertex2, vertex1);
+    vector orth1 = vector_orth(axis1, vector_normalize(axis2));
+    vector orth2 = vector_orth(axis2, vector_normalize(axis1));
+
+    frame.normal = vector_normalize(cross_product(axis1, axis2));
+    frame.across[0] = vector_normalize(orth1);
+    frame.across[1] = vector_normalize(orth2);
+    frame.widths[0] = vector_magnitude(orth1);
+    frame.widths[1] = vector_magnitude(orth2);
+    return frame;
+}
+
+static __inline bool quad_contains (vector vertex1, const quad_frame * frame, vector point)
+/* Determine if a point on the plane of a quad lies within the quad */
+{
+    vector relative_point = vector_sub(point, vertex1);
+    float proj1 = dot_product(relative_point, frame->across[0]);
+    float proj2 = dot_product(relative_point, frame->across[1]);
+    return .0f <= proj1 && proj1 <= frame->widths[0] &&
+           .0f <= proj2 && proj2 <= frame->widths[1];
+}
+
+static __inline bool quad_hit (vector origin, vector ray, vector vertex1, quad_frame frame,
+                               vector * intersection_out)
+{
+    return solve_linear(origin, ray, vertex1, frame.normal, intersection_out) &&
+           quad_contains(vertex1, &frame, *intersection_out);
+}
+
+static __inline bool sphere_blocks (vector origin, vector ray, vector center,
+                                    float squared_radius, float max_distance)
+{
+    float distances[2];
+    vector relative_origin = vector_sub(origin, center);
+    float k = dot_product(ray, relative_origin);
+    float c = squared_magnitude(relative_origin) - squared_radius;
+
+    return solve_quadratic_distances(1.0f, k, c, distances) > 0 && distances[0] < max_distance;
+}
+
+static __inline bool frustum_blocks (vector origin, vector ray, vector center0, float radius0,
+                                     frustum_frame frame, float max_distance)
+{
+    vector relative_origin;
+    vector ray_orth, origin_orth;
+    float distances[2];
+    float a, k, c;
+    float ray_axial, origin_axial, axial;
+    float radius_linear, radius_constant;
+    int index, num_hits;
+
+    relative_origin = vector_sub(origin, center0);
+    ray_axial = dot_product(ray, frame.axis);
+    origin_axial = dot_product(relative_origin, frame.axis);
+    origin_orth = vector_orth(relative_origin, frame.axis);
+    ray_orth = vector_orth(ray, frame.axis);
+    radius_linear = frame.slope * ray_axial;
+    radius_constant = frame.slope * origin_axial + radius0;
+
+    a = squared_magnitude(ray_orth) - square(radius_linear);
+    k = dot_product(ray_orth, origin_orth) - radius_linear * radius_constant;
+    c = squared_magnitude(origin_orth) - square(radius_constant);
+
+    /* The first root within the length of the frustum is the visible one */
+    num_hits = solve_quadratic_distances(a, k, c, distances);
+    for (index = 0; index < num_hits; index++)
+    {
+        axial = origin_axial + distances[index] * ray_axial;
+        if (axial >= .0f && axial <= frame.length)
+        {
+            return distances[index] < max_distance;
+        }
+    }
+    return false;
+}
+
+static __inline bool circle_blocks (vector origin, vector ray, vector center, vector normal,
+                                    float squared_radius, float max_distance)
+{
+    vector relative_center = vector_sub(center, origin);
+    float distance = dot_product(relative_center, normal) / dot_product(ray, normal);
+
+    if (distance < f_min || !(distance < max_distance))
+    {
+        return false;
+    }
+    return squared_magnitude(vector_sub(vector_multiply(distance, ray), relative_center)) <=
+           squared_radius;
+}
+
+static __inline bool quad_blocks (vector origin, vector ray, vector vertex1, quad_frame frame,
+                                  float max_distance)
+{
+    float distance = dot_product(vector_sub(vertex1, origin), frame.normal) /
+                     dot_product(ray, frame.normal);
+
+    if (distance < f_min || !(distance < max_distance))
+    {
+        return false;
+    }
+    return quad_contains(vertex1, &frame, vector_add(origin, vector_multiply(distance, ray)));
+}
+
+/* A ray direction as the watertight triangle test uses it.  The ray is moved
+   to the origin and sheared so that it runs along the z axis, which turns
+   the test into a 2D test of whether the origin lies within the triangle's
+   projection onto the xy plane.  Triangles that share an edge compute the
+   same edge function for it, so a ray through the edge hits exactly one of
+   them, or both, but never slips through between them.  The shear depends
+   only on the ray, so it is baked once per ray rather than per triangle. */
+typedef struct
+{
+    /* The axis of the largest component of the direction, becoming z, and
+       the other two, ordered to keep the winding of the triangles */
+    int kx, ky, kz;
+    float shear_x, shear_y, shear_z;
+} triangle_ray;
+
+static __inline float vector_axis (vector v, int axis)
+{
+    return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+static __inline triangle_ray triangle_ray_bake (vector ray)
+{
+    triangle_ray result;
+    float x = fabsf(ray.x), y = fabsf(ray.y), z = fabsf(ray.z);
+    int swap;
+
+    result.kz = x > y ? (x > z ? 0 : 2) : (y > z ? 1 : 2);
+    result.kx = (result.kz + 1) % 3;
+    result.ky = (result.kx + 1) % 3;
+    if (vector_axis(ray, result.kz) < .0f)
+    {
+        swap = result.kx;
+        result.kx = result.ky;
+        result.ky = swap;
+    }
+    result.shear_x = vector_axis(ray, result.kx) / vector_axis(ray, result.kz);
+    result.shear_y = vector_axis(ray, result.ky) / vector_axis(ray, result.kz);
+    result.shear_z = 1.0f / vector_axis(ray, result.kz);
+    return result;
+}
+
+static __inline bool triangle_hit (vector origin, const triangle_ray * ray,
+                                   vector vertex0, vector vertex1, vector vertex2, float * t_out)
+/* Output the ray parameter of the intersection with a triangle, if there is
+   one at least f_min along the ray, as solve_linear measures it for quads */
+{
+    vector a = vector_sub(vertex0, origin);
+    vector b = vector_sub(vertex1, origin);
+    vector c = vector_sub(vertex2, origin);
+    float az = vector_axis(a, ray->kz), bz = vector_axis(b, ray->kz), cz = vector_axis(c, ray->kz);
+    float ax = vector_axis(a, ray->kx) - ray->shear_x * az;
+    float ay = vector_axis(a, ray->ky) - ray->shear_y * az;
+    float bx = vector_axis(b, ray->kx) - ray->shear_x * bz;
+    float by = vector_axis(b, ray->ky) - ray->shear_y * bz;
+    float cx = vector_axis(c, ray->kx) - ray->shear_x * cz;
+    float cy = vector_axis(c, ray->ky) - ray->shear_y * cz;
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    float determinant;
+
+    /* On an edge in single precision, the sign of an edge function decides
+       which triangle is hit, so it is calculated again in double precision */
+    if (u == .0f || v == .0f || w == .0f)
+    {
+        u = (float)((double)cx * by - (double)cy * bx);
+        v = (float)((double)ax * cy - (double)ay * cx);
+        w = (float)((double)bx * ay - (double)by * ax);
+    }
+    if ((u < .0f || v < .0f || w < .0f) && (u > .0f || v > .0f || w > .0f))
+    {
+        return false;
+    }
+    determinant = u + v + w;
+    if (determinant == .0f)
+    {
+        return false;
+    }
+    *t_out = (u * ray->shear_z * az + v * ray->shear_z * bz + w * ray->shear_z * cz) / determinant;
+    return *t_out >= f_min;
+}
@@ -1,7 +1,15 @@
 #include "input_file.h"
+#include "animation.h"
+#include "compiled_scene.h"
 #include "output_file.h"
-#include "ray_trace.h"
+#include "render.h"
+#include "server.h"
+#include "farm.h"
+#include "thread_pool.h"
+#include "stats.h"
 #include "surface.h"
+#include "primitives.h"
+#include "packet.h"
 #include "vector.h"
 #include "scene.h"
 #include "color.h"
@@ -10,32 +18,517 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#include <math.h>
+#include <stdbool.h>
 
-const int depth = 8;
-
-void handle_args (int argc, char * argv[], FILE ** input_stream, FILE ** output_stream)
+typedef struct
 {
     char * scene_filename;
+    int threads;
+    bool stats;
+    float min_contribution;
+    bool russian_roulette;
+    bool stream;
+    bool compile;
+    /* The frame of the scene's animation to render, or the first of a video */
+    int frame;
+    /* Whether to render a video of "frames" frames, or if it is 0, of the
+       rest of the animation */
+    bool video;
+    int frames;
+    video_format video_format;
+    int frame_rate;
+    /* The socket to serve render requests on, or NULL to render the scene
+       file, and the memory the server caches scenes in */
+    char * serve;
+    size_t cache_size;
+    /* Whether to render with a farm of worker processes, or if "worker" is
+       not NULL, the HOST:PORT of the coordinator of one to work for */
+    bool farm;
+    char * worker;
+    farm_settings farm_settings;
+    /* The files to save the cost of each pixel to as a heatmap and as
+       floats, or NULL for none */
+    char * heatmap;
+    char * heatmap_pfm;
+    render_settings render;
+} options;
+
+/* The output image, which progressive renders save after every pass, and
+   streaming renders save a band of rows at a time after the header */
+typedef struct
+{
+    FILE * file;
+    int width;
+    int height;
+    long header_size;
+    /* The workers that quantize the image */
+    thread_pool * pool;
+} image_output;
+
+void usage (char * program)
+{
+    fprintf(stderr, "Usage: %s [options] <input_scene_file> <output_ppm_file>\n"
+                    "       %s [options] --serve <socket>\n"
+                    "       %s [options] --worker <host:port> <input_scene_file>\n"
+                    "The output file \"-\" is the standard output.\n"
+                    "Options:\n"
+                    "  --threads N       Render with N threads (0: one per processor, default 1)\n"
+                    "  --packet-width N  Trace camera rays in packets of N: 4, 8 (with AVX2),\n"
+                    "                    or 1 to trace them one at a time (default: widest)\n"
+                    "  --engine E        Trace rays depth first with the recursive engine,\n"
+                    "                    or a bounce at a time with wavefront (default: recursive)\n"
+                    "  --antialias A     Supersample no pixels (none, the default), only pixels\n"
+                    "                    on edges (adaptive) or every pixel (uniform)\n"
+                    "  --samples N       Supersample with N by N rays per pixel (2 to 8, default 4)\n"
+                    "  --contrast T      Color difference between neighbors that makes an edge\n"
+                    "                    for adaptive antialiasing (default 0.1)\n"
+                    "  --time-budget S   Render progressively, refining the image for up to\n"
+                    "                    S seconds and saving it after every pass\n"
+                    "  --roi X0,Y0,X1,Y1 Refine the pixels from X0,Y0 up to X1,Y1 first, counted\n"
+                    "                    from the top left, when rendering progressively\n"
+                    "  --region X0,Y0,X1,Y1  Only render the pixels from X0,Y0 up to X1,Y1,\n"
+                    "                    counted from the top left, into an image of that size\n"
+                    "  --min-contribution T  Skip reflected and refracted rays that can add\n"
+                    "                    less than T to a pixel's color (default 0: none)\n"
+                    "  --russian-roulette  Follow either the reflection or the refraction of\n"
+                    "                    a ray at random, weighted by the Fresnel coefficients\n"
+                    "  --stream          Write the image a band of rows at a time as it is\n"
+                    "                    rendered, instead of holding all of it in memory\n"
+                    "  --compile         Save the scene and its BVH to the output file as a\n"
+                    "                    compiled scene, which loads without parsing, instead\n"
+                    "                    of rendering it\n"
+                    "  --frame K         Render frame K of the scene's animation (default 0),\n"
+                    "                    or start a video at frame K\n"
+                    "  --frames N        Render a video of N frames of the scene's animation\n"
+                    "                    (default: to the end of the animation)\n"
+                    "  --video-format F  Render a video of the scene's animation as a YUV4MPEG2\n"
+                    "                    stream (y4m, the default) or as PAM images (pam)\n"
+                    "  --frame-rate N    Frames per second of a Y4M video (default 30)\n"
+                    "  --serve SOCKET    Render the images that clients connected to the Unix\n"
+                    "                    domain socket SOCKET ask for, keeping their scenes\n"
+                    "                    loaded (see server.h for the requests)\n"
+                    "  --cache-size MB   Memory the server keeps scenes loaded in (default 256)\n"
+                    "  --farm N          Render with N worker processes sharing the loaded scene,\n"
+                    "                    each with the threads given, handing them bands of rows\n"
+                    "                    over TCP (see farm.h), or with --worker, join with N\n"
+                    "  --farm-port P     Also take workers from other hosts on TCP port P\n"
+                    "  --farm-timeout S  Seconds a worker has for a band before it is handed to\n"
+                    "                    another (default 60)\n"
+                    "  --worker H:P      Render bands for the farm coordinated from host H, port P\n"
+                    "  --heatmap FILE    Save what each pixel cost to trace to FILE, as a PPM\n"
+                    "                    image on a false color scale\n"
+                    "  --heatmap-pfm FILE  Save what each pixel cost to FILE as a PFM image\n"
+                    "  --heatmap-metric M  Measure the cost in rays traced (rays, the default),\n"
+                    "                    intersection tests (tests) or processor cycles (cycles)\n"
+                    "  --stats           Print ray tracing statistics when done\n",
+                    program, program, program);
+    exit(1);
+}
+
+void save_progress (void * context, color image[])
+/*! Overwrite the output image with the image rendered so far */
+{
+    image_output * output = context;
+    rewind(output->file);
+    save_image(image, output->width, output->height, output->file, output->pool);
+    fflush(output->file);
+}
+
+int save_rows (void * context, const color rows[], int first_row, int num_rows)
+/*! Write rows of a streaming render to their place in the output image */
+{
+    image_output * output = context;
+    return save_image_rows(rows, output->width, first_row, num_rows, fileno(output->file),
+                           output->header_size);
+}
+
+char * option_value (int argc, char * argv[], int * index)
+/*! Return the value of the option at argv[*index], given either as
+    "--option=value" or as "--option value", advancing *index past it */
+{
+    char * equals = strchr(argv[*index], '=');
+    if (equals)
+    {
+        return equals + 1;
+    }
+    if (*index + 1 >= argc)
+    {
+        fprintf(stderr, "Option %s requires a value\n", argv[*index]);
+        usage(argv[0]);
+    }
+    return argv[++*index];
+}
+
+bool option_is (char * arg, char * name)
+/*! Determine if "arg" is the option "name", with or without an attached value */
+{
+    size_t length = strlen(name);
+    return strncmp(arg, name, length) == 0 && (arg[length] == '\0' || arg[length] == '=');
+}
+
+void handle_args (int argc, char * argv[], options * options_out,
+                  FILE ** input_stream, FILE ** output_stream)
+{
     char * image_filename;
-    if (argc != 3)
+    int index;
+
+    options_out->threads = 1;
+    options_out->stats = false;
+    options_out->min_contribution = 0;
+    options_out->russian_roulette = false;
+    options_out->stream = false;
+    options_out->compile = false;
+    options_out->frame = 0;
+    options_out->video = false;
+    options_out->frames = 0;
+    options_out->video_format = VIDEO_Y4M;
+    options_out->frame_rate = 30;
+    options_out->serve = NULL;
+    options_out->cache_size = (size_t)256 << 20;
+    options_out->farm = false;
+    options_out->worker = NULL;
+    options_out->farm_settings = (farm_settings){ 1, 1, 0, 60 };
+    options_out->heatmap = NULL;
+    options_out->heatmap_pfm = NULL;
+    options_out->render.engine = ENGINE_RECURSIVE;
+    options_out->render.packet_width = packet_width_supported();
+    options_out->render.antialias = ANTIALIAS_NONE;
+    options_out->render.samples = 4;
+    options_out->render.contrast = 0.1f;
+    options_out->render.deadline = 0;
+    options_out->render.interest = (render_region){ 0, 0, 0, 0 };
+    options_out->render.region = (render_region){ 0, 0, 0, 0 };
+    options_out->render.cancel = NULL;
+    options_out->render.progress = NULL;
+    options_out->render.cost_out = NULL;
+    options_out->render.cost = COST_RAYS;
+    for (index = 1; index < argc && strncmp(argv[index], "--", 2) == 0; index++)
     {
-        fprintf(stderr, "Usage: %s <input_scene_file> <output_ppm_file>\n", argv[0]);
-        exit(1);
+        if (option_is(argv[index], "--threads"))
+        {
+            options_out->threads = atoi(option_value(argc, argv, &index));
+        }
+        else if (option_is(argv[index], "--packet-width"))
+        {
+            int width = atoi(option_value(argc, argv, &index));
+            if ((width != 1 && width != 4 && width != 8) || width > packet_width_supported())
+            {
+                fprintf(stderr, "Packet width must be 1 or 4, or 8 where AVX2 is supported\n");
+                usage(argv[0]);
+            }
+            options_out->render.packet_width = width;
+        }
+        else if (option_is(argv[index], "--engine"))
+        {
+            char * engine = option_value(argc, argv, &index);
+            if (strcmp(engine, "recursive") == 0)
+            {
+                options_out->render.engine = ENGINE_RECURSIVE;
+            }
+            else if (strcmp(engine, "wavefront") == 0)
+            {
+                options_out->render.engine = ENGINE_WAVEFRONT;
+            }
+            else
+            {
+                fprintf(stderr, "Engine must be recursive or wavefront\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--antialias"))
+        {
+            char * antialias = option_value(argc, argv, &index);
+            if (strcmp(antialias, "none") == 0)
+            {
+                options_out->render.antialias = ANTIALIAS_NONE;
+            }
+            else if (strcmp(antialias, "adaptive") == 0)
+            {
+                options_out->render.antialias = ANTIALIAS_ADAPTIVE;
+            }
+            else if (strcmp(antialias, "uniform") == 0)
+            {
+                options_out->render.antialias = ANTIALIAS_UNIFORM;
+            }
+            else
+            {
+                fprintf(stderr, "Antialiasing must be none, adaptive or uniform\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--samples"))
+        {
+            int samples = atoi(option_value(argc, argv, &index));
+            if (samples < 2 || samples > RENDER_MAX_SAMPLES)
+            {
+                fprintf(stderr, "Samples must be from 2 to %d\n", RENDER_MAX_SAMPLES);
+                usage(argv[0]);
+            }
+            options_out->render.samples = samples;
+        }
+        else if (option_is(argv[index], "--contrast"))
+        {
+            options_out->render.contrast = atof(option_value(argc, argv, &index));
+        }
+        else if (option_is(argv[index], "--time-budget"))
+        {
+            double budget = atof(option_value(argc, argv, &index));
+            if (budget <= 0)
+            {
+                fprintf(stderr, "Time budget must be more than 0 seconds\n");
+                usage(argv[0]);
+            }
+            options_out->render.deadline = render_clock() + budget;
+        }
+        else if (option_is(argv[index], "--roi"))
+        {
+            render_region * roi = &options_out->render.interest;
+            if (sscanf(option_value(argc, argv, &index), "%d,%d,%d,%d",
+                       &roi->x0, &roi->y0, &roi->x1, &roi->y1) != 4 ||
+                roi->x0 >= roi->x1 || roi->y0 >= roi->y1)
+            {
+                fprintf(stderr, "Region of interest must be X0,Y0,X1,Y1 with X0 < X1, Y0 < Y1\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--region"))
+        {
+            render_region * region = &options_out->render.region;
+            if (sscanf(option_value(argc, argv, &index), "%d,%d,%d,%d",
+                       &region->x0, &region->y0, &region->x1, &region->y1) != 4 ||
+                region->x0 < 0 || region->y0 < 0 || region->x0 >= region->x1 ||
+                region->y0 >= region->y1)
+            {
+                fprintf(stderr, "Region must be X0,Y0,X1,Y1 with 0 <= X0 < X1, 0 <= Y0 < Y1\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--min-contribution"))
+        {
+            options_out->min_contribution = atof(option_value(argc, argv, &index));
+        }
+        else if (strcmp(argv[index], "--russian-roulette") == 0)
+        {
+            options_out->russian_roulette = true;
+        }
+        else if (strcmp(argv[index], "--stream") == 0)
+        {
+            options_out->stream = true;
+        }
+        else if (strcmp(argv[index], "--compile") == 0)
+        {
+            options_out->compile = true;
+        }
+        else if (option_is(argv[index], "--frame"))
+        {
+            options_out->frame = atoi(option_value(argc, argv, &index));
+            if (options_out->frame < 0)
+            {
+                fprintf(stderr, "Frame must be 0 or more\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--frames"))
+        {
+            options_out->frames = atoi(option_value(argc, argv, &index));
+            options_out->video = true;
+            if (options_out->frames < 1)
+            {
+                fprintf(stderr, "Frames must be 1 or more\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--video-format"))
+        {
+            char * format = option_value(argc, argv, &index);
+            options_out->video = true;
+            if (strcmp(format, "y4m") == 0)
+            {
+                options_out->video_format = VIDEO_Y4M;
+            }
+            else if (strcmp(format, "pam") == 0)
+            {
+                options_out->video_format = VIDEO_PAM;
+            }
+            else
+            {
+                fprintf(stderr, "Video format must be y4m or pam\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--frame-rate"))
+        {
+            options_out->frame_rate = atoi(option_value(argc, argv, &index));
+            if (options_out->frame_rate < 1)
+            {
+                fprintf(stderr, "Frame rate must be 1 or more\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--serve"))
+        {
+            options_out->serve = option_value(argc, argv, &index);
+        }
+        else if (option_is(argv[index], "--cache-size"))
+        {
+            double megabytes = atof(option_value(argc, argv, &index));
+            if (megabytes <= 0)
+            {
+                fprintf(stderr, "Cache size must be more than 0 MB\n");
+                usage(argv[0]);
+            }
+            options_out->cache_size = (size_t)(megabytes * (1 << 20));
+        }
+        else if (option_is(argv[index], "--farm"))
+        {
+            options_out->farm = true;
+            options_out->farm_settings.processes = atoi(option_value(argc, argv, &index));
+            if (options_out->farm_settings.processes < 0)
+            {
+                fprintf(stderr, "Farm processes must be 0 or more\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--farm-port"))
+        {
+            options_out->farm = true;
+            options_out->farm_settings.port = atoi(option_value(argc, argv, &index));
+            if (options_out->farm_settings.port < 1 || options_out->farm_settings.port > 65535)
+            {
+                fprintf(stderr, "Farm port must be from 1 to 65535\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--farm-timeout"))
+        {
+            options_out->farm_settings.timeout = atof(option_value(argc, argv, &index));
+            if (options_out->farm_settings.timeout <= 0)
+            {
+                fprintf(stderr, "Farm timeout must be more than 0 seconds\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--worker"))
+        {
+            options_out->worker = option_value(argc, argv, &index);
+            if (strrchr(options_out->worker, ':') == NULL)
+            {
+                fprintf(stderr, "Worker must be given the coordinator's HOST:PORT\n");
+                usage(argv[0]);
+            }
+        }
+        else if (option_is(argv[index], "--heatmap"))
+        {
+            options_out->heatmap = option_value(argc, argv, &index);
+        }
+        else if (option_is(argv[index], "--heatmap-pfm"))
+        {
+            options_out->heatmap_pfm = option_value(argc, argv, &index);
+        }
+        else if (option_is(argv[index], "--heatmap-metric"))
+        {
+            char * metric = option_value(argc, argv, &index);
+            if (strcmp(metric, "rays") == 0)
+            {
+                options_out->render.cost = COST_RAYS;
+            }
+            else if (strcmp(metric, "tests") == 0)
+            {
+                options_out->render.cost = COST_TESTS;
+            }
+            else if (strcmp(metric, "cycles") == 0)
+            {
+                options_out->render.cost = COST_CYCLES;
+            }
+            else
+            {
+                fprintf(stderr, "Heatmap metric must be rays, tests or cycles\n");
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[index], "--stats") == 0)
+        {
+            options_out->stats = true;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[index]);
+            usage(argv[0]);
+        }
+    }
+    options_out->farm_settings.threads = options_out->threads;
+    if ((options_out->farm || options_out->worker) &&
+        (options_out->stream || options_out->compile || options_out->video ||
+         options_out->render.deadline > 0 || options_out->render.region.x1 > 0))
+    {
+        fprintf(stderr, "Farm renders can't be streamed, compiled, rendered as videos or "
+                        "progressively, or cover a region\n");
+        usage(argv[0]);
+    }
+    if ((options_out->heatmap || options_out->heatmap_pfm) &&
+        (options_out->farm || options_out->worker || options_out->serve ||
+         options_out->stream || options_out->compile || options_out->video))
+    {
+        fprintf(stderr, "Heatmaps can't be made of farm, server, streaming, compiled or "
+                        "video renders\n");
+        usage(argv[0]);
+    }
+    if ((options_out->stream || options_out->video) && options_out->render.region.x1 > 0)
+    {
+        fprintf(stderr, "Regions can't be streamed or rendered as videos\n");
+        usage(argv[0]);
+    }
+    if (options_out->serve)
+    {
+        if (argc != index || options_out->stream || options_out->compile || options_out->video ||
+            options_out->render.deadline > 0)
+        {
+            fprintf(stderr, "Servers take no files, and don't stream, compile, render videos "
+                            "or render progressively\n");
+            usage(argv[0]);
+        }
+        return;
+    }
+    if (argc - index != (options_out->worker ? 1 : 2))
+    {
+        usage(argv[0]);
+    }
+    if (options_out->stream && (options_out->render.deadline > 0 ||
+                                options_out->render.antialias == ANTIALIAS_ADAPTIVE))
+    {
+        fprintf(stderr, "Streaming renders can't be progressive or adaptively antialiased\n");
+        usage(argv[0]);
+    }
+    if (options_out->video && (options_out->stream || options_out->compile ||
+                               options_out->render.deadline > 0))
+    {
+        fprintf(stderr, "Videos can't be streamed, compiled or rendered progressively\n");
+        usage(argv[0]);
     }
     
-    scene_filename = argv[1];
-    image_filename = argv[2];
-    
-    *input_stream = fopen(scene_filename, "r");
+    options_out->scene_filename = argv[index];
+    *input_stream = fopen(options_out->scene_filename, "r");
     if (*input_stream == NULL)
     {
         fprintf(stderr, "Unable to open input scene file %s: %s\n",
-                        scene_filename, strerror(errno));
+                        options_out->scene_filename, strerror(errno));
         exit(1);
     }
+    if (options_out->worker)
+    {
+        return;
+    }
+
+    image_filename = argv[index + 1];
+    /* Streaming and progressive renders write parts of the file over again */
+    if (strcmp(image_filename, "-") == 0 && (options_out->stream ||
+                                             options_out->render.deadline > 0))
+    {
+        fprintf(stderr, "Streaming and progressive renders can't write to the standard output\n");
+        usage(argv[0]);
+    }
     
-    *output_stream = fopen(image_filename, "w");
+    *output_stream = strcmp(image_filename, "-") == 0 ? stdout : fopen(image_filename, "w");
     if (*output_stream == NULL)
     {
         fprintf(stderr, "Unable to open output image file %s: %s\n",
@@ -44,31 +537,77 @@ void handle_args (int argc, char * argv[], FILE ** input_stream, FILE ** output_
     }
 }
 
-void render (scene * scene, color image_out[])
+int render_video (scene * scene, thread_pool * pool, options * options, FILE * file,
+                  ray_stats * stats_out)
+/*! Render the frames of a video of the scene's animation to "file", with
+    the scene already at its first frame.  The scene, its BVH and the image
+    stay in memory from frame to frame, and the BVH is refit to instances
+    that move.  Return 0, or -1 if memory runs out or writing fails. */
 {
-    vector ray;
-    int x, y;
-    float theta, phi;
-    color pixel_color;
+    animation * animation = scene->animation;
     resolution * res = &scene->camera.resolution;
-    direction * dir = &scene->camera.direction;
-
-    float h_angle = scene->camera.view_angle;
-    float v_angle = h_angle * (float)res->height / (float)res->width;
+    int frames = options->frames;
+    int end, frame;
+    color * image;
 
-    for (y = 0; y < res->height; y++)
+    if (frames == 0)
     {
-        phi = v_angle * ((float)y / (float)(res->height - 1) - 0.5f);
-        for (x = 0; x < res->width; x++)
+        frames = animation && animation->num_frames > options->frame + 1
+                 ? animation->num_frames - options->frame : 1;
+    }
+    end = options->frame + frames;
+    image = malloc(sizeof(color) * (size_t)res->width * res->height);
+    if (image == NULL ||
+        save_video_header(options->video_format, res->width, res->height, options->frame_rate,
+                          file))
+    {
+        free(image);
+        return -1;
+    }
+    for (frame = options->frame; frame < end; frame++)
+    {
+        if (frame > options->frame && animation && animation_apply(animation, frame, scene))
         {
-            theta = h_angle * -((float)x / (float)(res->width - 1) - 0.5f);
+            primitives_refit(scene->primitives);
+        }
+        render(scene, pool, &options->render, image, stats_out);
+        if (save_video_frame(options->video_format, image, res->width, res->height, file, pool))
+        {
+            free(image);
+            return -1;
+        }
+    }
+    free(image);
+    return 0;
+}
 
-            ray = vector_rotate(vector_theta_phi(theta, phi), dir->theta, dir->phi);
-            pixel_color = cast_ray(scene, scene->camera.position, ray, depth);
+int save_heatmaps (options * options, const float costs[], int width, int height)
+/*! Save the cost of each pixel to the heatmap files asked for.  Return 0,
+    or -1 if a file can't be written. */
+{
+    const char * units[] = { "rays", "intersection tests", "cycles" };
+    FILE * file;
+    int result = 0;
 
-            image_out[(res->height - y - 1) * res->width + x] = pixel_color;
+    if (options->heatmap)
+    {
+        file = fopen(options->heatmap, "w");
+        if (file == NULL ||
+            save_heatmap(costs, width, height, units[options->render.cost], file) |
+            fclose(file))
+        {
+            result = -1;
+        }
+    }
+    if (options->heatmap_pfm)
+    {
+        file = fopen(options->heatmap_pfm, "w");
+        if (file == NULL || save_pfm(costs, width, height, file) | fclose(file))
+        {
+            result = -1;
         }
     }
+    return result;
 }
 
 int main (int argc, char * argv[])
@@ -76,30 +615,179 @@ int main (int argc, char * argv[])
     FILE * scene_file;
     FILE * image_file;
     scene cur_scene = {};
+    options options;
+    thread_pool * pool;
+    ray_stats stats = { 0 };
     color * image;
+    unsigned char * bytes;
     resolution * res = &cur_scene.camera.resolution;
+    render_region * region = &options.render.region;
+    int width, height;
+    image_output output;
     
-    handle_args (argc, argv, &scene_file, &image_file);
+    handle_args (argc, argv, &options, &scene_file, &image_file);
 
-    if (load_scene(scene_file, &cur_scene))
+    pool = thread_pool_create(options.threads);
+    if (pool == NULL)
+    {
+        perror("Thread pool creation");
+        return -1;
+    }
+    if (options.serve)
+    {
+        server_settings settings = { options.cache_size, options.min_contribution,
+                                     options.russian_roulette, options.render };
+        if (serve(options.serve, &settings, pool))
+        {
+            perror("Server");
+            return -1;
+        }
+        thread_pool_destroy(pool);
+        return 0;
+    }
+    if (load_scene(scene_file, options.scene_filename, &cur_scene, pool))
     {
         perror("Scene load");
         return -1;
     }
     fclose(scene_file);
-    image = malloc(sizeof(color) * res->width * res->height);
-
-    render(&cur_scene, image);
-    free(cur_scene.light_sources);
-    free(cur_scene.surfaces);
-
-    if (save_image(image, res->width, res->height, image_file))
+    cur_scene.min_contribution = options.min_contribution;
+    cur_scene.russian_roulette = options.russian_roulette;
+    /* The BVH is built for the first frame to be rendered */
+    if (cur_scene.animation)
     {
-        perror("Image save");
+        animation_apply(cur_scene.animation, options.frame, &cur_scene);
+    }
+    /* Compiled scenes come with their primitives */
+    if (cur_scene.primitives == NULL)
+    {
+        cur_scene.primitives = primitives_create(cur_scene.surfaces);
+        if (cur_scene.primitives == NULL)
+        {
+            perror("BVH build");
+            return -1;
+        }
+    }
+    if (options.worker)
+    {
+        char * port = strrchr(options.worker, ':');
+        *port++ = '\0';
+        if (farm_join(&cur_scene, &options.render, &options.farm_settings, options.worker, port))
+        {
+            fprintf(stderr, "Farm work failed\n");
+            return -1;
+        }
+        thread_pool_destroy(pool);
+        free_scene(&cur_scene);
+        return 0;
+    }
+    if (region->x1 > res->width || region->y1 > res->height)
+    {
+        fprintf(stderr, "Region must lie within the image of %dx%d\n", res->width, res->height);
         return -1;
     }
+    if (options.compile)
+    {
+        if (cur_scene.animation)
+        {
+            fprintf(stderr, "Compiled scenes can't be animated; saving frame %d\n", options.frame);
+        }
+        if (save_compiled_scene(&cur_scene, image_file) || fclose(image_file))
+        {
+            perror("Scene compile");
+            return -1;
+        }
+        thread_pool_destroy(pool);
+        free_scene(&cur_scene);
+        return 0;
+    }
+    width = region->x1 > 0 ? region->x1 - region->x0 : res->width;
+    height = region->x1 > 0 ? region->y1 - region->y0 : res->height;
+    output = (image_output){ image_file, width, height, 0, pool };
+    if (options.video)
+    {
+        if (render_video(&cur_scene, pool, &options, image_file, &stats))
+        {
+            perror("Video save");
+            return -1;
+        }
+    }
+    else if (options.stream)
+    {
+        output.header_size = save_image_header(res->width, res->height, fileno(image_file));
+        if (output.header_size < 0 ||
+            render_streaming(&cur_scene, pool, &options.render, save_rows, &output, &stats))
+        {
+            perror("Image save");
+            return -1;
+        }
+    }
+    else if (options.farm)
+    {
+        bytes = malloc(3 * (size_t)width * height);
+        if (bytes == NULL)
+        {
+            perror("Image allocation");
+            return -1;
+        }
+        if (farm_render(&cur_scene, &options.render, &options.farm_settings, bytes))
+        {
+            fprintf(stderr, "Farm render failed\n");
+            return -1;
+        }
+        if (save_image_bytes(bytes, width, height, image_file))
+        {
+            perror("Image save");
+            return -1;
+        }
+        free(bytes);
+    }
+    else
+    {
+        image = malloc(sizeof(color) * (size_t)width * height);
+        if (image == NULL)
+        {
+            perror("Image allocation");
+            return -1;
+        }
+        if (options.render.deadline > 0)
+        {
+            options.render.progress = save_progress;
+            options.render.progress_context = &output;
+        }
+        if (options.heatmap || options.heatmap_pfm)
+        {
+            options.render.cost_out = calloc((size_t)width * height, sizeof(float));
+            if (options.render.cost_out == NULL)
+            {
+                perror("Heatmap allocation");
+                return -1;
+            }
+        }
+        render(&cur_scene, pool, &options.render, image, &stats);
+        rewind(image_file);
+        if (save_image(image, width, height, image_file, pool))
+        {
+            perror("Image save");
+            return -1;
+        }
+        free(image);
+        if (options.render.cost_out &&
+            save_heatmaps(&options, options.render.cost_out, width, height))
+        {
+            perror("Heatmap save");
+            return -1;
+        }
+        free(options.render.cost_out);
+    }
     fclose(image_file);
-    free(image);
+    thread_pool_destroy(pool);
+    free_scene(&cur_scene);
+
+    if (options.stats)
+    {
+        stats_print(&stats, stderr);
+    }
     
     return 0;
 }
@@ -0,0 +1,881 @@
+#include "mesh.h"
+#include "intersect.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+
+static intersection_function mesh_intersect;
+static occlusion_function mesh_occludes;
+static bounding_function mesh_bounds;
+
+static surface_class mesh_class = { mesh_intersect, mesh_occludes, mesh_bounds };
+
+surface_class * surface_mesh = &mesh_class;
+
+/* PLY files with more elements, or elements with more properties, than this
+   are rejected */
+#define PLY_MAX_ELEMENTS 16
+#define PLY_MAX_PROPERTIES 32
+
+static vector mesh_vertex (const triangle_mesh * mesh, int triangle, int corner)
+{
+    return mesh->vertices[mesh->indices[3 * triangle + corner]];
+}
+
+triangle_mesh * mesh_create (vector vertices[], int num_vertices,
+                             int indices[], int num_triangles)
+{
+    triangle_mesh * result = calloc(1, sizeof(triangle_mesh));
+    bounds * triangle_bounds = malloc(sizeof(bounds) * (num_triangles + 1));
+    int * leaf_indices = malloc(sizeof(int) * 3 * (num_triangles + 1));
+    bvh_node * nodes;
+    bvh tree;
+    int triangle, corner;
+
+    if (result == NULL || triangle_bounds == NULL || leaf_indices == NULL)
+    {
+        free(result);
+        free(triangle_bounds);
+        free(leaf_indices);
+        free(vertices);
+        free(indices);
+        return NULL;
+    }
+    result->vertices = vertices;
+    result->num_vertices = num_vertices;
+    result->indices = indices;
+    result->num_triangles = num_triangles;
+
+    for (triangle = 0; triangle < num_triangles; triangle++)
+    {
+        vector vertex = mesh_vertex(result, triangle, 0);
+        bounds box = { vertex, vertex };
+        for (corner = 1; corner < 3; corner++)
+        {
+            vertex = mesh_vertex(result, triangle, corner);
+            box.min = (vector){ min_float(box.min.x, vertex.x), min_float(box.min.y, vertex.y),
+                                min_float(box.min.z, vertex.z) };
+            box.max = (vector){ max_float(box.max.x, vertex.x), max_float(box.max.y, vertex.y),
+                                max_float(box.max.z, vertex.z) };
+        }
+        triangle_bounds[triangle] = bvh_pad_bounds(box);
+    }
+    if (!bvh_build(&tree, triangle_bounds, num_triangles, 1))
+    {
+        free(triangle_bounds);
+        free(leaf_indices);
+        mesh_free(result);
+        return NULL;
+    }
+    free(triangle_bounds);
+
+    /* With the triangles in the order of the tree's primitives, a leaf's
+       "first" is the index of its first triangle */
+    for (triangle = 0; triangle < num_triangles; triangle++)
+    {
+        memcpy(&leaf_indices[3 * triangle], &indices[3 * tree.primitives[triangle]],
+               3 * sizeof(int));
+    }
+    free(indices);
+    free(tree.primitives);
+    result->indices = leaf_indices;
+
+    /* The build allocates nodes for the deepest possible tree */
+    nodes = realloc(tree.nodes, sizeof(bvh_node) * (tree.num_nodes + 1));
+    result->nodes = nodes ? nodes : tree.nodes;
+    result->num_nodes = tree.num_nodes;
+    return result;
+}
+
+triangle_mesh * mesh_from_arrays (vector vertices[], int num_vertices,
+                                  int indices[], int num_triangles,
+                                  bvh_node nodes[], int num_nodes)
+{
+    triangle_mesh * result = malloc(sizeof(triangle_mesh));
+    if (result == NULL)
+    {
+        return NULL;
+    }
+    result->vertices = vertices;
+    result->num_vertices = num_vertices;
+    result->indices = indices;
+    result->num_triangles = num_triangles;
+    result->nodes = nodes;
+    result->num_nodes = num_nodes;
+    result->borrowed_arrays = true;
+    return result;
+}
+
+void mesh_free (triangle_mesh * mesh)
+{
+    if (mesh && !mesh->borrowed_arrays)
+    {
+        free(mesh->vertices);
+        free(mesh->indices);
+        free(mesh->nodes);
+    }
+    free(mesh);
+}
+
+size_t mesh_memory_size (const triangle_mesh * mesh)
+{
+    return sizeof(triangle_mesh) + sizeof(vector) * mesh->num_vertices +
+           sizeof(int) * 3 * mesh->num_triangles + sizeof(bvh_node) * mesh->num_nodes;
+}
+
+vector mesh_triangle_normal (const triangle_mesh * mesh, int triangle)
+{
+    vector vertex0 = mesh_vertex(mesh, triangle, 0);
+    return vector_normalize(cross_product(vector_sub(mesh_vertex(mesh, triangle, 1), vertex0),
+                                          vector_sub(mesh_vertex(mesh, triangle, 2), vertex0)));
+}
+
+bool mesh_hit (const triangle_mesh * mesh, vector origin, vector ray, float max_t,
+               int * triangle_out, float * t_out)
+{
+    int stack_nodes[BVH_MAX_STACK_DEPTH];
+    float stack_distances[BVH_MAX_STACK_DEPTH];
+    int top = 0;
+    int node_index = 0;
+    int left, right, triangle, closest = -1;
+    const bvh_node * node;
+    vector inverse = bvh_inverse_direction(ray);
+    triangle_ray sheared = triangle_ray_bake(ray);
+    float t, t_left, t_right, t_root, closest_t = max_t;
+    bool hit_left, hit_right;
+
+    if (mesh->num_nodes == 0 ||
+        !bvh_ray_hits_box(&mesh->nodes[0].box, origin, inverse, max_t * bvh_distance_slack,
+                          &t_root))
+    {
+        return false;
+    }
+
+    /* The near child is visited first, as in find_closest_hit in primitives.c */
+    while (true)
+    {
+        node = &mesh->nodes[node_index];
+        if (node->count > 0)
+        {
+            for (triangle = node->first; triangle < node->first + node->count; triangle++)
+            {
+                if (triangle_hit(origin, &sheared, mesh_vertex(mesh, triangle, 0),
+                                 mesh_vertex(mesh, triangle, 1),
+                                 mesh_vertex(mesh, triangle, 2), &t) &&
+                    (t < closest_t || (t == closest_t && (closest < 0 || triangle < closest))))
+                {
+                    closest_t = t;
+                    closest = triangle;
+                }
+            }
+        }
+        else
+        {
+            left = node_index + 1;
+            right = node->first;
+            hit_left = bvh_ray_hits_box(&mesh->nodes[left].box, origin, inverse,
+                                        closest_t * bvh_distance_slack, &t_left);
+            hit_right = bvh_ray_hits_box(&mesh->nodes[right].box, origin, inverse,
+                                         closest_t * bvh_distance_slack, &t_right);
+            if (hit_left && hit_right)
+            {
+                if (t_right < t_left)
+                {
+                    stack_nodes[top] = left;
+                    stack_distances[top++] = t_left;
+                    node_index = right;
+                }
+                else
+                {
+                    stack_nodes[top] = right;
+                    stack_distances[top++] = t_right;
+                    node_index = left;
+                }
+                continue;
+            }
+            else if (hit_left || hit_right)
+            {
+                node_index = hit_left ? left : right;
+                continue;
+            }
+        }
+
+        do
+        {
+            if (top == 0)
+            {
+                if (closest < 0)
+                {
+                    return false;
+                }
+                *triangle_out = closest;
+                *t_out = closest_t;
+                return true;
+            }
+            node_index = stack_nodes[--top];
+        } while (stack_distances[top] > closest_t * bvh_distance_slack);
+    }
+}
+
+bool mesh_blocks (const triangle_mesh * mesh, vector origin, vector ray, float max_distance)
+{
+    int stack[BVH_MAX_STACK_DEPTH];
+    int top = 0;
+    int triangle;
+    const bvh_node * node;
+    vector inverse = bvh_inverse_direction(ray);
+    triangle_ray sheared = triangle_ray_bake(ray);
+    float t, t_near, max_t = max_distance * bvh_distance_slack;
+
+    if (mesh->num_nodes == 0)
+    {
+        return false;
+    }
+
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        node = &mesh->nodes[stack[--top]];
+        if (!bvh_ray_hits_box(&node->box, origin, inverse, max_t, &t_near))
+        {
+            continue;
+        }
+        if (node->count > 0)
+        {
+            for (triangle = node->first; triangle < node->first + node->count; triangle++)
+            {
+                if (triangle_hit(origin, &sheared, mesh_vertex(mesh, triangle, 0),
+                                 mesh_vertex(mesh, triangle, 1),
+                                 mesh_vertex(mesh, triangle, 2), &t) &&
+                    t < max_distance)
+                {
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            stack[top++] = node->first;
+            stack[top++] = node - mesh->nodes + 1;
+        }
+    }
+    return false;
+}
+
+static bool mesh_intersect (vector origin, vector ray, void * geometry,
+                            vector * intersection_out, vector * normal_out)
+{
+    triangle_mesh * self = ((mesh *)geometry)->triangles;
+    int triangle;
+    float t;
+
+    if (!mesh_hit(self, origin, ray, INFINITY, &triangle, &t))
+    {
+        return false;
+    }
+    if (normal_out)
+    {
+        *normal_out = mesh_triangle_normal(self, triangle);
+    }
+    if (intersection_out)
+    {
+        *intersection_out = vector_add(origin, vector_multiply(t, ray));
+    }
+    return true;
+}
+
+static bool mesh_occludes (vector origin, vector ray, void * geometry, float max_distance)
+{
+    return mesh_blocks(((mesh *)geometry)->triangles, origin, ray, max_distance);
+}
+
+static bounds mesh_bounds (void * geometry)
+{
+    return ((mesh *)geometry)->triangles->nodes[0].box;
+}
+
+/* Mesh files */
+
+static void * grow (void * array, int * capacity, int count, size_t element_size)
+/*! Return "array", which has room for "*capacity" elements of element_size
+    bytes, reallocated if need be to double its capacity until it has room
+    for "count" elements, or NULL if memory runs out, freeing the array */
+{
+    int new_capacity = *capacity > 0 ? *capacity : 1024;
+    void * grown;
+
+    if (count <= *capacity)
+    {
+        return array;
+    }
+    while (new_capacity < count)
+    {
+        new_capacity *= 2;
+    }
+    grown = realloc(array, new_capacity * element_size);
+    if (grown == NULL)
+    {
+        free(array);
+        return NULL;
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+static triangle_mesh * reject (const char * filename, const char * reason,
+                               vector vertices[], int indices[])
+/*! Give up loading a mesh file, freeing what was read of it */
+{
+    fprintf(stderr, "Mesh file %s %s\n", filename, reason);
+    free(vertices);
+    free(indices);
+    errno = EINVAL;
+    return NULL;
+}
+
+static triangle_mesh * finish_mesh (const char * filename, vector vertices[], int num_vertices,
+                                    int indices[], int num_triangles)
+/*! Check the triangles read from a mesh file and make a mesh of them */
+{
+    int index;
+
+    if (num_triangles == 0)
+    {
+        return reject(filename, "has no triangles", vertices, indices);
+    }
+    for (index = 0; index < 3 * num_triangles; index++)
+    {
+        if (indices[index] < 0 || indices[index] >= num_vertices)
+        {
+            return reject(filename, "has a face with a vertex that doesn't exist",
+                          vertices, indices);
+        }
+    }
+    return mesh_create(vertices, num_vertices, indices, num_triangles);
+}
+
+static char * read_file (const char * filename, size_t * size_out)
+/*! Read a whole file into a buffer, ending it with a null character, and
+    output its size without the null character.  Return the buffer, which
+    the caller frees, or NULL with errno set on error. */
+{
+    FILE * file = fopen(filename, "rb");
+    size_t capacity = 1 << 16, size = 0;
+    char * text, * grown;
+
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    text = malloc(capacity);
+    while (text != NULL)
+    {
+        size += fread(text + size, 1, capacity - size - 1, file);
+        if (size < capacity - 1)
+        {
+            break;
+        }
+        grown = realloc(text, capacity * 2);
+        if (grown == NULL)
+        {
+            free(text);
+        }
+        text = grown;
+        capacity *= 2;
+    }
+    if (text != NULL && ferror(file))
+    {
+        free(text);
+        text = NULL;
+        errno = EIO;
+    }
+    fclose(file);
+    if (text != NULL)
+    {
+        text[size] = '\0';
+        *size_out = size;
+    }
+    return text;
+}
+
+static bool obj_keyword (const char * line, const char * keyword)
+/*! Determine if an OBJ line starts with the given keyword */
+{
+    size_t length = strlen(keyword);
+    return strncmp(line, keyword, length) == 0 && (line[length] == ' ' || line[length] == '\t');
+}
+
+static triangle_mesh * parse_obj (const char * filename, char * text)
+/*! Make a mesh of the "v" and "f" lines of an OBJ file's text.  Face
+    vertices are given as their position indices, counted from 1, or
+    backwards from the last vertex read if negative, followed by texture
+    coordinate and normal indices which are ignored. */
+{
+    vector * vertices = NULL;
+    int * indices = NULL;
+    int num_vertices = 0, vertex_capacity = 0;
+    int num_triangles = 0, index_capacity = 0;
+    int corner, first = 0, previous = 0;
+    long index;
+    float coordinates[3];
+    char * cursor = text, * end;
+
+    while (*cursor)
+    {
+        while (*cursor == ' ' || *cursor == '\t')
+        {
+            cursor++;
+        }
+        if (obj_keyword(cursor, "v"))
+        {
+            vertices = grow(vertices, &vertex_capacity, num_vertices + 1, sizeof(vector));
+            if (vertices == NULL)
+            {
+                free(indices);
+                return NULL;
+            }
+            cursor++;
+            for (corner = 0; corner < 3; corner++)
+            {
+                coordinates[corner] = strtof(cursor, &end);
+                if (end == cursor)
+                {
+                    return reject(filename, "has a vertex without three coordinates",
+                                  vertices, indices);
+                }
+                cursor = end;
+            }
+            vertices[num_vertices++] = (vector){ coordinates[0], coordinates[1], coordinates[2] };
+        }
+        else if (obj_keyword(cursor, "f"))
+        {
+            cursor++;
+            for (corner = 0; true; corner++)
+            {
+                index = strtol(cursor, &end, 10);
+                if (end == cursor)
+                {
+                    break;
+                }
+                if (index == 0)
+                {
+                    return reject(filename, "has a face with a vertex 0", vertices, indices);
+                }
+                index = index > 0 ? index - 1 : num_vertices + index;
+                /* finish_mesh rejects faces with vertices out of range */
+                index = index < INT_MAX ? index : -1;
+                while (*end && !isspace((unsigned char)*end))
+                {
+                    end++;
+                }
+                cursor = end;
+
+                /* Faces of more than three vertices are fans of triangles
+                   around their first vertex */
+                if (corner == 0)
+                {
+                    first = index;
+                }
+                else if (corner >= 2)
+                {
+                    indices = grow(indices, &index_capacity, 3 * (num_triangles + 1), sizeof(int));
+                    if (indices == NULL)
+                    {
+                        free(vertices);
+                        return NULL;
+                    }
+                    indices[3 * num_triangles] = first;
+                    indices[3 * num_triangles + 1] = previous;
+                    indices[3 * num_triangles + 2] = index;
+                    num_triangles++;
+                }
+                previous = index;
+            }
+        }
+        cursor = strchr(cursor, '\n');
+        if (cursor == NULL)
+        {
+            break;
+        }
+        cursor++;
+    }
+    return finish_mesh(filename, vertices, num_vertices, indices, num_triangles);
+}
+
+/* The types of PLY properties */
+typedef enum
+{
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64,
+    PLY_NUM_TYPES,
+} ply_type;
+
+static const struct
+{
+    const char * names[2];
+    int size;
+} ply_types[PLY_NUM_TYPES] =
+{
+    { { "char", "int8" }, 1 },
+    { { "uchar", "uint8" }, 1 },
+    { { "short", "int16" }, 2 },
+    { { "ushort", "uint16" }, 2 },
+    { { "int", "int32" }, 4 },
+    { { "uint", "uint32" }, 4 },
+    { { "float", "float32" }, 4 },
+    { { "double", "float64" }, 8 },
+};
+
+typedef struct
+{
+    char name[32];
+    ply_type type;
+    /* For a list, the type of its count, which precedes its items */
+    bool is_list;
+    ply_type count_type;
+} ply_property;
+
+typedef struct
+{
+    char name[32];
+    long count;
+    ply_property properties[PLY_MAX_PROPERTIES];
+    int num_properties;
+} ply_element;
+
+/* The binary data of a PLY file being read */
+typedef struct
+{
+    const unsigned char * cursor;
+    const unsigned char * end;
+    /* Whether the file's byte order is the reverse of the processor's */
+    bool swap;
+} ply_data;
+
+static bool parse_ply_type (const char * name, ply_type * type_out)
+{
+    int type;
+    for (type = 0; type < PLY_NUM_TYPES; type++)
+    {
+        if (strcmp(name, ply_types[type].names[0]) == 0 ||
+            strcmp(name, ply_types[type].names[1]) == 0)
+        {
+            *type_out = type;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_ply_value (ply_data * data, ply_type type, double * value_out)
+/*! Read a value of the given type, advancing past it.  Return false if the
+    data ends first. */
+{
+    unsigned char bytes[8];
+    int size = ply_types[type].size, index;
+    union
+    {
+        signed char int8;
+        unsigned char uint8;
+        short int16;
+        unsigned short uint16;
+        int int32;
+        unsigned int uint32;
+        float float32;
+        double float64;
+    } value;
+
+    if (data->end - data->cursor < size)
+    {
+        return false;
+    }
+    for (index = 0; index < size; index++)
+    {
+        bytes[index] = data->cursor[data->swap ? size - 1 - index : index];
+    }
+    data->cursor += size;
+    memcpy(&value, bytes, size);
+    switch (type)
+    {
+        case PLY_INT8: *value_out = value.int8; break;
+        case PLY_UINT8: *value_out = value.uint8; break;
+        case PLY_INT16: *value_out = value.int16; break;
+        case PLY_UINT16: *value_out = value.uint16; break;
+        case PLY_INT32: *value_out = value.int32; break;
+        case PLY_UINT32: *value_out = value.uint32; break;
+        case PLY_FLOAT32: *value_out = value.float32; break;
+        default: *value_out = value.float64; break;
+    }
+    return true;
+}
+
+static const char * parse_ply_header (char * text, ply_element elements[], int * num_elements_out,
+                                      bool * big_endian_out, char ** data_out)
+/*! Read the elements and byte order of a PLY file from its header, and
+    output where its data starts.  Return NULL, or what is wrong with the
+    header. */
+{
+    char * line = text, * next;
+    char words[5][32];
+    int num_words, num_elements = 0;
+    bool formatted = false;
+    ply_element * element;
+    ply_property * property;
+
+    while (true)
+    {
+        next = strchr(line, '\n');
+        if (next == NULL)
+        {
+            return "has no end to its header";
+        }
+        *next = '\0';
+        num_words = sscanf(line, "%31s %31s %31s %31s %31s",
+                           words[0], words[1], words[2], words[3], words[4]);
+        line = next + 1;
+        if (num_words <= 0 || strcmp(words[0], "ply") == 0 || strcmp(words[0], "comment") == 0 ||
+            strcmp(words[0], "obj_info") == 0)
+        {
+            continue;
+        }
+        if (strcmp(words[0], "end_header") == 0)
+        {
+            break;
+        }
+        if (strcmp(words[0], "format") == 0 && num_words >= 2)
+        {
+            if (strcmp(words[1], "binary_little_endian") != 0 &&
+                strcmp(words[1], "binary_big_endian") != 0)
+            {
+                return "is not binary; only binary PLY files are supported";
+            }
+            *big_endian_out = strcmp(words[1], "binary_big_endian") == 0;
+            formatted = true;
+        }
+        else if (strcmp(words[0], "element") == 0 && num_words == 3)
+        {
+            if (num_elements == PLY_MAX_ELEMENTS)
+            {
+                return "has too many elements";
+            }
+            element = &elements[num_elements++];
+            strcpy(element->name, words[1]);
+            element->count = atol(words[2]);
+            element->num_properties = 0;
+            if (element->count < 0)
+            {
+                return "has an element with a negative count";
+            }
+        }
+        else if (strcmp(words[0], "property") == 0 && num_elements > 0)
+        {
+            element = &elements[num_elements - 1];
+            if (element->num_properties == PLY_MAX_PROPERTIES)
+            {
+                return "has too many properties";
+            }
+            property = &element->properties[element->num_properties++];
+            property->is_list = strcmp(words[1], "list") == 0;
+            if (property->is_list ? num_words != 5 ||
+                                    !parse_ply_type(words[2], &property->count_type) ||
+                                    !parse_ply_type(words[3], &property->type)
+                                  : num_words != 3 || !parse_ply_type(words[1], &property->type))
+            {
+                return "has a property of unknown type";
+            }
+            strcpy(property->name, words[num_words - 1]);
+        }
+        else
+        {
+            return "has an unknown header line";
+        }
+    }
+    if (!formatted)
+    {
+        return "has no format line";
+    }
+    *num_elements_out = num_elements;
+    *data_out = line;
+    return NULL;
+}
+
+static int find_ply_property (const ply_element * element, const char * name1, const char * name2)
+/*! Return the index of the element's property with either name, or -1 */
+{
+    int index;
+    for (index = 0; index < element->num_properties; index++)
+    {
+        if (strcmp(element->properties[index].name, name1) == 0 ||
+            strcmp(element->properties[index].name, name2) == 0)
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+static triangle_mesh * parse_ply (const char * filename, char * text, size_t size)
+/*! Make a mesh of the "vertex" element's x, y and z properties and the
+    "face" element's vertex index lists of a binary PLY file's text.  Other
+    elements and properties are skipped. */
+{
+    ply_element elements[PLY_MAX_ELEMENTS];
+    ply_element * element;
+    ply_property * property;
+    ply_data data;
+    vector * vertices = NULL;
+    int * indices = NULL;
+    int num_elements, num_vertices = 0, num_triangles = 0, index_capacity = 0;
+    int element_index, property_index, axis, index;
+    int axes[3] = { -1, -1, -1 }, list = -1, first = 0, previous = 0;
+    long record, item, count;
+    double value, coordinates[3] = { 0, 0, 0 };
+    bool big_endian = false, is_vertex, is_face;
+    unsigned int byte_order = 1;
+    const char * problem;
+    char * start;
+
+    problem = parse_ply_header(text, elements, &num_elements, &big_endian, &start);
+    if (problem)
+    {
+        return reject(filename, problem, NULL, NULL);
+    }
+    data.cursor = (unsigned char *)start;
+    data.end = (unsigned char *)text + size;
+    /* The first byte of 1 is 0 on a big endian processor */
+    data.swap = big_endian != (*(unsigned char *)&byte_order == 0);
+
+    for (element_index = 0; element_index < num_elements; element_index++)
+    {
+        element = &elements[element_index];
+        is_vertex = strcmp(element->name, "vertex") == 0;
+        is_face = strcmp(element->name, "face") == 0;
+        if (is_vertex)
+        {
+            for (axis = 0; axis < 3; axis++)
+            {
+                axes[axis] = find_ply_property(element, axis == 0 ? "x" : axis == 1 ? "y" : "z",
+                                               "");
+            }
+            if (axes[0] < 0 || axes[1] < 0 || axes[2] < 0 || vertices != NULL ||
+                element->count >= INT_MAX)
+            {
+                return reject(filename, "has vertices without positions", vertices, indices);
+            }
+            num_vertices = element->count;
+            vertices = malloc(sizeof(vector) * (num_vertices + 1));
+            if (vertices == NULL)
+            {
+                free(indices);
+                return NULL;
+            }
+        }
+        else if (is_face)
+        {
+            list = find_ply_property(element, "vertex_indices", "vertex_index");
+            if (list < 0 || !element->properties[list].is_list)
+            {
+                return reject(filename, "has faces without vertex index lists", vertices, indices);
+            }
+        }
+
+        for (record = 0; record < element->count; record++)
+        {
+            for (property_index = 0; property_index < element->num_properties; property_index++)
+            {
+                property = &element->properties[property_index];
+                if (!property->is_list)
+                {
+                    if (!read_ply_value(&data, property->type, &value))
+                    {
+                        return reject(filename, "is truncated", vertices, indices);
+                    }
+                    for (axis = 0; axis < 3 && is_vertex; axis++)
+                    {
+                        coordinates[axis] = property_index == axes[axis] ? value
+                                                                         : coordinates[axis];
+                    }
+                    continue;
+                }
+
+                if (!read_ply_value(&data, property->count_type, &value))
+                {
+                    return reject(filename, "is truncated", vertices, indices);
+                }
+                count = (long)value;
+                for (item = 0; item < count; item++)
+                {
+                    if (!read_ply_value(&data, property->type, &value))
+                    {
+                        return reject(filename, "is truncated", vertices, indices);
+                    }
+                    if (!is_face || property_index != list)
+                    {
+                        continue;
+                    }
+                    /* Faces of more than three vertices are fans of
+                       triangles around their first vertex */
+                    index = (int)value;
+                    if (item == 0)
+                    {
+                        first = index;
+                    }
+                    else if (item >= 2)
+                    {
+                        indices = grow(indices, &index_capacity, 3 * (num_triangles + 1),
+                                       sizeof(int));
+                        if (indices == NULL)
+                        {
+                            free(vertices);
+                            return NULL;
+                        }
+                        indices[3 * num_triangles] = first;
+                        indices[3 * num_triangles + 1] = previous;
+                        indices[3 * num_triangles + 2] = index;
+                        num_triangles++;
+                    }
+                    previous = index;
+                }
+            }
+            if (is_vertex)
+            {
+                vertices[record] = (vector){ coordinates[0], coordinates[1], coordinates[2] };
+            }
+        }
+    }
+    return finish_mesh(filename, vertices, num_vertices, indices, num_triangles);
+}
+
+triangle_mesh * mesh_load (const char * filename)
+{
+    triangle_mesh * result;
+    size_t size;
+    char * text = read_file(filename, &size);
+
+    if (text == NULL)
+    {
+        fprintf(stderr, "Unable to read mesh file %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+    if (strncmp(text, "ply\n", 4) == 0 || strncmp(text, "ply\r\n", 5) == 0)
+    {
+        result = parse_ply(filename, text, size);
+    }
+    else
+    {
+        result = parse_obj(filename, text);
+    }
+    free(text);
+    return result;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "surface.h"
+#include "bvh.h"
+#include "vector.h"
+
+/* This module holds triangle meshes, such as scanned models, and traces
+   rays through them.
+
+   A mesh is a single surface, with one material for all of its triangles.
+   Its vertices are stored once, in one array, and each triangle is three
+   indices into that array, so a triangle costs 12 bytes plus its share of
+   the vertices, about 6 bytes in a closed mesh, where a quad surface costs
+   72.  The mesh has a BVH of its own over its triangles, built with
+   bvh_build, and the scene's BVH sees the whole mesh as one primitive with
+   the mesh's box.  The triangles are stored in the order of the leaves of
+   the mesh's BVH, so each leaf refers to a run of triangles directly.
+
+   Rays are tested against the triangles with the watertight test of
+   intersect.h: a ray through an edge or vertex shared by several triangles
+   always hits one of them, so closed meshes have no cracks for rays to slip
+   through.
+
+   Meshes are loaded from Wavefront OBJ files, of which only the vertex
+   positions and faces are used, and from binary PLY files with vertex
+   positions and face vertex index lists.  Faces with more than three
+   vertices are split into fans of triangles.
+*/
+
+typedef struct triangle_mesh
+{
+    vector * vertices;
+    int num_vertices;
+    /* Three indices into the vertex array for each triangle, in the order
+       of the leaves of the BVH */
+    int * indices;
+    int num_triangles;
+    /* BVH over the triangles.  The "first" member of a leaf node is the
+       index of the leaf's first triangle. */
+    bvh_node * nodes;
+    int num_nodes;
+    /* Whether the arrays above belong to someone else, such as a mapped
+       compiled scene, and aren't freed with the mesh */
+    bool borrowed_arrays;
+} triangle_mesh;
+
+/*! Make a mesh of the given vertices and triangles, given as three vertex
+    indices each, taking over both arrays, which must have been allocated
+    with malloc, and build its BVH.  The triangles are reordered.  On
+    failure, free both arrays and return NULL. */
+triangle_mesh * mesh_create (vector vertices[], int num_vertices,
+                             int indices[], int num_triangles);
+
+/*! Make a mesh that uses the arrays of a mesh made by mesh_create in
+    place.  They must outlive the result, and they are not freed with it.
+    Return NULL if memory could not be allocated. */
+triangle_mesh * mesh_from_arrays (vector vertices[], int num_vertices,
+                                  int indices[], int num_triangles,
+                                  bvh_node nodes[], int num_nodes);
+
+/*! Load a mesh from an OBJ or binary PLY file, telling them apart by their
+    contents.  Return NULL, with errno set and the reason printed, if the
+    file can't be read or isn't a mesh of at least one triangle. */
+triangle_mesh * mesh_load (const char * filename);
+
+/*! Release a mesh returned by the functions above */
+void mesh_free (triangle_mesh * mesh);
+
+/*! Find the closest triangle of a mesh hit by a ray, at a ray parameter of
+    at most max_t, as solve_linear in intersect.h measures it.  Ties go to the
+    first triangle in the mesh's order, so the same triangle is found however
+    the search is bounded.  Output the triangle's index and the parameter of
+    the intersection, or return false if there is none. */
+bool mesh_hit (const triangle_mesh * mesh, vector origin, vector ray, float max_t,
+               int * triangle_out, float * t_out);
+
+/*! Determine if a ray with the given origin and normalized direction hits
+    any triangle of a mesh at a distance less than max_distance */
+bool mesh_blocks (const triangle_mesh * mesh, vector origin, vector ray, float max_distance);
+
+/*! Return the unit normal of a triangle of a mesh, on the side from which
+    its vertices run counterclockwise */
+vector mesh_triangle_normal (const triangle_mesh * mesh, int triangle);
+
+/*! Return the number of bytes of memory a mesh's arrays take up */
+size_t mesh_memory_size (const triangle_mesh * mesh);
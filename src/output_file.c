@@ -1,6 +1,10 @@
 #include "output_file.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <math.h>
 
 unsigned char convert_to_8_bit (float float_val)
 {
@@ -16,28 +20,383 @@ unsigned char convert_to_8_bit (float float_val)
     return value;
 }
 
-int save_image (color image[], int width, int height, FILE * file)
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/* The vector conversions multiply by 256 and truncate toward zero as
+   convert_to_8_bit does.  Values too large for an int, infinities and NaNs
+   become INT_MIN there and in the scalar conversion on x86, giving 0 either
+   way, and the saturating packs from 32 to 16 to 8 bits clamp the rest to
+   0 to 255 just like its comparisons. */
+
+static void quantize_sse (const float values[], size_t count, unsigned char bytes_out[])
+/*! Convert "count", a multiple of 16, values 16 at a time */
+{
+    const __m128 scale = _mm_set1_ps((float)0x100);
+    __m128i a, b, c, d;
+    size_t index;
+
+    for (index = 0; index < count; index += 16)
+    {
+        a = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(&values[index]), scale));
+        b = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(&values[index + 4]), scale));
+        c = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(&values[index + 8]), scale));
+        d = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(&values[index + 12]), scale));
+        _mm_storeu_si128((__m128i *)&bytes_out[index],
+                         _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void quantize_avx2 (const float values[], size_t count, unsigned char bytes_out[])
+/*! Convert "count", a multiple of 32, values 32 at a time */
+{
+    const __m256 scale = _mm256_set1_ps((float)0x100);
+    /* The packs work within each 128 bit half, which leaves the groups of 4
+       bytes in the order 0 2 4 6 1 3 5 7 */
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i a, b, c, d;
+    size_t index;
+
+    for (index = 0; index < count; index += 32)
+    {
+        a = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_loadu_ps(&values[index]), scale));
+        b = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_loadu_ps(&values[index + 8]), scale));
+        c = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_loadu_ps(&values[index + 16]), scale));
+        d = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_loadu_ps(&values[index + 24]), scale));
+        _mm256_storeu_si256((__m256i *)&bytes_out[index],
+                            _mm256_permutevar8x32_epi32(
+                                _mm256_packus_epi16(_mm256_packs_epi32(a, b),
+                                                    _mm256_packs_epi32(c, d)),
+                                order));
+    }
+    /* See PACKET_LEAVE in packet.c */
+    _mm256_zeroupper();
+}
+
+static size_t quantize_vector (const float values[], size_t count, unsigned char bytes_out[])
+/*! Convert as many of the values as the widest vector code can, returning
+    how many that is */
+{
+    size_t converted;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        converted = count - count % 32;
+        quantize_avx2(values, converted, bytes_out);
+    }
+    else
+    {
+        converted = count - count % 16;
+        quantize_sse(values, converted, bytes_out);
+    }
+    return converted;
+}
+
+#else
+
+static size_t quantize_vector (const float values[], size_t count, unsigned char bytes_out[])
+{
+    return 0;
+}
+
+#endif
+
+void quantize_colors (const color colors[], size_t count, unsigned char bytes_out[])
+{
+    /* The components of an array of colors are an array of floats */
+    const float * values = &colors[0].r;
+    size_t index = quantize_vector(values, count * 3, bytes_out);
+
+    for (; index < count * 3; index++)
+    {
+        bytes_out[index] = convert_to_8_bit(values[index]);
+    }
+}
+
+/* Rows are quantized in parallel in tasks of this many rows */
+#define QUANTIZE_ROWS 32
+
+typedef struct
+{
+    const color * image;
+    unsigned char * bytes;
+    int width;
+    int height;
+} quantize_job;
+
+static void quantize_task (void * context, int task, int worker)
+{
+    quantize_job * job = context;
+    int first_row = task * QUANTIZE_ROWS;
+    int num_rows = job->height - first_row < QUANTIZE_ROWS ? job->height - first_row : QUANTIZE_ROWS;
+    size_t first = (size_t)first_row * job->width;
+
+    quantize_colors(&job->image[first], (size_t)num_rows * job->width, &job->bytes[first * 3]);
+}
+
+static unsigned char * quantize_image (color image[], int width, int height, thread_pool * pool)
+/*! Return the bytes of an image, 3 per pixel, quantizing its rows in
+    parallel with the workers of "pool" if it isn't NULL, or return NULL if
+    memory runs out.  The caller frees the bytes. */
+{
+    quantize_job job = { image, malloc((size_t)width * height * 3), width, height };
+
+    if (job.bytes == NULL)
+    {
+        return NULL;
+    }
+    if (pool)
+    {
+        thread_pool_run(pool, quantize_task, &job,
+                        (height + QUANTIZE_ROWS - 1) / QUANTIZE_ROWS);
+    }
+    else
+    {
+        quantize_colors(image, (size_t)width * height, job.bytes);
+    }
+    return job.bytes;
+}
+
+int save_image_bytes (const unsigned char bytes[], int width, int height, FILE * file)
 {
     const int max_value = 0xff;
-    unsigned char output[3];
-    color pixel_color;
-    int x, y;
+    size_t size = (size_t)width * height * 3;
 
     fprintf(file, "P6\n");
     fprintf(file, "%d %d\n", width, height);
     fprintf(file, "%d\n", max_value);
+    return fwrite(bytes, 1, size, file) == size ? 0 : -1;
+}
+
+int save_image (color image[], int width, int height, FILE * file, thread_pool * pool)
+{
+    unsigned char * bytes = quantize_image(image, width, height, pool);
+    int result;
+
+    if (bytes == NULL)
+    {
+        return -1;
+    }
+    result = save_image_bytes(bytes, width, height, file);
+    free(bytes);
+    return result;
+}
+
+int save_pfm (const float values[], int width, int height, FILE * file)
+{
+    const unsigned int one = 1;
+    int y;
+
+    /* A negative scale marks little endian floats */
+    if (fprintf(file, "Pf\n%d %d\n%s\n", width, height,
+                *(const unsigned char *)&one ? "-1.0" : "1.0") < 0)
+    {
+        return -1;
+    }
+    for (y = height - 1; y >= 0; y--)
+    {
+        if (fwrite(&values[(size_t)y * width], sizeof(float), width, file) != (size_t)width)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The colors of the heatmap scale, evenly spaced from 0 to the largest value */
+static const color heatmap_colors[] =
+    { { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 } };
+
+#define HEATMAP_STEPS (sizeof(heatmap_colors) / sizeof(heatmap_colors[0]) - 1)
+
+static color heatmap_color (float value, float max)
+/*! The color of "value" on the scale up to "max" */
+{
+    float position = max > 0 ? logf(1.0f + value) / logf(1.0f + max) * HEATMAP_STEPS : 0;
+    int step = position;
+    const color * below, * above;
+    float fraction;
+
+    if (step >= (int)HEATMAP_STEPS)
+    {
+        return heatmap_colors[HEATMAP_STEPS];
+    }
+    fraction = position - step;
+    below = &heatmap_colors[step];
+    above = &heatmap_colors[step + 1];
+    return (color){ below->r + fraction * (above->r - below->r),
+                    below->g + fraction * (above->g - below->g),
+                    below->b + fraction * (above->b - below->b) };
+}
+
+int save_heatmap (const float values[], int width, int height, const char * unit, FILE * file)
+{
+    size_t num_pixels = (size_t)width * height, index;
+    color * colors = malloc(sizeof(color) * num_pixels);
+    unsigned char * bytes = malloc(num_pixels * 3);
+    float max = 0;
+    int result = -1;
+
+    for (index = 0; index < num_pixels; index++)
+    {
+        max = values[index] > max ? values[index] : max;
+    }
+    if (colors && bytes)
+    {
+        for (index = 0; index < num_pixels; index++)
+        {
+            colors[index] = heatmap_color(values[index], max);
+        }
+        quantize_colors(colors, num_pixels, bytes);
+        result = fprintf(file, "P6\n# 0 to %.0f %s per pixel, on a logarithmic scale\n"
+                               "%d %d\n255\n", max, unit, width, height) >= 0 &&
+                 fwrite(bytes, 1, num_pixels * 3, file) == num_pixels * 3
+                 ? 0 : -1;
+    }
+    free(colors);
+    free(bytes);
+    return result;
+}
+
+int save_video_header (video_format format, int width, int height, int frame_rate, FILE * file)
+{
+    if (format == VIDEO_Y4M)
+    {
+        /* Progressive frames of square pixels, with chroma sited between
+           the pixels of each 2 by 2 block as in JPEG */
+        return fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                       width, height, frame_rate) < 0 ? -1 : 0;
+    }
+    /* PAM has no stream header; every frame is a whole image */
+    return 0;
+}
+
+void convert_to_ycbcr (const unsigned char rgb[], int width, int height,
+                       unsigned char y_out[], unsigned char cb_out[], unsigned char cr_out[])
+{
+    int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+    int x, y, dx, dy, r, g, b, count;
+    const unsigned char * pixel;
 
     for (y = 0; y < height; y++)
     {
         for (x = 0; x < width; x++)
         {
-            pixel_color = image[y * width + x];
-            output[0] = convert_to_8_bit(pixel_color.r);
-            output[1] = convert_to_8_bit(pixel_color.g);
-            output[2] = convert_to_8_bit(pixel_color.b);
-            
-            fwrite(output, 1, 3, file);
+            pixel = &rgb[((size_t)y * width + x) * 3];
+            y_out[(size_t)y * width + x] =
+                ((66 * pixel[0] + 129 * pixel[1] + 25 * pixel[2] + 128) >> 8) + 16;
         }
     }
+    for (y = 0; y < chroma_height; y++)
+    {
+        for (x = 0; x < chroma_width; x++)
+        {
+            /* The average of the block, which is cut short at an odd edge */
+            r = g = b = count = 0;
+            for (dy = 0; dy < 2 && 2 * y + dy < height; dy++)
+            {
+                for (dx = 0; dx < 2 && 2 * x + dx < width; dx++)
+                {
+                    pixel = &rgb[((size_t)(2 * y + dy) * width + 2 * x + dx) * 3];
+                    r += pixel[0];
+                    g += pixel[1];
+                    b += pixel[2];
+                    count++;
+                }
+            }
+            r = (r + count / 2) / count;
+            g = (g + count / 2) / count;
+            b = (b + count / 2) / count;
+            /* Shifts of negative numbers are left to the compiler, so the
+               offset is added first */
+            cb_out[(size_t)y * chroma_width + x] =
+                (-38 * r - 74 * g + 112 * b + 128 + (128 << 8)) >> 8;
+            cr_out[(size_t)y * chroma_width + x] =
+                (112 * r - 94 * g - 18 * b + 128 + (128 << 8)) >> 8;
+        }
+    }
+}
+
+int save_video_frame (video_format format, color image[], int width, int height, FILE * file,
+                      thread_pool * pool)
+{
+    size_t size = (size_t)width * height * 3;
+    size_t chroma_size = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    unsigned char * bytes = quantize_image(image, width, height, pool);
+    unsigned char * planes = NULL;
+    bool written;
+
+    if (bytes == NULL)
+    {
+        return -1;
+    }
+    if (format == VIDEO_PAM)
+    {
+        written = fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 3\nMAXVAL 255\n"
+                                "TUPLTYPE RGB\nENDHDR\n", width, height) >= 0 &&
+                  fwrite(bytes, 1, size, file) == size;
+    }
+    else
+    {
+        size = (size_t)width * height + 2 * chroma_size;
+        planes = malloc(size);
+        written = planes != NULL;
+        if (written)
+        {
+            convert_to_ycbcr(bytes, width, height, planes, planes + (size_t)width * height,
+                             planes + (size_t)width * height + chroma_size);
+            written = fputs("FRAME\n", file) >= 0 && fwrite(planes, 1, size, file) == size;
+        }
+    }
+    free(bytes);
+    free(planes);
+    /* A reader such as an encoder on a pipe gets each frame as it is done */
+    return written && fflush(file) == 0 ? 0 : -1;
+}
+
+static int write_all (int fd, const unsigned char * bytes, size_t size, off_t offset)
+/*! pwrite all of "size" bytes, which may take several calls */
+{
+    ssize_t written;
+
+    while (size > 0)
+    {
+        written = pwrite(fd, bytes, size, offset);
+        if (written < 0)
+        {
+            return -1;
+        }
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
     return 0;
 }
+
+long save_image_header (int width, int height, int fd)
+{
+    char header[64];
+    int size = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, height, 0xff);
+
+    return write_all(fd, (unsigned char *)header, size, 0) ? -1 : size;
+}
+
+int save_image_rows (const color rows[], int width, int first_row, int num_rows,
+                     int fd, long header_size)
+{
+    size_t num_pixels = (size_t)width * num_rows;
+    unsigned char * output = malloc(num_pixels * 3);
+    int result;
+
+    if (output == NULL)
+    {
+        return -1;
+    }
+    quantize_colors(rows, num_pixels, output);
+    result = write_all(fd, output, num_pixels * 3, header_size + (off_t)first_row * width * 3);
+    free(output);
+    return result;
+}
@@ -1,7 +1,82 @@
 #pragma once
 
 #include "color.h"
+#include "thread_pool.h"
 
 #include <stdio.h>
+#include <stddef.h>
 
-int save_image (color image[], int width, int height, FILE * file);
+/* The formats of a stream of video frames.  Both are uncompressed, for
+   piping to an encoder.
+
+   A YUV4MPEG2 (Y4M) stream has a header giving the size and frame rate,
+   then each frame's Y, Cb and Cr planes after a "FRAME" line.  The colors
+   are converted with the BT.601 coefficients to the limited range, Y from 16
+   to 235, and the chroma planes have a sample per 2 by 2 block of pixels
+   (4:2:0), the average of the block.
+
+   A PAM stream is a series of whole PAM images of 8 bit RGB pixels, with
+   exactly the bytes of a PPM image after each header. */
+typedef enum
+{
+    VIDEO_Y4M,
+    VIDEO_PAM
+} video_format;
+
+/*! Convert a color component from 0 to 1 to a byte from 0 to 255, clamping
+    it to that range */
+unsigned char convert_to_8_bit (float float_val);
+
+/*! Convert "count" colors to bytes, 3 per color, as convert_to_8_bit does.
+    This uses SSE or AVX2 instructions where the processor has them. */
+void quantize_colors (const color colors[], size_t count, unsigned char bytes_out[]);
+
+/*! Save an image as a binary PPM file, quantizing its rows in parallel with
+    the workers of "pool" if it isn't NULL, and writing all of its pixels
+    with a single fwrite.  Return 0, or -1 if memory runs out or writing
+    fails. */
+int save_image (color image[], int width, int height, FILE * file, thread_pool * pool);
+
+/*! Save an image already quantized to 8 bit RGB, 3 bytes per pixel, as a
+    binary PPM file.  Return 0, or -1 if writing fails. */
+int save_image_bytes (const unsigned char bytes[], int width, int height, FILE * file);
+
+/*! Save values, "width" by "height" of them stored from the top row of the
+    image down, as a greyscale PFM image of 32 bit floats, which lists the
+    rows from the bottom up.  Return 0, or -1 if writing fails. */
+int save_pfm (const float values[], int width, int height, FILE * file);
+
+/*! Save values, stored as save_pfm takes them, as a binary PPM image on a
+    false color scale: from black for 0 through blue, cyan, green and
+    yellow to red for the largest, in proportion to the logarithm of 1 plus
+    the value, so that values a hundred times apart still stand apart.  A
+    comment in the header gives the largest value, in "unit".  Return 0, or
+    -1 if memory runs out or writing fails. */
+int save_heatmap (const float values[], int width, int height, const char * unit, FILE * file);
+
+/*! Write the header of a PPM image of the given size to the start of the file
+    open as "fd", returning its size in bytes, or -1 if writing fails */
+long save_image_header (int width, int height, int fd);
+
+/*! Write "num_rows" rows of an image "width" pixels wide, starting at row
+    "first_row", to their place in the PPM file open as "fd", whose header is
+    "header_size" bytes long.  Rows are written with pwrite, so several threads
+    can write different rows at once.  Return 0, or -1 if writing fails. */
+int save_image_rows (const color rows[], int width, int first_row, int num_rows,
+                     int fd, long header_size);
+
+/*! Write the header of a video stream of frames of the given size, shown
+    "frame_rate" frames a second.  Return 0, or -1 if writing fails. */
+int save_video_header (video_format format, int width, int height, int frame_rate, FILE * file);
+
+/*! Append a frame to a video stream, quantizing it as save_image does, and
+    flush it to the file.  Return 0, or -1 if memory runs out or writing
+    fails. */
+int save_video_frame (video_format format, color image[], int width, int height, FILE * file,
+                      thread_pool * pool);
+
+/*! Convert 8 bit RGB pixels, 3 bytes each, to the Y, Cb and Cr planes of
+    a Y4M frame: Y "width" by "height", and Cb and Cr half that in each
+    direction, rounded up */
+void convert_to_ycbcr (const unsigned char rgb[], int width, int height,
+                       unsigned char y_out[], unsigned char cb_out[], unsigned char cr_out[]);
@@ -0,0 +1,107 @@
+#include "packet.h"
+#include "intersect.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "instance.h"
+#include "stats.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/* Packets of 4 rays, with the SSE instructions every x86-64 processor has */
+#define PACKET_WIDTH 4
+#define PACKET(name) name##_4
+#define PACKET_TARGET
+#define PACKET_SQRT(v) ((floats)_mm_sqrt_ps((__m128)(v)))
+#define PACKET_BITS(mask) _mm_movemask_ps((__m128)(mask))
+#define PACKET_LEAVE()
+#include "packet_template.h"
+#undef PACKET_WIDTH
+#undef PACKET
+#undef PACKET_TARGET
+#undef PACKET_SQRT
+#undef PACKET_BITS
+#undef PACKET_LEAVE
+
+/* Packets of 8 rays, compiled for AVX2 and only run where it is supported */
+#define PACKET_WIDTH 8
+#define PACKET(name) name##_8
+#define PACKET_TARGET __attribute__((target("avx2")))
+#define PACKET_SQRT(v) ((floats)_mm256_sqrt_ps((__m256)(v)))
+#define PACKET_BITS(mask) _mm256_movemask_ps((__m256)(mask))
+/* GCC doesn't clear the upper halves of the AVX registers on leaving a
+   function compiled for another target, and leaving them dirty slows down
+   every SSE instruction that follows, so they are cleared explicitly */
+#define PACKET_LEAVE() _mm256_zeroupper()
+#include "packet_template.h"
+#undef PACKET_WIDTH
+#undef PACKET
+#undef PACKET_TARGET
+#undef PACKET_SQRT
+#undef PACKET_BITS
+#undef PACKET_LEAVE
+
+int packet_width_supported (void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? 8 : 4;
+}
+
+const primitive_kernels * packet_primitive_kernels (int width)
+{
+    return width == 8 ? &primitive_kernels_8 : width == 4 ? &primitive_kernels_4 : NULL;
+}
+
+void packet_hit_surfaces (primitives * primitives, int width, vector origin,
+                          const vector rays[], int count, surface * hits_out[],
+                          vector intersections_out[], vector normals_out[])
+{
+    int first, size;
+
+    for (first = 0; first < count; first += width)
+    {
+        size = count - first < width ? count - first : width;
+        if (width == 8)
+        {
+            hit_surfaces_8(primitives, origin, rays + first, size, hits_out + first,
+                           intersections_out + first, normals_out + first);
+        }
+        else
+        {
+            hit_surfaces_4(primitives, origin, rays + first, size, hits_out + first,
+                           intersections_out + first, normals_out + first);
+        }
+    }
+}
+
+#else
+
+/* Without vector instructions to use, rays are traced one at a time */
+
+int packet_width_supported (void)
+{
+    return 1;
+}
+
+const primitive_kernels * packet_primitive_kernels (int width)
+{
+    return NULL;
+}
+
+void packet_hit_surfaces (primitives * primitives, int width, vector origin,
+                          const vector rays[], int count, surface * hits_out[],
+                          vector intersections_out[], vector normals_out[])
+{
+    int index;
+    for (index = 0; index < count; index++)
+    {
+        hits_out[index] = primitives_hit_surface(primitives, origin, rays[index],
+                                                 &intersections_out[index], &normals_out[index]);
+    }
+}
+
+#endif
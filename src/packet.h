@@ -0,0 +1,50 @@
+#pragma once
+
+#include "surface.h"
+#include "primitives.h"
+#include "vector.h"
+
+/* This module holds the ray tracer's vector code, which works 4 elements at
+   a time with SSE instructions, or 8 with AVX2 where the processor supports
+   it.  It traces packets of rays that share an origin, such as the camera
+   rays of neighboring pixels, together, and it tests single rays against
+   several primitives at a time.
+
+   Rays from neighboring pixels take nearly the same path through the BVH, so
+   a packet visits each node once for all of its rays, testing the node's box
+   and the primitives of a leaf against every ray with one sequence of vector
+   instructions.  Rays that miss a box are masked out of the tests below it,
+   and the packet carries on while any of its rays remains.
+
+   Each ray of a packet goes through exactly the same arithmetic as when it is
+   traced alone with primitives_hit_surface, so it finds the same surface and
+   the same intersection point.  Only the closest hit is found this way;
+   reflected, refracted and shadow rays go their separate ways and are traced
+   one at a time.
+
+   Those rays are still tested against the primitives of a BVH leaf a group
+   at a time, with the kernels returned by packet_primitive_kernels, which
+   primitives.c uses for every search through its arrays.  Each vector
+   element holds a different primitive there, and the hits are reduced to
+   the closest one, or to the first one blocking a shadow ray.
+*/
+
+/* The widest packet supported by any processor */
+#define PACKET_MAX_WIDTH 8
+
+/*! Return the widest packet the processor supports: 8 or 4 */
+int packet_width_supported (void);
+
+/*! Return the kernels for testing one ray against "width" primitives at a
+    time (4 or 8, at most what packet_width_supported returns), or NULL for
+    a width of 1 */
+const primitive_kernels * packet_primitive_kernels (int width);
+
+/*! Find the closest surface hit by each of "count" rays with the given origin
+    and directions, as primitives_hit_surface does, tracing them as packets of
+    "width" rays (4 or 8, at most what packet_width_supported returns).  For
+    ray i, store the surface hit, or NULL, to hits_out[i], and if there is one,
+    the intersection and normal to intersections_out[i] and normals_out[i]. */
+void packet_hit_surfaces (primitives * primitives, int width, vector origin,
+                          const vector rays[], int count, surface * hits_out[],
+                          vector intersections_out[], vector normals_out[]);
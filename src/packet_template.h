@@ -0,0 +1,1054 @@
+/* Packet tracing for one packet width.  packet.c includes this file once for
+   each width it supports, after defining:
+
+   PACKET_WIDTH      the number of rays in a packet
+   PACKET(name)      the name "name" is given for this width
+   PACKET_TARGET     attributes enabling the instruction set for this width
+   PACKET_SQRT(v)    the square roots of the elements of a "floats" vector
+   PACKET_BITS(mask) a bit for each element of an "ints" mask, set if it is
+   PACKET_LEAVE()    a statement to run before returning to scalar code
+
+   Everything here works on vectors holding one value per ray of a packet.
+   Comparisons produce "ints" masks with every bit of an element set where
+   the comparison holds.  Each calculation mirrors the one in intersect.h and
+   primitives.c that it replaces, operation for operation, with the values
+   that don't depend on the ray calculated once as scalars.  That is what makes
+   the results the same as when the rays are traced alone.
+*/
+
+#define PACKET_ANY(mask) (PACKET_BITS(mask) != 0)
+#define floats PACKET(floats)
+#define ints PACKET(ints)
+#define vectors PACKET(vectors)
+#define packet_query PACKET(packet_query)
+
+typedef float floats __attribute__((vector_size(PACKET_WIDTH * sizeof(float))));
+typedef int ints __attribute__((vector_size(PACKET_WIDTH * sizeof(int))));
+
+typedef struct
+{
+    floats x;
+    floats y;
+    floats z;
+} vectors;
+
+/* The state of a closest hit search for a packet, as hit_query in primitives.c */
+typedef struct
+{
+    vectors ray;
+    vectors unit_ray;
+    vectors inverse;
+    floats ray_length;
+    floats closest_distance;
+    floats max_t;
+    ints closest;
+    vectors intersection;
+} packet_query;
+
+static __inline PACKET_TARGET floats PACKET(splat) (float value)
+{
+    floats result;
+    int lane;
+    for (lane = 0; lane < PACKET_WIDTH; lane++)
+    {
+        result[lane] = value;
+    }
+    return result;
+}
+
+static __inline PACKET_TARGET ints PACKET(splat_int) (int value)
+{
+    ints result;
+    int lane;
+    for (lane = 0; lane < PACKET_WIDTH; lane++)
+    {
+        result[lane] = value;
+    }
+    return result;
+}
+
+static __inline PACKET_TARGET floats PACKET(select) (ints mask, floats a, floats b)
+/* Choose the elements of a where the mask is set and of b elsewhere */
+{
+    return (floats)(((ints)a & mask) | ((ints)b & ~mask));
+}
+
+static __inline PACKET_TARGET ints PACKET(select_int) (ints mask, ints a, ints b)
+{
+    return (a & mask) | (b & ~mask);
+}
+
+static __inline PACKET_TARGET vectors PACKET(select_vectors) (ints mask, vectors a, vectors b)
+{
+    return (vectors){ PACKET(select)(mask, a.x, b.x), PACKET(select)(mask, a.y, b.y),
+                      PACKET(select)(mask, a.z, b.z) };
+}
+
+static __inline PACKET_TARGET floats PACKET(min) (floats a, floats b)
+{
+    return PACKET(select)(a < b, a, b);
+}
+
+static __inline PACKET_TARGET floats PACKET(max) (floats a, floats b)
+{
+    return PACKET(select)(a > b, a, b);
+}
+
+static __inline PACKET_TARGET floats PACKET(abs) (floats a)
+{
+    return (floats)((ints)a & PACKET(splat_int)(0x7fffffff));
+}
+
+static __inline PACKET_TARGET floats PACKET(dot) (vectors a, vector b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static __inline PACKET_TARGET floats PACKET(dot_vectors) (vectors a, vectors b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static __inline PACKET_TARGET vectors PACKET(point) (vector origin, floats t, vectors direction)
+/* origin + t direction, as vector_add(origin, vector_multiply(t, direction)) */
+{
+    return (vectors){ origin.x + t * direction.x, origin.y + t * direction.y,
+                      origin.z + t * direction.z };
+}
+
+static __inline PACKET_TARGET floats PACKET(distance) (vector origin, vectors point)
+/* As vector_distance(origin, point) */
+{
+    floats dx = origin.x - point.x;
+    floats dy = origin.y - point.y;
+    floats dz = origin.z - point.z;
+    return PACKET_SQRT(dx * dx + dy * dy + dz * dz);
+}
+
+static __inline PACKET_TARGET ints PACKET(hits_box) (const bounds * box, vector origin,
+                                                     packet_query * query, floats * t_out)
+/* As bvh_ray_hits_box, for every ray of the packet */
+{
+    floats t0, t1, t_near, t_far;
+
+    t0 = (box->min.x - origin.x) * query->inverse.x;
+    t1 = (box->max.x - origin.x) * query->inverse.x;
+    t_near = PACKET(min)(t0, t1);
+    t_far = PACKET(max)(t0, t1);
+    t0 = (box->min.y - origin.y) * query->inverse.y;
+    t1 = (box->max.y - origin.y) * query->inverse.y;
+    t_near = PACKET(max)(t_near, PACKET(min)(t0, t1));
+    t_far = PACKET(min)(t_far, PACKET(max)(t0, t1));
+    t0 = (box->min.z - origin.z) * query->inverse.z;
+    t1 = (box->max.z - origin.z) * query->inverse.z;
+    t_near = PACKET(max)(t_near, PACKET(min)(t0, t1));
+    t_far = PACKET(min)(t_far, PACKET(max)(t0, t1));
+
+    *t_out = t_near;
+    return (t_far >= PACKET(max)(t_near, PACKET(splat)(.0f))) & (t_near <= query->max_t);
+}
+
+static __inline PACKET_TARGET void PACKET(record_hit) (packet_query * query, ints mask,
+                                                       int surface, floats distance,
+                                                       vectors intersection)
+/* As record_hit in primitives.c, for the rays of the packet in the mask */
+{
+    ints index = PACKET(splat_int)(surface);
+    ints closer = mask & ((distance < query->closest_distance) |
+                          ((distance == query->closest_distance) & (index < query->closest)));
+
+    query->closest_distance = PACKET(select)(closer, distance, query->closest_distance);
+    query->closest = PACKET(select_int)(closer, index, query->closest);
+    query->intersection = PACKET(select_vectors)(closer, intersection, query->intersection);
+    query->max_t = PACKET(select)(closer, distance / query->ray_length * bvh_distance_slack,
+                                  query->max_t);
+}
+
+static __inline PACKET_TARGET ints PACKET(solve_linear) (vector origin, vectors ray,
+                                                         vector plane_point, vector plane_normal,
+                                                         vectors * intersection_out)
+/* As solve_linear in intersect.h */
+{
+    float numerator = dot_product(vector_sub(plane_point, origin), plane_normal);
+    floats t = numerator / PACKET(dot)(ray, plane_normal);
+    *intersection_out = PACKET(point)(origin, t, ray);
+    return ~(t < f_min);
+}
+
+static PACKET_TARGET void PACKET(hit_spheres) (sphere_array * spheres, int first, int end,
+                                               vector origin, packet_query * query, ints mask)
+{
+    vector relative_origin;
+    floats k, determinant, root, base, delta, t;
+    float c;
+    ints near_root, far_root, hit;
+    int index;
+
+    stats_count_many(hit_tests[CLASS_SPHERES],
+                     (end - first) * __builtin_popcount(PACKET_BITS(mask)));
+    for (index = first; index < end; index++)
+    {
+        relative_origin = vector_sub(origin, (vector){ spheres->centers.x[index],
+                                                       spheres->centers.y[index],
+                                                       spheres->centers.z[index] });
+        k = PACKET(dot)(query->ray, relative_origin);
+        c = squared_magnitude(relative_origin) - spheres->squared_radii[index];
+
+        /* solve_quadratic_distances with a = 1 */
+        determinant = k * k - 1.0f * c;
+        root = PACKET_SQRT(determinant);
+        base = -k / 1.0f;
+        delta = PACKET(abs)(root / 1.0f);
+        near_root = base - delta > f_min;
+        far_root = base + delta > f_min;
+        t = PACKET(select)(near_root, base - delta, base + delta);
+        hit = mask & ~(determinant < .0f) & (near_root | far_root);
+        if (PACKET_ANY(hit))
+        {
+            stats_count_many(hits[CLASS_SPHERES], __builtin_popcount(PACKET_BITS(hit)));
+            vectors intersection = PACKET(point)(origin, t, query->unit_ray);
+            PACKET(record_hit)(query, hit, spheres->surfaces[index],
+                               PACKET(distance)(origin, intersection), intersection);
+        }
+    }
+}
+
+static PACKET_TARGET void PACKET(hit_frustums) (frustum_array * frustums, int first, int end,
+                                                vector origin, packet_query * query, ints mask)
+{
+    vector center0, center1, axis, relative_origin, origin_orth;
+    vectors ray_orth, intersections[2];
+    floats ray_axial, radius_linear, a, k, determinant, root, base, delta;
+    float radius_constant, c;
+    ints roots[2], inside[2], hit;
+    int index, which;
+
+    stats_count_many(hit_tests[CLASS_FRUSTUMS],
+                     (end - first) * __builtin_popcount(PACKET_BITS(mask)));
+    for (index = first; index < end; index++)
+    {
+        center0 = (vector){ frustums->centers[0].x[index], frustums->centers[0].y[index],
+                            frustums->centers[0].z[index] };
+        center1 = (vector){ frustums->centers[1].x[index], frustums->centers[1].y[index],
+                            frustums->centers[1].z[index] };
+        axis = (vector){ frustums->axes.x[index], frustums->axes.y[index],
+                         frustums->axes.z[index] };
+
+        relative_origin = vector_sub(origin, center0);
+        origin_orth = vector_orth(relative_origin, axis);
+        ray_axial = PACKET(dot)(query->ray, axis);
+        ray_orth = (vectors){ query->ray.x - ray_axial * axis.x, query->ray.y - ray_axial * axis.y,
+                              query->ray.z - ray_axial * axis.z };
+        radius_linear = frustums->slopes[index] * ray_axial;
+        radius_constant = frustums->slopes[index] * dot_product(relative_origin, axis) +
+                          frustums->radii[index];
+
+        a = PACKET(dot_vectors)(ray_orth, ray_orth) - radius_linear * radius_linear;
+        k = PACKET(dot)(ray_orth, origin_orth) - radius_linear * radius_constant;
+        c = squared_magnitude(origin_orth) - square(radius_constant);
+
+        determinant = k * k - a * c;
+        root = PACKET_SQRT(determinant);
+        base = -k / a;
+        delta = PACKET(abs)(root / a);
+        roots[0] = ~(determinant < .0f) & (base - delta > f_min);
+        roots[1] = ~(determinant < .0f) & (base + delta > f_min);
+        intersections[0] = PACKET(point)(origin, base - delta, query->unit_ray);
+        intersections[1] = PACKET(point)(origin, base + delta, query->unit_ray);
+
+        /* Take the first root within the length of the frustum */
+        for (which = 0; which < 2; which++)
+        {
+            vectors from0 = { intersections[which].x - center0.x, intersections[which].y - center0.y,
+                              intersections[which].z - center0.z };
+            vectors from1 = { intersections[which].x - center1.x, intersections[which].y - center1.y,
+                              intersections[which].z - center1.z };
+            inside[which] = roots[which] & (PACKET(dot)(from0, axis) >= .0f) &
+                            (PACKET(dot)(from1, axis) <= .0f);
+        }
+        hit = mask & (inside[0] | inside[1]);
+        if (PACKET_ANY(hit))
+        {
+            stats_count_many(hits[CLASS_FRUSTUMS], __builtin_popcount(PACKET_BITS(hit)));
+            vectors intersection = PACKET(select_vectors)(inside[0], intersections[0],
+                                                          intersections[1]);
+            PACKET(record_hit)(query, hit, frustums->surfaces[index],
+                               PACKET(distance)(origin, intersection), intersection);
+        }
+    }
+}
+
+static PACKET_TARGET void PACKET(hit_circles) (circle_array * circles, int first, int end,
+                                               vector origin, packet_query * query, ints mask)
+{
+    vector center;
+    vectors intersection;
+    ints hit;
+    int index;
+
+    stats_count_many(hit_tests[CLASS_CIRCLES],
+                     (end - first) * __builtin_popcount(PACKET_BITS(mask)));
+    for (index = first; index < end; index++)
+    {
+        center = (vector){ circles->centers.x[index], circles->centers.y[index],
+                           circles->centers.z[index] };
+        hit = mask & PACKET(solve_linear)(origin, query->ray, center,
+                                          (vector){ circles->normals.x[index],
+                                                    circles->normals.y[index],
+                                                    circles->normals.z[index] },
+                                          &intersection);
+        hit &= PACKET(distance)(center, intersection) <= circles->radii[index];
+        if (PACKET_ANY(hit))
+        {
+            stats_count_many(hits[CLASS_CIRCLES], __builtin_popcount(PACKET_BITS(hit)));
+            PACKET(record_hit)(query, hit, circles->surfaces[index],
+                               PACKET(distance)(origin, intersection), intersection);
+        }
+    }
+}
+
+static PACKET_TARGET void PACKET(hit_quads) (quad_array * quads, int first, int end,
+                                             vector origin, packet_query * query, ints mask)
+{
+    vector vertex, across[2];
+    vectors intersection, relative_point;
+    floats projection;
+    ints hit;
+    int index, side;
+
+    stats_count_many(hit_tests[CLASS_QUADS], (end - first) * __builtin_popcount(PACKET_BITS(mask)));
+    for (index = first; index < end; index++)
+    {
+        vertex = (vector){ quads->vertices.x[index], quads->vertices.y[index],
+                           quads->vertices.z[index] };
+        hit = mask & PACKET(solve_linear)(origin, query->ray, vertex,
+                                          (vector){ quads->normals.x[index],
+                                                    quads->normals.y[index],
+                                                    quads->normals.z[index] },
+                                          &intersection);
+        if (!PACKET_ANY(hit))
+        {
+            continue;
+        }
+
+        /* As quad_contains */
+        relative_point = (vectors){ intersection.x - vertex.x, intersection.y - vertex.y,
+                                    intersection.z - vertex.z };
+        for (side = 0; side < 2; side++)
+        {
+            across[side] = (vector){ quads->across[side].x[index], quads->across[side].y[index],
+                                     quads->across[side].z[index] };
+            projection = PACKET(dot)(relative_point, across[side]);
+            hit &= (.0f <= projection) & (projection <= quads->widths[side][index]);
+        }
+        if (PACKET_ANY(hit))
+        {
+            stats_count_many(hits[CLASS_QUADS], __builtin_popcount(PACKET_BITS(hit)));
+            PACKET(record_hit)(query, hit, quads->surfaces[index],
+                               PACKET(distance)(origin, intersection), intersection);
+        }
+    }
+}
+
+static PACKET_TARGET void PACKET(hit_meshes) (primitives * primitives, int first, int end,
+                                              vector origin, packet_query * query, ints mask)
+/* As hit_meshes in primitives.c, for each ray of the packet in the mask in turn */
+{
+    surface * source;
+    vector ray, intersection;
+    float t;
+    int index, lane, triangle;
+    ints lane_mask;
+
+    stats_count_many(hit_tests[CLASS_MESHES],
+                     (end - first) * __builtin_popcount(PACKET_BITS(mask)));
+    for (index = first; index < end; index++)
+    {
+        source = &primitives->surfaces[primitives->meshes.surfaces[index]];
+        for (lane = 0; lane < PACKET_WIDTH; lane++)
+        {
+            if (!mask[lane])
+            {
+                continue;
+            }
+            ray = (vector){ query->ray.x[lane], query->ray.y[lane], query->ray.z[lane] };
+            if (mesh_hit(((mesh *)source->geometry)->triangles, origin, ray, query->max_t[lane],
+                         &triangle, &t))
+            {
+                stats_count(hits[CLASS_MESHES]);
+                intersection = vector_add(origin, vector_multiply(t, ray));
+                lane_mask = PACKET(splat_int)(0);
+                lane_mask[lane] = -1;
+                PACKET(record_hit)(query, lane_mask, primitives->meshes.surfaces[index],
+                                   PACKET(splat)(vector_distance(origin, intersection)),
+                                   (vectors){ PACKET(splat)(intersection.x),
+                                              PACKET(splat)(intersection.y),
+                                              PACKET(splat)(intersection.z) });
+            }
+        }
+    }
+}
+
+static PACKET_TARGET void PACKET(hit_instances) (primitives * primitives, int first, int end,
+                                                 vector origin, packet_query * query, ints mask)
+/* As hit_instances in primitives.c, for each ray of the packet in the mask in turn */
+{
+    surface * source;
+    vector ray, intersection;
+    int index, lane;
+    ints lane_mask;
+
+    stats_count_many(hit_tests[CLASS_INSTANCES],
+                     (end - first) * __builtin_popcount(PACKET_BITS(mask)));
+    for (index = first; index < end; index++)
+    {
+        source = &primitives->surfaces[primitives->instances.surfaces[index]];
+        for (lane = 0; lane < PACKET_WIDTH; lane++)
+        {
+            if (!mask[lane])
+            {
+                continue;
+            }
+            ray = (vector){ query->ray.x[lane], query->ray.y[lane], query->ray.z[lane] };
+            if (instance_hit((instance *)source->geometry, origin, ray, query->max_t[lane],
+                             &intersection))
+            {
+                stats_count(hits[CLASS_INSTANCES]);
+                lane_mask = PACKET(splat_int)(0);
+                lane_mask[lane] = -1;
+                PACKET(record_hit)(query, lane_mask, primitives->instances.surfaces[index],
+                                   PACKET(splat)(vector_distance(origin, intersection)),
+                                   (vectors){ PACKET(splat)(intersection.x),
+                                              PACKET(splat)(intersection.y),
+                                              PACKET(splat)(intersection.z) });
+            }
+        }
+    }
+}
+
+static PACKET_TARGET void PACKET(hit_leaf) (primitives * primitives, primitive_leaf * leaf,
+                                            vector origin, packet_query * query, ints mask)
+/*! As hit_leaf in primitives.c, for the rays of the packet in the mask */
+{
+    primitive_leaf * next = leaf + 1;
+
+    PACKET(hit_spheres)(&primitives->spheres, leaf->first[CLASS_SPHERES],
+                        next->first[CLASS_SPHERES], origin, query, mask);
+    PACKET(hit_frustums)(&primitives->frustums, leaf->first[CLASS_FRUSTUMS],
+                         next->first[CLASS_FRUSTUMS], origin, query, mask);
+    PACKET(hit_circles)(&primitives->circles, leaf->first[CLASS_CIRCLES],
+                        next->first[CLASS_CIRCLES], origin, query, mask);
+    PACKET(hit_quads)(&primitives->quads, leaf->first[CLASS_QUADS],
+                      next->first[CLASS_QUADS], origin, query, mask);
+    PACKET(hit_meshes)(primitives, leaf->first[CLASS_MESHES],
+                       next->first[CLASS_MESHES], origin, query, mask);
+    PACKET(hit_instances)(primitives, leaf->first[CLASS_INSTANCES],
+                          next->first[CLASS_INSTANCES], origin, query, mask);
+}
+
+static __inline PACKET_TARGET float PACKET(nearest) (floats t, ints mask)
+/* The smallest element of t among those in the mask */
+{
+    float nearest = INFINITY;
+    int lane;
+    for (lane = 0; lane < PACKET_WIDTH; lane++)
+    {
+        if (mask[lane] && t[lane] < nearest)
+        {
+            nearest = t[lane];
+        }
+    }
+    return nearest;
+}
+
+static PACKET_TARGET void PACKET(find_closest_hits) (primitives * primitives, vector origin,
+                                                     packet_query * query, ints mask)
+/*! Traverse the BVH for the closest hits of the rays in the mask, as
+    find_closest_hit in primitives.c does for each of them.  A node is
+    visited while any ray of the packet would visit it alone, and only
+    those rays are tested against its children or primitives. */
+{
+    int stack_nodes[BVH_MAX_STACK_DEPTH];
+    ints stack_masks[BVH_MAX_STACK_DEPTH];
+    floats stack_distances[BVH_MAX_STACK_DEPTH];
+    int top = 0;
+    int node_index = 0;
+    int left, right;
+    bvh * bvh = primitives->bvh;
+    bvh_node * node;
+    floats t_left, t_right, t_root;
+    ints hit_left, hit_right;
+    bool any_left, any_right;
+
+    if (bvh->num_nodes == 0)
+    {
+        return;
+    }
+    mask &= PACKET(hits_box)(&bvh->nodes[0].box, origin, query, &t_root);
+    if (!PACKET_ANY(mask))
+    {
+        return;
+    }
+
+    while (true)
+    {
+        node = &bvh->nodes[node_index];
+        if (node->count > 0)
+        {
+            PACKET(hit_leaf)(primitives, &primitives->leaves[node->first], origin, query, mask);
+        }
+        else
+        {
+            left = node_index + 1;
+            right = node->first;
+            hit_left = mask & PACKET(hits_box)(&bvh->nodes[left].box, origin, query, &t_left);
+            hit_right = mask & PACKET(hits_box)(&bvh->nodes[right].box, origin, query, &t_right);
+            any_left = PACKET_ANY(hit_left);
+            any_right = PACKET_ANY(hit_right);
+            if (any_left && any_right)
+            {
+                /* Visit first the child that the packet reaches first */
+                if (PACKET(nearest)(t_right, hit_right) < PACKET(nearest)(t_left, hit_left))
+                {
+                    stack_nodes[top] = left;
+                    stack_masks[top] = hit_left;
+                    stack_distances[top++] = t_left;
+                    node_index = right;
+                    mask = hit_right;
+                }
+                else
+                {
+                    stack_nodes[top] = right;
+                    stack_masks[top] = hit_right;
+                    stack_distances[top++] = t_right;
+                    node_index = left;
+                    mask = hit_left;
+                }
+                continue;
+            }
+            else if (any_left || any_right)
+            {
+                node_index = any_left ? left : right;
+                mask = any_left ? hit_left : hit_right;
+                continue;
+            }
+        }
+
+        do
+        {
+            if (top == 0)
+            {
+                return;
+            }
+            node_index = stack_nodes[--top];
+            mask = stack_masks[top] & ~(stack_distances[top] > query->max_t);
+        } while (!PACKET_ANY(mask));
+    }
+}
+
+static PACKET_TARGET void PACKET(hit_surfaces) (primitives * primitives, vector origin,
+                                                const vector rays[], int count,
+                                                surface * hits_out[],
+                                                vector intersections_out[],
+                                                vector normals_out[])
+/*! packet_hit_surfaces for up to PACKET_WIDTH rays */
+{
+    packet_query query;
+    ints mask;
+    vector unit_ray, inverse;
+    surface * closest_surface;
+    int lane;
+
+    for (lane = 0; lane < PACKET_WIDTH; lane++)
+    {
+        /* Lanes beyond the last ray repeat it, masked out */
+        vector ray = rays[lane < count ? lane : count - 1];
+        unit_ray = vector_normalize(ray);
+        inverse = bvh_inverse_direction(ray);
+        query.ray.x[lane] = ray.x;
+        query.ray.y[lane] = ray.y;
+        query.ray.z[lane] = ray.z;
+        query.unit_ray.x[lane] = unit_ray.x;
+        query.unit_ray.y[lane] = unit_ray.y;
+        query.unit_ray.z[lane] = unit_ray.z;
+        query.inverse.x[lane] = inverse.x;
+        query.inverse.y[lane] = inverse.y;
+        query.inverse.z[lane] = inverse.z;
+        query.ray_length[lane] = vector_magnitude(ray);
+        mask[lane] = lane < count ? -1 : 0;
+    }
+    query.closest_distance = PACKET(splat)(INFINITY);
+    query.max_t = PACKET(splat)(INFINITY);
+    query.closest = PACKET(splat_int)(-1);
+    query.intersection = (vectors){ query.max_t, query.max_t, query.max_t };
+
+    PACKET(find_closest_hits)(primitives, origin, &query, mask);
+    PACKET_LEAVE();
+
+    for (lane = 0; lane < count; lane++)
+    {
+        if (query.closest[lane] < 0)
+        {
+            hits_out[lane] = NULL;
+            continue;
+        }
+        closest_surface = &primitives->surfaces[query.closest[lane]];
+        if (closest_surface->class == surface_instance)
+        {
+            closest_surface = instance_hit_surface((instance *)closest_surface->geometry, origin,
+                                                   rays[lane], NULL, &normals_out[lane]);
+        }
+        else
+        {
+            closest_surface->class->calculate_intersection(origin, rays[lane],
+                                                           closest_surface->geometry,
+                                                           NULL, &normals_out[lane]);
+        }
+        intersections_out[lane] = (vector){ query.intersection.x[lane], query.intersection.y[lane],
+                                            query.intersection.z[lane] };
+        hits_out[lane] = closest_surface;
+    }
+}
+
+/* One ray against several primitives
+
+   The kernels below test a single ray against a run of primitives of one
+   class, PACKET_WIDTH primitives at a time, with each element of a vector
+   holding a different primitive.  This serves the rays that packets can't,
+   such as reflected, refracted and shadow rays.  The arrays of primitives.h
+   are padded so that loading a full group past the end of a run stays
+   within them; the lanes beyond the run are masked out.
+*/
+
+static __inline PACKET_TARGET floats PACKET(load) (const float * values)
+{
+    floats result;
+    memcpy(&result, values, sizeof(result));
+    return result;
+}
+
+static __inline PACKET_TARGET vectors PACKET(load_vectors) (const vector_array * array, int index)
+{
+    return (vectors){ PACKET(load)(array->x + index), PACKET(load)(array->y + index),
+                      PACKET(load)(array->z + index) };
+}
+
+static __inline PACKET_TARGET vectors PACKET(sub) (vectors a, vector b)
+{
+    return (vectors){ a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+static __inline PACKET_TARGET vectors PACKET(sub_from) (vector a, vectors b)
+{
+    return (vectors){ a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+static __inline PACKET_TARGET vectors PACKET(sub_vectors) (vectors a, vectors b)
+{
+    return (vectors){ a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+static __inline PACKET_TARGET vectors PACKET(along) (vector origin, floats t, vector direction)
+/* origin + t direction for a single direction */
+{
+    return (vectors){ origin.x + t * direction.x, origin.y + t * direction.y,
+                      origin.z + t * direction.z };
+}
+
+static __inline PACKET_TARGET vectors PACKET(orth) (vectors a, vectors b)
+/* As vector_orth */
+{
+    floats d = PACKET(dot_vectors)(a, b);
+    return (vectors){ a.x - d * b.x, a.y - d * b.y, a.z - d * b.z };
+}
+
+static __inline PACKET_TARGET vectors PACKET(orth_of) (vector a, vectors b)
+{
+    floats d = PACKET(dot)(b, a);
+    return (vectors){ a.x - d * b.x, a.y - d * b.y, a.z - d * b.z };
+}
+
+static __inline PACKET_TARGET ints PACKET(run_mask) (int index, int end)
+/* The lanes of the group starting at "index" that hold primitives before "end" */
+{
+    ints lanes;
+    int lane;
+    for (lane = 0; lane < PACKET_WIDTH; lane++)
+    {
+        lanes[lane] = lane;
+    }
+    return lanes < PACKET(splat_int)(end - index);
+}
+
+static __inline PACKET_TARGET void PACKET(keep_closest) (ints hit, vector origin,
+                                                         vectors intersections,
+                                                         const int surfaces[], int * closest,
+                                                         float * closest_distance,
+                                                         vector * intersection)
+/* Reduce the hits of a group to the closest hit of the run so far, comparing
+   as record_hit in primitives.c does */
+{
+    floats distance = PACKET(distance)(origin, intersections);
+    int bits = PACKET_BITS(hit);
+    int lane;
+
+    while (bits)
+    {
+        lane = __builtin_ctz(bits);
+        bits &= bits - 1;
+        if (distance[lane] < *closest_distance ||
+            (distance[lane] == *closest_distance && surfaces[lane] < *closest))
+        {
+            *closest_distance = distance[lane];
+            *closest = surfaces[lane];
+            *intersection = (vector){ intersections.x[lane], intersections.y[lane],
+                                      intersections.z[lane] };
+        }
+    }
+}
+
+static __inline PACKET_TARGET int PACKET(first_blocker) (ints blocks, const int surfaces[])
+{
+    return surfaces[__builtin_ctz(PACKET_BITS(blocks))];
+}
+
+static __inline PACKET_TARGET void PACKET(quadratic) (floats a, floats k, floats c,
+                                                      ints * near_out, ints * far_out,
+                                                      floats * near_t_out, floats * far_t_out)
+/* As solve_quadratic_distances: the roots base - delta and base + delta, and
+   which of them it would return */
+{
+    floats determinant = k * k - a * c;
+    floats root = PACKET_SQRT(determinant);
+    floats base = -k / a;
+    floats delta = PACKET(abs)(root / a);
+    ints real = ~(determinant < .0f);
+
+    *near_t_out = base - delta;
+    *far_t_out = base + delta;
+    *near_out = real & (*near_t_out > f_min);
+    *far_out = real & (*far_t_out > f_min);
+}
+
+static PACKET_TARGET int PACKET(closest_sphere) (const sphere_array * spheres, int first, int end,
+                                                 vector origin, vector ray, vector unit_ray,
+                                                 float * distance_out, vector * intersection_out)
+{
+    vectors relative_origin;
+    floats k, c, near_t, far_t;
+    ints near_root, far_root, hit;
+    int index, closest = -1;
+
+    *distance_out = INFINITY;
+    stats_count_many(hit_tests[CLASS_SPHERES], end - first);
+    for (index = first; index < end; index += PACKET_WIDTH)
+    {
+        relative_origin = PACKET(sub_from)(origin, PACKET(load_vectors)(&spheres->centers, index));
+        k = PACKET(dot)(relative_origin, ray);
+        c = PACKET(dot_vectors)(relative_origin, relative_origin) -
+            PACKET(load)(spheres->squared_radii + index);
+        PACKET(quadratic)(PACKET(splat)(1.0f), k, c, &near_root, &far_root, &near_t, &far_t);
+        hit = PACKET(run_mask)(index, end) & (near_root | far_root);
+        if (PACKET_ANY(hit))
+        {
+            stats_count_many(hits[CLASS_SPHERES], __builtin_popcount(PACKET_BITS(hit)));
+            PACKET(keep_closest)(hit, origin,
+                                 PACKET(along)(origin, PACKET(select)(near_root, near_t, far_t),
+                                               unit_ray),
+                                 spheres->surfaces + index, &closest, distance_out,
+                                 intersection_out);
+        }
+    }
+    PACKET_LEAVE();
+    return closest;
+}
+
+static PACKET_TARGET int PACKET(blocking_sphere) (const sphere_array * spheres, int first, int end,
+                                                  vector origin, vector ray, float max_distance)
+{
+    vectors relative_origin;
+    floats k, c, near_t, far_t;
+    ints near_root, far_root, blocks;
+    int index, blocker = -1;
+
+    for (index = first; index < end && blocker < 0; index += PACKET_WIDTH)
+    {
+        relative_origin = PACKET(sub_from)(origin, PACKET(load_vectors)(&spheres->centers, index));
+        k = PACKET(dot)(relative_origin, ray);
+        c = PACKET(dot_vectors)(relative_origin, relative_origin) -
+            PACKET(load)(spheres->squared_radii + index);
+        PACKET(quadratic)(PACKET(splat)(1.0f), k, c, &near_root, &far_root, &near_t, &far_t);
+        blocks = PACKET(run_mask)(index, end) &
+                 ((near_root & (near_t < max_distance)) |
+                  (~near_root & far_root & (far_t < max_distance)));
+        if (PACKET_ANY(blocks))
+        {
+            blocker = PACKET(first_blocker)(blocks, spheres->surfaces + index);
+        }
+    }
+    PACKET_LEAVE();
+    return blocker;
+}
+
+typedef struct
+{
+    vectors relative_origin;
+    vectors axis;
+    floats ray_axial;
+    ints roots[2];
+    floats distances[2];
+} PACKET(frustum_roots);
+
+static __inline PACKET_TARGET PACKET(frustum_roots) PACKET(frustum_quadratic) (
+    const frustum_array * frustums, int index, vector origin, vector ray)
+/* The calculation shared by frustum_hit and frustum_blocks, up to the roots */
+{
+    PACKET(frustum_roots) result;
+    vectors origin_orth, ray_orth;
+    floats slope, radius_linear, radius_constant, a, k, c;
+
+    result.relative_origin = PACKET(sub_from)(origin, PACKET(load_vectors)(&frustums->centers[0],
+                                                                           index));
+    result.axis = PACKET(load_vectors)(&frustums->axes, index);
+    result.ray_axial = PACKET(dot)(result.axis, ray);
+    slope = PACKET(load)(frustums->slopes + index);
+
+    origin_orth = PACKET(orth)(result.relative_origin, result.axis);
+    ray_orth = PACKET(orth_of)(ray, result.axis);
+    radius_linear = slope * result.ray_axial;
+    radius_constant = slope * PACKET(dot_vectors)(result.relative_origin, result.axis) +
+                      PACKET(load)(frustums->radii + index);
+
+    a = PACKET(dot_vectors)(ray_orth, ray_orth) - radius_linear * radius_linear;
+    k = PACKET(dot_vectors)(ray_orth, origin_orth) - radius_linear * radius_constant;
+    c = PACKET(dot_vectors)(origin_orth, origin_orth) - radius_constant * radius_constant;
+    PACKET(quadratic)(a, k, c, &result.roots[0], &result.roots[1],
+                      &result.distances[0], &result.distances[1]);
+    return result;
+}
+
+static PACKET_TARGET int PACKET(closest_frustum) (const frustum_array * frustums, int first,
+                                                  int end, vector origin, vector ray,
+                                                  vector unit_ray, float * distance_out,
+                                                  vector * intersection_out)
+{
+    PACKET(frustum_roots) roots;
+    vectors center0, center1, intersections[2];
+    ints inside[2], hit;
+    int index, which, closest = -1;
+
+    *distance_out = INFINITY;
+    stats_count_many(hit_tests[CLASS_FRUSTUMS], end - first);
+    for (index = first; index < end; index += PACKET_WIDTH)
+    {
+        roots = PACKET(frustum_quadratic)(frustums, index, origin, ray);
+        center0 = PACKET(load_vectors)(&frustums->centers[0], index);
+        center1 = PACKET(load_vectors)(&frustums->centers[1], index);
+        for (which = 0; which < 2; which++)
+        {
+            intersections[which] = PACKET(along)(origin, roots.distances[which], unit_ray);
+            inside[which] =
+                roots.roots[which] &
+                (PACKET(dot_vectors)(PACKET(sub_vectors)(intersections[which], center0),
+                                     roots.axis) >= .0f) &
+                (PACKET(dot_vectors)(PACKET(sub_vectors)(intersections[which], center1),
+                                     roots.axis) <= .0f);
+        }
+        hit = PACKET(run_mask)(index, end) & (inside[0] | inside[1]);
+        if (PACKET_ANY(hit))
+        {
+            stats_count_many(hits[CLASS_FRUSTUMS], __builtin_popcount(PACKET_BITS(hit)));
+            PACKET(keep_closest)(hit, origin,
+                                 PACKET(select_vectors)(inside[0], intersections[0],
+                                                        intersections[1]),
+                                 frustums->surfaces + index, &closest, distance_out,
+                                 intersection_out);
+        }
+    }
+    PACKET_LEAVE();
+    return closest;
+}
+
+static PACKET_TARGET int PACKET(blocking_frustum) (const frustum_array * frustums, int first,
+                                                   int end, vector origin, vector ray,
+                                                   float max_distance)
+{
+    PACKET(frustum_roots) roots;
+    floats origin_axial, length, axial;
+    ints inside[2], blocks;
+    int index, which, blocker = -1;
+
+    for (index = first; index < end && blocker < 0; index += PACKET_WIDTH)
+    {
+        roots = PACKET(frustum_quadratic)(frustums, index, origin, ray);
+        origin_axial = PACKET(dot_vectors)(roots.relative_origin, roots.axis);
+        length = PACKET(load)(frustums->lengths + index);
+        for (which = 0; which < 2; which++)
+        {
+            axial = origin_axial + roots.distances[which] * roots.ray_axial;
+            inside[which] = roots.roots[which] & (axial >= .0f) & (axial <= length);
+        }
+        /* The first root within the length of the frustum is the visible one */
+        blocks = PACKET(run_mask)(index, end) &
+                 ((inside[0] & (roots.distances[0] < max_distance)) |
+                  (~inside[0] & inside[1] & (roots.distances[1] < max_distance)));
+        if (PACKET_ANY(blocks))
+        {
+            blocker = PACKET(first_blocker)(blocks, frustums->surfaces + index);
+        }
+    }
+    PACKET_LEAVE();
+    return blocker;
+}
+
+static PACKET_TARGET int PACKET(closest_circle) (const circle_array * circles, int first, int end,
+                                                 vector origin, vector ray, vector unit_ray,
+                                                 float * distance_out, vector * intersection_out)
+{
+    vectors center, normal, intersection, offset;
+    floats t;
+    ints hit;
+    int index, closest = -1;
+
+    *distance_out = INFINITY;
+    stats_count_many(hit_tests[CLASS_CIRCLES], end - first);
+    for (index = first; index < end; index += PACKET_WIDTH)
+    {
+        center = PACKET(load_vectors)(&circles->centers, index);
+        normal = PACKET(load_vectors)(&circles->normals, index);
+        t = PACKET(dot_vectors)(PACKET(sub)(center, origin), normal) / PACKET(dot)(normal, ray);
+        intersection = PACKET(along)(origin, t, ray);
+        offset = PACKET(sub_vectors)(intersection, center);
+        hit = PACKET(run_mask)(index, end) & ~(t < f_min) &
+              (PACKET_SQRT(PACKET(dot_vectors)(offset, offset)) <=
+               PACKET(load)(circles->radii + index));
+        if (PACKET_ANY(hit))
+        {
+            stats_count_many(hits[CLASS_CIRCLES], __builtin_popcount(PACKET_BITS(hit)));
+            PACKET(keep_closest)(hit, origin, intersection, circles->surfaces + index, &closest,
+                                 distance_out, intersection_out);
+        }
+    }
+    PACKET_LEAVE();
+    return closest;
+}
+
+static PACKET_TARGET int PACKET(blocking_circle) (const circle_array * circles, int first, int end,
+                                                  vector origin, vector ray, float max_distance)
+{
+    vectors relative_center, normal, offset;
+    floats distance;
+    ints blocks;
+    int index, blocker = -1;
+
+    for (index = first; index < end && blocker < 0; index += PACKET_WIDTH)
+    {
+        relative_center = PACKET(sub)(PACKET(load_vectors)(&circles->centers, index), origin);
+        normal = PACKET(load_vectors)(&circles->normals, index);
+        distance = PACKET(dot_vectors)(relative_center, normal) / PACKET(dot)(normal, ray);
+        offset = PACKET(sub_vectors)((vectors){ distance * ray.x, distance * ray.y,
+                                                distance * ray.z },
+                                     relative_center);
+        blocks = PACKET(run_mask)(index, end) & ~(distance < f_min) & (distance < max_distance) &
+                 (PACKET(dot_vectors)(offset, offset) <= PACKET(load)(circles->squared_radii + index));
+        if (PACKET_ANY(blocks))
+        {
+            blocker = PACKET(first_blocker)(blocks, circles->surfaces + index);
+        }
+    }
+    PACKET_LEAVE();
+    return blocker;
+}
+
+static __inline PACKET_TARGET ints PACKET(quad_contains) (const quad_array * quads, int index,
+                                                          vectors vertex, vectors point)
+/* As quad_contains */
+{
+    vectors relative_point = PACKET(sub_vectors)(point, vertex);
+    floats projection;
+    ints inside = PACKET(splat_int)(-1);
+    int side;
+
+    for (side = 0; side < 2; side++)
+    {
+        projection = PACKET(dot_vectors)(relative_point,
+                                         PACKET(load_vectors)(&quads->across[side], index));
+        inside &= (.0f <= projection) & (projection <= PACKET(load)(quads->widths[side] + index));
+    }
+    return inside;
+}
+
+static PACKET_TARGET int PACKET(closest_quad) (const quad_array * quads, int first, int end,
+                                               vector origin, vector ray, vector unit_ray,
+                                               float * distance_out, vector * intersection_out)
+{
+    vectors vertex, normal, intersection;
+    floats t;
+    ints hit;
+    int index, closest = -1;
+
+    *distance_out = INFINITY;
+    stats_count_many(hit_tests[CLASS_QUADS], end - first);
+    for (index = first; index < end; index += PACKET_WIDTH)
+    {
+        vertex = PACKET(load_vectors)(&quads->vertices, index);
+        normal = PACKET(load_vectors)(&quads->normals, index);
+        t = PACKET(dot_vectors)(PACKET(sub)(vertex, origin), normal) / PACKET(dot)(normal, ray);
+        intersection = PACKET(along)(origin, t, ray);
+        hit = PACKET(run_mask)(index, end) & ~(t < f_min);
+        if (PACKET_ANY(hit))
+        {
+            hit &= PACKET(quad_contains)(quads, index, vertex, intersection);
+        }
+        if (PACKET_ANY(hit))
+        {
+            stats_count_many(hits[CLASS_QUADS], __builtin_popcount(PACKET_BITS(hit)));
+            PACKET(keep_closest)(hit, origin, intersection, quads->surfaces + index, &closest,
+                                 distance_out, intersection_out);
+        }
+    }
+    PACKET_LEAVE();
+    return closest;
+}
+
+static PACKET_TARGET int PACKET(blocking_quad) (const quad_array * quads, int first, int end,
+                                                vector origin, vector ray, float max_distance)
+{
+    vectors vertex, normal;
+    floats distance;
+    ints blocks;
+    int index, blocker = -1;
+
+    for (index = first; index < end && blocker < 0; index += PACKET_WIDTH)
+    {
+        vertex = PACKET(load_vectors)(&quads->vertices, index);
+        normal = PACKET(load_vectors)(&quads->normals, index);
+        distance = PACKET(dot_vectors)(PACKET(sub)(vertex, origin), normal) /
+                   PACKET(dot)(normal, ray);
+        blocks = PACKET(run_mask)(index, end) & ~(distance < f_min) & (distance < max_distance);
+        if (PACKET_ANY(blocks))
+        {
+            blocks &= PACKET(quad_contains)(quads, index, vertex,
+                                            PACKET(along)(origin, distance, ray));
+        }
+        if (PACKET_ANY(blocks))
+        {
+            blocker = PACKET(first_blocker)(blocks, quads->surfaces + index);
+        }
+    }
+    PACKET_LEAVE();
+    return blocker;
+}
+
+static const primitive_kernels PACKET(primitive_kernels) =
+{
+    PACKET(closest_sphere), PACKET(closest_frustum), PACKET(closest_circle), PACKET(closest_quad),
+    PACKET(blocking_sphere), PACKET(blocking_frustum), PACKET(blocking_circle),
+    PACKET(blocking_quad)
+};
+
+#undef PACKET_ANY
+#undef floats
+#undef ints
+#undef vectors
+#undef packet_query
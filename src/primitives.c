@@ -0,0 +1,1167 @@
+#include "primitives.h"
+#include "intersect.h"
+#include "packet.h"
+#include "mesh.h"
+#include "instance.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+
+/* State of a closest hit search */
+typedef struct
+{
+    vector origin;
+    vector ray;
+    vector unit_ray;
+    vector inverse;
+    float ray_length;
+    float closest_distance;
+    float max_t;
+    /* Index of the closest surface hit so far, -1 if none */
+    int closest;
+    vector intersection;
+} hit_query;
+
+static __inline vector vector_array_get (const vector_array * array, int index)
+{
+    return (vector){ array->x[index], array->y[index], array->z[index] };
+}
+
+static __inline void vector_array_set (vector_array * array, int index, vector v)
+{
+    array->x[index] = v.x;
+    array->y[index] = v.y;
+    array->z[index] = v.z;
+}
+
+static __inline frustum_frame frustum_frame_get (const frustum_array * frustums, int index)
+{
+    frustum_frame frame;
+    frame.axis = vector_array_get(&frustums->axes, index);
+    frame.length = frustums->lengths[index];
+    frame.slope = frustums->slopes[index];
+    return frame;
+}
+
+static __inline quad_frame quad_frame_get (const quad_array * quads, int index)
+{
+    quad_frame frame;
+    frame.normal = vector_array_get(&quads->normals, index);
+    frame.across[0] = vector_array_get(&quads->across[0], index);
+    frame.across[1] = vector_array_get(&quads->across[1], index);
+    frame.widths[0] = quads->widths[0][index];
+    frame.widths[1] = quads->widths[1][index];
+    return frame;
+}
+
+static float * take_floats (float ** block, int count)
+{
+    float * result = *block;
+    *block += count;
+    return result;
+}
+
+static vector_array take_vectors (float ** block, int count)
+{
+    vector_array result;
+    result.x = take_floats(block, count);
+    result.y = take_floats(block, count);
+    result.z = take_floats(block, count);
+    return result;
+}
+
+/* The number of float arrays holding each class's fields.  Meshes and
+   instances have none, since their geometry stays with their surfaces. */
+static const int class_fields[NUM_CLASSES] = { 4, 12, 8, 14, 0, 0 };
+
+static void lay_out_class (primitives * primitives, primitive_class class, float * block,
+                           int * surfaces, int count)
+/*! Point the field arrays of a class of primitives into a block of memory
+    for "count" primitives, and its surface indices to "surfaces" */
+{
+    int stride = count + PRIMITIVE_PADDING;
+    int side;
+
+    switch (class)
+    {
+        case CLASS_SPHERES:
+            primitives->spheres.centers = take_vectors(&block, stride);
+            primitives->spheres.squared_radii = take_floats(&block, stride);
+            primitives->spheres.surfaces = surfaces;
+            break;
+        case CLASS_FRUSTUMS:
+            primitives->frustums.centers[0] = take_vectors(&block, stride);
+            primitives->frustums.centers[1] = take_vectors(&block, stride);
+            primitives->frustums.radii = take_floats(&block, stride);
+            primitives->frustums.axes = take_vectors(&block, stride);
+            primitives->frustums.lengths = take_floats(&block, stride);
+            primitives->frustums.slopes = take_floats(&block, stride);
+            primitives->frustums.surfaces = surfaces;
+            break;
+        case CLASS_CIRCLES:
+            primitives->circles.centers = take_vectors(&block, stride);
+            primitives->circles.normals = take_vectors(&block, stride);
+            primitives->circles.radii = take_floats(&block, stride);
+            primitives->circles.squared_radii = take_floats(&block, stride);
+            primitives->circles.surfaces = surfaces;
+            break;
+        case CLASS_QUADS:
+            primitives->quads.vertices = take_vectors(&block, stride);
+            primitives->quads.normals = take_vectors(&block, stride);
+            for (side = 0; side < 2; side++)
+            {
+                primitives->quads.across[side] = take_vectors(&block, stride);
+                primitives->quads.widths[side] = take_floats(&block, stride);
+            }
+            primitives->quads.surfaces = surfaces;
+            break;
+        case CLASS_MESHES:
+            primitives->meshes.surfaces = surfaces;
+            break;
+        default:
+            primitives->instances.surfaces = surfaces;
+            break;
+    }
+}
+
+static bool allocate_class (primitives * primitives, primitive_class class, int count)
+/*! Allocate the field arrays and surface indices of a class of primitives.
+    The padding is zeroed so that the vector kernels only ever load numbers. */
+{
+    float * fields = NULL;
+    int * surfaces = calloc(count + PRIMITIVE_PADDING, sizeof(int));
+    if (class_fields[class] > 0)
+    {
+        fields = calloc(class_fields[class] * (count + PRIMITIVE_PADDING), sizeof(float));
+    }
+    if ((fields == NULL && class_fields[class] > 0) || surfaces == NULL)
+    {
+        free(fields);
+        free(surfaces);
+        return false;
+    }
+    lay_out_class(primitives, class, fields, surfaces, count);
+    return true;
+}
+
+static primitive_class class_of (surface * surface)
+{
+    if (surface->class == surface_sphere)
+    {
+        return CLASS_SPHERES;
+    }
+    else if (surface->class == surface_frustum)
+    {
+        return CLASS_FRUSTUMS;
+    }
+    else if (surface->class == surface_circle)
+    {
+        return CLASS_CIRCLES;
+    }
+    else if (surface->class == surface_mesh)
+    {
+        return CLASS_MESHES;
+    }
+    else if (surface->class == surface_instance)
+    {
+        return CLASS_INSTANCES;
+    }
+    else
+    {
+        return CLASS_QUADS;
+    }
+}
+
+static void append_primitive (primitives * primitives, int surface_index)
+/*! Bake the geometry of a surface into the end of the arrays of its class */
+{
+    surface * source = &primitives->surfaces[surface_index];
+    int index, side;
+
+    switch (class_of(source))
+    {
+        case CLASS_SPHERES:
+        {
+            sphere_array * spheres = &primitives->spheres;
+            sphere * geometry = (sphere *)source->geometry;
+            index = spheres->count++;
+            vector_array_set(&spheres->centers, index, geometry->center);
+            spheres->squared_radii[index] = square(geometry->radius);
+            spheres->surfaces[index] = surface_index;
+            break;
+        }
+        case CLASS_FRUSTUMS:
+        {
+            frustum_array * frustums = &primitives->frustums;
+            frustum * geometry = (frustum *)source->geometry;
+            frustum_frame frame = frustum_bake(geometry->centers[0], geometry->centers[1],
+                                               geometry->radii[0], geometry->radii[1]);
+            index = frustums->count++;
+            vector_array_set(&frustums->centers[0], index, geometry->centers[0]);
+            vector_array_set(&frustums->centers[1], index, geometry->centers[1]);
+            frustums->radii[index] = geometry->radii[0];
+            vector_array_set(&frustums->axes, index, frame.axis);
+            frustums->lengths[index] = frame.length;
+            frustums->slopes[index] = frame.slope;
+            frustums->surfaces[index] = surface_index;
+            break;
+        }
+        case CLASS_CIRCLES:
+        {
+            circle_array * circles = &primitives->circles;
+            circle * geometry = (circle *)source->geometry;
+            index = circles->count++;
+            vector_array_set(&circles->centers, index, geometry->center);
+            vector_array_set(&circles->normals, index, geometry->normal);
+            circles->radii[index] = geometry->radius;
+            circles->squared_radii[index] = square(geometry->radius);
+            circles->surfaces[index] = surface_index;
+            break;
+        }
+        case CLASS_QUADS:
+        {
+            quad_array * quads = &primitives->quads;
+            quad * geometry = (quad *)source->geometry;
+            quad_frame frame = quad_bake(geometry->vertices[0], geometry->vertices[1],
+                                         geometry->vertices[2]);
+            index = quads->count++;
+            vector_array_set(&quads->vertices, index, geometry->vertices[1]);
+            vector_array_set(&quads->normals, index, frame.normal);
+            for (side = 0; side < 2; side++)
+            {
+                vector_array_set(&quads->across[side], index, frame.across[side]);
+                quads->widths[side][index] = frame.widths[side];
+            }
+            quads->surfaces[index] = surface_index;
+            break;
+        }
+        case CLASS_MESHES:
+            primitives->meshes.surfaces[primitives->meshes.count++] = surface_index;
+            break;
+        default:
+            primitives->instances.surfaces[primitives->instances.count++] = surface_index;
+            break;
+    }
+}
+
+static void class_counts (primitives * primitives, int counts_out[NUM_CLASSES])
+{
+    counts_out[CLASS_SPHERES] = primitives->spheres.count;
+    counts_out[CLASS_FRUSTUMS] = primitives->frustums.count;
+    counts_out[CLASS_CIRCLES] = primitives->circles.count;
+    counts_out[CLASS_QUADS] = primitives->quads.count;
+    counts_out[CLASS_MESHES] = primitives->meshes.count;
+    counts_out[CLASS_INSTANCES] = primitives->instances.count;
+}
+
+static void class_surfaces (primitives * primitives, int * surfaces_out[NUM_CLASSES])
+/*! Output the surface indices of each class's entries */
+{
+    surfaces_out[CLASS_SPHERES] = primitives->spheres.surfaces;
+    surfaces_out[CLASS_FRUSTUMS] = primitives->frustums.surfaces;
+    surfaces_out[CLASS_CIRCLES] = primitives->circles.surfaces;
+    surfaces_out[CLASS_QUADS] = primitives->quads.surfaces;
+    surfaces_out[CLASS_MESHES] = primitives->meshes.surfaces;
+    surfaces_out[CLASS_INSTANCES] = primitives->instances.surfaces;
+}
+
+static bool pack_leaves (primitives * primitives)
+/*! Fill the primitive arrays in the order of the BVH leaves, grouping the
+    primitives of each leaf by class, and point the leaves at them */
+{
+    bvh * bvh = primitives->bvh;
+    bvh_node * node;
+    int node_index, index, num_leaves = 0;
+    primitive_class class;
+
+    for (node_index = 0; node_index < bvh->num_nodes; node_index++)
+    {
+        num_leaves += bvh->nodes[node_index].count > 0;
+    }
+    primitives->leaves = malloc(sizeof(primitive_leaf) * (num_leaves + 1));
+    if (primitives->leaves == NULL)
+    {
+        return false;
+    }
+
+    /* Depth first order visits the leaves in the order of their surfaces */
+    num_leaves = 0;
+    for (node_index = 0; node_index < bvh->num_nodes; node_index++)
+    {
+        node = &bvh->nodes[node_index];
+        if (node->count == 0)
+        {
+            continue;
+        }
+        class_counts(primitives, primitives->leaves[num_leaves].first);
+        for (class = 0; class < NUM_CLASSES; class++)
+        {
+            for (index = node->first; index < node->first + node->count; index++)
+            {
+                if (class_of(&primitives->surfaces[bvh->primitives[index]]) == class)
+                {
+                    append_primitive(primitives, bvh->primitives[index]);
+                }
+            }
+        }
+        node->first = num_leaves++;
+    }
+    class_counts(primitives, primitives->leaves[num_leaves].first);
+    return true;
+}
+
+primitives * primitives_create (surface surfaces[])
+{
+    int counts[NUM_CLASSES] = { 0 };
+    int width = packet_width_supported();
+    primitives * result = calloc(1, sizeof(primitives));
+    if (result == NULL)
+    {
+        return NULL;
+    }
+
+    result->surfaces = surfaces;
+    for (result->num_surfaces = 0; surfaces[result->num_surfaces].class; result->num_surfaces++)
+    {
+        counts[class_of(&surfaces[result->num_surfaces])]++;
+    }
+
+    /* The leaves are made as wide as the kernels that test them */
+    result->kernels = packet_primitive_kernels(width);
+    result->bvh = bvh_create_grouped(surfaces, width);
+    if (result->bvh == NULL ||
+        !allocate_class(result, CLASS_SPHERES, counts[CLASS_SPHERES]) ||
+        !allocate_class(result, CLASS_FRUSTUMS, counts[CLASS_FRUSTUMS]) ||
+        !allocate_class(result, CLASS_CIRCLES, counts[CLASS_CIRCLES]) ||
+        !allocate_class(result, CLASS_QUADS, counts[CLASS_QUADS]) ||
+        !allocate_class(result, CLASS_MESHES, counts[CLASS_MESHES]) ||
+        !allocate_class(result, CLASS_INSTANCES, counts[CLASS_INSTANCES]) ||
+        !pack_leaves(result))
+    {
+        primitives_free(result);
+        return NULL;
+    }
+    return result;
+}
+
+void primitives_refit (primitives * primitives)
+{
+    int * surfaces[NUM_CLASSES];
+    bvh * bvh = primitives->bvh;
+    bvh_node * node;
+    primitive_leaf * leaf;
+    bounds box;
+    int node_index, index;
+    primitive_class class;
+
+    class_surfaces(primitives, surfaces);
+    for (node_index = 0; node_index < bvh->num_nodes; node_index++)
+    {
+        node = &bvh->nodes[node_index];
+        if (node->count == 0)
+        {
+            continue;
+        }
+        leaf = &primitives->leaves[node->first];
+        box = (bounds){ { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+        for (class = 0; class < NUM_CLASSES; class++)
+        {
+            for (index = leaf->first[class]; index < leaf[1].first[class]; index++)
+            {
+                box = bvh_bounds_union(box, bvh_surface_bounds(
+                                                &primitives->surfaces[surfaces[class][index]]));
+            }
+        }
+        node->box = box;
+    }
+    bvh_refit(bvh);
+}
+
+void primitives_blocks (primitives * primitives, primitives_block blocks_out[PRIMITIVES_NUM_BLOCKS])
+{
+    /* The first array of each class is the start of its block of fields */
+    void * fields[NUM_CLASSES];
+    int * surfaces[NUM_CLASSES];
+    int counts[NUM_CLASSES];
+    bvh * bvh = primitives->bvh;
+    int node_index, num_leaves = 0;
+    primitive_class class;
+
+    fields[CLASS_SPHERES] = primitives->spheres.centers.x;
+    fields[CLASS_FRUSTUMS] = primitives->frustums.centers[0].x;
+    fields[CLASS_CIRCLES] = primitives->circles.centers.x;
+    fields[CLASS_QUADS] = primitives->quads.vertices.x;
+    fields[CLASS_MESHES] = NULL;
+    fields[CLASS_INSTANCES] = NULL;
+    class_surfaces(primitives, surfaces);
+    class_counts(primitives, counts);
+    for (class = 0; class < NUM_CLASSES; class++)
+    {
+        blocks_out[2 * class].data = fields[class];
+        blocks_out[2 * class].size =
+            sizeof(float) * class_fields[class] * (counts[class] + PRIMITIVE_PADDING);
+        blocks_out[2 * class + 1].data = surfaces[class];
+        blocks_out[2 * class + 1].size = sizeof(int) * (counts[class] + PRIMITIVE_PADDING);
+    }
+
+    for (node_index = 0; node_index < bvh->num_nodes; node_index++)
+    {
+        num_leaves += bvh->nodes[node_index].count > 0;
+    }
+    blocks_out[2 * NUM_CLASSES].data = bvh->nodes;
+    blocks_out[2 * NUM_CLASSES].size = sizeof(bvh_node) * bvh->num_nodes;
+    blocks_out[2 * NUM_CLASSES + 1].data = bvh->primitives;
+    blocks_out[2 * NUM_CLASSES + 1].size = sizeof(int) * bvh->num_primitives;
+    blocks_out[2 * NUM_CLASSES + 2].data = primitives->leaves;
+    blocks_out[2 * NUM_CLASSES + 2].size = sizeof(primitive_leaf) * (num_leaves + 1);
+}
+
+bool primitives_blocks_valid (surface surfaces[],
+                              const primitives_block blocks[PRIMITIVES_NUM_BLOCKS])
+{
+    const primitive_leaf * leaves = blocks[2 * NUM_CLASSES + 2].data;
+    const bvh_node * nodes = blocks[2 * NUM_CLASSES].data;
+    const int * indices;
+    size_t counts[NUM_CLASSES], num_nodes, num_leaves, index;
+    int num_surfaces = 0, leaf_index = 0;
+    primitive_class class;
+
+    while (surfaces[num_surfaces].class)
+    {
+        num_surfaces++;
+    }
+    for (class = 0; class < NUM_CLASSES; class++)
+    {
+        if (blocks[2 * class + 1].size % sizeof(int) != 0 ||
+            blocks[2 * class + 1].size < sizeof(int) * PRIMITIVE_PADDING)
+        {
+            return false;
+        }
+        counts[class] = blocks[2 * class + 1].size / sizeof(int) - PRIMITIVE_PADDING;
+        if (blocks[2 * class].size !=
+            sizeof(float) * class_fields[class] * (counts[class] + PRIMITIVE_PADDING))
+        {
+            return false;
+        }
+        indices = blocks[2 * class + 1].data;
+        for (index = 0; index < counts[class]; index++)
+        {
+            if (indices[index] < 0 || indices[index] >= num_surfaces ||
+                class_of(&surfaces[indices[index]]) != class)
+            {
+                return false;
+            }
+        }
+    }
+
+    num_nodes = blocks[2 * NUM_CLASSES].size / sizeof(bvh_node);
+    num_leaves = blocks[2 * NUM_CLASSES + 2].size / sizeof(primitive_leaf);
+    if (blocks[2 * NUM_CLASSES].size % sizeof(bvh_node) != 0 || num_nodes > INT_MAX ||
+        blocks[2 * NUM_CLASSES + 1].size % sizeof(int) != 0 ||
+        blocks[2 * NUM_CLASSES + 2].size % sizeof(primitive_leaf) != 0 || num_leaves == 0 ||
+        !bvh_nodes_valid(nodes, num_nodes))
+    {
+        return false;
+    }
+    /* Each leaf's primitives run up to the next leaf's, so the leaves must
+       be numbered in order, and their starts must only ever grow */
+    for (index = 0; index < num_nodes; index++)
+    {
+        if (nodes[index].count > 0 && nodes[index].first != leaf_index++)
+        {
+            return false;
+        }
+    }
+    if ((size_t)leaf_index + 1 != num_leaves)
+    {
+        return false;
+    }
+    for (class = 0; class < NUM_CLASSES; class++)
+    {
+        for (index = 0; index < num_leaves; index++)
+        {
+            if (leaves[index].first[class] < (index > 0 ? leaves[index - 1].first[class] : 0) ||
+                (size_t)leaves[index].first[class] > counts[class])
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+primitives * primitives_from_blocks (surface surfaces[],
+                                     const primitives_block blocks[PRIMITIVES_NUM_BLOCKS])
+{
+    int counts[NUM_CLASSES];
+    primitives * result = calloc(1, sizeof(primitives));
+    bvh * bvh = malloc(sizeof(*bvh));
+    primitive_class class;
+
+    if (result == NULL || bvh == NULL)
+    {
+        free(result);
+        free(bvh);
+        return NULL;
+    }
+    result->surfaces = surfaces;
+    while (surfaces[result->num_surfaces].class)
+    {
+        result->num_surfaces++;
+    }
+    result->borrowed_arrays = true;
+    result->kernels = packet_primitive_kernels(packet_width_supported());
+
+    for (class = 0; class < NUM_CLASSES; class++)
+    {
+        counts[class] = blocks[2 * class + 1].size / sizeof(int) - PRIMITIVE_PADDING;
+        lay_out_class(result, class, blocks[2 * class].data, blocks[2 * class + 1].data,
+                      counts[class]);
+    }
+    result->spheres.count = counts[CLASS_SPHERES];
+    result->frustums.count = counts[CLASS_FRUSTUMS];
+    result->circles.count = counts[CLASS_CIRCLES];
+    result->quads.count = counts[CLASS_QUADS];
+    result->meshes.count = counts[CLASS_MESHES];
+    result->instances.count = counts[CLASS_INSTANCES];
+
+    bvh->nodes = blocks[2 * NUM_CLASSES].data;
+    bvh->num_nodes = blocks[2 * NUM_CLASSES].size / sizeof(bvh_node);
+    bvh->primitives = blocks[2 * NUM_CLASSES + 1].data;
+    bvh->num_primitives = blocks[2 * NUM_CLASSES + 1].size / sizeof(int);
+    result->bvh = bvh;
+    result->leaves = blocks[2 * NUM_CLASSES + 2].data;
+    return result;
+}
+
+void primitives_free (primitives * primitives)
+{
+    if (primitives && primitives->borrowed_arrays)
+    {
+        free(primitives->bvh);
+        free(primitives);
+    }
+    else if (primitives)
+    {
+        /* The first array of each class is the start of its block of fields */
+        if (primitives->spheres.surfaces)
+        {
+            free(primitives->spheres.centers.x);
+            free(primitives->spheres.surfaces);
+        }
+        if (primitives->frustums.surfaces)
+        {
+            free(primitives->frustums.centers[0].x);
+            free(primitives->frustums.surfaces);
+        }
+        if (primitives->circles.surfaces)
+        {
+            free(primitives->circles.centers.x);
+            free(primitives->circles.surfaces);
+        }
+        if (primitives->quads.surfaces)
+        {
+            free(primitives->quads.vertices.x);
+            free(primitives->quads.surfaces);
+        }
+        free(primitives->meshes.surfaces);
+        free(primitives->instances.surfaces);
+        bvh_free(primitives->bvh);
+        free(primitives->leaves);
+        free(primitives);
+    }
+}
+
+static __inline void record_hit (hit_query * query, int surface, float distance,
+                                 vector intersection)
+/*! Keep the intersection with the given surface, at the given distance from
+    the ray origin, if it is the closest so far, with ties going to the
+    earlier surface as they do in a linear search */
+{
+    if (distance < query->closest_distance ||
+        (distance == query->closest_distance && surface < query->closest))
+    {
+        query->closest_distance = distance;
+        query->closest = surface;
+        query->intersection = intersection;
+        query->max_t = distance / query->ray_length * bvh_distance_slack;
+    }
+}
+
+static void hit_spheres (sphere_array * spheres, int first, int end, hit_query * query)
+{
+    vector intersection;
+    int index;
+
+    stats_count_many(hit_tests[CLASS_SPHERES], end - first);
+    for (index = first; index < end; index++)
+    {
+        if (sphere_hit(query->origin, query->ray, query->unit_ray,
+                       vector_array_get(&spheres->centers, index), spheres->squared_radii[index],
+                       &intersection))
+        {
+            stats_count(hits[CLASS_SPHERES]);
+            record_hit(query, spheres->surfaces[index],
+                       vector_distance(query->origin, intersection), intersection);
+        }
+    }
+}
+
+static void hit_frustums (frustum_array * frustums, int first, int end, hit_query * query)
+{
+    vector intersection;
+    int index;
+
+    stats_count_many(hit_tests[CLASS_FRUSTUMS], end - first);
+    for (index = first; index < end; index++)
+    {
+        if (frustum_hit(query->origin, query->ray, query->unit_ray,
+                        vector_array_get(&frustums->centers[0], index),
+                        vector_array_get(&frustums->centers[1], index),
+                        frustums->radii[index], frustum_frame_get(frustums, index),
+                        &intersection))
+        {
+            stats_count(hits[CLASS_FRUSTUMS]);
+            record_hit(query, frustums->surfaces[index],
+                       vector_distance(query->origin, intersection), intersection);
+        }
+    }
+}
+
+static void hit_circles (circle_array * circles, int first, int end, hit_query * query)
+{
+    vector intersection;
+    int index;
+
+    stats_count_many(hit_tests[CLASS_CIRCLES], end - first);
+    for (index = first; index < end; index++)
+    {
+        if (circle_hit(query->origin, query->ray, vector_array_get(&circles->centers, index),
+                       vector_array_get(&circles->normals, index), circles->radii[index],
+                       &intersection))
+        {
+            stats_count(hits[CLASS_CIRCLES]);
+            record_hit(query, circles->surfaces[index],
+                       vector_distance(query->origin, intersection), intersection);
+        }
+    }
+}
+
+static void hit_quads (quad_array * quads, int first, int end, hit_query * query)
+{
+    vector intersection;
+    int index;
+
+    stats_count_many(hit_tests[CLASS_QUADS], end - first);
+    for (index = first; index < end; index++)
+    {
+        if (quad_hit(query->origin, query->ray, vector_array_get(&quads->vertices, index),
+                     quad_frame_get(quads, index), &intersection))
+        {
+            stats_count(hits[CLASS_QUADS]);
+            record_hit(query, quads->surfaces[index],
+                       vector_distance(query->origin, intersection), intersection);
+        }
+    }
+}
+
+static void hit_meshes (primitives * primitives, int first, int end, hit_query * query)
+/*! Test the ray against meshes, each of which searches its own BVH, with
+    the search bounded by the closest hit so far */
+{
+    mesh_array * meshes = &primitives->meshes;
+    surface * source;
+    vector intersection;
+    float t;
+    int index, triangle;
+
+    stats_count_many(hit_tests[CLASS_MESHES], end - first);
+    for (index = first; index < end; index++)
+    {
+        source = &primitives->surfaces[meshes->surfaces[index]];
+        if (mesh_hit(((mesh *)source->geometry)->triangles, query->origin, query->ray,
+                     query->max_t, &triangle, &t))
+        {
+            intersection = vector_add(query->origin, vector_multiply(t, query->ray));
+            stats_count(hits[CLASS_MESHES]);
+            record_hit(query, meshes->surfaces[index],
+                       vector_distance(query->origin, intersection), intersection);
+        }
+    }
+}
+
+static void hit_instances (primitives * primitives, int first, int end, hit_query * query)
+/*! Test the ray against instances, each of which searches its group, with
+    the search bounded by the closest hit so far */
+{
+    instance_array * instances = &primitives->instances;
+    surface * source;
+    vector intersection;
+    int index;
+
+    stats_count_many(hit_tests[CLASS_INSTANCES], end - first);
+    for (index = first; index < end; index++)
+    {
+        source = &primitives->surfaces[instances->surfaces[index]];
+        if (instance_hit((instance *)source->geometry, query->origin, query->ray, query->max_t,
+                         &intersection))
+        {
+            stats_count(hits[CLASS_INSTANCES]);
+            record_hit(query, instances->surfaces[index],
+                       vector_distance(query->origin, intersection), intersection);
+        }
+    }
+}
+
+static void hit_leaf_kernels (primitives * primitives, primitive_leaf * leaf, hit_query * query)
+/*! hit_leaf, testing several primitives at a time with the vector kernels.
+    Most leaves hold only some of the classes, and the empty runs are skipped
+    without a call. */
+{
+    const primitive_kernels * kernels = primitives->kernels;
+    primitive_leaf * next = leaf + 1;
+    vector intersection;
+    float distance;
+    int surface;
+
+    if (leaf->first[CLASS_SPHERES] < next->first[CLASS_SPHERES])
+    {
+        surface = kernels->closest_sphere(&primitives->spheres, leaf->first[CLASS_SPHERES],
+                                          next->first[CLASS_SPHERES], query->origin, query->ray,
+                                          query->unit_ray, &distance, &intersection);
+        if (surface >= 0)
+        {
+            record_hit(query, surface, distance, intersection);
+        }
+    }
+    if (leaf->first[CLASS_FRUSTUMS] < next->first[CLASS_FRUSTUMS])
+    {
+        surface = kernels->closest_frustum(&primitives->frustums, leaf->first[CLASS_FRUSTUMS],
+                                           next->first[CLASS_FRUSTUMS], query->origin, query->ray,
+                                           query->unit_ray, &distance, &intersection);
+        if (surface >= 0)
+        {
+            record_hit(query, surface, distance, intersection);
+        }
+    }
+    if (leaf->first[CLASS_CIRCLES] < next->first[CLASS_CIRCLES])
+    {
+        surface = kernels->closest_circle(&primitives->circles, leaf->first[CLASS_CIRCLES],
+                                          next->first[CLASS_CIRCLES], query->origin, query->ray,
+                                          query->unit_ray, &distance, &intersection);
+        if (surface >= 0)
+        {
+            record_hit(query, surface, distance, intersection);
+        }
+    }
+    if (leaf->first[CLASS_QUADS] < next->first[CLASS_QUADS])
+    {
+        surface = kernels->closest_quad(&primitives->quads, leaf->first[CLASS_QUADS],
+                                        next->first[CLASS_QUADS], query->origin, query->ray,
+                                        query->unit_ray, &distance, &intersection);
+        if (surface >= 0)
+        {
+            record_hit(query, surface, distance, intersection);
+        }
+    }
+    if (leaf->first[CLASS_MESHES] < next->first[CLASS_MESHES])
+    {
+        hit_meshes(primitives, leaf->first[CLASS_MESHES], next->first[CLASS_MESHES], query);
+    }
+    if (leaf->first[CLASS_INSTANCES] < next->first[CLASS_INSTANCES])
+    {
+        hit_instances(primitives, leaf->first[CLASS_INSTANCES], next->first[CLASS_INSTANCES],
+                      query);
+    }
+}
+
+static void hit_leaf (primitives * primitives, primitive_leaf * leaf, hit_query * query)
+/*! Test the ray of a closest hit search against the primitives of a leaf, class by class */
+{
+    primitive_leaf * next = leaf + 1;
+
+    if (primitives->kernels)
+    {
+        hit_leaf_kernels(primitives, leaf, query);
+        return;
+    }
+
+    hit_spheres(&primitives->spheres, leaf->first[CLASS_SPHERES], next->first[CLASS_SPHERES], query);
+    hit_frustums(&primitives->frustums, leaf->first[CLASS_FRUSTUMS], next->first[CLASS_FRUSTUMS], query);
+    hit_circles(&primitives->circles, leaf->first[CLASS_CIRCLES], next->first[CLASS_CIRCLES], query);
+    hit_quads(&primitives->quads, leaf->first[CLASS_QUADS], next->first[CLASS_QUADS], query);
+    hit_meshes(primitives, leaf->first[CLASS_MESHES], next->first[CLASS_MESHES], query);
+    hit_instances(primitives, leaf->first[CLASS_INSTANCES], next->first[CLASS_INSTANCES], query);
+}
+
+static void find_closest_hit (primitives * primitives, hit_query * query)
+/*! Traverse the BVH for the closest hit, as bvh_hit_surface in bvh.c does */
+{
+    int stack_nodes[BVH_MAX_STACK_DEPTH];
+    float stack_distances[BVH_MAX_STACK_DEPTH];
+    int top = 0;
+    int node_index = 0;
+    int left, right;
+    bvh * bvh = primitives->bvh;
+    bvh_node * node;
+    float t_left, t_right, t_root;
+    bool hit_left, hit_right;
+
+    if (bvh->num_nodes == 0 ||
+        !bvh_ray_hits_box(&bvh->nodes[0].box, query->origin, query->inverse, query->max_t, &t_root))
+    {
+        return;
+    }
+
+    while (true)
+    {
+        node = &bvh->nodes[node_index];
+        if (node->count > 0)
+        {
+            hit_leaf(primitives, &primitives->leaves[node->first], query);
+        }
+        else
+        {
+            left = node_index + 1;
+            right = node->first;
+            hit_left = bvh_ray_hits_box(&bvh->nodes[left].box, query->origin, query->inverse,
+                                        query->max_t, &t_left);
+            hit_right = bvh_ray_hits_box(&bvh->nodes[right].box, query->origin, query->inverse,
+                                         query->max_t, &t_right);
+            if (hit_left && hit_right)
+            {
+                if (t_right < t_left)
+                {
+                    stack_nodes[top] = left;
+                    stack_distances[top++] = t_left;
+                    node_index = right;
+                }
+                else
+                {
+                    stack_nodes[top] = right;
+                    stack_distances[top++] = t_right;
+                    node_index = left;
+                }
+                continue;
+            }
+            else if (hit_left || hit_right)
+            {
+                node_index = hit_left ? left : right;
+                continue;
+            }
+        }
+
+        do
+        {
+            if (top == 0)
+            {
+                return;
+            }
+            node_index = stack_nodes[--top];
+        } while (stack_distances[top] > query->max_t);
+    }
+}
+
+int primitives_closest_hit (primitives * primitives, vector origin, vector ray, float max_t,
+                            vector * intersection_out)
+{
+    hit_query query;
+
+    query.origin = origin;
+    query.ray = ray;
+    query.unit_ray = vector_normalize(ray);
+    query.inverse = bvh_inverse_direction(ray);
+    query.ray_length = vector_magnitude(ray);
+    query.closest_distance = INFINITY;
+    query.max_t = max_t;
+    query.closest = -1;
+
+    find_closest_hit(primitives, &query);
+    if (query.closest >= 0)
+    {
+        *intersection_out = query.intersection;
+    }
+    return query.closest;
+}
+
+surface * primitives_hit_surface (primitives * primitives, vector origin, vector ray,
+                                  vector * intersection_out, vector * normal_out)
+{
+    surface * closest_surface;
+    int closest = primitives_closest_hit(primitives, origin, ray, INFINITY, intersection_out);
+
+    if (closest < 0)
+    {
+        return NULL;
+    }
+
+    /* Only the closest surface needs a normal, which its class calculates,
+       and an instance's material is that of the surface of its group hit */
+    closest_surface = &primitives->surfaces[closest];
+    if (closest_surface->class == surface_instance)
+    {
+        return instance_hit_surface((instance *)closest_surface->geometry, origin, ray,
+                                    NULL, normal_out);
+    }
+    closest_surface->class->calculate_intersection(origin, ray, closest_surface->geometry,
+                                                   NULL, normal_out);
+    return closest_surface;
+}
+
+static int blocking_sphere (sphere_array * spheres, int first, int end,
+                            vector origin, vector ray, float max_distance)
+{
+    int index;
+    for (index = first; index < end; index++)
+    {
+        if (sphere_blocks(origin, ray, vector_array_get(&spheres->centers, index),
+                          spheres->squared_radii[index], max_distance))
+        {
+            return spheres->surfaces[index];
+        }
+    }
+    return -1;
+}
+
+static int blocking_frustum (frustum_array * frustums, int first, int end,
+                             vector origin, vector ray, float max_distance)
+{
+    int index;
+    for (index = first; index < end; index++)
+    {
+        if (frustum_blocks(origin, ray, vector_array_get(&frustums->centers[0], index),
+                           frustums->radii[index], frustum_frame_get(frustums, index),
+                           max_distance))
+        {
+            return frustums->surfaces[index];
+        }
+    }
+    return -1;
+}
+
+static int blocking_circle (circle_array * circles, int first, int end,
+                            vector origin, vector ray, float max_distance)
+{
+    int index;
+    for (index = first; index < end; index++)
+    {
+        if (circle_blocks(origin, ray, vector_array_get(&circles->centers, index),
+                          vector_array_get(&circles->normals, index),
+                          circles->squared_radii[index], max_distance))
+        {
+            return circles->surfaces[index];
+        }
+    }
+    return -1;
+}
+
+static int blocking_quad (quad_array * quads, int first, int end,
+                          vector origin, vector ray, float max_distance)
+{
+    int index;
+    for (index = first; index < end; index++)
+    {
+        if (quad_blocks(origin, ray, vector_array_get(&quads->vertices, index),
+                        quad_frame_get(quads, index), max_distance))
+        {
+            return quads->surfaces[index];
+        }
+    }
+    return -1;
+}
+
+static int blocking_mesh (primitives * primitives, int first, int end,
+                          vector origin, vector ray, float max_distance)
+{
+    mesh_array * meshes = &primitives->meshes;
+    surface * source;
+    int index;
+    for (index = first; index < end; index++)
+    {
+        source = &primitives->surfaces[meshes->surfaces[index]];
+        if (mesh_blocks(((mesh *)source->geometry)->triangles, origin, ray, max_distance))
+        {
+            return meshes->surfaces[index];
+        }
+    }
+    return -1;
+}
+
+static int blocking_instance (primitives * primitives, int first, int end,
+                              vector origin, vector ray, float max_distance)
+{
+    instance_array * instances = &primitives->instances;
+    surface * source;
+    int index;
+    for (index = first; index < end; index++)
+    {
+        source = &primitives->surfaces[instances->surfaces[index]];
+        if (instance_blocks((instance *)source->geometry, origin, ray, max_distance))
+        {
+            return instances->surfaces[index];
+        }
+    }
+    return -1;
+}
+
+static int run_length (primitive_leaf * leaf, primitive_class class)
+/*! The number of primitives of the given class in a leaf */
+{
+    return leaf[1].first[class] - leaf->first[class];
+}
+
+static int blocking_primitive (primitives * primitives, primitive_leaf * leaf,
+                               vector origin, vector ray, float max_distance)
+/*! Return the index in the surface array of a primitive of the leaf that
+    blocks the shadow ray, or -1 if there is none.  The shadow tests are
+    counted a run of primitives at a time, including those after a blocker. */
+{
+    const primitive_kernels * kernels = primitives->kernels;
+    primitive_leaf * next = leaf + 1;
+    int blocker;
+
+    if (kernels)
+    {
+        blocker = -1;
+        if (leaf->first[CLASS_SPHERES] < next->first[CLASS_SPHERES])
+        {
+            stats_count_many(occlusion_tests[CLASS_SPHERES], run_length(leaf, CLASS_SPHERES));
+            blocker = kernels->blocking_sphere(&primitives->spheres, leaf->first[CLASS_SPHERES],
+                                               next->first[CLASS_SPHERES], origin, ray,
+                                               max_distance);
+        }
+        if (blocker < 0 && leaf->first[CLASS_FRUSTUMS] < next->first[CLASS_FRUSTUMS])
+        {
+            stats_count_many(occlusion_tests[CLASS_FRUSTUMS], run_length(leaf, CLASS_FRUSTUMS));
+            blocker = kernels->blocking_frustum(&primitives->frustums, leaf->first[CLASS_FRUSTUMS],
+                                                next->first[CLASS_FRUSTUMS], origin, ray,
+                                                max_distance);
+        }
+        if (blocker < 0 && leaf->first[CLASS_CIRCLES] < next->first[CLASS_CIRCLES])
+        {
+            stats_count_many(occlusion_tests[CLASS_CIRCLES], run_length(leaf, CLASS_CIRCLES));
+            blocker = kernels->blocking_circle(&primitives->circles, leaf->first[CLASS_CIRCLES],
+                                               next->first[CLASS_CIRCLES], origin, ray,
+                                               max_distance);
+        }
+        if (blocker < 0 && leaf->first[CLASS_QUADS] < next->first[CLASS_QUADS])
+        {
+            stats_count_many(occlusion_tests[CLASS_QUADS], run_length(leaf, CLASS_QUADS));
+            blocker = kernels->blocking_quad(&primitives->quads, leaf->first[CLASS_QUADS],
+                                             next->first[CLASS_QUADS], origin, ray, max_distance);
+        }
+        if (blocker < 0 && leaf->first[CLASS_MESHES] < next->first[CLASS_MESHES])
+        {
+            stats_count_many(occlusion_tests[CLASS_MESHES], run_length(leaf, CLASS_MESHES));
+            blocker = blocking_mesh(primitives, leaf->first[CLASS_MESHES],
+                                    next->first[CLASS_MESHES], origin, ray, max_distance);
+        }
+        if (blocker < 0 && leaf->first[CLASS_INSTANCES] < next->first[CLASS_INSTANCES])
+        {
+            stats_count_many(occlusion_tests[CLASS_INSTANCES], run_length(leaf, CLASS_INSTANCES));
+            blocker = blocking_instance(primitives, leaf->first[CLASS_INSTANCES],
+                                        next->first[CLASS_INSTANCES], origin, ray, max_distance);
+        }
+        return blocker;
+    }
+
+    stats_count_many(occlusion_tests[CLASS_SPHERES], run_length(leaf, CLASS_SPHERES));
+    blocker = blocking_sphere(&primitives->spheres, leaf->first[CLASS_SPHERES],
+                              next->first[CLASS_SPHERES], origin, ray, max_distance);
+    if (blocker < 0)
+    {
+        stats_count_many(occlusion_tests[CLASS_FRUSTUMS], run_length(leaf, CLASS_FRUSTUMS));
+        blocker = blocking_frustum(&primitives->frustums, leaf->first[CLASS_FRUSTUMS],
+                                   next->first[CLASS_FRUSTUMS], origin, ray, max_distance);
+    }
+    if (blocker < 0)
+    {
+        stats_count_many(occlusion_tests[CLASS_CIRCLES], run_length(leaf, CLASS_CIRCLES));
+        blocker = blocking_circle(&primitives->circles, leaf->first[CLASS_CIRCLES],
+                                  next->first[CLASS_CIRCLES], origin, ray, max_distance);
+    }
+    if (blocker < 0)
+    {
+        stats_count_many(occlusion_tests[CLASS_QUADS], run_length(leaf, CLASS_QUADS));
+        blocker = blocking_quad(&primitives->quads, leaf->first[CLASS_QUADS],
+                                next->first[CLASS_QUADS], origin, ray, max_distance);
+    }
+    if (blocker < 0)
+    {
+        stats_count_many(occlusion_tests[CLASS_MESHES], run_length(leaf, CLASS_MESHES));
+        blocker = blocking_mesh(primitives, leaf->first[CLASS_MESHES],
+                                next->first[CLASS_MESHES], origin, ray, max_distance);
+    }
+    if (blocker < 0)
+    {
+        stats_count_many(occlusion_tests[CLASS_INSTANCES], run_length(leaf, CLASS_INSTANCES));
+        blocker = blocking_instance(primitives, leaf->first[CLASS_INSTANCES],
+                                    next->first[CLASS_INSTANCES], origin, ray, max_distance);
+    }
+    return blocker;
+}
+
+bool primitives_is_occluded (primitives * primitives, vector origin, vector ray,
+                             float max_distance, surface ** occluder_cache)
+{
+    int stack[BVH_MAX_STACK_DEPTH];
+    int top = 0;
+    int node_index, blocker;
+    bvh * bvh = primitives->bvh;
+    bvh_node * node;
+    surface * cached;
+    vector inverse = bvh_inverse_direction(ray);
+    float max_t = max_distance * bvh_distance_slack;
+    float t_near;
+
+    if (occluder_cache && *occluder_cache)
+    {
+        cached = *occluder_cache;
+        stats_count(occluder_cache_tests);
+        /* The cache may be left over from another scene */
+        if (cached >= primitives->surfaces && cached < primitives->surfaces + primitives->num_surfaces &&
+            cached->class->test_occlusion(origin, ray, cached->geometry, max_distance))
+        {
+            stats_count(occluder_cache_hits);
+            return true;
+        }
+    }
+
+    if (bvh->num_nodes == 0)
+    {
+        return false;
+    }
+
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        node_index = stack[--top];
+        node = &bvh->nodes[node_index];
+        if (!bvh_ray_hits_box(&node->box, origin, inverse, max_t, &t_near))
+        {
+            continue;
+        }
+        if (node->count > 0)
+        {
+            blocker = blocking_primitive(primitives, &primitives->leaves[node->first],
+                                         origin, ray, max_distance);
+            if (blocker >= 0)
+            {
+                stats_count(occlusions[class_of(&primitives->surfaces[blocker])]);
+                if (occluder_cache)
+                {
+                    *occluder_cache = &primitives->surfaces[blocker];
+                }
+                return true;
+            }
+        }
+        else
+        {
+            stack[top++] = node->first;
+            stack[top++] = node_index + 1;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "surface.h"
+#include "bvh.h"
+#include "vector.h"
+
+/* This module stores the geometry of a scene's surfaces the way the ray
+   tracer reads it: class by class, one array per geometric quantity.
+
+   The surface array of scene.h mixes every class of surface in one list and
+   keeps each surface's material next to an opaque block of geometry, which is
+   handed to the class's intersection function through a function pointer.
+   That suits loading and describing a scene, but it is a poor fit for the
+   inner loop of the ray tracer, which tests a ray against many surfaces and
+   only needs the material of the one it hits.  Here the spheres of a scene
+   are stored together, with their center coordinates and radii in separate
+   arrays, and likewise for each other class.  A single BVH covers all the
+   surfaces, and each class's arrays are ordered like the leaves of the tree,
+   so a leaf holds a consecutive run of entries of each class.  The leaves are
+   tested class by class, a run at a time, with the vector kernels of
+   packet.h testing a ray against several entries at once.  The tree is
+   built with leaves as wide as those kernels.  Without vector kernels, the
+   entries are tested one by one with the kernels of intersect.h.
+
+   The arrays hold the geometry in the form the kernels use it, baked when
+   the arrays are made: squared radii instead of radii, the axis frame of
+   each frustum, and the normal and edge directions of each quad.
+
+   Triangle meshes (see mesh.h) hold their triangles and a BVH of their own,
+   so each mesh is one entry here, which is only its surface index.  Meshes
+   are tested one at a time, with the rays of a packet also tested one at
+   a time.
+
+   Instances (see instance.h) are likewise one entry each, and each is tested
+   by tracing the ray through the primitives of its group.
+
+   Materials stay in the surface array.  Each primitive refers back to its
+   surface by index, and the surface found by a query is looked up there.
+*/
+
+/* The primitive arrays, in the order a leaf's primitives are tested */
+typedef enum
+{
+    CLASS_SPHERES,
+    CLASS_FRUSTUMS,
+    CLASS_CIRCLES,
+    CLASS_QUADS,
+    CLASS_MESHES,
+    CLASS_INSTANCES,
+    NUM_CLASSES,
+} primitive_class;
+
+/* Coordinates of a series of points or directions, one array per axis */
+typedef struct
+{
+    float * x;
+    float * y;
+    float * z;
+} vector_array;
+
+typedef struct
+{
+    int count;
+    vector_array centers;
+    float * squared_radii;
+    /* Index of each sphere's surface in the surface array */
+    int * surfaces;
+} sphere_array;
+
+typedef struct
+{
+    int count;
+    vector_array centers[2];
+    /* Radius at the first center, and the frustum_frame members */
+    float * radii;
+    vector_array axes;
+    float * lengths;
+    float * slopes;
+    int * surfaces;
+} frustum_array;
+
+typedef struct
+{
+    int count;
+    vector_array centers;
+    vector_array normals;
+    float * radii;
+    float * squared_radii;
+    int * surfaces;
+} circle_array;
+
+typedef struct
+{
+    int count;
+    /* The middle vertex, and the quad_frame members */
+    vector_array vertices;
+    vector_array normals;
+    vector_array across[2];
+    float * widths[2];
+    int * surfaces;
+} quad_array;
+
+typedef struct
+{
+    int count;
+    int * surfaces;
+} mesh_array;
+
+typedef struct
+{
+    int count;
+    int * surfaces;
+} instance_array;
+
+/* The primitives of a BVH leaf.  The leaf's primitives of each class are
+   the entries of that class's arrays from first[class] up to the first entry
+   of the next leaf. */
+typedef struct
+{
+    int first[NUM_CLASSES];
+} primitive_leaf;
+
+/* Functions testing one ray against the primitives of a class from index
+   "first" up to "end", several at a time with vector instructions (see
+   packet.h).  They give the same results as the kernels of intersect.h.
+
+   The "closest" functions return the surface index of the closest primitive
+   hit, ties going to the lowest surface index, and output its distance from
+   the origin and the intersection, or return -1 if none is hit.  The
+   "blocking" functions return the surface index of the first primitive that
+   blocks a shadow ray, in array order, or -1 if there is none. */
+typedef struct
+{
+    int (*closest_sphere) (const sphere_array * spheres, int first, int end,
+                           vector origin, vector ray, vector unit_ray,
+                           float * distance_out, vector * intersection_out);
+    int (*closest_frustum) (const frustum_array * frustums, int first, int end,
+                            vector origin, vector ray, vector unit_ray,
+                            float * distance_out, vector * intersection_out);
+    int (*closest_circle) (const circle_array * circles, int first, int end,
+                           vector origin, vector ray, vector unit_ray,
+                           float * distance_out, vector * intersection_out);
+    int (*closest_quad) (const quad_array * quads, int first, int end,
+                         vector origin, vector ray, vector unit_ray,
+                         float * distance_out, vector * intersection_out);
+    int (*blocking_sphere) (const sphere_array * spheres, int first, int end,
+                            vector origin, vector ray, float max_distance);
+    int (*blocking_frustum) (const frustum_array * frustums, int first, int end,
+                             vector origin, vector ray, float max_distance);
+    int (*blocking_circle) (const circle_array * circles, int first, int end,
+                            vector origin, vector ray, float max_distance);
+    int (*blocking_quad) (const quad_array * quads, int first, int end,
+                          vector origin, vector ray, float max_distance);
+} primitive_kernels;
+
+/* Each array has room for this many entries beyond its last primitive, so
+   that vector loads of a group of primitives never run past its end */
+#define PRIMITIVE_PADDING 8
+
+typedef struct
+{
+    /* The sentinel terminated surface array the primitives were made from */
+    surface * surfaces;
+    int num_surfaces;
+    sphere_array spheres;
+    frustum_array frustums;
+    circle_array circles;
+    quad_array quads;
+    mesh_array meshes;
+    instance_array instances;
+    /* BVH over all the surfaces.  The "first" member of its leaf nodes is
+       an index into the leaves array, which has one extra entry at the end
+       holding the number of primitives of each class. */
+    bvh * bvh;
+    primitive_leaf * leaves;
+    /* The vector kernels the leaves are tested with, the widest the processor
+       supports, or NULL to test one primitive at a time */
+    const primitive_kernels * kernels;
+    /* Whether the arrays above belong to someone else, such as a mapped
+       compiled scene, and aren't freed with the primitives */
+    bool borrowed_arrays;
+} primitives;
+
+/* The arrays of primitives, as blocks of memory that can be saved and used
+   again in place, in the order primitives_blocks outputs them: the fields
+   and the surface indices of each class, in the order of primitive_class,
+   then the BVH nodes, the BVH primitive indices and the leaves */
+#define PRIMITIVES_NUM_BLOCKS (2 * NUM_CLASSES + 3)
+
+typedef struct
+{
+    void * data;
+    size_t size;
+} primitives_block;
+
+/*! Make the packed primitive arrays for a sentinel terminated surface array,
+    as defined in scene.h, and build a BVH over them.  The surface array must
+    outlive the result.  Return NULL if memory could not be allocated. */
+primitives * primitives_create (surface surfaces[]);
+
+/*! Release primitives returned by primitives_create or primitives_from_blocks */
+void primitives_free (primitives * primitives);
+
+/*! Fit the boxes of the BVH of "primitives" to its surfaces again, after
+    instances among them have moved (see bvh_refit).  Only instances can
+    move, since the other classes' geometry is baked into the arrays. */
+void primitives_refit (primitives * primitives);
+
+/*! Output the blocks of memory holding the arrays of "primitives" */
+void primitives_blocks (primitives * primitives, primitives_block blocks_out[PRIMITIVES_NUM_BLOCKS]);
+
+/*! Determine whether blocks read from somewhere they may have been
+    corrupted can be used by primitives_from_blocks for a sentinel terminated
+    surface array: that their sizes agree, the BVH is well formed, and every
+    index in them is in range and names a surface of the right class. */
+bool primitives_blocks_valid (surface surfaces[],
+                              const primitives_block blocks[PRIMITIVES_NUM_BLOCKS]);
+
+/*! Make primitives for a sentinel terminated surface array that use the
+    blocks of primitives made for the same surfaces in place, as output by
+    primitives_blocks.  The blocks must outlive the result, and they are not
+    freed with it.  Return NULL if memory could not be allocated. */
+primitives * primitives_from_blocks (surface surfaces[],
+                                     const primitives_block blocks[PRIMITIVES_NUM_BLOCKS]);
+
+/*! Find the closest surface hit by a ray, as primitives_hit_surface does,
+    among the hits at a ray parameter of at most max_t, though farther ones may
+    be found too.  Return its index in the surface array and output the
+    intersection, or return -1 if there is none.  Instances are not resolved
+    to the surfaces of their groups. */
+int primitives_closest_hit (primitives * primitives, vector origin, vector ray, float max_t,
+                            vector * intersection_out);
+
+/*! Find the closest surface hit by a ray, as hit_surface in ray_trace.c does.
+    The same surface is found as with a linear search through the surface
+    array; ties in distance go to the earlier surface.  A ray that hits an
+    instance hits a surface of its group (see instance.h). */
+surface * primitives_hit_surface (primitives * primitives, vector origin, vector ray,
+                                  vector * intersection_out, vector * normal_out);
+
+/*! Determine if any surface is hit by a ray with the given origin and
+    normalized direction at a distance less than max_distance from the origin.
+    "occluder_cache" works as it does for bvh_is_occluded in bvh.h. */
+bool primitives_is_occluded (primitives * primitives, vector origin, vector ray,
+                             float max_distance, surface ** occluder_cache);
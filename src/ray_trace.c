@@ -2,6 +2,8 @@
 #include "surface.h"
 #include "vector.h"
 #include "scene.h"
+#include "instance.h"
+#include "stats.h"
 
 #include <math.h>
 #include <string.h>
@@ -40,6 +42,19 @@
 
    Add the calculated subtotals together to determine the color of the ray: 
    ray color = transmitted + reflected + diffuse
+
+   Each ray carries a throughput weight: the factor by which its color is scaled on the way into
+   the pixel, the product of the specular parts and coefficients along its path.  A ray's color
+   is assumed to be at most 1, the brightest color an image can show, so the weight bounds what
+   the ray can add to the pixel.  Reflected and refracted rays whose weight is below the scene's
+   min_contribution in every component are pruned, giving no color, which skips the branches of
+   the tree too dim to change the image.
+
+   With the scene's russian_roulette setting, a ray that would both reflect and refract follows
+   only one of them, chosen at random with the probabilities c_reflected and c_transmitted.  The
+   chosen ray's color is divided by its probability, cancelling its coefficient, so the color
+   is right on average but noisy.  The random choice is a hash of the ray, so it is the same for
+   any number of threads and either engine.
 */
 
 bool get_intersection (vector origin, vector ray, surface * test_surface,
@@ -99,6 +114,7 @@ float fresnel_refraction (vector ray, vector normal, float refraction_index,
     if (cos2_t < 0)
     {
         /* Imaginary square root: total internal reflection */
+        stats_count(total_internal_reflections);
         return 1.0f;
     }
     cos_t = sqrtf(cos2_t);
@@ -144,7 +160,30 @@ surface * hit_surface (vector origin, vector ray, surface surfaces[],
 */
 {
     surface * closest_surface = NULL;
-    /* Implement me! */
+    surface * cur_surface;
+    vector intersection, normal;
+    float distance, closest_distance = INFINITY;
+
+    for (cur_surface = surfaces; cur_surface->class; cur_surface++)
+    {
+        if (get_intersection(origin, ray, cur_surface, &intersection, &normal))
+        {
+            distance = vector_distance(origin, intersection);
+            if (distance < closest_distance)
+            {
+                closest_distance = distance;
+                closest_surface = cur_surface;
+                *intersection_out = intersection;
+                *normal_out = normal;
+            }
+        }
+    }
+    /* An instance's material is that of the surface of its group hit */
+    if (closest_surface && closest_surface->class == surface_instance)
+    {
+        closest_surface = instance_hit_surface((instance *)closest_surface->geometry, origin, ray,
+                                               NULL, normal_out);
+    }
     return closest_surface;
 }
 
@@ -156,14 +195,85 @@ bool is_illuminated (light_source * source, vector point, surface surfaces[])
     If the point is in the light, return true, otherwise return false.
 */
 {
-    vector shadow_ray;
+    vector shadow_ray, intersection;
+    surface * cur_surface;
+    float light_distance;
     /* Ray directions must be normalized, since the ray tracing framework
        assumes they are.  The shadow ray is calculated and normalized for you below. */
     shadow_ray = vector_normalize(vector_sub(source->position, point));
-    /* Implement me! */
+    light_distance = vector_distance(point, source->position);
+
+    for (cur_surface = surfaces; cur_surface->class; cur_surface++)
+    {
+        if (get_intersection(point, shadow_ray, cur_surface, &intersection, NULL) &&
+            vector_distance(point, intersection) < light_distance)
+        {
+            return false;
+        }
+    }
     return true;
 }
 
+/* For each light, the surface that last blocked a shadow ray to it on this thread.
+   Neighboring points tend to be shadowed by the same surface, so it is tested
+   before anything else.  Lights beyond the size of the cache share entries. */
+#define OCCLUDER_CACHE_SIZE 64
+static __thread surface * last_occluders[OCCLUDER_CACHE_SIZE];
+
+bool light_is_visible (light_source * source, int light_index, vector point,
+                       surface surfaces[], primitives * primitives)
+/*! Determine if the given point is in the light of the given light source as
+    is_illuminated does.  With packed primitives, this is an any-hit search
+    that stops at the first blocking surface found, starting with the surface
+    that blocked the last shadow ray to the same light. */
+{
+    bool visible;
+
+    stats_count(shadow_rays);
+    if (primitives)
+    {
+        visible = !primitives_is_occluded(primitives, point,
+                                          vector_normalize(vector_sub(source->position, point)),
+                                          vector_distance(point, source->position),
+                                          &last_occluders[light_index % OCCLUDER_CACHE_SIZE]);
+    }
+    else
+    {
+        visible = is_illuminated(source, point, surfaces);
+    }
+    if (!visible)
+    {
+        stats_count(blocked_shadow_rays);
+    }
+    return visible;
+}
+
+static color illuminate (vector point, vector ray, vector normal,
+                         light_source light_sources[], surface surfaces[],
+                         primitives * primitives)
+{
+    color illumination = { .0f, .0f, .0f };
+    light_source * source;
+    float c_diffuse;
+    /* The normal needs to be inverted if we're inside a surface before calculating
+       illumination.  This is done for you below */
+    if (dot_product(ray, normal) > 0)
+    {
+        normal = vector_negate(normal);
+    }
+
+    for (source = light_sources; source->type != LIGHT_SOURCE_SENTINEL; source++)
+    {
+        c_diffuse = get_diffuse_coefficient(point, normal, source);
+        if (c_diffuse > .0f &&
+            light_is_visible(source, source - light_sources, point, surfaces, primitives))
+        {
+            illumination = color_add(illumination, color_scale(c_diffuse, source->color));
+        }
+    }
+    return illumination;
+}
+
 color get_illumination (vector point, vector ray, vector normal,
                         light_source light_sources[], surface surfaces[])
 /*! Determine the diffuse illumination of the given point on a surface with the given
@@ -173,15 +283,149 @@ color get_illumination (vector point, vector ray, vector normal,
     coefficient calculated by the get_diffuse_coefficient function.
 */
 {
-    color illumination = { .0f, .0f, .0f };
-    /* The normal needs to be inverted if we're inside a surface before calculating
-       illumination.  This is done for you below */
-    if (dot_product(ray, normal) > 0)
+    return illuminate(point, ray, normal, light_sources, surfaces, NULL);
+}
+
+surface * scene_hit_surface (scene * scene, vector origin, vector ray,
+                             vector * intersection_out, vector * normal_out)
+{
+    if (scene->primitives)
     {
-        normal = vector_negate(normal);
+        return primitives_hit_surface(scene->primitives, origin, ray, intersection_out, normal_out);
     }
-    /* Implement me! */
-    return illumination;
+    return hit_surface(origin, ray, scene->surfaces, intersection_out, normal_out);
+}
+
+static float roulette_random (vector intersection, vector ray)
+/*! A number from 0 up to 1 that depends only on the given ray, which is
+    random enough for Russian roulette */
+{
+    float values[6] = { intersection.x, intersection.y, intersection.z, ray.x, ray.y, ray.z };
+    unsigned int bits, hash = 2166136261u;
+    int index;
+
+    for (index = 0; index < 6; index++)
+    {
+        memcpy(&bits, &values[index], sizeof(bits));
+        hash = (hash ^ bits) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return (float)(hash >> 8) / 16777216.0f;
+}
+
+static float max_component (color c)
+{
+    float max_rg = c.r > c.g ? c.r : c.g;
+    return max_rg > c.b ? max_rg : c.b;
+}
+
+void split_specular (scene * scene, vector intersection, vector ray, color weight,
+                     color specular_part, float c_reflected, bool traced,
+                     float coefficients_out[2], color weights_out[2])
+{
+    int index;
+
+    coefficients_out[0] = c_reflected;
+    coefficients_out[1] = 1.0f - c_reflected;
+    if (scene->russian_roulette && c_reflected > .0f && c_reflected < 1.0f)
+    {
+        /* The chosen ray's coefficient over its probability is 1 */
+        index = roulette_random(intersection, ray) < c_reflected ? 1 : 0;
+        coefficients_out[index] = .0f;
+        coefficients_out[1 - index] = 1.0f;
+        stats_count(roulette_rays);
+    }
+    for (index = 0; index < 2; index++)
+    {
+        if (coefficients_out[index] > .0f)
+        {
+            weights_out[index] = color_scale(coefficients_out[index],
+                                             color_multiply(weight, specular_part));
+            if (max_component(weights_out[index]) < scene->min_contribution)
+            {
+                coefficients_out[index] = .0f;
+                stats_count(pruned_rays);
+            }
+            else if (traced && index == 0)
+            {
+                stats_count(secondary_rays);
+                stats_count(reflected_rays);
+            }
+            else if (traced)
+            {
+                stats_count(secondary_rays);
+                stats_count(refracted_rays);
+            }
+        }
+    }
+}
+
+static color trace_ray (scene * scene, vector origin, vector ray, int depth, color weight)
+/*! cast_ray, for a ray with the given throughput weight */
+{
+    surface * closest_surface;
+    vector intersection, normal;
+
+    if (depth == 0)
+    {
+        return scene->background_color;
+    }
+
+    closest_surface = scene_hit_surface(scene, origin, ray, &intersection, &normal);
+    if (closest_surface == NULL)
+    {
+        return scene->background_color;
+    }
+    return shade_surface(scene, ray, closest_surface, intersection, normal, depth, weight);
+}
+
+color shade_surface (scene * scene, vector ray, surface * surface,
+                     vector intersection, vector normal, int depth, color weight)
+/*! Determine the color of a ray with given direction, recursion depth limit "depth" and
+    throughput weight that first hits the given surface at the given intersection point, where
+    the surface has the given normal.  This is the part of cast_ray that follows finding the
+    surface hit.
+*/
+{
+    color result = { .0f, .0f, .0f };
+    color reflected, transmitted, illumination;
+    color weights[2];
+    vector refracted_ray;
+    float coefficients[2];
+
+    if (is_color(surface->specular_part))
+    {
+        split_specular(scene, intersection, ray, weight, surface->specular_part,
+                       fresnel_refraction(ray, normal, surface->refraction_index, &refracted_ray),
+                       depth > 1, coefficients, weights);
+        reflected = transmitted = result;
+        /* Rays without depth left count at depth 0 (see stats.h) */
+        if (coefficients[0] > .0f)
+        {
+            stats_count(depth_rays[stats_depth(depth - 1)]);
+            reflected = color_scale(coefficients[0],
+                                    trace_ray(scene, intersection, reflect_ray(ray, normal),
+                                              depth - 1, weights[0]));
+        }
+        if (coefficients[1] > .0f)
+        {
+            stats_count(depth_rays[stats_depth(depth - 1)]);
+            transmitted = color_scale(coefficients[1],
+                                      trace_ray(scene, intersection, refracted_ray, depth - 1,
+                                                weights[1]));
+        }
+        result = color_multiply(surface->specular_part, color_add(transmitted, reflected));
+    }
+
+    if (is_color(surface->diffuse_part))
+    {
+        illumination = illuminate(intersection, ray, normal,
+                                  scene->light_sources, scene->surfaces, scene->primitives);
+        result = color_add(result, color_multiply(surface->diffuse_part, illumination));
+    }
+    return result;
 }
 
 color cast_ray (scene * scene, vector origin, vector ray, int depth)
@@ -193,9 +437,6 @@ color cast_ray (scene * scene, vector origin, vector ray, int depth)
     addition functions defined in color.h will be useful here.
 */
 {
-    color result = { .0f, .0f, .0f };
-    /* Implement me!
-       Be careful to avoid unnecessary function calls, especially ray casting calls for
-       rays that will have no contribution! */
-    return result;
+    color white = { 1.0f, 1.0f, 1.0f };
+    return trace_ray(scene, origin, ray, depth, white);
 }
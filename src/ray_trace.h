@@ -3,3 +3,46 @@
 #include "scene.h"
 
 color cast_ray (scene * scene, vector origin, vector ray, int depth);
+
+/*! Find the closest surface of the scene hit by a ray, as cast_ray does,
+    outputting the intersection and normal, or return NULL if there is none */
+surface * scene_hit_surface (scene * scene, vector origin, vector ray,
+                             vector * intersection_out, vector * normal_out);
+
+/*! Determine the color of a ray of recursion depth limit "depth" (at least 1)
+    and throughput weight "weight" (white for camera rays) that first hits
+    "surface" at "intersection", where its normal is "normal", as cast_ray
+    does once it has found the surface hit */
+color shade_surface (scene * scene, vector ray, surface * surface,
+                     vector intersection, vector normal, int depth, color weight);
+
+/* The steps of cast_ray, for engines that schedule them differently */
+
+/*! Determine the reflection coefficient of a ray hitting a surface with the
+    given normal and relative refraction index, outputting the refracted ray
+    if the coefficient is less than 1 */
+float fresnel_refraction (vector ray, vector normal, float refraction_index,
+                          vector * refracted_ray_out);
+
+/*! Decide which of the reflected and refracted rays of a ray with throughput
+    weight "weight" hitting a specular surface at "intersection" are traced,
+    following the scene's pruning and Russian roulette settings.  Output the
+    coefficients their colors are scaled by, which are 0 for rays that aren't
+    traced, and their weights.  The rays kept are only counted as traced if
+    "traced" is true; otherwise they have no depth left, and take the
+    background color without being traced. */
+void split_specular (scene * scene, vector intersection, vector ray, color weight,
+                     color specular_part, float c_reflected, bool traced,
+                     float coefficients_out[2], color weights_out[2]);
+
+/*! Determine the reflection of a ray from a surface with the given normal */
+vector reflect_ray (vector ray, vector surface_normal);
+
+/*! Determine the cosine shading coefficient of a light source at a point on a
+    surface with the given normal, facing the incoming ray */
+float get_diffuse_coefficient (vector point, vector normal, light_source * source);
+
+/*! Determine if a point is in the light of the light source at index
+    "light_index" of the scene, as cast_ray does, counting the shadow ray */
+bool light_is_visible (light_source * source, int light_index, vector point,
+                       surface surfaces[], primitives * primitives);
@@ -0,0 +1,824 @@
+#include "render.h"
+#include "ray_trace.h"
+#include "packet.h"
+#include "wavefront.h"
+#include "vector.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+const int depth = 8;
+
+/* Tiles are square blocks of TILE_SIZE by TILE_SIZE pixels.  They are small
+   enough that expensive areas of the image (like refractive surfaces) are
+   split across many tiles for the workers to share, and large enough that
+   the scheduling cost per tile is insignificant. */
+#define TILE_SIZE 16
+
+/* The number of pixels in a tile */
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+/* Progressive rendering first traces every COARSE_STEP-th pixel of every
+   COARSE_STEP-th row, which must divide TILE_SIZE */
+#define COARSE_STEP 8
+
+typedef struct
+{
+    scene * scene;
+    const render_settings * settings;
+    /* The image, or the band of it from row first_row (counted from the top
+       of the image) down that is being rendered.  When streaming, the rows
+       wrap around to the top of the band after band_rows rows. */
+    color * image;
+    int first_row;
+    int band_rows;
+    int tiles_wide;
+    /* The pixels rendered, the whole image or the settings' region, which
+       the image and the tiles cover */
+    render_region area;
+    /* For adaptive antialiasing, the surface hit by each pixel's camera ray,
+       and whether each pixel is supersampled, in the order of the image */
+    surface ** hits;
+    bool * refine;
+    /* Tasks trace the pixels at every step-th column of every step-th row,
+       except those at multiples of traced_step, which are already traced
+       (0 if none are), and fill the rest from those */
+    int step;
+    int traced_step;
+    /* The tile of each task, or NULL for the tile numbered as the task */
+    const int * tiles;
+    /* The time after which tasks do nothing, or 0 for none */
+    double deadline;
+    /* When streaming, the next tile to render, counted from the top left of
+       the image, and for each of the window of num_bands rows of tiles in
+       memory, the row of tiles it holds, counted from the top, and the
+       number of tiles of that row yet to finish.  A row of tiles takes over
+       the memory of the row num_bands above it once that has gone to the
+       sink, which band_free signals.  The function the rows go to, and
+       whether it has failed. */
+    int next_tile;
+    int num_bands;
+    int * band_rows_held;
+    int * tiles_left;
+    pthread_mutex_t band_lock;
+    pthread_cond_t band_free;
+    row_sink * sink;
+    void * sink_context;
+    bool sink_failed;
+    /* Counts collected from each worker */
+    ray_stats * worker_stats;
+    /* The settings' costs of the pixels, stored as the image is, or NULL if
+       they aren't measured */
+    float * cost;
+} render_job;
+
+static vector camera_ray (scene * scene, float x, float y)
+/*! The direction of the camera ray through the point at column x, row y of
+    the image, pixel centers being at whole numbers */
+{
+    float theta, phi;
+    resolution * res = &scene->camera.resolution;
+    direction * dir = &scene->camera.direction;
+
+    float h_angle = scene->camera.view_angle;
+    float v_angle = h_angle * (float)res->height / (float)res->width;
+
+    phi = v_angle * ((float)y / (float)(res->height - 1) - 0.5f);
+    theta = h_angle * -((float)x / (float)(res->width - 1) - 0.5f);
+
+    return vector_rotate(vector_theta_phi(theta, phi), dir->theta, dir->phi);
+}
+
+color render_pixel (scene * scene, int x, int y)
+{
+    return cast_ray(scene, scene->camera.position, camera_ray(scene, x, y), depth);
+}
+
+static size_t pixel_index (render_job * job, int x, int y)
+/*! The index in the job's image of the pixel at column x, row y */
+{
+    resolution * res = &job->scene->camera.resolution;
+    int row = res->height - y - 1 - job->area.y0 - job->first_row;
+
+    if (job->band_rows > 0)
+    {
+        row %= job->band_rows;
+    }
+    return (size_t)row * (job->area.x1 - job->area.x0) + x - job->area.x0;
+}
+
+static unsigned long long read_cycles (void)
+/*! The processor's cycle counter, or nanoseconds where there is none */
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+static unsigned long long cost_so_far (render_cost cost)
+/*! The calling thread's count of what costs are measured in, so far */
+{
+    unsigned long long count = 0;
+    int index;
+
+    switch (cost)
+    {
+        case COST_RAYS:
+            /* Camera rays are counted once they are all traced, and the
+               reflected and refracted rays only as they are traced, not
+               those left at the last bounce (see split_specular) */
+            count = thread_stats.secondary_rays + thread_stats.shadow_rays;
+            break;
+        case COST_TESTS:
+            for (index = 0; index < STATS_NUM_CLASSES; index++)
+            {
+                count += thread_stats.hit_tests[index] + thread_stats.occlusion_tests[index];
+            }
+            break;
+        case COST_CYCLES:
+            count = read_cycles();
+            break;
+    }
+    return count;
+}
+
+static void trace_camera_rays (render_job * job, const vector rays[], int count,
+                               color colors_out[], surface * hits_out[], float costs_out[])
+/*! Determine the colors of "count" camera rays and the surfaces they hit
+    first with the job's engine and packet width, or if the job measures
+    costs, one at a time, with the cost of each */
+{
+    scene * scene = job->scene;
+    int width = job->settings->packet_width;
+    vector intersections[PACKET_MAX_WIDTH], normals[PACKET_MAX_WIDTH];
+    color white = { 1.0f, 1.0f, 1.0f };
+    render_cost cost = job->settings->cost;
+    unsigned long long before = 0;
+    int first, size, index;
+
+    if (job->settings->engine == ENGINE_WAVEFRONT && job->cost == NULL)
+    {
+        wavefront_trace(scene, scene->camera.position, rays, count, depth, width,
+                        colors_out, hits_out);
+        return;
+    }
+    if (width == 1 || scene->primitives == NULL || job->cost)
+    {
+        /* One ray at a time, as cast_ray traces it */
+        for (index = 0; index < count; index++)
+        {
+            if (job->cost)
+            {
+                before = cost_so_far(cost);
+            }
+            hits_out[index] = scene_hit_surface(scene, scene->camera.position, rays[index],
+                                                &intersections[0], &normals[0]);
+            colors_out[index] = hits_out[index]
+                                    ? shade_surface(scene, rays[index], hits_out[index],
+                                                    intersections[0], normals[0], depth, white)
+                                    : scene->background_color;
+            if (job->cost)
+            {
+                costs_out[index] = (float)(cost_so_far(cost) - before) + (cost == COST_RAYS);
+            }
+        }
+        return;
+    }
+
+    /* Packets find the surfaces hit, and then each ray is shaded on its own,
+       since the rays reflected and refracted from there no longer travel
+       together */
+    for (first = 0; first < count; first += size)
+    {
+        size = count - first < width ? count - first : width;
+        packet_hit_surfaces(scene->primitives, width, scene->camera.position, rays + first, size,
+                            hits_out + first, intersections, normals);
+        for (index = 0; index < size; index++)
+        {
+            colors_out[first + index] =
+                hits_out[first + index]
+                    ? shade_surface(scene, rays[first + index], hits_out[first + index],
+                                    intersections[index], normals[index], depth, white)
+                    : scene->background_color;
+        }
+    }
+}
+
+static void tile_bounds (render_job * job, int tile, int * x0, int * y0, int * x1, int * y1)
+/*! The tile covers pixels *x0 to *x1 - 1 of rows *y0 to *y1 - 1 */
+{
+    resolution * res = &job->scene->camera.resolution;
+    int bottom = res->height - job->area.y1, top = res->height - job->area.y0;
+
+    /* Rows of the area count from the top of the image, and tile rows from
+       the bottom */
+    *x0 = job->area.x0 + (tile % job->tiles_wide) * TILE_SIZE;
+    *y0 = bottom + (tile / job->tiles_wide) * TILE_SIZE;
+    *x1 = *x0 + TILE_SIZE < job->area.x1 ? *x0 + TILE_SIZE : job->area.x1;
+    *y1 = *y0 + TILE_SIZE < top ? *y0 + TILE_SIZE : top;
+}
+
+static int step_offset (render_job * job, int x, int y, int step, int * y_offset_out)
+/*! Output the offsets of the pixel at column x, row y from the corner of
+    its step by step block, counted from the bottom left of the area */
+{
+    *y_offset_out = (y - (job->scene->camera.resolution.height - job->area.y1)) % step;
+    return (x - job->area.x0) % step;
+}
+
+static bool pixel_is_traced (render_job * job, int x, int y, int step)
+{
+    int y_offset;
+    return step > 0 && step_offset(job, x, y, step, &y_offset) == 0 && y_offset == 0;
+}
+
+static void fill_tile (render_job * job, int x0, int y0, int x1, int y1)
+/*! Give each pixel of the tile that isn't traced yet the color of the traced
+    pixel at the corner of its step by step block */
+{
+    int step = job->step;
+    int x, y, x_offset, y_offset;
+
+    for (y = y0; y < y1; y++)
+    {
+        for (x = x0; x < x1; x++)
+        {
+            x_offset = step_offset(job, x, y, step, &y_offset);
+            if (x_offset != 0 || y_offset != 0)
+            {
+                job->image[pixel_index(job, x, y)] =
+                    job->image[pixel_index(job, x - x_offset, y - y_offset)];
+            }
+        }
+    }
+}
+
+static bool job_is_stopped (render_job * job)
+/*! Determine if tiles are to be left as they are, because the deadline has
+    passed or the render is cancelled */
+{
+    return (job->deadline > 0 && render_clock() > job->deadline) ||
+           (job->settings->cancel && __atomic_load_n(job->settings->cancel, __ATOMIC_RELAXED));
+}
+
+static void render_tile (void * context, int task, int worker)
+/*! Trace one camera ray through the center of each pixel of the task's tile
+    that the pass traces */
+{
+    render_job * job = context;
+    vector rays[TILE_PIXELS];
+    color colors[TILE_PIXELS];
+    surface * hits[TILE_PIXELS];
+    float costs[TILE_PIXELS];
+    int pixels[TILE_PIXELS][2];
+    size_t pixel;
+    int tile = job->tiles ? job->tiles[task] : task;
+    int x0, y0, x1, y1, x, y, count = 0, index;
+
+    if (job_is_stopped(job))
+    {
+        return;
+    }
+
+    tile_bounds(job, tile, &x0, &y0, &x1, &y1);
+    for (y = y0; y < y1; y++)
+    {
+        for (x = x0; x < x1; x++)
+        {
+            if (pixel_is_traced(job, x, y, job->step) &&
+                !pixel_is_traced(job, x, y, job->traced_step))
+            {
+                pixels[count][0] = x;
+                pixels[count][1] = y;
+                rays[count++] = camera_ray(job->scene, x, y);
+            }
+        }
+    }
+    if (count > 0)
+    {
+        trace_camera_rays(job, rays, count, colors, hits, costs);
+        stats_count_many(camera_rays, count);
+    }
+    for (index = 0; index < count; index++)
+    {
+        pixel = pixel_index(job, pixels[index][0], pixels[index][1]);
+        job->image[pixel] = colors[index];
+        if (job->hits)
+        {
+            job->hits[pixel] = hits[index];
+        }
+        if (job->cost)
+        {
+            job->cost[pixel] += costs[index];
+        }
+    }
+    if (job->step > 1)
+    {
+        fill_tile(job, x0, y0, x1, y1);
+    }
+
+    if (job->worker_stats)
+    {
+        stats_collect(&job->worker_stats[worker]);
+    }
+}
+
+static void supersample_pixels (render_job * job, const int pixels[][2], int num_pixels,
+                                vector rays[], color colors[], surface * hits[], float costs[])
+/*! Trace a grid of samples through each of the given pixels, given by column
+    and row, and store the average of each pixel's samples to the image */
+{
+    scene * scene = job->scene;
+    int samples = job->settings->samples;
+    int per_pixel = samples * samples;
+    float x, y, scale = 1.0f / (float)per_pixel;
+    color sum;
+    size_t image_pixel;
+    int pixel, i, j, index = 0;
+
+    /* The samples are at the centers of a grid of samples by samples cells
+       dividing the pixel */
+    for (pixel = 0; pixel < num_pixels; pixel++)
+    {
+        for (j = 0; j < samples; j++)
+        {
+            y = (float)pixels[pixel][1] + ((float)j + .5f) / (float)samples - .5f;
+            for (i = 0; i < samples; i++)
+            {
+                x = (float)pixels[pixel][0] + ((float)i + .5f) / (float)samples - .5f;
+                rays[index++] = camera_ray(scene, x, y);
+            }
+        }
+    }
+    trace_camera_rays(job, rays, index, colors, hits, costs);
+
+    for (pixel = 0; pixel < num_pixels; pixel++)
+    {
+        sum = colors[pixel * per_pixel];
+        for (index = 1; index < per_pixel; index++)
+        {
+            sum = color_add(sum, colors[pixel * per_pixel + index]);
+        }
+        image_pixel = pixel_index(job, pixels[pixel][0], pixels[pixel][1]);
+        job->image[image_pixel] = color_scale(scale, sum);
+        for (index = 0; job->cost && index < per_pixel; index++)
+        {
+            job->cost[image_pixel] += costs[pixel * per_pixel + index];
+        }
+    }
+    stats_count_many(antialiased_pixels, num_pixels);
+    stats_count_many(antialias_rays, num_pixels * per_pixel);
+}
+
+static void supersample_tile (void * context, int task, int worker)
+/*! Supersample the pixels of the task's tile that are to be refined, or all
+    of them for uniform antialiasing, tracing their samples in batches */
+{
+    render_job * job = context;
+    int tile = job->tiles ? job->tiles[task] : task;
+    vector rays[TILE_PIXELS];
+    color colors[TILE_PIXELS];
+    surface * hits[TILE_PIXELS];
+    float costs[TILE_PIXELS];
+    int pixels[TILE_PIXELS][2];
+    int per_batch = TILE_PIXELS / (job->settings->samples * job->settings->samples);
+    int x0, y0, x1, y1, x, y, num_pixels = 0;
+
+    if (job_is_stopped(job))
+    {
+        return;
+    }
+
+    tile_bounds(job, tile, &x0, &y0, &x1, &y1);
+    for (y = y0; y < y1; y++)
+    {
+        for (x = x0; x < x1; x++)
+        {
+            if (job->refine && !job->refine[pixel_index(job, x, y)])
+            {
+                continue;
+            }
+            pixels[num_pixels][0] = x;
+            pixels[num_pixels][1] = y;
+            if (++num_pixels == per_batch)
+            {
+                supersample_pixels(job, pixels, num_pixels, rays, colors, hits, costs);
+                num_pixels = 0;
+            }
+        }
+    }
+    if (num_pixels > 0)
+    {
+        supersample_pixels(job, pixels, num_pixels, rays, colors, hits, costs);
+    }
+
+    if (job->worker_stats)
+    {
+        stats_collect(&job->worker_stats[worker]);
+    }
+}
+
+static bool pixels_differ (render_job * job, size_t a, size_t b)
+/*! Determine if the pixels at indices a and b of the image are on an edge */
+{
+    color * ca = &job->image[a], * cb = &job->image[b];
+    float contrast = job->settings->contrast;
+
+    return job->hits[a] != job->hits[b] ||
+           fabsf(ca->r - cb->r) > contrast || fabsf(ca->g - cb->g) > contrast ||
+           fabsf(ca->b - cb->b) > contrast;
+}
+
+static void find_edges (render_job * job)
+/*! Mark the pixels that differ from the pixel to their right or below them,
+    and those pixels, to be refined */
+{
+    int width = job->area.x1 - job->area.x0, height = job->area.y1 - job->area.y0;
+    size_t pixel;
+    int x, y;
+
+    for (y = 0; y < height; y++)
+    {
+        for (x = 0; x < width; x++)
+        {
+            pixel = (size_t)y * width + x;
+            if (x + 1 < width && pixels_differ(job, pixel, pixel + 1))
+            {
+                job->refine[pixel] = job->refine[pixel + 1] = true;
+            }
+            if (y + 1 < height && pixels_differ(job, pixel, pixel + width))
+            {
+                job->refine[pixel] = job->refine[pixel + width] = true;
+            }
+        }
+    }
+}
+
+double render_clock (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static bool tile_is_interesting (render_job * job, int tile)
+/*! Determine if the tile overlaps the region of interest */
+{
+    resolution * res = &job->scene->camera.resolution;
+    const render_region * interest = &job->settings->interest;
+    int x0, y0, x1, y1;
+
+    tile_bounds(job, tile, &x0, &y0, &x1, &y1);
+    /* Rows of the region count from the top of the image, and tile rows
+       from the bottom */
+    return x0 < interest->x1 && interest->x0 < x1 &&
+           y0 < res->height - interest->y0 && res->height - interest->y1 < y1;
+}
+
+static void refine_tiles (render_job * job, thread_pool * pool, const int tiles[], int num_tiles)
+/*! Run the passes that follow the coarse pass over the given tiles */
+{
+    job->tiles = tiles;
+    for (job->step = COARSE_STEP / 2; job->step >= 1 && num_tiles > 0; job->step /= 2)
+    {
+        if (job_is_stopped(job))
+        {
+            return;
+        }
+        job->traced_step = job->step * 2;
+        thread_pool_run(pool, render_tile, job, num_tiles);
+        if (job->settings->progress)
+        {
+            job->settings->progress(job->settings->progress_context, job->image);
+        }
+    }
+}
+
+static void render_progressive (render_job * job, thread_pool * pool, int num_tiles)
+/*! Render the image in passes, from coarse to fine, until the deadline */
+{
+    int * order = malloc(sizeof(int) * num_tiles);
+    int tile, num_interesting = 0, num_ordered;
+
+    /* The coarse pass always runs in full, so there is an image */
+    job->step = COARSE_STEP;
+    job->traced_step = 0;
+    thread_pool_run(pool, render_tile, job, num_tiles);
+    if (job->settings->progress)
+    {
+        job->settings->progress(job->settings->progress_context, job->image);
+    }
+
+    job->deadline = job->settings->deadline;
+    if (order == NULL)
+    {
+        refine_tiles(job, pool, NULL, num_tiles);
+        return;
+    }
+    /* The tiles in the region of interest go first */
+    for (tile = 0; tile < num_tiles; tile++)
+    {
+        if (tile_is_interesting(job, tile))
+        {
+            order[num_interesting++] = tile;
+        }
+    }
+    num_ordered = num_interesting;
+    for (tile = 0; tile < num_tiles; tile++)
+    {
+        if (!tile_is_interesting(job, tile))
+        {
+            order[num_ordered++] = tile;
+        }
+    }
+    refine_tiles(job, pool, order, num_interesting);
+    refine_tiles(job, pool, order + num_interesting, num_tiles - num_interesting);
+    job->tiles = NULL;
+    free(order);
+}
+
+static render_region whole_image (scene * scene)
+{
+    return (render_region){ 0, 0, scene->camera.resolution.width,
+                            scene->camera.resolution.height };
+}
+
+static void render_area (scene * scene, thread_pool * pool, const render_settings * settings,
+                         render_region area, color image_out[], ray_stats * stats_out)
+/*! Render the pixels of "area" of the image into "image_out" */
+{
+    int width = area.x1 - area.x0, height = area.y1 - area.y0;
+    size_t num_pixels = (size_t)width * height;
+    int tiles_high = (height + TILE_SIZE - 1) / TILE_SIZE;
+    int num_workers = thread_pool_size(pool);
+    int num_tiles, worker;
+    bool traced;
+    render_job job = { scene, settings, image_out, 0, 0, (width + TILE_SIZE - 1) / TILE_SIZE,
+                       area };
+
+    num_tiles = job.tiles_wide * tiles_high;
+    job.worker_stats = calloc(num_workers, sizeof(ray_stats));
+    job.cost = settings->cost_out;
+    if (settings->antialias == ANTIALIAS_ADAPTIVE)
+    {
+        job.hits = malloc(sizeof(surface *) * num_pixels);
+        job.refine = calloc(num_pixels, sizeof(bool));
+    }
+
+    if (settings->deadline > 0)
+    {
+        render_progressive(&job, pool, num_tiles);
+    }
+    else
+    {
+        job.step = 1;
+        thread_pool_run(pool, render_tile, &job, num_tiles);
+    }
+
+    /* Progressive rendering only antialiases images that are fully traced,
+       which they are if the deadline hasn't passed yet, and cancelled
+       renders stop here */
+    traced = (settings->deadline == 0 || render_clock() <= settings->deadline) &&
+             !(settings->cancel && __atomic_load_n(settings->cancel, __ATOMIC_RELAXED));
+    if (traced && settings->antialias == ANTIALIAS_UNIFORM)
+    {
+        thread_pool_run(pool, supersample_tile, &job, num_tiles);
+    }
+    /* Without the memory to find edges, the image is left as it is */
+    else if (traced && settings->antialias == ANTIALIAS_ADAPTIVE && job.hits && job.refine)
+    {
+        find_edges(&job);
+        thread_pool_run(pool, supersample_tile, &job, num_tiles);
+    }
+
+    if (stats_out && job.worker_stats)
+    {
+        for (worker = 0; worker < num_workers; worker++)
+        {
+            stats_add(stats_out, &job.worker_stats[worker]);
+        }
+    }
+    free(job.worker_stats);
+    free(job.hits);
+    free(job.refine);
+}
+
+/* A render of a region through a render of a larger region around it */
+typedef struct
+{
+    const render_settings * settings;
+    render_region area;
+    render_region grown;
+    color * image;
+} cropped_render;
+
+static void crop_pixels (cropped_render * crop, const void * grown_pixels, void * pixels_out,
+                         size_t pixel_size)
+/*! Copy the pixels of the region, of "pixel_size" bytes each, from those
+    of the larger region */
+{
+    int width = crop->area.x1 - crop->area.x0, grown_width = crop->grown.x1 - crop->grown.x0;
+    int y;
+
+    for (y = crop->area.y0; y < crop->area.y1; y++)
+    {
+        memcpy((char *)pixels_out + pixel_size * (y - crop->area.y0) * width,
+               (const char *)grown_pixels +
+                   pixel_size * ((size_t)(y - crop->grown.y0) * grown_width + crop->area.x0 -
+                                 crop->grown.x0),
+               pixel_size * width);
+    }
+}
+
+static void crop_progress (void * context, color image[])
+/*! Pass the region of each pass of a progressive render on */
+{
+    cropped_render * crop = context;
+    crop_pixels(crop, image, crop->image, sizeof(color));
+    crop->settings->progress(crop->settings->progress_context, crop->image);
+}
+
+void render (scene * scene, thread_pool * pool, const render_settings * settings,
+             color image_out[], ray_stats * stats_out)
+{
+    const render_region * region = &settings->region;
+    resolution * res = &scene->camera.resolution;
+    cropped_render crop = { settings, *region, *region, image_out };
+    render_settings grown_settings = *settings;
+    color * grown_image;
+    size_t grown_pixels;
+
+    if (region->x0 >= region->x1 || region->y0 >= region->y1)
+    {
+        render_area(scene, pool, settings, whole_image(scene), image_out, stats_out);
+        return;
+    }
+    /* Adaptive antialiasing finds the edges of a region's pixels with all of
+       their neighbors, and so a pixel more on each side */
+    if (settings->antialias == ANTIALIAS_ADAPTIVE)
+    {
+        crop.grown = (render_region){ region->x0 > 0 ? region->x0 - 1 : 0,
+                                      region->y0 > 0 ? region->y0 - 1 : 0,
+                                      region->x1 < res->width ? region->x1 + 1 : res->width,
+                                      region->y1 < res->height ? region->y1 + 1 : res->height };
+    }
+    grown_pixels = (size_t)(crop.grown.x1 - crop.grown.x0) * (crop.grown.y1 - crop.grown.y0);
+    grown_image = memcmp(&crop.grown, region, sizeof(render_region)) == 0
+                      ? NULL
+                      : malloc(sizeof(color) * grown_pixels);
+    grown_settings.cost_out = settings->cost_out && grown_image
+                                  ? calloc(grown_pixels, sizeof(float))
+                                  : NULL;
+    /* Without the memory for the larger region, edges are only found
+       between the region's pixels */
+    if (grown_image == NULL || (settings->cost_out && grown_settings.cost_out == NULL))
+    {
+        free(grown_image);
+        render_area(scene, pool, settings, *region, image_out, stats_out);
+        return;
+    }
+    if (settings->progress)
+    {
+        grown_settings.progress = crop_progress;
+        grown_settings.progress_context = &crop;
+    }
+    render_area(scene, pool, &grown_settings, crop.grown, grown_image, stats_out);
+    crop_pixels(&crop, grown_image, image_out, sizeof(color));
+    if (settings->cost_out)
+    {
+        crop_pixels(&crop, grown_settings.cost_out, settings->cost_out, sizeof(float));
+    }
+    free(grown_settings.cost_out);
+    free(grown_image);
+}
+
+static void stream_tiles (void * context, int task, int worker)
+/*! Render tiles from the top of the image down until none are left, and
+    pass each row of tiles on to the sink once its last tile is done */
+{
+    render_job * job = context;
+    resolution * res = &job->scene->camera.resolution;
+    int tiles_high = (res->height + TILE_SIZE - 1) / TILE_SIZE;
+    int next, row, band, tile_row, y1, first_row;
+
+    /* A tile is only taken while the render goes on, and every tile taken
+       is finished, so that the rows waited for below always are */
+    while (!job_is_stopped(job) && !__atomic_load_n(&job->sink_failed, __ATOMIC_RELAXED))
+    {
+        next = __atomic_fetch_add(&job->next_tile, 1, __ATOMIC_RELAXED);
+        if (next >= job->tiles_wide * tiles_high)
+        {
+            return;
+        }
+        row = next / job->tiles_wide;
+        band = row % job->num_bands;
+        if (__atomic_load_n(&job->band_rows_held[band], __ATOMIC_ACQUIRE) != row)
+        {
+            pthread_mutex_lock(&job->band_lock);
+            while (job->band_rows_held[band] != row)
+            {
+                pthread_cond_wait(&job->band_free, &job->band_lock);
+            }
+            pthread_mutex_unlock(&job->band_lock);
+        }
+
+        tile_row = tiles_high - 1 - row;
+        render_tile(context, tile_row * job->tiles_wide + next % job->tiles_wide, worker);
+        if (job->settings->antialias == ANTIALIAS_UNIFORM)
+        {
+            supersample_tile(context, tile_row * job->tiles_wide + next % job->tiles_wide,
+                             worker);
+        }
+        if (__atomic_sub_fetch(&job->tiles_left[band], 1, __ATOMIC_ACQ_REL) > 0)
+        {
+            continue;
+        }
+
+        y1 = (tile_row + 1) * TILE_SIZE < res->height ? (tile_row + 1) * TILE_SIZE : res->height;
+        first_row = res->height - y1;
+        if (!job_is_stopped(job) &&
+            job->sink(job->sink_context, &job->image[pixel_index(job, 0, y1 - 1)], first_row,
+                      y1 - tile_row * TILE_SIZE))
+        {
+            __atomic_store_n(&job->sink_failed, true, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_lock(&job->band_lock);
+        job->tiles_left[band] = job->tiles_wide;
+        __atomic_store_n(&job->band_rows_held[band], row + job->num_bands, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&job->band_free);
+        pthread_mutex_unlock(&job->band_lock);
+    }
+}
+
+int render_streaming (scene * scene, thread_pool * pool, const render_settings * settings,
+                      row_sink * sink, void * sink_context, ray_stats * stats_out)
+{
+    resolution * res = &scene->camera.resolution;
+    int tiles_high = (res->height + TILE_SIZE - 1) / TILE_SIZE;
+    int num_workers = thread_pool_size(pool);
+    int band, worker, result = 0;
+    render_job job = { scene, settings, NULL, 0, 0, (res->width + TILE_SIZE - 1) / TILE_SIZE,
+                       whole_image(scene) };
+
+    /* Two rows of tiles per worker are in memory at a time, so that workers
+       go on to the rows below one that is slow to finish */
+    job.num_bands = 2 * num_workers < tiles_high ? 2 * num_workers : tiles_high;
+    job.band_rows = TILE_SIZE * job.num_bands;
+    /* The top row of tiles is the one cut short if the height isn't a
+       multiple of the tile size, so each row of tiles starts a band */
+    job.first_row = res->height - TILE_SIZE * tiles_high;
+    job.image = malloc(sizeof(color) * res->width * job.band_rows);
+    job.band_rows_held = malloc(sizeof(int) * job.num_bands);
+    job.tiles_left = malloc(sizeof(int) * job.num_bands);
+    job.worker_stats = calloc(num_workers, sizeof(ray_stats));
+    job.sink = sink;
+    job.sink_context = sink_context;
+    job.step = 1;
+    if (job.image == NULL || job.band_rows_held == NULL || job.tiles_left == NULL)
+    {
+        result = -1;
+    }
+    else
+    {
+        for (band = 0; band < job.num_bands; band++)
+        {
+            job.band_rows_held[band] = band;
+            job.tiles_left[band] = job.tiles_wide;
+        }
+        pthread_mutex_init(&job.band_lock, NULL);
+        pthread_cond_init(&job.band_free, NULL);
+        /* One task per worker, each taking tiles in order as it goes */
+        thread_pool_run(pool, stream_tiles, &job, num_workers);
+        pthread_cond_destroy(&job.band_free);
+        pthread_mutex_destroy(&job.band_lock);
+        if (job.sink_failed || job_is_stopped(&job))
+        {
+            result = -1;
+        }
+    }
+
+    if (stats_out && job.worker_stats)
+    {
+        for (worker = 0; worker < num_workers; worker++)
+        {
+            stats_add(stats_out, &job.worker_stats[worker]);
+        }
+    }
+    free(job.worker_stats);
+    free(job.tiles_left);
+    free(job.band_rows_held);
+    free(job.image);
+    return result;
+}
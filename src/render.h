@@ -0,0 +1,154 @@
+#pragma once
+
+#include "scene.h"
+#include "thread_pool.h"
+#include "stats.h"
+
+/* This module drives the rendering of a whole image.  The image is divided
+   into square tiles which are traced in parallel by the workers of a thread
+   pool.  Every pixel is computed by the same sequence of operations no matter
+   which worker traces it, so the image is identical for any number of threads.
+
+   Camera rays through neighboring pixels of a row can be traced together as
+   packets (see packet.h), which finds exactly the same surfaces as tracing
+   them one at a time, so the image is the same for any packet width too.
+
+   Tiles can also be traced by the wavefront engine (see wavefront.h), which
+   traces all the rays of a tile one bounce at a time instead of one pixel at
+   a time, and produces the same image as the recursive engine.
+
+   With antialiasing, some pixels are traced again as a grid of samples
+   spread over the pixel, and their color is the average of the samples.
+   Adaptive antialiasing first traces every pixel once, then supersamples
+   only the pixels on an edge: those whose camera ray hits a different
+   surface than a neighboring pixel's, or whose color differs from a
+   neighbor's by more than a contrast threshold.  Uniform antialiasing
+   supersamples every pixel.
+
+   Progressive rendering produces the best image it can by a deadline.  It
+   first traces every 8th pixel of every 8th row, filling the 8 by 8 block
+   of pixels below and to the right of each with its color, then traces
+   every 4th pixel in the same way, and so on until every pixel is traced,
+   and finally antialiases the image if asked to.  Once the deadline passes,
+   no further tiles are refined.  The tiles covering a region of interest
+   are refined in full before the rest of the image.  A fully refined image
+   is identical to one rendered without a deadline.
+
+   A render can cover only a region of the image, whose pixels are the same
+   as in a render of the whole image.  For adaptive antialiasing, the pixels
+   around the region are traced too, to find the edges along its sides.  A
+   render can also be cancelled from another thread, which leaves the tiles
+   not yet started as they are.
+
+   A render can also measure what each pixel costs, in rays traced,
+   intersection tests or processor cycles, for a heatmap of the image.  The
+   rays of each pixel are then traced one at a time by the recursive engine,
+   so that what is measured is the pixel's own work, and the image is the
+   same as ever.
+
+   Streaming renders an image too large to hold in memory a few rows of
+   tiles at a time, with two rows of tiles per worker in memory.  The worker
+   that finishes the last tile of a row of tiles hands its pixels on to be
+   saved, and its memory goes to the next row of tiles down, while the other
+   workers carry on with the rows they are rendering. */
+
+/* The engine that traces the rays of a tile */
+typedef enum
+{
+    ENGINE_RECURSIVE,
+    ENGINE_WAVEFRONT
+} render_engine;
+
+/* Which pixels are supersampled */
+typedef enum
+{
+    ANTIALIAS_NONE,
+    ANTIALIAS_ADAPTIVE,
+    ANTIALIAS_UNIFORM
+} render_antialias;
+
+/* What the cost of a pixel is measured in: the rays traced for it, the
+   tests of those rays against primitives, or the processor's cycles, read
+   with rdtsc where there is one and in nanoseconds elsewhere */
+typedef enum
+{
+    COST_RAYS,
+    COST_TESTS,
+    COST_CYCLES
+} render_cost;
+
+/* The largest number of samples per side of a supersampled pixel */
+#define RENDER_MAX_SAMPLES 8
+
+/* A rectangle of pixels from column x0 and row y0, counted from the top
+   left of the image, up to but not including column x1 and row y1 */
+typedef struct
+{
+    int x0, y0, x1, y1;
+} render_region;
+
+/* How the renderer traces an image */
+typedef struct
+{
+    render_engine engine;
+    /* Number of camera rays traced together as a packet: 4, 8 if the
+       processor supports it (see packet_width_supported), or 1 for none */
+    int packet_width;
+    render_antialias antialias;
+    /* Supersampled pixels are traced with a grid of samples by samples rays,
+       up to RENDER_MAX_SAMPLES */
+    int samples;
+    /* Adaptive antialiasing supersamples pixels where a color component
+       differs from a neighboring pixel's by more than this */
+    float contrast;
+    /* For progressive rendering, the time (see render_clock) after which
+       the image is no longer refined, or 0 to render the image in full */
+    double deadline;
+    /* Progressive rendering refines this region first, if it isn't empty */
+    render_region interest;
+    /* If this region isn't empty, only its pixels are rendered, and the
+       image holds just them.  It must lie within the image. */
+    render_region region;
+    /* If not NULL, the render stops as soon as the flag it points to is set,
+       which another thread may do at any time */
+    bool * cancel;
+    /* If not NULL, called with "progress_context" and the image after each
+       pass of progressive rendering */
+    void (*progress) (void * context, color image[]);
+    void * progress_context;
+    /* If not NULL, the cost of each pixel, measured in "cost", is added to
+       this array of floats, which must start as zeros and is stored as the
+       image is */
+    float * cost_out;
+    render_cost cost;
+} render_settings;
+
+/* A function that takes rows of a rendered image, "num_rows" rows of colors
+   from row "first_row", counted from the top of the image, down.  It may be
+   called from several threads at once.  It returns 0 on success. */
+typedef int row_sink (void * context, const color rows[], int first_row, int num_rows);
+
+/*! Return the time in seconds since an arbitrary point, which only moves
+    forward */
+double render_clock (void);
+
+/*! Determine the color of the pixel at column x, row y of the camera image,
+    row 0 being the bottom row of the output image */
+color render_pixel (scene * scene, int x, int y);
+
+/*! Render the scene into "image_out", an array of width * height colors stored
+    from the top row of the image, or of the settings' region, to the bottom,
+    using the workers of "pool".
+    If "stats_out" is not NULL, the render's counts are added to it. */
+void render (scene * scene, thread_pool * pool, const render_settings * settings,
+             color image_out[], ray_stats * stats_out);
+
+/*! Render the scene as render does, but a band of rows at a time, handing
+    each group of rows to "sink" as soon as it is done and holding only a
+    few of them in memory.  Progressive rendering and adaptive antialiasing
+    need the whole image, so the deadline and the region are ignored, and
+    antialiasing is only done if it is uniform.  Pixel costs aren't
+    measured.  Return 0, or -1 if memory runs out, the sink fails or the
+    render is cancelled. */
+int render_streaming (scene * scene, thread_pool * pool, const render_settings * settings,
+                      row_sink * sink, void * sink_context, ray_stats * stats_out);
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "surface.h"
+#include "primitives.h"
 #include "vector.h"
 #include "color.h"
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef enum
 {
     LIGHT_SOURCE_STANDARD,
@@ -50,4 +54,25 @@ typedef struct
        a surface with class NULL.  See surface.h for the definition of
        a surface */
     surface * surfaces;
+    /* The groups of surfaces that the scene's instances place copies of
+       (see instance.h).  Their surfaces aren't in the array above. */
+    struct instance_group * groups;
+    int num_groups;
+    /* Packed copy of the surface geometry with an acceleration structure,
+       made once the scene is loaded (see primitives.h).  Scenes without it
+       are traced by testing every surface. */
+    primitives * primitives;
+    /* The keys that move the camera, light sources and instances from frame
+       to frame, or NULL if the scene is still (see animation.h) */
+    struct animation * animation;
+    /* Reflected and refracted rays that can't add this much to any color
+       component of a pixel aren't traced, and with russian_roulette, rays
+       follow either their reflection or their refraction at random (see
+       ray_trace.c).  Both are off when 0. */
+    float min_contribution;
+    bool russian_roulette;
+    /* The mapping of a compiled scene file that the arrays above point
+       into, or NULL if they were allocated (see compiled_scene.h) */
+    void * mapping;
+    size_t mapping_size;
 } scene;
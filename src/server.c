@@ -0,0 +1,1173 @@
+#include "server.h"
+#include "input_file.h"
+#include "output_file.h"
+#include "animation.h"
+#include "primitives.h"
+#include "instance.h"
+#include "mesh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+/* The longest request line */
+#define REQUEST_MAX 4096
+
+/* The largest image width or height a request can ask for */
+#define MAX_RESOLUTION 32768
+
+/* A client that takes none of its replies for this many seconds is hung up
+   on, and the replies waiting for it are dropped */
+#define REPLY_TIMEOUT 30
+
+/* A reply waiting to be sent, followed by its bytes */
+typedef struct reply_buffer
+{
+    size_t size;
+    size_t sent;
+    struct reply_buffer * next;
+} reply_buffer;
+
+typedef struct connection
+{
+    int fd;
+    /* The start of the next request, read so far */
+    char request[REQUEST_MAX];
+    size_t length;
+    /* The connection's jobs not yet replied to, and whether the client has
+       hung up.  The connection is released once both are done. */
+    int jobs;
+    bool closed;
+    /* The replies not sent yet, in order.  The render thread queues them and
+       the socket thread sends them as fast as the client takes them, so that
+       a client that stops reading holds up no one else's requests.  These
+       are shared under the lock. */
+    reply_buffer * first_reply;
+    reply_buffer * last_reply;
+    /* When the client last took some of the replies, or the first of them
+       was queued */
+    struct timespec reply_progress;
+    /* Whether memory ran out for a reply, losing it */
+    bool reply_lost;
+    struct connection * next;
+} connection;
+
+typedef enum
+{
+    JOB_RENDER,
+    JOB_STATUS,
+    JOB_ERROR
+} job_type;
+
+typedef struct job
+{
+    job_type type;
+    connection * connection;
+    long id;
+    char * scene_path;
+    /* The camera properties the request gives, with the key_property flags
+       of those it gives (see animation.h) */
+    keyframe camera;
+    resolution resolution;
+    bool resolution_given;
+    int frame;
+    render_region region;
+    char * shm_name;
+    /* Set from the socket thread, and read while rendering */
+    bool cancel;
+    /* For errors, the message to reply with */
+    char message[128];
+    struct job * next;
+} job;
+
+typedef struct cache_entry
+{
+    char * path;
+    /* The file's modification time and size when it was loaded */
+    struct timespec mtime;
+    off_t size;
+    scene scene;
+    size_t memory;
+    /* When the scene was last rendered, in requests */
+    unsigned long last_use;
+    struct cache_entry * next;
+} cache_entry;
+
+typedef struct
+{
+    const server_settings * settings;
+    thread_pool * pool;
+    connection * connections;
+    /* The jobs waiting, in order, and the one rendering, if any, shared by
+       the socket thread and the render thread under the lock */
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;
+    job * first_job;
+    job * last_job;
+    job * current_job;
+    bool stopping;
+    /* A pipe the render thread writes to once it queues replies, to wake
+       the socket thread to send them */
+    int wake[2];
+    /* The cached scenes, which only the render thread uses */
+    cache_entry * cache;
+    int num_cached;
+    size_t cache_memory;
+    unsigned long requests;
+} server;
+
+static volatile sig_atomic_t stop_signal;
+
+static void handle_stop (int signal)
+{
+    stop_signal = signal;
+}
+
+static size_t surfaces_memory (surface surfaces[], primitives * primitives)
+/*! The bytes taken up by a sentinel terminated surface array, the meshes
+    among its surfaces and its primitives */
+{
+    primitives_block blocks[PRIMITIVES_NUM_BLOCKS];
+    size_t memory = sizeof(surface);
+    surface * cur_surface;
+    int block;
+
+    for (cur_surface = surfaces; cur_surface->class; cur_surface++)
+    {
+        memory += sizeof(surface);
+        if (cur_surface->class == surface_mesh)
+        {
+            memory += mesh_memory_size(((mesh *)cur_surface->geometry)->triangles);
+        }
+    }
+    if (primitives)
+    {
+        primitives_blocks(primitives, blocks);
+        for (block = 0; block < PRIMITIVES_NUM_BLOCKS; block++)
+        {
+            memory += blocks[block].size;
+        }
+        memory += sizeof(*primitives) + sizeof(bvh);
+    }
+    return memory;
+}
+
+static size_t scene_memory (scene * scene)
+/*! The bytes taken up by a loaded scene and its primitives */
+{
+    light_source * light;
+    size_t memory = sizeof(light_source);
+    int group, object;
+
+    if (scene->mapping)
+    {
+        return scene->mapping_size;
+    }
+    for (light = scene->light_sources; light->type != LIGHT_SOURCE_SENTINEL; light++)
+    {
+        memory += sizeof(light_source);
+    }
+    memory += surfaces_memory(scene->surfaces, scene->primitives);
+    for (group = 0; group < scene->num_groups; group++)
+    {
+        memory += sizeof(instance_group) +
+                  surfaces_memory(scene->groups[group].surfaces, scene->groups[group].primitives);
+    }
+    if (scene->animation)
+    {
+        for (object = 0; object < scene->animation->num_objects; object++)
+        {
+            memory += sizeof(animated_object) +
+                      sizeof(keyframe) * scene->animation->objects[object].key_capacity;
+        }
+    }
+    return memory;
+}
+
+static void free_entry (cache_entry * entry)
+{
+    free_scene(&entry->scene);
+    free(entry->path);
+    free(entry);
+}
+
+static void remove_entry (server * server, cache_entry * entry)
+/*! Take an entry out of the cache and release it */
+{
+    cache_entry ** link = &server->cache;
+
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    server->num_cached--;
+    server->cache_memory -= entry->memory;
+    free_entry(entry);
+}
+
+static void evict_scenes (server * server, cache_entry * keep)
+/*! Release the least recently used scenes other than "keep" until the cache
+    is within its limit */
+{
+    cache_entry * entry, * oldest;
+
+    while (server->cache_memory > server->settings->cache_limit)
+    {
+        oldest = NULL;
+        for (entry = server->cache; entry; entry = entry->next)
+        {
+            if (entry != keep && (oldest == NULL || entry->last_use < oldest->last_use))
+            {
+                oldest = entry;
+            }
+        }
+        if (oldest == NULL)
+        {
+            return;
+        }
+        remove_entry(server, oldest);
+    }
+}
+
+static cache_entry * load_entry (server * server, const char * path, const struct stat * status,
+                                 char * message)
+/*! Load a scene and its primitives into a new cache entry.  Return the
+    entry, or NULL with an error message in "message". */
+{
+    cache_entry * entry = calloc(1, sizeof(cache_entry));
+    FILE * file;
+
+    if (entry == NULL || (entry->path = malloc(strlen(path) + 1)) == NULL)
+    {
+        free(entry);
+        strcpy(message, "Out of memory");
+        return NULL;
+    }
+    strcpy(entry->path, path);
+    errno = 0;
+    file = fopen(path, "r");
+    if (file == NULL || load_scene(file, path, &entry->scene, server->pool))
+    {
+        /* Errors in the scene file itself are reported on the standard
+           error stream */
+        strcpy(message, "Unable to load the scene");
+        if (errno)
+        {
+            sprintf(message + strlen(message), ": %.80s", strerror(errno));
+        }
+        if (file)
+        {
+            fclose(file);
+        }
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    fclose(file);
+    entry->scene.min_contribution = server->settings->min_contribution;
+    entry->scene.russian_roulette = server->settings->russian_roulette;
+    /* The BVH is built for frame 0, and refit for other frames */
+    if (entry->scene.animation)
+    {
+        animation_apply(entry->scene.animation, 0, &entry->scene);
+    }
+    if (entry->scene.primitives == NULL)
+    {
+        entry->scene.primitives = primitives_create(entry->scene.surfaces);
+        if (entry->scene.primitives == NULL)
+        {
+            strcpy(message, "Out of memory");
+            free_entry(entry);
+            return NULL;
+        }
+    }
+    entry->mtime = status->st_mtim;
+    entry->size = status->st_size;
+    entry->memory = scene_memory(&entry->scene);
+    return entry;
+}
+
+static cache_entry * cached_scene (server * server, const char * path, char * message)
+/*! Find the scene at "path" in the cache, or load it if it isn't there or
+    its file has changed since.  Return the entry, or NULL with an error
+    message in "message". */
+{
+    struct stat status;
+    cache_entry * entry;
+
+    if (stat(path, &status))
+    {
+        sprintf(message, "Unable to open the scene: %.80s", strerror(errno));
+        return NULL;
+    }
+    for (entry = server->cache; entry; entry = entry->next)
+    {
+        if (strcmp(entry->path, path) == 0)
+        {
+            break;
+        }
+    }
+    if (entry && (entry->mtime.tv_sec != status.st_mtim.tv_sec ||
+                  entry->mtime.tv_nsec != status.st_mtim.tv_nsec || entry->size != status.st_size))
+    {
+        remove_entry(server, entry);
+        entry = NULL;
+    }
+    if (entry == NULL)
+    {
+        entry = load_entry(server, path, &status, message);
+        if (entry == NULL)
+        {
+            return NULL;
+        }
+        entry->next = server->cache;
+        server->cache = entry;
+        server->num_cached++;
+        server->cache_memory += entry->memory;
+    }
+    entry->last_use = server->requests;
+    evict_scenes(server, entry);
+    return entry;
+}
+
+static double seconds_since (const struct timespec * start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static reply_buffer * new_reply (size_t size)
+/*! Allocate a reply of "size" bytes, which follow the buffer, or return NULL */
+{
+    reply_buffer * buffer = malloc(sizeof(reply_buffer) + size);
+    if (buffer)
+    {
+        buffer->size = size;
+        buffer->sent = 0;
+        buffer->next = NULL;
+    }
+    return buffer;
+}
+
+static char * reply_bytes (reply_buffer * buffer)
+{
+    return (char *)(buffer + 1);
+}
+
+static void queue_reply (server * server, connection * connection, reply_buffer * buffer)
+/*! Queue a reply made by new_reply to be sent to the client, taking it
+    over, and wake the socket thread to send it.  The reply is dropped if the
+    client has hung up, and a NULL reply, for which memory ran out, gets the
+    client hung up on. */
+{
+    pthread_mutex_lock(&server->lock);
+    if (connection->closed)
+    {
+        free(buffer);
+    }
+    else if (buffer == NULL)
+    {
+        connection->reply_lost = true;
+    }
+    else if (connection->first_reply)
+    {
+        connection->last_reply->next = buffer;
+        connection->last_reply = buffer;
+    }
+    else
+    {
+        connection->first_reply = connection->last_reply = buffer;
+        clock_gettime(CLOCK_MONOTONIC, &connection->reply_progress);
+    }
+    pthread_mutex_unlock(&server->lock);
+    /* The pipe only needs a byte in it, so a full pipe is as good */
+    if (write(server->wake[1], "", 1) < 0 && errno != EAGAIN)
+    {
+        perror("Waking the server");
+    }
+}
+
+static void free_replies (connection * connection)
+{
+    reply_buffer * buffer;
+    while ((buffer = connection->first_reply))
+    {
+        connection->first_reply = buffer->next;
+        free(buffer);
+    }
+    connection->last_reply = NULL;
+}
+
+static bool send_replies (server * server, connection * connection)
+/*! Send as much of the connection's queued replies as the client takes
+    without waiting.  Return false if the connection is to be closed: the
+    client has hung up, a reply was lost, or the client has taken none of
+    its replies for REPLY_TIMEOUT seconds. */
+{
+    reply_buffer * buffer;
+    ssize_t sent;
+    bool open;
+
+    pthread_mutex_lock(&server->lock);
+    open = !connection->reply_lost;
+    while (open && (buffer = connection->first_reply))
+    {
+        sent = send(connection->fd, reply_bytes(buffer) + buffer->sent,
+                    buffer->size - buffer->sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (sent <= 0)
+        {
+            open = false;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &connection->reply_progress);
+        buffer->sent += sent;
+        if (buffer->sent == buffer->size)
+        {
+            connection->first_reply = buffer->next;
+            free(buffer);
+        }
+    }
+    if (connection->first_reply == NULL)
+    {
+        connection->last_reply = NULL;
+    }
+    else if (seconds_since(&connection->reply_progress) > REPLY_TIMEOUT)
+    {
+        open = false;
+    }
+    pthread_mutex_unlock(&server->lock);
+    return open;
+}
+
+static bool has_replies (server * server, connection * connection)
+{
+    bool waiting;
+    pthread_mutex_lock(&server->lock);
+    waiting = connection->first_reply != NULL;
+    pthread_mutex_unlock(&server->lock);
+    return waiting;
+}
+
+static void reply (server * server, connection * connection, const char * format, ...)
+/*! Queue a reply line, formatted as printf does */
+{
+    char line[256];
+    reply_buffer * buffer;
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (length > (int)sizeof(line) - 2)
+    {
+        length = sizeof(line) - 2;
+    }
+    line[length] = '\n';
+    buffer = new_reply(length + 1);
+    if (buffer)
+    {
+        memcpy(reply_bytes(buffer), line, length + 1);
+    }
+    queue_reply(server, connection, buffer);
+}
+
+static bool job_is_cancelled (job * job)
+{
+    return __atomic_load_n(&job->cancel, __ATOMIC_RELAXED);
+}
+
+static int put_in_shm (const char * name, const color image[], size_t num_pixels, char * message)
+/*! Quantize the pixels of an image into the start of a shared memory
+    object.  Return 0, or -1 with an error message in "message". */
+{
+    size_t size = 3 * num_pixels;
+    struct stat status;
+    void * memory;
+    int fd = shm_open(name, O_RDWR, 0);
+
+    if (fd < 0 || fstat(fd, &status) || (size_t)status.st_size < size)
+    {
+        sprintf(message, "Unable to use shared memory %.48s: %.40s", name,
+                fd < 0 ? strerror(errno) : "too small");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        sprintf(message, "Unable to map shared memory %.48s: %.40s", name, strerror(errno));
+        return -1;
+    }
+    quantize_colors(image, num_pixels, memory);
+    munmap(memory, size);
+    return 0;
+}
+
+static void render_job (server * server, job * job)
+/*! Render the image a job asks for, and send it */
+{
+    render_settings settings = server->settings->render;
+    render_region * region = &job->region;
+    cache_entry * entry;
+    scene * scene;
+    camera saved_camera;
+    resolution * res;
+    color * image = NULL;
+    reply_buffer * pixels = NULL;
+    size_t num_pixels;
+
+    server->requests++;
+    entry = cached_scene(server, job->scene_path, job->message);
+    if (entry == NULL)
+    {
+        reply(server, job->connection, "error %ld %s", job->id, job->message);
+        return;
+    }
+
+    /* The cached scene stays at the frame of its last request, and its
+       camera is put back as it was */
+    scene = &entry->scene;
+    if (scene->animation && animation_apply(scene->animation, job->frame, scene))
+    {
+        primitives_refit(scene->primitives);
+    }
+    saved_camera = scene->camera;
+    res = &scene->camera.resolution;
+    if (job->camera.properties & KEY_POSITION)
+    {
+        scene->camera.position = job->camera.position;
+    }
+    if (job->camera.properties & KEY_DIRECTION)
+    {
+        scene->camera.direction = job->camera.direction;
+    }
+    if (job->camera.properties & KEY_VIEW_ANGLE)
+    {
+        scene->camera.view_angle = job->camera.view_angle;
+    }
+    if (job->resolution_given)
+    {
+        *res = job->resolution;
+    }
+    if (region->x0 >= region->x1)
+    {
+        *region = (render_region){ 0, 0, res->width, res->height };
+    }
+    num_pixels = (size_t)(region->x1 - region->x0) * (region->y1 - region->y0);
+
+    if (region->x1 > res->width || region->y1 > res->height)
+    {
+        reply(server, job->connection, "error %ld Region outside the image", job->id);
+    }
+    else if ((image = malloc(sizeof(color) * num_pixels)) == NULL ||
+             (job->shm_name == NULL && (pixels = new_reply(3 * num_pixels)) == NULL))
+    {
+        reply(server, job->connection, "error %ld Out of memory", job->id);
+    }
+    else
+    {
+        settings.region = *region;
+        settings.cancel = &job->cancel;
+        render(scene, server->pool, &settings, image, NULL);
+        if (job_is_cancelled(job))
+        {
+            reply(server, job->connection, "cancelled %ld", job->id);
+        }
+        else if (job->shm_name)
+        {
+            if (put_in_shm(job->shm_name, image, num_pixels, job->message))
+            {
+                reply(server, job->connection, "error %ld %s", job->id, job->message);
+            }
+            else
+            {
+                reply(server, job->connection, "pixels %ld %d %d shm", job->id,
+                      region->x1 - region->x0, region->y1 - region->y0);
+            }
+        }
+        else
+        {
+            quantize_colors(image, num_pixels, (unsigned char *)reply_bytes(pixels));
+            reply(server, job->connection, "pixels %ld %d %d %lu", job->id,
+                  region->x1 - region->x0, region->y1 - region->y0,
+                  (unsigned long)(3 * num_pixels));
+            queue_reply(server, job->connection, pixels);
+            pixels = NULL;
+        }
+    }
+    scene->camera = saved_camera;
+    free(image);
+    free(pixels);
+}
+
+static void free_job (job * job)
+{
+    free(job->scene_path);
+    free(job->shm_name);
+    free(job);
+}
+
+static void release_connection (connection * connection)
+/*! Close and release a connection once its client has hung up and its
+    jobs are replied to.  Call this with the lock held. */
+{
+    if (connection->closed && connection->jobs == 0)
+    {
+        close(connection->fd);
+        free_replies(connection);
+        free(connection);
+    }
+}
+
+static void * render_jobs (void * context)
+/*! Run the jobs of the queue, one at a time, until the server stops */
+{
+    server * server = context;
+    job * job;
+
+    pthread_mutex_lock(&server->lock);
+    while (true)
+    {
+        while (!server->stopping && server->first_job == NULL)
+        {
+            pthread_cond_wait(&server->job_ready, &server->lock);
+        }
+        if (server->stopping)
+        {
+            break;
+        }
+        job = server->first_job;
+        server->first_job = job->next;
+        server->current_job = job;
+        pthread_mutex_unlock(&server->lock);
+
+        if (job_is_cancelled(job))
+        {
+            reply(server, job->connection, "cancelled %ld", job->id);
+        }
+        else if (job->type == JOB_ERROR)
+        {
+            reply(server, job->connection, "error %ld %s", job->id, job->message);
+        }
+        else if (job->type == JOB_STATUS)
+        {
+            reply(server, job->connection, "status %d %lu", server->num_cached,
+                  (unsigned long)server->cache_memory);
+        }
+        else
+        {
+            render_job(server, job);
+        }
+
+        pthread_mutex_lock(&server->lock);
+        server->current_job = NULL;
+        job->connection->jobs--;
+        release_connection(job->connection);
+        free_job(job);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+static void queue_job (server * server, job * job)
+{
+    pthread_mutex_lock(&server->lock);
+    job->connection->jobs++;
+    if (server->first_job)
+    {
+        server->last_job->next = job;
+    }
+    else
+    {
+        server->first_job = job;
+    }
+    server->last_job = job;
+    pthread_cond_signal(&server->job_ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void cancel_jobs (server * server, connection * connection, bool all, long id)
+/*! Cancel the connection's job "id", or all its jobs, waiting or rendering */
+{
+    job * job;
+
+    pthread_mutex_lock(&server->lock);
+    for (job = server->first_job; job; job = job->next)
+    {
+        if (job->connection == connection && (all || job->id == id))
+        {
+            job->cancel = true;
+        }
+    }
+    job = server->current_job;
+    if (job && job->connection == connection && (all || job->id == id))
+    {
+        __atomic_store_n(&job->cancel, true, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+static bool parse_numbers (const char * text, float numbers_out[], int count)
+/*! Parse "count" numbers separated by commas, the whole of "text" */
+{
+    char * end;
+    int index;
+
+    for (index = 0; index < count; index++)
+    {
+        numbers_out[index] = strtof(text, &end);
+        if (end == text || !isfinite(numbers_out[index]) ||
+            *end != (index + 1 < count ? ',' : '\0'))
+        {
+            return false;
+        }
+        text = end + 1;
+    }
+    return true;
+}
+
+static char * copy_word (const char * word)
+{
+    char * copy = malloc(strlen(word) + 1);
+    if (copy)
+    {
+        strcpy(copy, word);
+    }
+    return copy;
+}
+
+static bool parse_option (char * option, job * job)
+/*! Parse a NAME=VALUE option of a render request into the job, or set its
+    error message and return false */
+{
+    char * value = strchr(option, '=');
+    float numbers[4];
+
+    if (value == NULL)
+    {
+        sprintf(job->message, "Option without a value: %.64s", option);
+        return false;
+    }
+    *value++ = '\0';
+    if (strcmp(option, "resolution") == 0 && parse_numbers(value, numbers, 2))
+    {
+        job->resolution = (resolution){ (int)numbers[0], (int)numbers[1] };
+        job->resolution_given = true;
+        if (numbers[0] < 2 || numbers[1] < 2 || numbers[0] > MAX_RESOLUTION ||
+            numbers[1] > MAX_RESOLUTION)
+        {
+            sprintf(job->message, "Resolution must be from 2 to %d pixels", MAX_RESOLUTION);
+            return false;
+        }
+    }
+    else if (strcmp(option, "position") == 0 && parse_numbers(value, numbers, 3))
+    {
+        job->camera.position = (vector){ numbers[0], numbers[1], numbers[2] };
+        job->camera.properties |= KEY_POSITION;
+    }
+    else if (strcmp(option, "direction") == 0 && parse_numbers(value, numbers, 2))
+    {
+        job->camera.direction = (direction){ numbers[0] * M_PI / 180, numbers[1] * M_PI / 180 };
+        job->camera.properties |= KEY_DIRECTION;
+    }
+    else if (strcmp(option, "view_angle") == 0 && parse_numbers(value, numbers, 1))
+    {
+        job->camera.view_angle = numbers[0] * M_PI / 180;
+        job->camera.properties |= KEY_VIEW_ANGLE;
+    }
+    else if (strcmp(option, "frame") == 0 && parse_numbers(value, numbers, 1))
+    {
+        if (numbers[0] < 0)
+        {
+            strcpy(job->message, "Frame must be 0 or more");
+            return false;
+        }
+        job->frame = numbers[0] < INT_MAX / 2 ? (int)numbers[0] : INT_MAX / 2;
+    }
+    else if (strcmp(option, "region") == 0 && parse_numbers(value, numbers, 4))
+    {
+        job->region = (render_region){ (int)numbers[0], (int)numbers[1], (int)numbers[2],
+                                       (int)numbers[3] };
+        if (numbers[0] < 0 || numbers[1] < 0 || numbers[0] >= numbers[2] ||
+            numbers[1] >= numbers[3] || numbers[2] > MAX_RESOLUTION || numbers[3] > MAX_RESOLUTION)
+        {
+            strcpy(job->message, "Region must be X0,Y0,X1,Y1 with 0 <= X0 < X1, 0 <= Y0 < Y1");
+            return false;
+        }
+    }
+    else if (strcmp(option, "shm") == 0 && *value)
+    {
+        job->shm_name = copy_word(value);
+        if (job->shm_name == NULL)
+        {
+            strcpy(job->message, "Out of memory");
+            return false;
+        }
+    }
+    else
+    {
+        sprintf(job->message, "Bad option: %.32s=%.64s", option, value);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_id (const char * word, long * id_out)
+{
+    char * end;
+
+    if (word == NULL)
+    {
+        return false;
+    }
+    *id_out = strtol(word, &end, 10);
+    return end != word && *end == '\0';
+}
+
+static int handle_request (server * server, connection * connection, char * line)
+/*! Queue the job a request line asks for, or cancel the jobs it names.
+    Return 0, or -1 if memory runs out. */
+{
+    char * save, * command = strtok_r(line, " \t\r", &save);
+    char * word;
+    long id = 0;
+    job * job;
+
+    if (command == NULL)
+    {
+        return 0;
+    }
+    if (strcmp(command, "cancel") == 0)
+    {
+        if (parse_id(strtok_r(NULL, " \t\r", &save), &id))
+        {
+            cancel_jobs(server, connection, false, id);
+        }
+        return 0;
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL)
+    {
+        return -1;
+    }
+    job->connection = connection;
+    if (strcmp(command, "status") == 0)
+    {
+        job->type = JOB_STATUS;
+    }
+    else if (strcmp(command, "render") == 0)
+    {
+        job->type = JOB_RENDER;
+        if (!parse_id(strtok_r(NULL, " \t\r", &save), &job->id) ||
+            (word = strtok_r(NULL, " \t\r", &save)) == NULL)
+        {
+            job->type = JOB_ERROR;
+            strcpy(job->message, "Render requests need an ID and a scene");
+        }
+        else if ((job->scene_path = copy_word(word)) == NULL)
+        {
+            free_job(job);
+            return -1;
+        }
+        while (job->type == JOB_RENDER && (word = strtok_r(NULL, " \t\r", &save)))
+        {
+            if (!parse_option(word, job))
+            {
+                job->type = JOB_ERROR;
+            }
+        }
+    }
+    else
+    {
+        job->type = JOB_ERROR;
+        sprintf(job->message, "Unknown request: %.64s", command);
+    }
+    queue_job(server, job);
+    return 0;
+}
+
+static bool read_requests (server * server, connection * connection)
+/*! Read what the client has sent and handle the complete request lines.
+    Return false if the connection is to be closed. */
+{
+    ssize_t received = recv(connection->fd, connection->request + connection->length,
+                            REQUEST_MAX - connection->length, 0);
+    char * start, * end;
+
+    if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return true;
+    }
+    if (received <= 0)
+    {
+        return false;
+    }
+    connection->length += received;
+    start = connection->request;
+    while ((end = memchr(start, '\n', connection->request + connection->length - start)))
+    {
+        *end = '\0';
+        if (handle_request(server, connection, start))
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    connection->length -= start - connection->request;
+    memmove(connection->request, start, connection->length);
+    /* A request too long to hold is never complete */
+    return connection->length < REQUEST_MAX;
+}
+
+static void hang_up (server * server, connection * connection)
+/*! Take a connection out of the list, cancelling its jobs and dropping the
+    replies waiting for it */
+{
+    struct connection ** link = &server->connections;
+
+    while (*link != connection)
+    {
+        link = &(*link)->next;
+    }
+    *link = connection->next;
+    cancel_jobs(server, connection, true, 0);
+    pthread_mutex_lock(&server->lock);
+    connection->closed = true;
+    free_replies(connection);
+    release_connection(connection);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static int open_socket (const char * socket_path)
+/*! Make a Unix domain socket at "socket_path" and listen on it, replacing
+    a socket left there before.  Return its descriptor, or -1. */
+{
+    struct sockaddr_un address;
+    struct stat status;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    if (stat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode))
+    {
+        unlink(socket_path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) || listen(fd, 16))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve_connections (server * server, int listener)
+/*! Accept connections, read their requests and send them their replies
+    until a signal stops the server.  Return 0, or -1 if memory runs out. */
+{
+    struct pollfd * polled = NULL, * grown;
+    connection * connection, * next;
+    int num_polled, capacity = 0, index, fd, timeout;
+    char wake_bytes[64];
+
+    while (!stop_signal)
+    {
+        num_polled = 2;
+        for (connection = server->connections; connection; connection = connection->next)
+        {
+            num_polled++;
+        }
+        if (num_polled > capacity)
+        {
+            grown = realloc(polled, sizeof(struct pollfd) * num_polled * 2);
+            if (grown == NULL)
+            {
+                free(polled);
+                return -1;
+            }
+            polled = grown;
+            capacity = num_polled * 2;
+        }
+        polled[0] = (struct pollfd){ listener, POLLIN };
+        polled[1] = (struct pollfd){ server->wake[0], POLLIN };
+        index = 2;
+        /* While replies wait, poll wakes up every second to time them out */
+        timeout = -1;
+        for (connection = server->connections; connection; connection = connection->next)
+        {
+            polled[index] = (struct pollfd){ connection->fd, POLLIN };
+            if (has_replies(server, connection))
+            {
+                polled[index].events |= POLLOUT;
+                timeout = 1000;
+            }
+            index++;
+        }
+        if (poll(polled, num_polled, timeout) < 0)
+        {
+            continue;
+        }
+        if (polled[1].revents & POLLIN)
+        {
+            while (read(server->wake[0], wake_bytes, sizeof(wake_bytes)) > 0)
+            {
+            }
+        }
+
+        /* The connections are in the order they were polled.  Replies are
+           sent to every connection, since the render thread may have
+           queued some since the poll began. */
+        index = 2;
+        for (connection = server->connections; connection; connection = next)
+        {
+            next = connection->next;
+            if (((polled[index++].revents & ~POLLOUT) && !read_requests(server, connection)) ||
+                !send_replies(server, connection))
+            {
+                hang_up(server, connection);
+            }
+        }
+        if (polled[0].revents & POLLIN)
+        {
+            fd = accept(listener, NULL, NULL);
+            connection = fd >= 0 ? calloc(1, sizeof(*connection)) : NULL;
+            if (connection && fcntl(fd, F_SETFL, O_NONBLOCK) == 0)
+            {
+                connection->fd = fd;
+                connection->next = server->connections;
+                server->connections = connection;
+            }
+            else if (fd >= 0)
+            {
+                free(connection);
+                close(fd);
+            }
+        }
+    }
+    free(polled);
+    return 0;
+}
+
+int serve (const char * socket_path, const server_settings * settings, thread_pool * pool)
+{
+    server server = { settings, pool };
+    struct sigaction action;
+    pthread_t render_thread;
+    connection * connection;
+    job * job;
+    int listener, result;
+
+    listener = open_socket(socket_path);
+    if (listener < 0)
+    {
+        return -1;
+    }
+    if (pipe(server.wake))
+    {
+        close(listener);
+        unlink(socket_path);
+        return -1;
+    }
+    fcntl(server.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(server.wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.job_ready, NULL);
+    if (pthread_create(&render_thread, NULL, render_jobs, &server))
+    {
+        close(server.wake[0]);
+        close(server.wake[1]);
+        close(listener);
+        unlink(socket_path);
+        return -1;
+    }
+
+    /* Without SA_RESTART, the signals interrupt poll */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop;
+    sigemptyset(&action.sa_mask);
+    stop_signal = 0;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "Serving on %s\n", socket_path);
+    result = serve_connections(&server, listener);
+
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    if (server.current_job)
+    {
+        __atomic_store_n(&server.current_job->cancel, true, __ATOMIC_RELAXED);
+    }
+    pthread_cond_signal(&server.job_ready);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(render_thread, NULL);
+
+    while ((job = server.first_job))
+    {
+        server.first_job = job->next;
+        job->connection->jobs--;
+        release_connection(job->connection);
+        free_job(job);
+    }
+    while ((connection = server.connections))
+    {
+        server.connections = connection->next;
+        close(connection->fd);
+        free_replies(connection);
+        free(connection);
+    }
+    while (server.cache)
+    {
+        remove_entry(&server, server.cache);
+    }
+    pthread_cond_destroy(&server.job_ready);
+    pthread_mutex_destroy(&server.lock);
+    close(server.wake[0]);
+    close(server.wake[1]);
+    close(listener);
+    unlink(socket_path);
+    return result;
+}
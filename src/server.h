@@ -0,0 +1,79 @@
+#pragma once
+
+#include "render.h"
+#include "thread_pool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* This module runs the ray tracer as a server, which renders images on
+   request from clients connected to a Unix domain socket.  Short renders of
+   small images are dominated by starting the program and loading the scene,
+   so the server keeps the scenes it loads in memory, each with its BVH,
+   ready for the next request for it.
+
+   Scenes are cached by path, and a scene is loaded again once its file's
+   modification time or size changes.  The cached scenes are kept within a
+   limit of memory by releasing the least recently used ones, though the
+   scene of the latest request always stays.
+
+   Requests are rendered one at a time, in the order they arrive, each with
+   all the workers of the thread pool.  A request can be cancelled while it
+   waits or renders, and a client that hangs up cancels its requests.  The
+   replies to each client are queued and sent as fast as it reads them, so
+   a client that stops reading holds up no other client, and one that reads
+   none of them for 30 seconds is hung up on.
+
+   Requests and replies are lines of words separated by spaces.  The
+   requests are:
+
+     render ID SCENE [NAME=VALUE ...]
+         Render the scene file at the path SCENE, as the server sees it.  ID
+         is a number of the client's choosing, which the reply gives back.
+         The values override the scene's camera and how it is rendered:
+           resolution=W,H         the image size in pixels
+           position=X,Y,Z         the camera position
+           direction=THETA,PHI    the camera direction, in degrees
+           view_angle=A           the camera view angle, in degrees
+           frame=K                the frame of the scene's animation
+           region=X0,Y0,X1,Y1     only render the pixels from X0,Y0 up to
+                                  X1,Y1, counted from the top left
+           shm=NAME               put the pixels in the POSIX shared memory
+                                  object NAME, made by the client, instead
+                                  of sending them
+
+     cancel ID
+         Cancel the client's request ID, if it isn't done yet
+
+     status
+         Give the number of scenes in the cache and the memory they take up
+
+   The replies, one for each render or status request in the order of the
+   requests, are:
+
+     pixels ID WIDTH HEIGHT SIZE
+         The image or region rendered, followed by its pixels: SIZE bytes of
+         8 bit RGB, 3 per pixel, from the top row down, as in a PPM file.
+         With shm, SIZE is "shm" and the pixels are at the start of the
+         shared memory object instead.
+     cancelled ID
+     error ID MESSAGE
+     status SCENES BYTES
+*/
+
+typedef struct
+{
+    /* The most memory the cached scenes take up, in bytes */
+    size_t cache_limit;
+    /* As for the scene (see scene.h) */
+    float min_contribution;
+    bool russian_roulette;
+    /* How the images are rendered, other than the region */
+    render_settings render;
+} server_settings;
+
+/*! Serve render requests on a Unix domain socket made at "socket_path",
+    rendering with the workers of "pool", until the process is interrupted
+    or terminated.  Return 0 once the server stops, or -1 if the socket can't
+    be made or memory runs out. */
+int serve (const char * socket_path, const server_settings * settings, thread_pool * pool);
@@ -0,0 +1,114 @@
+#include "stats.h"
+
+__thread ray_stats thread_stats;
+
+static double percentage (unsigned long long part, unsigned long long whole)
+{
+    return whole ? 100.0 * part / whole : .0;
+}
+
+void stats_add (ray_stats * total, ray_stats * stats)
+{
+    int index;
+
+    total->camera_rays += stats->camera_rays;
+    total->antialiased_pixels += stats->antialiased_pixels;
+    total->antialias_rays += stats->antialias_rays;
+    total->secondary_rays += stats->secondary_rays;
+    total->pruned_rays += stats->pruned_rays;
+    total->roulette_rays += stats->roulette_rays;
+    total->shadow_rays += stats->shadow_rays;
+    total->blocked_shadow_rays += stats->blocked_shadow_rays;
+    total->occluder_cache_tests += stats->occluder_cache_tests;
+    total->occluder_cache_hits += stats->occluder_cache_hits;
+    total->reflected_rays += stats->reflected_rays;
+    total->refracted_rays += stats->refracted_rays;
+    total->total_internal_reflections += stats->total_internal_reflections;
+    for (index = 0; index < STATS_MAX_DEPTH; index++)
+    {
+        total->depth_rays[index] += stats->depth_rays[index];
+    }
+    for (index = 0; index < STATS_NUM_CLASSES; index++)
+    {
+        total->hit_tests[index] += stats->hit_tests[index];
+        total->hits[index] += stats->hits[index];
+        total->occlusion_tests[index] += stats->occlusion_tests[index];
+        total->occlusions[index] += stats->occlusions[index];
+    }
+}
+
+void stats_collect (ray_stats * total)
+{
+    stats_add(total, &thread_stats);
+    thread_stats = (ray_stats){ 0 };
+}
+
+static const char * class_names[STATS_NUM_CLASSES] =
+    { "Spheres", "Frustums", "Circles", "Quads", "Meshes", "Instances" };
+
+static void print_detail (ray_stats * stats, FILE * file)
+/*! Print the counts of rays by kind and bounce, and of the tests of each
+    class of primitive */
+{
+    int index, deepest;
+
+    fprintf(file, "Reflected rays: %llu, refracted rays: %llu, total internal reflections: %llu\n",
+            stats->reflected_rays, stats->refracted_rays, stats->total_internal_reflections);
+
+    /* Camera rays are bounce 0, and the rays with the most depth left are
+       bounce 1 */
+    fprintf(file, "Rays by bounce: 0: %llu", stats->camera_rays + stats->antialias_rays);
+    for (deepest = STATS_MAX_DEPTH - 1; deepest > 0 && stats->depth_rays[deepest] == 0; deepest--)
+    {
+    }
+    for (index = deepest; index > 0; index--)
+    {
+        fprintf(file, ", %d: %llu", deepest - index + 1, stats->depth_rays[index]);
+    }
+    fprintf(file, "\n");
+
+    for (index = 0; index < STATS_NUM_CLASSES; index++)
+    {
+        if (stats->hit_tests[index] || stats->occlusion_tests[index])
+        {
+            fprintf(file, "%s: %llu tests, %llu hits (%.1f%%); "
+                          "%llu shadow tests, %llu blocked (%.1f%%)\n",
+                    class_names[index], stats->hit_tests[index], stats->hits[index],
+                    percentage(stats->hits[index], stats->hit_tests[index]),
+                    stats->occlusion_tests[index], stats->occlusions[index],
+                    percentage(stats->occlusions[index], stats->occlusion_tests[index]));
+        }
+    }
+}
+
+void stats_print (ray_stats * stats, FILE * file)
+{
+    fprintf(file, "Camera rays: %llu\n", stats->camera_rays);
+    if (stats->antialiased_pixels)
+    {
+        fprintf(file, "Antialiasing: %llu pixels supersampled (%.1f%%) "
+                      "with %llu extra camera rays (%.1f%% more)\n",
+                stats->antialiased_pixels,
+                percentage(stats->antialiased_pixels, stats->camera_rays),
+                stats->antialias_rays, percentage(stats->antialias_rays, stats->camera_rays));
+    }
+    fprintf(file, "Reflected and refracted rays: %llu", stats->secondary_rays);
+    if (stats->pruned_rays)
+    {
+        fprintf(file, ", %llu pruned with the rays they would have led to", stats->pruned_rays);
+    }
+    if (stats->roulette_rays)
+    {
+        fprintf(file, ", %llu splits decided by Russian roulette", stats->roulette_rays);
+    }
+    fprintf(file, "\n");
+    fprintf(file, "Shadow rays: %llu, %llu blocked (%.1f%%)\n",
+            stats->shadow_rays, stats->blocked_shadow_rays,
+            percentage(stats->blocked_shadow_rays, stats->shadow_rays));
+    fprintf(file, "Occluder cache: %llu hits of %llu tests (%.1f%%), "
+                  "finding %.1f%% of blocked shadow rays\n",
+            stats->occluder_cache_hits, stats->occluder_cache_tests,
+            percentage(stats->occluder_cache_hits, stats->occluder_cache_tests),
+            percentage(stats->occluder_cache_hits, stats->blocked_shadow_rays));
+    print_detail(stats, file);
+}
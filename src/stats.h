@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdio.h>
+
+/* This module counts ray tracing events, such as shadow rays cast, for the
+   --stats report.  Each thread counts into its own copy of the counters with
+   no synchronization, and the renderer collects every thread's counts into
+   a total once the thread's work is done.
+
+   The counters of the innermost loops, such as those of the intersection
+   tests, are added to once for each run of primitives tested or packet of
+   rays, rather than for every test, so that counting costs too little to
+   leave out of any build. */
+
+/* The depths of reflected and refracted rays counted, deeper ones counting
+   as the deepest */
+#define STATS_MAX_DEPTH 16
+
+/* The classes of primitives tested, as in primitives.h: spheres, frustums,
+   circles, quads, meshes and instances */
+#define STATS_NUM_CLASSES 6
+
+typedef struct
+{
+    /* Camera rays traced once through the center of every pixel, and the
+       extra rays traced to supersample some of those pixels */
+    unsigned long long camera_rays;
+    unsigned long long antialiased_pixels;
+    unsigned long long antialias_rays;
+    /* Reflected and refracted rays traced, those pruned for contributing too
+       little, and the rays that skipped one of the two by Russian roulette */
+    unsigned long long secondary_rays;
+    unsigned long long pruned_rays;
+    unsigned long long roulette_rays;
+    unsigned long long shadow_rays;
+    unsigned long long blocked_shadow_rays;
+    /* Shadow rays tested against the surface that blocked the previous shadow
+       ray to the same light, and the number of those the surface blocked */
+    unsigned long long occluder_cache_tests;
+    unsigned long long occluder_cache_hits;
+    /* The reflected and refracted rays traced, and the rays that reflected
+       whole because they couldn't refract */
+    unsigned long long reflected_rays;
+    unsigned long long refracted_rays;
+    unsigned long long total_internal_reflections;
+    /* The reflected and refracted rays traced by the recursion depth left
+       for them, which is one less for every bounce.  Those left with none
+       aren't traced, and count at depth 0, which isn't reported. */
+    unsigned long long depth_rays[STATS_MAX_DEPTH];
+    /* Tests of rays against primitives by class, in closest hit searches
+       and for shadow rays, and the number of them that hit.  Meshes and
+       instances count a test for each search of their BVHs, and shadow
+       rays count the whole run of a class they are tested against, even
+       the primitives after the one that blocks them. */
+    unsigned long long hit_tests[STATS_NUM_CLASSES];
+    unsigned long long hits[STATS_NUM_CLASSES];
+    unsigned long long occlusion_tests[STATS_NUM_CLASSES];
+    unsigned long long occlusions[STATS_NUM_CLASSES];
+} ray_stats;
+
+extern __thread ray_stats thread_stats;
+
+/* Count one event for the given ray_stats member in the calling thread */
+#define stats_count(counter) (thread_stats.counter++)
+
+/* Count "n" events for the given ray_stats member in the calling thread */
+#define stats_count_many(counter, n) (thread_stats.counter += (n))
+
+/* The index in depth_rays of rays with "depth" recursion depth left */
+#define stats_depth(depth) ((depth) < STATS_MAX_DEPTH ? (depth) : STATS_MAX_DEPTH - 1)
+
+/*! Add the counts in "stats" to "total" */
+void stats_add (ray_stats * total, ray_stats * stats);
+
+/*! Add the calling thread's counts to "total" and reset them */
+void stats_collect (ray_stats * total);
+
+/*! Print a human readable report of the counts */
+void stats_print (ray_stats * stats, FILE * file);
@@ -1,18 +1,21 @@
 #include "surface.h"
+#include "intersect.h"
 
 #include <math.h>
 
-const float f_min = 1e-2;
-
 static intersection_function sphere_intersect, frustum_intersect,
                              circle_intersect, quad_intersect;
+static occlusion_function sphere_occludes, frustum_occludes,
+                          circle_occludes, quad_occludes;
+static bounding_function sphere_bounds, frustum_bounds,
+                         circle_bounds, quad_bounds;
 
 static surface_class surface_classes[] =
 {
-    { sphere_intersect },
-    { frustum_intersect },
-    { circle_intersect },
-    { quad_intersect },
+    { sphere_intersect, sphere_occludes, sphere_bounds },
+    { frustum_intersect, frustum_occludes, frustum_bounds },
+    { circle_intersect, circle_occludes, circle_bounds },
+    { quad_intersect, quad_occludes, quad_bounds },
 };
 
 surface_class * surface_sphere = &surface_classes[0];
@@ -20,139 +23,72 @@ surface_class * surface_frustum = &surface_classes[1];
 surface_class * surface_circle = &surface_classes[2];
 surface_class * surface_quad = &surface_classes[3];
 
-static bool solve_linear (vector origin, vector ray, vector plane_point, vector plane_normal,
-                          vector * intersection_out)
+static bounds bounds_union (bounds a, bounds b)
 {
-    float t;
-    t = dot_product(vector_sub(plane_point, origin), plane_normal) / dot_product(ray, plane_normal);
-    if (t < f_min)
-    {
-        return false;
-    }
-    else
-    {
-        *intersection_out = vector_add(origin, vector_multiply(t, ray));
-        return true;
-    }
+    return (bounds){ { fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y), fminf(a.min.z, b.min.z) },
+                     { fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y), fmaxf(a.max.z, b.max.z) } };
 }
 
-static int solve_quadratic (vector origin, vector ray, float a, float k, float c,
-                            vector intersections_out[2])
+static bounds disc_bounds (vector center, vector normal, float radius)
+/* A disc extends radius * sin(angle between the normal and an axis) along that axis */
 {
-    ray = vector_normalize(ray);
-    float root;
-    float base, delta;
-    float determinant = square(k) - a * c;
-
-    if (determinant < .0f)
-    {
-        return 0;
-    }
-
-    root = sqrtf(determinant);
-
-    base = -k / a;
-    delta = fabsf(root / a);
-
-    if (base - delta > f_min)
-    {
-        intersections_out[0] = vector_add(origin, vector_multiply(base - delta, ray));
-        intersections_out[1] = vector_add(origin, vector_multiply(base + delta, ray));
-        return 2;
-    }
-    else if (base + delta > f_min)
-    {
-        intersections_out[0] = vector_add(origin, vector_multiply(base + delta, ray));
-        return 1;
-    }
-    else
-    {
-        return 0;
-    }
+    vector extent = { radius * sqrtf(fmaxf(1.0f - square(normal.x), .0f)),
+                      radius * sqrtf(fmaxf(1.0f - square(normal.y), .0f)),
+                      radius * sqrtf(fmaxf(1.0f - square(normal.z), .0f)) };
+    return (bounds){ vector_sub(center, extent), vector_add(center, extent) };
 }
 
 bool sphere_intersect (vector origin, vector ray, void * geometry,
                        vector * intersection_out, vector * normal_out)
 {
     sphere * self = (sphere *)geometry;
-    float k, c;
-    vector relative_origin;
-    vector intersections[2];
-
-    relative_origin = vector_sub(origin, self->center);
-    k = dot_product(ray, relative_origin);
-    c = squared_magnitude(relative_origin) - square(self->radius);
+    vector intersection;
 
-    if (solve_quadratic(origin, ray, 1.0f, k, c, intersections) > 0)
+    if (!sphere_hit(origin, ray, vector_normalize(ray), self->center, square(self->radius),
+                    &intersection))
+    {
+        return false;
+    }
+    if (normal_out)
     {
-        if (normal_out)
-        {
-            *normal_out = vector_normalize(vector_sub(intersections[0], self->center));
-        }
-        if (intersection_out)
-        {
-            *intersection_out = intersections[0];
-        }
-        return true;
+        *normal_out = vector_normalize(vector_sub(intersection, self->center));
     }
-    else
+    if (intersection_out)
     {
-        return false;
+        *intersection_out = intersection;
     }
+    return true;
 }
 
 bool frustum_intersect (vector origin, vector ray, void * geometry,
                         vector * intersection_out, vector * normal_out)
 {
     frustum * self = (frustum *)geometry;
-    vector axis, relative_origin, relative_center;
-    vector ray_orth, origin_orth;
-    vector intersections[2];
-    float a,k,c;
-    float coefficient;
-    float radius_linear, radius_constant;
-    int index, num_hits;
-
-    relative_origin = vector_sub(origin, self->centers[0]);
-    relative_center = vector_sub(self->centers[1], self->centers[0]);
-    axis = vector_normalize(relative_center);
-    coefficient = (self->radii[1] - self->radii[0]) / vector_magnitude(relative_center);
-
-    origin_orth = vector_orth(relative_origin, axis);
-    ray_orth = vector_orth(ray, axis);
-    radius_linear = coefficient * dot_product(ray, axis);
-    radius_constant = coefficient * dot_product(relative_origin, axis) + self->radii[0];
-
-    a = squared_magnitude(ray_orth) - square(radius_linear);
-    k = dot_product(ray_orth, origin_orth) - radius_linear * radius_constant;
-    c = squared_magnitude(origin_orth) - square(radius_constant);
-
-    num_hits = solve_quadratic(origin, ray, a, k, c, intersections);
-    for (index = 0; index < num_hits; index++)
+    frustum_frame frame = frustum_bake(self->centers[0], self->centers[1],
+                                       self->radii[0], self->radii[1]);
+    vector intersection, axis = frame.axis;
+    vector relative_intersection, axis_normal, cap_point, surface_tangent;
+    float normal_origin;
+
+    if (!frustum_hit(origin, ray, vector_normalize(ray), self->centers[0], self->centers[1],
+                     self->radii[0], frame, &intersection))
+    {
+        return false;
+    }
+    if (intersection_out)
+    {
+        *intersection_out = intersection;
+    }
+    if (normal_out)
     {
-        if (dot_product(vector_sub(intersections[index], self->centers[0]), axis) >= .0f &&
-            dot_product(vector_sub(intersections[index], self->centers[1]), axis) <= .0f)
-        {
-            if (intersection_out)
-            {
-                *intersection_out = intersections[index];
-            }
-            if (normal_out)
-            {
-                vector relative_intersection, axis_normal, cap_point, surface_tangent;
-                float normal_origin;
-
-                relative_intersection = vector_sub(intersections[index], self->centers[0]);
-                axis_normal = vector_normalize(vector_orth(relative_intersection, axis));
-                cap_point = vector_add(self->centers[0], vector_multiply(self->radii[0], axis_normal));
-                surface_tangent = vector_normalize(vector_sub(intersections[index], cap_point));
-                normal_origin = dot_product(relative_intersection, surface_tangent) / dot_product(surface_tangent, axis);
-                *normal_out = vector_normalize(vector_sub(relative_intersection, vector_multiply(normal_origin, axis)));
-            }
-            return true;
-        }
+        relative_intersection = vector_sub(intersection, self->centers[0]);
+        axis_normal = vector_normalize(vector_orth(relative_intersection, axis));
+        cap_point = vector_add(self->centers[0], vector_multiply(self->radii[0], axis_normal));
+        surface_tangent = vector_normalize(vector_sub(intersection, cap_point));
+        normal_origin = dot_product(relative_intersection, surface_tangent) / dot_product(surface_tangent, axis);
+        *normal_out = vector_normalize(vector_sub(relative_intersection, vector_multiply(normal_origin, axis)));
     }
-    return false;
+    return true;
 }
 
 bool circle_intersect (vector origin, vector ray, void * geometry,
@@ -161,64 +97,100 @@ bool circle_intersect (vector origin, vector ray, void * geometry,
     circle * self = (circle *)geometry;
     vector intersection;
 
-    if (!solve_linear(origin, ray, self->center, self->normal, &intersection))
+    if (!circle_hit(origin, ray, self->center, self->normal, self->radius, &intersection))
     {
         return false;
     }
-    if (vector_distance(intersection, self->center) <= self->radius)
+    if (normal_out)
     {
-        if (normal_out)
-        {
-            *normal_out = self->normal;
-        }
-        if (intersection_out)
-        {
-            *intersection_out = intersection;
-        }
-        return true;
+        *normal_out = self->normal;
     }
-    else
+    if (intersection_out)
     {
-        return false;
+        *intersection_out = intersection;
     }
+    return true;
 }
 
 bool quad_intersect (vector origin, vector ray, void * geometry,
                      vector * intersection_out, vector * normal_out)
 {
-    float proj1, proj2;
-    vector intersection, relative_intersection;
     quad * self = (quad *)geometry;
+    quad_frame frame = quad_bake(self->vertices[0], self->vertices[1], self->vertices[2]);
+    vector intersection;
 
-    vector axis1 = vector_sub(self->vertices[0], self->vertices[1]);
-    vector axis2 = vector_sub(self->vertices[2], self->vertices[1]);
-    vector normal = vector_normalize(cross_product(axis1, axis2));
-
-    if (!solve_linear(origin, ray, self->vertices[1], normal, &intersection))
+    if (!quad_hit(origin, ray, self->vertices[1], frame, &intersection))
     {
         return false;
     }
-
-    relative_intersection = vector_sub(intersection, self->vertices[1]);
-    vector orth1 = vector_orth(axis1, vector_normalize(axis2));
-    vector orth2 = vector_orth(axis2, vector_normalize(axis1));
-    proj1 = dot_product(relative_intersection, vector_normalize(orth1));
-    proj2 = dot_product(relative_intersection, vector_normalize(orth2));
-    if (.0f <= proj1 && proj1 <= vector_magnitude(orth1) &&
-        .0f <= proj2 && proj2 <= vector_magnitude(orth2))
+    if (normal_out)
     {
-        if (normal_out)
-        {
-            *normal_out = normal;
-        }
-        if (intersection_out)
-        {
-            *intersection_out = intersection;
-        }
-        return true;
+        *normal_out = frame.normal;
     }
-    else
+    if (intersection_out)
     {
-        return false;
+        *intersection_out = intersection;
     }
+    return true;
+}
+
+bounds sphere_bounds (void * geometry)
+{
+    sphere * self = (sphere *)geometry;
+    vector extent = { self->radius, self->radius, self->radius };
+    return (bounds){ vector_sub(self->center, extent), vector_add(self->center, extent) };
+}
+
+bounds frustum_bounds (void * geometry)
+{
+    frustum * self = (frustum *)geometry;
+    vector axis = vector_normalize(vector_sub(self->centers[1], self->centers[0]));
+    return bounds_union(disc_bounds(self->centers[0], axis, self->radii[0]),
+                        disc_bounds(self->centers[1], axis, self->radii[1]));
+}
+
+bounds circle_bounds (void * geometry)
+{
+    circle * self = (circle *)geometry;
+    return disc_bounds(self->center, self->normal, self->radius);
+}
+
+bounds quad_bounds (void * geometry)
+{
+    quad * self = (quad *)geometry;
+    vector fourth = vector_sub(vector_add(self->vertices[0], self->vertices[2]), self->vertices[1]);
+    bounds result = { self->vertices[0], self->vertices[0] };
+    result = bounds_union(result, (bounds){ self->vertices[1], self->vertices[1] });
+    result = bounds_union(result, (bounds){ self->vertices[2], self->vertices[2] });
+    return bounds_union(result, (bounds){ fourth, fourth });
+}
+
+bool sphere_occludes (vector origin, vector ray, void * geometry, float max_distance)
+{
+    sphere * self = (sphere *)geometry;
+    return sphere_blocks(origin, ray, self->center, square(self->radius), max_distance);
+}
+
+bool frustum_occludes (vector origin, vector ray, void * geometry, float max_distance)
+{
+    frustum * self = (frustum *)geometry;
+    return frustum_blocks(origin, ray, self->centers[0], self->radii[0],
+                          frustum_bake(self->centers[0], self->centers[1],
+                                       self->radii[0], self->radii[1]),
+                          max_distance);
+}
+
+bool circle_occludes (vector origin, vector ray, void * geometry, float max_distance)
+{
+    circle * self = (circle *)geometry;
+    return circle_blocks(origin, ray, self->center, self->normal, square(self->radius),
+                         max_distance);
+}
+
+bool quad_occludes (vector origin, vector ray, void * geometry, float max_distance)
+{
+    quad * self = (quad *)geometry;
+    return quad_blocks(origin, ray, self->vertices[1],
+                       quad_bake(self->vertices[0], self->vertices[1], self->vertices[2]),
+                       max_distance);
 }
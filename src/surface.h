@@ -6,10 +6,10 @@
 #include "vector.h"
 
 /* Object oriented programming in ANSI C!
-   This framework effectively turns the surface struct into a class,
-   with sphere, frustum, circle, and quad "flavors" inheriting from it.  Large
-   projects (such as the Linux kernel) use conventions like this to do object
-   oriented programming in C.
+   This framework effectively turns the surface struct into a class, with
+   sphere, frustum, circle, quad, mesh and instance "flavors" inheriting from it.
+   Large projects (such as the Linux kernel) use conventions like this to do
+   object oriented programming in C.
 
    How this works:
    Each surface maintains a "class" member which points to a structure which
@@ -20,22 +20,47 @@
 
    How to initialize a surface:
    Set the class pointer to point to the appropriate surface class, one of
-   surface_sphere, surface_frustum, surface_circle, surface_quad.
+   surface_sphere, surface_frustum, surface_circle, surface_quad, surface_mesh,
+   surface_instance.
    Interpret the extra bytes as the appropriate structure, and fill it in.
 */
 
+/* An axis aligned bounding box, defined by its minimum and maximum corners */
+typedef struct
+{
+    vector min;
+    vector max;
+} bounds;
+
 typedef bool intersection_function (vector origin, vector ray, void * geometry,
                                     vector * intersection_out, vector * normal_out);
 
+/* An occlusion function answers shadow ray queries: it determines if a ray
+   with a normalized direction hits the surface at a distance less than
+   max_distance from its origin.  Unlike the intersection function it never
+   calculates the intersection point or normal. */
+typedef bool occlusion_function (vector origin, vector ray, void * geometry,
+                                 float max_distance);
+
+/* A bounding function returns a box enclosing the whole surface, used
+   to build the acceleration structure described in bvh.h */
+typedef bounds bounding_function (void * geometry);
+
 typedef struct
 {
     intersection_function * calculate_intersection;
+    occlusion_function * test_occlusion;
+    bounding_function * calculate_bounds;
 } surface_class;
 
-surface_class * surface_sphere;
-surface_class * surface_frustum;
-surface_class * surface_circle;
-surface_class * surface_quad;
+extern surface_class * surface_sphere;
+extern surface_class * surface_frustum;
+extern surface_class * surface_circle;
+extern surface_class * surface_quad;
+/* Defined with the triangle meshes it traces, in mesh.c */
+extern surface_class * surface_mesh;
+/* Defined with the groups it places, in instance.c */
+extern surface_class * surface_instance;
 
 typedef struct
 {
@@ -43,9 +68,10 @@ typedef struct
     float refraction_index;
     color specular_part;
     color diffuse_part;
-    /* Information about the geometry of the object
-       is stored in the following 32 bytes.  */
-    char geometry[32];
+    /* Information about the geometry of the object is stored in the
+       following 40 bytes, enough for the largest, a quad.  They are aligned
+       for a pointer, since meshes and instances keep pointers there.  */
+    char geometry[40] __attribute__((aligned(sizeof(void *))));
 } surface;
 /* The geometry bytes are to be interpreted according to the struct
    that corresponds to the surface's class.  Those struct definitions follow: */
@@ -79,3 +105,20 @@ typedef struct
 {
     vector vertices[3];
 } quad;
+
+/* A mesh is a set of triangles sharing their vertices and the surface's
+   material.  The triangles are too many to fit here, so this only points to
+   them; they are defined in mesh.h. */
+typedef struct
+{
+    struct triangle_mesh * triangles;
+} mesh;
+
+/* An instance is a copy of a group of surfaces, moved, rotated and scaled
+   into place.  The surfaces and the transform are shared or too big to fit
+   here, so this only points to them; they are defined in instance.h. */
+typedef struct
+{
+    struct instance_group * group;
+    struct instance_transform * transform;
+} instance;
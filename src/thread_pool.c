@@ -0,0 +1,254 @@
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Since every batch hands out a contiguous run of task indices to each worker,
+   a deque never needs to hold anything but a range of task indices.  The owner
+   takes tasks from the front of the range, and thieves split off the back half. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    int front;
+    int back;
+} __attribute__((aligned(64))) task_deque;
+
+typedef struct
+{
+    thread_pool * pool;
+    int index;
+} worker_info;
+
+struct thread_pool
+{
+    int num_workers;
+    pthread_t * threads;
+    worker_info * workers;
+    task_deque * deques;
+
+    pthread_mutex_t lock;
+    pthread_cond_t batch_ready;
+    pthread_cond_t batch_done;
+    unsigned generation;
+    int busy_workers;
+    bool shutdown;
+
+    task_function * function;
+    void * context;
+};
+
+static bool take_task (task_deque * deque, int * task_out)
+/*! Take the task at the front of the given deque, return false if it is empty */
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->front < deque->back)
+    {
+        *task_out = deque->front++;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool steal_tasks (thread_pool * pool, int thief, int * task_out)
+/*! Look through the other workers' deques, in order starting after the thief,
+    for one that still has tasks.  Split off the back half of its range, keep the
+    first stolen task in "task_out" and move the rest into the thief's deque.
+    Return false if every other deque is empty.
+*/
+{
+    int offset, front, back;
+    task_deque * victim;
+    task_deque * own = &pool->deques[thief];
+
+    for (offset = 1; offset < pool->num_workers; offset++)
+    {
+        victim = &pool->deques[(thief + offset) % pool->num_workers];
+        pthread_mutex_lock(&victim->lock);
+        back = victim->back;
+        front = back - (victim->back - victim->front + 1) / 2;
+        victim->back = front;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (front < back)
+        {
+            *task_out = front;
+            pthread_mutex_lock(&own->lock);
+            own->front = front + 1;
+            own->back = back;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_tasks (thread_pool * pool, int worker)
+{
+    int task;
+    while (take_task(&pool->deques[worker], &task) || steal_tasks(pool, worker, &task))
+    {
+        pool->function(pool->context, task, worker);
+    }
+}
+
+static void * worker_main (void * argument)
+{
+    worker_info * info = argument;
+    thread_pool * pool = info->pool;
+    unsigned generation = 0;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->generation == generation)
+        {
+            pthread_cond_wait(&pool->batch_ready, &pool->lock);
+        }
+        if (pool->shutdown)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool, info->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy_workers == 0)
+        {
+            pthread_cond_signal(&pool->batch_done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+thread_pool * thread_pool_create (int num_workers)
+{
+    thread_pool * pool;
+    int index;
+
+    if (num_workers <= 0)
+    {
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_workers <= 0)
+        {
+            num_workers = 1;
+        }
+    }
+
+    pool = calloc(1, sizeof(thread_pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->num_workers = num_workers;
+    pool->threads = calloc(num_workers, sizeof(pthread_t));
+    pool->workers = calloc(num_workers, sizeof(worker_info));
+    if (posix_memalign((void **)&pool->deques, sizeof(task_deque),
+                       num_workers * sizeof(task_deque)) != 0)
+    {
+        pool->deques = NULL;
+    }
+    if (pool->threads == NULL || pool->workers == NULL || pool->deques == NULL)
+    {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->batch_ready, NULL);
+    pthread_cond_init(&pool->batch_done, NULL);
+    for (index = 0; index < num_workers; index++)
+    {
+        pthread_mutex_init(&pool->deques[index].lock, NULL);
+        pool->deques[index].front = pool->deques[index].back = 0;
+        pool->workers[index] = (worker_info){ pool, index };
+    }
+
+    /* Worker 0 is the thread that calls thread_pool_run */
+    for (index = 1; index < num_workers; index++)
+    {
+        if (pthread_create(&pool->threads[index], NULL, worker_main, &pool->workers[index]) != 0)
+        {
+            pool->num_workers = index;
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+int thread_pool_size (thread_pool * pool)
+{
+    return pool->num_workers;
+}
+
+void thread_pool_run (thread_pool * pool, task_function * function,
+                      void * context, int num_tasks)
+{
+    int index;
+    long long num_workers = pool->num_workers;
+
+    pool->function = function;
+    pool->context = context;
+    for (index = 0; index < pool->num_workers; index++)
+    {
+        pool->deques[index].front = index * num_tasks / num_workers;
+        pool->deques[index].back = (index + 1) * num_tasks / num_workers;
+    }
+
+    if (pool->num_workers == 1)
+    {
+        run_tasks(pool, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy_workers = pool->num_workers - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->batch_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_tasks(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy_workers > 0)
+    {
+        pthread_cond_wait(&pool->batch_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy (thread_pool * pool)
+{
+    int index;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->batch_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (index = 1; index < pool->num_workers; index++)
+    {
+        pthread_join(pool->threads[index], NULL);
+    }
+    for (index = 0; index < pool->num_workers; index++)
+    {
+        pthread_mutex_destroy(&pool->deques[index].lock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->batch_ready);
+    pthread_cond_destroy(&pool->batch_done);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+/* This module defines a pool of worker threads that execute batches of
+   independent tasks.  A batch is a task function plus a count of tasks;
+   each task is identified by its index, from 0 up to the task count.
+
+   Tasks are scheduled with work stealing: the batch is divided into
+   contiguous runs of tasks, one run per worker, and each worker keeps its
+   run in its own double ended queue (deque).  A worker takes tasks from the
+   front of its own deque, and once that is empty it steals tasks from the
+   back of the other workers' deques.  Workers that finish early therefore
+   take load off workers stuck with expensive tasks, while each worker mostly
+   processes neighboring tasks in order.
+
+   The thread calling thread_pool_run acts as worker 0, so a pool with a
+   single worker runs every task on the calling thread without any thread
+   creation or locking.  The worker threads stay alive between batches.
+*/
+
+typedef struct thread_pool thread_pool;
+
+/* A task function is called once per task index with the context pointer
+   given to thread_pool_run and the index of the worker running it.  The
+   worker index is between 0 and the pool size, useful for indexing
+   per-worker scratch data. */
+typedef void task_function (void * context, int task, int worker);
+
+/*! Create a thread pool with the given number of workers, including the
+    calling thread.  A worker count of 0 or less selects one worker per
+    online processor.  Return NULL if the threads could not be created. */
+thread_pool * thread_pool_create (int num_workers);
+
+/*! Return the number of workers in the pool, including the calling thread */
+int thread_pool_size (thread_pool * pool);
+
+/*! Run "function" for every task index from 0 to num_tasks - 1, spread
+    across the workers of the pool.  Return once every task is complete. */
+void thread_pool_run (thread_pool * pool, task_function * function,
+                      void * context, int num_tasks);
+
+/*! Stop the worker threads and release the pool */
+void thread_pool_destroy (thread_pool * pool);
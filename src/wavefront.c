@@ -0,0 +1,457 @@
+#include "wavefront.h"
+#include "ray_trace.h"
+#include "packet.h"
+#include "surface.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* A ray of one bounce of the wavefront */
+typedef struct
+{
+    vector origin;
+    vector ray;
+    /* The surface hit, or NULL if none is */
+    surface * surface;
+    vector intersection;
+    vector normal;
+    /* The throughput weight of the ray, and the coefficients of its reflected
+       and refracted rays' colors, which are 0 for rays that aren't traced */
+    color weight;
+    float coefficients[2];
+    /* Indices of the reflected and refracted rays in the queue of the next
+       bounce, or -1 if they are not traced */
+    int children[2];
+    /* The ray's shadow rays, which are consecutive in the bounce's shadow
+       queue and in the order of the lights */
+    int first_shadow;
+    int num_shadows;
+    color color;
+} wave_ray;
+
+typedef struct
+{
+    /* Index of the ray in the bounce's queue */
+    int ray;
+    int light;
+    float c_diffuse;
+    bool visible;
+} shadow_ray;
+
+/* The queues of one bounce */
+typedef struct
+{
+    wave_ray * rays;
+    int num_rays;
+    int rays_capacity;
+    shadow_ray * shadows;
+    int num_shadows;
+    int shadows_capacity;
+    /* The order in which the rays or shadow rays are tested */
+    int * order;
+    int order_capacity;
+} bounce;
+
+/* Rays are grouped by the signs of their direction components */
+#define NUM_OCTANTS 8
+
+static bool reserve (void ** array, int * capacity, int needed, size_t size)
+/*! Make room in a growable array for "needed" elements of "size" bytes */
+{
+    void * grown;
+    int new_capacity = *capacity > 0 ? *capacity : 64;
+
+    if (needed <= *capacity)
+    {
+        return true;
+    }
+    while (new_capacity < needed)
+    {
+        new_capacity *= 2;
+    }
+    grown = realloc(*array, new_capacity * size);
+    if (grown == NULL)
+    {
+        return false;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+static int queue_ray (bounce * current, vector origin, vector ray, color weight)
+/*! Add a ray to the queue of a bounce, returning its index or -1 if there
+    is no memory for it */
+{
+    wave_ray * queued;
+
+    if (!reserve((void **)&current->rays, &current->rays_capacity, current->num_rays + 1,
+                 sizeof(wave_ray)))
+    {
+        return -1;
+    }
+    queued = &current->rays[current->num_rays];
+    queued->origin = origin;
+    queued->ray = ray;
+    queued->weight = weight;
+    queued->surface = NULL;
+    queued->children[0] = queued->children[1] = -1;
+    queued->num_shadows = 0;
+    return current->num_rays++;
+}
+
+static bool sort_order (bounce * current, int count, int num_keys, int (*key) (bounce * current, int index))
+/*! Fill the bounce's order with the indices 0 to count - 1 sorted by the
+    given key, keeping indices with equal keys in order */
+{
+    int starts[NUM_OCTANTS + 1];
+    int * counts;
+    int index, k;
+
+    if (!reserve((void **)&current->order, &current->order_capacity, count, sizeof(int)))
+    {
+        return false;
+    }
+    counts = num_keys <= NUM_OCTANTS ? starts : malloc(sizeof(int) * (num_keys + 1));
+    if (counts == NULL)
+    {
+        return false;
+    }
+
+    for (k = 0; k <= num_keys; k++)
+    {
+        counts[k] = 0;
+    }
+    for (index = 0; index < count; index++)
+    {
+        counts[key(current, index) + 1]++;
+    }
+    for (k = 1; k <= num_keys; k++)
+    {
+        counts[k] += counts[k - 1];
+    }
+    for (index = 0; index < count; index++)
+    {
+        current->order[counts[key(current, index)]++] = index;
+    }
+
+    if (counts != starts)
+    {
+        free(counts);
+    }
+    return true;
+}
+
+static int octant_key (bounce * current, int index)
+{
+    vector ray = current->rays[index].ray;
+    return (ray.x < .0f) | (ray.y < .0f) << 1 | (ray.z < .0f) << 2;
+}
+
+static int light_key (bounce * current, int index)
+{
+    return current->shadows[index].light;
+}
+
+static void hit_camera_rays (scene * scene, bounce * current, int packet_width)
+/*! The hit stage for camera rays, which share an origin and are traced as
+    packets in the order they were given, neighboring pixels together */
+{
+    vector rays[PACKET_MAX_WIDTH];
+    surface * hits[PACKET_MAX_WIDTH];
+    vector intersections[PACKET_MAX_WIDTH], normals[PACKET_MAX_WIDTH];
+    int first, count, lane;
+
+    for (first = 0; first < current->num_rays; first += count)
+    {
+        count = current->num_rays - first < packet_width ? current->num_rays - first : packet_width;
+        for (lane = 0; lane < count; lane++)
+        {
+            rays[lane] = current->rays[first + lane].ray;
+        }
+        packet_hit_surfaces(scene->primitives, packet_width, current->rays[first].origin, rays, count,
+                            hits, intersections, normals);
+        for (lane = 0; lane < count; lane++)
+        {
+            current->rays[first + lane].surface = hits[lane];
+            current->rays[first + lane].intersection = intersections[lane];
+            current->rays[first + lane].normal = normals[lane];
+        }
+    }
+}
+
+static void hit_stage (scene * scene, bounce * current)
+/*! Find the surfaces hit by the rays of a bounce, grouped by direction */
+{
+    wave_ray * ray;
+    int index;
+
+    if (!sort_order(current, current->num_rays, NUM_OCTANTS, octant_key))
+    {
+        /* Without memory to sort, the rays are traced as they were queued */
+        for (index = 0; index < current->num_rays; index++)
+        {
+            ray = &current->rays[index];
+            ray->surface = scene_hit_surface(scene, ray->origin, ray->ray, &ray->intersection,
+                                             &ray->normal);
+        }
+        return;
+    }
+    for (index = 0; index < current->num_rays; index++)
+    {
+        ray = &current->rays[current->order[index]];
+        ray->surface = scene_hit_surface(scene, ray->origin, ray->ray, &ray->intersection,
+                                         &ray->normal);
+    }
+}
+
+static bool shade_stage (scene * scene, bounce * current, bounce * next)
+/*! Queue the reflected and refracted rays of the rays of a bounce that hit a
+    specular surface to the next bounce, or leave them untraced if "next" is
+    NULL, and queue shadow rays for those that hit a diffuse surface.
+    Return false if memory runs out. */
+{
+    wave_ray * ray;
+    light_source * source;
+    vector refracted_ray, normal;
+    color weights[2];
+    float c_diffuse;
+    int index;
+
+    for (index = 0; index < current->num_rays; index++)
+    {
+        ray = &current->rays[index];
+        if (ray->surface == NULL)
+        {
+            continue;
+        }
+
+        if (is_color(ray->surface->specular_part))
+        {
+            split_specular(scene, ray->intersection, ray->ray, ray->weight,
+                           ray->surface->specular_part,
+                           fresnel_refraction(ray->ray, ray->normal,
+                                              ray->surface->refraction_index, &refracted_ray),
+                           next != NULL, ray->coefficients, weights);
+            if (next && ray->coefficients[0] > .0f)
+            {
+                ray->children[0] = queue_ray(next, ray->intersection,
+                                             reflect_ray(ray->ray, ray->normal), weights[0]);
+                if (ray->children[0] < 0)
+                {
+                    return false;
+                }
+            }
+            if (next && ray->coefficients[1] > .0f)
+            {
+                ray->children[1] = queue_ray(next, ray->intersection, refracted_ray, weights[1]);
+                if (ray->children[1] < 0)
+                {
+                    return false;
+                }
+            }
+        }
+
+        if (is_color(ray->surface->diffuse_part))
+        {
+            /* As illuminate in ray_trace.c, facing the normal toward the ray */
+            normal = dot_product(ray->ray, ray->normal) > 0 ? vector_negate(ray->normal)
+                                                            : ray->normal;
+            ray->first_shadow = current->num_shadows;
+            for (source = scene->light_sources; source->type != LIGHT_SOURCE_SENTINEL; source++)
+            {
+                c_diffuse = get_diffuse_coefficient(ray->intersection, normal, source);
+                if (c_diffuse > .0f)
+                {
+                    if (!reserve((void **)&current->shadows, &current->shadows_capacity,
+                                 current->num_shadows + 1, sizeof(shadow_ray)))
+                    {
+                        return false;
+                    }
+                    current->shadows[current->num_shadows++] =
+                        (shadow_ray){ index, source - scene->light_sources, c_diffuse, false };
+                }
+            }
+            ray->num_shadows = current->num_shadows - ray->first_shadow;
+        }
+    }
+    return true;
+}
+
+static void shadow_stage (scene * scene, bounce * current)
+/*! Test the shadow rays of a bounce, grouped by light */
+{
+    shadow_ray * shadow;
+    int index, num_lights = 0;
+    bool sorted;
+
+    while (scene->light_sources[num_lights].type != LIGHT_SOURCE_SENTINEL)
+    {
+        num_lights++;
+    }
+    sorted = sort_order(current, current->num_shadows, num_lights, light_key);
+    for (index = 0; index < current->num_shadows; index++)
+    {
+        shadow = &current->shadows[sorted ? current->order[index] : index];
+        shadow->visible = light_is_visible(&scene->light_sources[shadow->light], shadow->light,
+                                           current->rays[shadow->ray].intersection,
+                                           scene->surfaces, scene->primitives);
+    }
+}
+
+static color child_color (scene * scene, bounce * next, int child)
+/*! The color of a reflected or refracted ray.  Those beyond the depth limit
+    aren't traced, and have the background color as in cast_ray. */
+{
+    return child >= 0 ? next->rays[child].color : scene->background_color;
+}
+
+static void resolve_bounce (scene * scene, bounce * current, bounce * next)
+/*! Determine the colors of the rays of a bounce from the colors of their
+    reflected and refracted rays in the next bounce and their shadow rays,
+    with the same operations as cast_ray and shade_surface */
+{
+    color black = { .0f, .0f, .0f };
+    color reflected, transmitted, illumination;
+    wave_ray * ray;
+    shadow_ray * shadow;
+    int index;
+
+    for (index = 0; index < current->num_rays; index++)
+    {
+        ray = &current->rays[index];
+        if (ray->surface == NULL)
+        {
+            ray->color = scene->background_color;
+            continue;
+        }
+
+        ray->color = black;
+        if (is_color(ray->surface->specular_part))
+        {
+            reflected = transmitted = black;
+            if (ray->coefficients[0] > .0f)
+            {
+                reflected = color_scale(ray->coefficients[0],
+                                        child_color(scene, next, ray->children[0]));
+            }
+            if (ray->coefficients[1] > .0f)
+            {
+                transmitted = color_scale(ray->coefficients[1],
+                                          child_color(scene, next, ray->children[1]));
+            }
+            ray->color = color_multiply(ray->surface->specular_part,
+                                        color_add(transmitted, reflected));
+        }
+
+        if (is_color(ray->surface->diffuse_part))
+        {
+            illumination = black;
+            for (shadow = &current->shadows[ray->first_shadow];
+                 shadow < &current->shadows[ray->first_shadow + ray->num_shadows]; shadow++)
+            {
+                if (shadow->visible)
+                {
+                    illumination = color_add(illumination,
+                                             color_scale(shadow->c_diffuse,
+                                                         scene->light_sources[shadow->light].color));
+                }
+            }
+            ray->color = color_add(ray->color,
+                                   color_multiply(ray->surface->diffuse_part, illumination));
+        }
+    }
+}
+
+static bool trace_bounces (scene * scene, bounce bounces[], int depth, int packet_width)
+/*! Trace the camera rays queued in the first bounce and everything they
+    lead to, then resolve their colors.  Return false if memory runs out. */
+{
+    int level, last = 0;
+
+    for (level = 0; level < depth && bounces[level].num_rays > 0; level++)
+    {
+        if (level > 0)
+        {
+            stats_count_many(depth_rays[stats_depth(depth - level)], bounces[level].num_rays);
+        }
+        if (level == 0 && packet_width > 1 && scene->primitives)
+        {
+            hit_camera_rays(scene, &bounces[level], packet_width);
+        }
+        else
+        {
+            hit_stage(scene, &bounces[level]);
+        }
+        if (!shade_stage(scene, &bounces[level], level + 1 < depth ? &bounces[level + 1] : NULL))
+        {
+            return false;
+        }
+        shadow_stage(scene, &bounces[level]);
+        last = level;
+    }
+
+    for (level = last; level >= 0; level--)
+    {
+        resolve_bounce(scene, &bounces[level], level + 1 < depth ? &bounces[level + 1] : NULL);
+    }
+    return true;
+}
+
+void wavefront_trace (scene * scene, vector origin, const vector rays[], int count, int depth,
+                      int packet_width, color colors_out[], surface * hits_out[])
+{
+    bounce * bounces = depth > 0 ? calloc(depth, sizeof(bounce)) : NULL;
+    color white = { 1.0f, 1.0f, 1.0f };
+    bool traced = false;
+    surface * hit;
+    vector intersection, normal;
+    int index, level;
+
+    if (bounces)
+    {
+        index = 0;
+        while (index < count && queue_ray(&bounces[0], origin, rays[index], white) >= 0)
+        {
+            index++;
+        }
+        if (index == count && trace_bounces(scene, bounces, depth, packet_width))
+        {
+            for (index = 0; index < count; index++)
+            {
+                colors_out[index] = bounces[0].rays[index].color;
+                if (hits_out)
+                {
+                    hits_out[index] = bounces[0].rays[index].surface;
+                }
+            }
+            traced = true;
+        }
+        for (level = 0; level < depth; level++)
+        {
+            free(bounces[level].rays);
+            free(bounces[level].shadows);
+            free(bounces[level].order);
+        }
+        free(bounces);
+    }
+
+    /* Without the memory for the queues, the rays are traced one by one as
+       cast_ray traces them */
+    if (!traced)
+    {
+        for (index = 0; index < count; index++)
+        {
+            hit = depth > 0 ? scene_hit_surface(scene, origin, rays[index], &intersection, &normal)
+                            : NULL;
+            colors_out[index] = hit ? shade_surface(scene, rays[index], hit, intersection, normal,
+                                                    depth, white)
+                                    : scene->background_color;
+            if (hits_out)
+            {
+                hits_out[index] = hit;
+            }
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "scene.h"
+#include "color.h"
+#include "vector.h"
+
+/* This module is a second ray tracing engine, which computes the same colors
+   as cast_ray in ray_trace.c in a different order.
+
+   cast_ray follows each ray depth first: it finds the surface the ray hits,
+   then recursively traces its reflected and refracted rays, and tests its
+   shadow rays, before moving on to the next ray.  Every ray runs through the
+   intersection, Fresnel and lighting code in turn, and the working set of
+   code and data changes from one step to the next.
+
+   The wavefront engine takes a whole batch of rays, such as the camera rays
+   of a tile, and traces them breadth first, one bounce at a time.  Each
+   bounce runs as a sequence of stages over a queue of rays:
+
+   Hit stage: find the surface hit by every ray of the queue, in the order of
+   their directions so that rays heading the same way traverse the BVH one
+   after another.  Camera rays can be traced as packets (see packet.h).
+
+   Shade stage: for every ray that hit a surface, work out its Fresnel
+   coefficients, queue its reflected and refracted rays for the next bounce,
+   and queue a shadow ray to each light that faces the surface.
+
+   Shadow stage: test the shadow rays, grouped by light, so that the rays to
+   each light follow one another through the occluder cache.
+
+   Only rays that are still alive are queued, so the queues shrink with each
+   bounce.  Once the last bounce is done, the tree of rays is resolved from
+   the deepest bounce back up to the camera rays, combining the colors of
+   each ray's reflected and refracted rays and its lighting exactly as
+   cast_ray combines them, so both engines produce identical images.
+*/
+
+/*! Determine the colors of "count" rays with the given origin and directions,
+    as cast_ray with recursion depth limit "depth" does, storing them to
+    colors_out.  If packet_width is more than 1, the rays are traced as
+    packets of that width until their first hits.  If hits_out is not NULL,
+    the surface each ray hits first, or NULL, is stored to it. */
+void wavefront_trace (scene * scene, vector origin, const vector rays[], int count, int depth,
+                      int packet_width, color colors_out[], surface * hits_out[]);
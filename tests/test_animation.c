@@ -0,0 +1,237 @@
+#include "scene.h"
+#include "animation.h"
+#include "primitives.h"
+#include "instance.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+static int tests_run;
+static int tests_passed;
+
+void test_int (char * label, int expected, int actual)
+{
+    if (expected == actual)
+    {
+        printf("Pass: %s: %d = %d\n", label, expected, actual);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: expected %d, got %d\n", label, expected, actual);
+    }
+    tests_run++;
+}
+
+void test_float (char * label, float expected, float actual)
+{
+    if (fabsf(expected - actual) < 1e-5f)
+    {
+        printf("Pass: %s: %g\n", label, expected);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: expected %g, got %g\n", label, expected, actual);
+    }
+    tests_run++;
+}
+
+float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+vector random_vector (float min, float max)
+{
+    return (vector){ random_float(min, max), random_float(min, max), random_float(min, max) };
+}
+
+void test_interpolate ()
+/*! Each property is interpolated between the keys that give it, and held
+    after the last of them */
+{
+    animation anim = { NULL, 0, 0, 0 };
+    keyframe base = { 0, KEY_LIGHT_PROPERTIES, { 0, 0, 0 } };
+    keyframe key;
+    animated_object * light;
+
+    base.color = (color){ 0, 0, 0 };
+    light = animation_add_object(&anim, ANIMATED_LIGHT, 0, &base);
+    key = (keyframe){ 20, KEY_COLOR };
+    key.color = (color){ 1, 0.5, 0 };
+    animation_add_key(&anim, light, &key);
+    key = (keyframe){ 10, KEY_POSITION, { 10, 0, -10 } };
+    animation_add_key(&anim, light, &key);
+
+    test_int("Keys, in order of frame", 10, light->keys[1].frame);
+    test_int("Frames of an animation", 21, anim.num_frames);
+    test_float("Position halfway to a key", 5, animation_interpolate(light, 5).position.x);
+    test_float("Position after the last key", -10, animation_interpolate(light, 15).position.z);
+    test_float("Color across a key of position", 0.5, animation_interpolate(light, 10).color.r);
+    test_float("Color after the last key", 0.5, animation_interpolate(light, 100).color.g);
+    test_int("Properties of a light", KEY_LIGHT_PROPERTIES,
+             animation_interpolate(light, 100).properties);
+
+    /* A second key at frame 10 only replaces the properties it gives */
+    key = (keyframe){ 10, KEY_COLOR };
+    key.color = (color){ 0, 0, 1 };
+    animation_add_key(&anim, light, &key);
+    test_int("Keys at the same frame merged", 3, light->num_keys);
+    test_float("Merged key keeps its position", 10, animation_interpolate(light, 10).position.x);
+    test_float("Merged key gives its color", 1, animation_interpolate(light, 10).color.b);
+
+    free(light->keys);
+    free(anim.objects);
+}
+
+void test_apply ()
+/*! Frames move the camera, light sources and instances of a scene, and
+    report whether instances moved */
+{
+    light_source lights[2] = { { LIGHT_SOURCE_STANDARD }, { LIGHT_SOURCE_SENTINEL } };
+    surface surfaces[2] = { { .class = NULL }, { .class = NULL } };
+    instance_transform transform;
+    scene scene = { .light_sources = lights, .surfaces = surfaces };
+    animation * anim = calloc(1, sizeof(animation));
+    keyframe base = { 0, KEY_CAMERA_PROPERTIES };
+    keyframe key = { 10, KEY_VIEW_ANGLE };
+    animated_object * object;
+
+    surfaces[0].class = surface_instance;
+    ((instance *)surfaces[0].geometry)->transform = &transform;
+    instance_transform_make((vector){ 1, 1, 1 }, (vector){ 0, 0, 0 }, (vector){ 0, 0, 0 },
+                            &transform);
+
+    base.view_angle = 1;
+    key.view_angle = 2;
+    object = animation_add_object(anim, ANIMATED_CAMERA, 0, &base);
+    animation_add_key(anim, object, &key);
+    base = (keyframe){ 0, KEY_LIGHT_PROPERTIES };
+    key = (keyframe){ 4, KEY_COLOR };
+    key.color = (color){ 1, 1, 1 };
+    object = animation_add_object(anim, ANIMATED_LIGHT, 0, &base);
+    animation_add_key(anim, object, &key);
+
+    test_int("No instance moved", 0, animation_apply(anim, 5, &scene));
+    test_float("Camera view angle", 1.5, scene.camera.view_angle);
+    test_float("Light color", 1, lights[0].color.g);
+
+    base = (keyframe){ 0, KEY_INSTANCE_PROPERTIES };
+    base.scale = (vector){ 1, 1, 1 };
+    key = (keyframe){ 10, KEY_POSITION, { 0, 0, 10 } };
+    object = animation_add_object(anim, ANIMATED_INSTANCE, 0, &base);
+    animation_add_key(anim, object, &key);
+    key = (keyframe){ 20, KEY_SCALE };
+    key.scale = (vector){ 1, 1, -1 };
+    animation_add_key(anim, object, &key);
+
+    test_int("Instance moved", 1, animation_apply(anim, 5, &scene));
+    test_float("Instance position", 5, transform.to_world.translation.z);
+    test_int("Instance at the same place", 0, animation_apply(anim, 5, &scene));
+    test_int("Instance scaled by 0", 0, animation_apply(anim, 10, &scene));
+    test_float("Instance keeps its transform", 5, transform.to_world.translation.z);
+
+    animation_free(anim);
+}
+
+void test_refit (int num_instances, int num_frames, int num_rays)
+/*! Primitives refit to moving instances find the same surfaces as
+    primitives built again for every frame */
+{
+    surface * group_surfaces = calloc(4, sizeof(surface));
+    surface * instances = calloc(num_instances + 1, sizeof(surface));
+    instance_transform * transforms = malloc(sizeof(instance_transform) * num_instances);
+    animation * anim = calloc(1, sizeof(animation));
+    instance_group group;
+    primitives * refit, * rebuilt;
+    animated_object * object;
+    keyframe base, key;
+    vector origin, ray, refit_point, rebuilt_point, normal;
+    surface * refit_hit, * rebuilt_hit;
+    int index, frame, mismatches = 0, hits = 0, outside = 0;
+    bounds root, box;
+
+    for (index = 0; index < 3; index++)
+    {
+        group_surfaces[index].class = surface_sphere;
+        *(sphere *)group_surfaces[index].geometry = (sphere){ random_vector(-2, 2), 1 };
+    }
+    instance_group_create(&group, group_surfaces);
+    for (index = 0; index < num_instances; index++)
+    {
+        base = (keyframe){ 0, KEY_INSTANCE_PROPERTIES, random_vector(-50, 50),
+                           random_vector(-M_PI, M_PI), { 1, 1, 1 } };
+        instance_transform_make(base.scale, base.rotation, base.position, &transforms[index]);
+        instances[index].class = surface_instance;
+        ((instance *)instances[index].geometry)->group = &group;
+        ((instance *)instances[index].geometry)->transform = &transforms[index];
+        object = animation_add_object(anim, ANIMATED_INSTANCE, index, &base);
+        key = (keyframe){ num_frames - 1, KEY_POSITION | KEY_SCALE, random_vector(-50, 50) };
+        key.scale = random_vector(0.5, 2);
+        animation_add_key(anim, object, &key);
+    }
+
+    refit = primitives_create(instances);
+    for (frame = 1; frame < num_frames; frame++)
+    {
+        animation_apply(anim, frame, &(scene){ .surfaces = instances });
+        primitives_refit(refit);
+        rebuilt = primitives_create(instances);
+        for (index = 0; index < num_rays; index++)
+        {
+            origin = random_vector(-80, 80);
+            ray = vector_normalize(vector_sub(random_vector(-50, 50), origin));
+            refit_hit = primitives_hit_surface(refit, origin, ray, &refit_point, &normal);
+            rebuilt_hit = primitives_hit_surface(rebuilt, origin, ray, &rebuilt_point, &normal);
+            hits += refit_hit != NULL;
+            mismatches += refit_hit != rebuilt_hit ||
+                          (refit_hit && vector_distance(refit_point, rebuilt_point) != 0);
+        }
+        primitives_free(rebuilt);
+
+        root = refit->bvh->nodes[0].box;
+        for (index = 0; index < num_instances; index++)
+        {
+            box = surface_instance->calculate_bounds(instances[index].geometry);
+            outside += box.min.x < root.min.x || box.min.y < root.min.y || box.min.z < root.min.z ||
+                       box.max.x > root.max.x || box.max.y > root.max.y || box.max.z > root.max.z;
+        }
+    }
+    printf("%d of %d rays hit instances\n", hits, num_rays * (num_frames - 1));
+    test_int("Instances outside the refit root box", 0, outside);
+    test_int("Refit and rebuilt primitives disagree", 0, mismatches);
+
+    primitives_free(refit);
+    instance_group_free(&group);
+    animation_free(anim);
+    free(group_surfaces);
+    free(instances);
+    free(transforms);
+}
+
+int main ()
+{
+    tests_run = tests_passed = 0;
+    srand(1);
+
+    test_interpolate();
+    test_apply();
+    test_refit(300, 8, 5000);
+
+    printf("%d out of %d tests passed.\n", tests_passed, tests_run);
+
+    if (tests_passed == tests_run)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
@@ -0,0 +1,307 @@
+#include "scene.h"
+#include "bvh.h"
+#include "primitives.h"
+#include "packet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+surface * hit_surface (vector origin, vector ray, surface surfaces[],
+                       vector * intersection_out, vector * normal_out);
+bool is_illuminated (light_source * source, vector point, surface surfaces[]);
+
+static int tests_run;
+static int tests_passed;
+
+void test_int (char * label, int expected, int actual)
+{
+    if (expected == actual)
+    {
+        printf("Pass: %s: %d = %d\n", label, expected, actual);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: expected %d, got %d\n", label, expected, actual);
+    }
+    tests_run++;
+}
+
+float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+vector random_vector (float min, float max)
+{
+    return (vector){ random_float(min, max), random_float(min, max), random_float(min, max) };
+}
+
+surface * random_scene (int count)
+/*! Make a sentinel terminated array of "count" surfaces of every class,
+    scattered through a cube of side 200 centered at the origin */
+{
+    surface * surfaces = calloc(count + 1, sizeof(surface));
+    int index;
+    vector center;
+
+    for (index = 0; index < count; index++)
+    {
+        center = random_vector(-100, 100);
+        switch (index % 4)
+        {
+            case 0:
+                surfaces[index].class = surface_sphere;
+                *(sphere *)surfaces[index].geometry = (sphere){ center, random_float(1, 10) };
+                break;
+            case 1:
+                surfaces[index].class = surface_frustum;
+                *(frustum *)surfaces[index].geometry =
+                    (frustum){ { center, vector_add(center, random_vector(-10, 10)) },
+                               { random_float(0, 5), random_float(0, 5) } };
+                break;
+            case 2:
+                surfaces[index].class = surface_circle;
+                *(circle *)surfaces[index].geometry =
+                    (circle){ center, vector_normalize(random_vector(-1, 1)), random_float(1, 10) };
+                break;
+            case 3:
+                surfaces[index].class = surface_quad;
+                *(quad *)surfaces[index].geometry =
+                    (quad){ { vector_add(center, random_vector(-10, 10)), center,
+                              vector_add(center, random_vector(-10, 10)) } };
+                break;
+        }
+    }
+    surfaces[count].class = NULL;
+    return surfaces;
+}
+
+void test_bvh_matches_linear_search (int num_surfaces, int num_rays)
+/*! Trace random rays through a random scene both with and without a BVH,
+    and count the rays where the results differ */
+{
+    surface * surfaces = random_scene(num_surfaces);
+    bvh * bvh = bvh_create(surfaces);
+    primitives * primitives = primitives_create(surfaces);
+    vector origin, ray, intersection, normal, bvh_intersection, bvh_normal;
+    light_source light;
+    surface * expected;
+    surface * actual;
+    bool illuminated;
+    int index, hits = 0, hit_mismatches = 0, shadow_mismatches = 0;
+    int packed_hit_mismatches = 0, packed_shadow_mismatches = 0;
+    char label[64];
+
+    for (index = 0; index < num_rays; index++)
+    {
+        origin = random_vector(-150, 150);
+        ray = vector_normalize(random_vector(-1, 1));
+        expected = hit_surface(origin, ray, surfaces, &intersection, &normal);
+        actual = bvh_hit_surface(bvh, surfaces, origin, ray, &bvh_intersection, &bvh_normal);
+        if (expected != actual ||
+            (expected && (intersection.x != bvh_intersection.x || normal.x != bvh_normal.x)))
+        {
+            hit_mismatches++;
+        }
+        actual = primitives_hit_surface(primitives, origin, ray, &bvh_intersection, &bvh_normal);
+        if (expected != actual ||
+            (expected && (intersection.x != bvh_intersection.x || normal.x != bvh_normal.x)))
+        {
+            packed_hit_mismatches++;
+        }
+        hits += expected != NULL;
+
+        light.position = random_vector(-150, 150);
+        ray = vector_normalize(vector_sub(light.position, origin));
+        illuminated = is_illuminated(&light, origin, surfaces);
+        if (illuminated ==
+            bvh_is_occluded(bvh, surfaces, origin, ray, vector_distance(origin, light.position),
+                            NULL))
+        {
+            shadow_mismatches++;
+        }
+        if (illuminated ==
+            primitives_is_occluded(primitives, origin, ray,
+                                   vector_distance(origin, light.position), NULL))
+        {
+            packed_shadow_mismatches++;
+        }
+    }
+
+    printf("%d surfaces: %d of %d rays hit a surface\n", num_surfaces, hits, num_rays);
+    sprintf(label, "BVH closest hits, %d surfaces", num_surfaces);
+    test_int(label, 0, hit_mismatches);
+    sprintf(label, "BVH shadow rays, %d surfaces", num_surfaces);
+    test_int(label, 0, shadow_mismatches);
+    sprintf(label, "Packed closest hits, %d surfaces", num_surfaces);
+    test_int(label, 0, packed_hit_mismatches);
+    sprintf(label, "Packed shadow rays, %d surfaces", num_surfaces);
+    test_int(label, 0, packed_shadow_mismatches);
+
+    primitives_free(primitives);
+    bvh_free(bvh);
+    free(surfaces);
+}
+
+static bool same_vector (vector a, vector b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+void test_packets_match_single_rays (int num_surfaces, int num_packets, int width)
+/*! Trace packets of random rays from shared origins through a random scene,
+    both in packets of "width" and one ray at a time, and count the rays where
+    the results differ.  Half the packets are bundles of nearly parallel rays,
+    like camera rays, and half are spread in every direction.  Packets of 13
+    rays leave the last group of each partly filled. */
+{
+    surface * surfaces = random_scene(num_surfaces);
+    primitives * primitives = primitives_create(surfaces);
+    vector origin, direction, rays[13], intersection, normal;
+    vector intersections[13], normals[13];
+    surface * hits[13];
+    surface * expected;
+    int packet, index, mismatches = 0;
+    char label[64];
+
+    for (packet = 0; packet < num_packets; packet++)
+    {
+        origin = random_vector(-150, 150);
+        direction = vector_normalize(vector_sub(random_vector(-100, 100), origin));
+        for (index = 0; index < 13; index++)
+        {
+            rays[index] = packet % 2 ? vector_normalize(random_vector(-1, 1))
+                                     : vector_normalize(vector_add(direction,
+                                                                   random_vector(-0.05f, 0.05f)));
+        }
+        packet_hit_surfaces(primitives, width, origin, rays, 13, hits, intersections, normals);
+        for (index = 0; index < 13; index++)
+        {
+            expected = primitives_hit_surface(primitives, origin, rays[index],
+                                              &intersection, &normal);
+            if (expected != hits[index] ||
+                (expected && (!same_vector(intersection, intersections[index]) ||
+                              !same_vector(normal, normals[index]))))
+            {
+                mismatches++;
+            }
+        }
+    }
+
+    sprintf(label, "Packets of %d, %d surfaces", width, num_surfaces);
+    test_int(label, 0, mismatches);
+
+    primitives_free(primitives);
+    free(surfaces);
+}
+
+void test_kernels_match_single_primitives (int num_surfaces, int num_rays, int width)
+/*! Trace random rays through a random scene, testing the primitives of each
+    leaf both with the vector kernels of "width" and one at a time, and count
+    the rays where the results differ, including which surface blocks a
+    shadow ray */
+{
+    surface * surfaces = random_scene(num_surfaces);
+    primitives * primitives = primitives_create(surfaces);
+    const primitive_kernels * kernels = packet_primitive_kernels(width);
+    vector origin, ray, intersection, normal, wide_intersection, wide_normal;
+    surface * expected;
+    surface * actual;
+    surface * expected_blocker;
+    surface * actual_blocker;
+    float distance;
+    bool blocked;
+    int index, mismatches = 0;
+    char label[64];
+
+    for (index = 0; index < num_rays; index++)
+    {
+        origin = random_vector(-150, 150);
+        ray = vector_normalize(random_vector(-1, 1));
+        distance = random_float(0, 300);
+
+        primitives->kernels = NULL;
+        expected = primitives_hit_surface(primitives, origin, ray, &intersection, &normal);
+        expected_blocker = NULL;
+        blocked = primitives_is_occluded(primitives, origin, ray, distance, &expected_blocker);
+
+        primitives->kernels = kernels;
+        actual = primitives_hit_surface(primitives, origin, ray, &wide_intersection, &wide_normal);
+        actual_blocker = NULL;
+        if (expected != actual ||
+            (expected && (!same_vector(intersection, wide_intersection) ||
+                          !same_vector(normal, wide_normal))) ||
+            blocked != primitives_is_occluded(primitives, origin, ray, distance, &actual_blocker) ||
+            expected_blocker != actual_blocker)
+        {
+            mismatches++;
+        }
+    }
+
+    sprintf(label, "Kernels of %d, %d surfaces", width, num_surfaces);
+    test_int(label, 0, mismatches);
+
+    primitives_free(primitives);
+    free(surfaces);
+}
+
+void test_empty_bvh ()
+{
+    surface surfaces[] = {{.class = NULL}};
+    bvh * bvh = bvh_create(surfaces);
+    vector intersection, normal;
+
+    test_int("Empty BVH nodes", 0, bvh->num_nodes);
+    test_int("Empty BVH hit", 0, bvh_hit_surface(bvh, surfaces, (vector){0,0,0}, (vector){1,0,0},
+                                                 &intersection, &normal) != NULL);
+    bvh_free(bvh);
+}
+
+void test_empty_primitives ()
+{
+    surface surfaces[] = {{.class = NULL}};
+    primitives * primitives = primitives_create(surfaces);
+    vector intersection, normal;
+
+    test_int("Empty primitives hit", 0,
+             primitives_hit_surface(primitives, (vector){0,0,0}, (vector){1,0,0},
+                                    &intersection, &normal) != NULL);
+    test_int("Empty primitives shadow ray", 0,
+             primitives_is_occluded(primitives, (vector){0,0,0}, (vector){1,0,0}, 10, NULL));
+    primitives_free(primitives);
+}
+
+int main ()
+{
+    tests_run = tests_passed = 0;
+    srand(1);
+
+    test_empty_bvh();
+    test_empty_primitives();
+    test_bvh_matches_linear_search(1, 1000);
+    test_bvh_matches_linear_search(100, 10000);
+    test_bvh_matches_linear_search(1000, 10000);
+    if (packet_width_supported() >= 4)
+    {
+        test_packets_match_single_rays(1000, 2000, 4);
+        test_kernels_match_single_primitives(1000, 10000, 4);
+    }
+    if (packet_width_supported() >= 8)
+    {
+        test_packets_match_single_rays(1000, 2000, 8);
+        test_kernels_match_single_primitives(1000, 10000, 8);
+    }
+
+    printf("%d out of %d tests passed.\n", tests_passed, tests_run);
+
+    if (tests_passed == tests_run)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+/* Tests the renders of regions and of farms:
+
+     test_farm region FULL_PPM REGION_PPM X0,Y0,X1,Y1
+         The region rendered must be the pixels of the full image within it
+
+     test_farm workers HOST PORT WIDTH HEIGHT
+         Connects workers that fail in each way to a coordinator, which must
+         drop them and hand their bands to the workers that come after */
+
+static int tests_run;
+static int tests_passed;
+
+void test_bool (char * label, bool passed)
+{
+    printf("%s: %s\n", passed ? "Pass" : "Fail", label);
+    tests_passed += passed;
+    tests_run++;
+}
+
+unsigned char * load_ppm (char * filename, int * width_out, int * height_out)
+{
+    FILE * file = fopen(filename, "rb");
+    unsigned char * pixels = NULL;
+    size_t size;
+
+    if (file && fscanf(file, "P6 %d %d 255", width_out, height_out) == 2 && fgetc(file) == '\n')
+    {
+        size = 3ul * *width_out * *height_out;
+        pixels = malloc(size);
+        if (fread(pixels, 1, size, file) != size)
+        {
+            free(pixels);
+            pixels = NULL;
+        }
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+    return pixels;
+}
+
+void test_region (char * full_file, char * region_file, char * bounds)
+{
+    unsigned char * full = NULL, * region = NULL;
+    int width, height, region_width, region_height, x0, y0, x1, y1, y;
+    bool matches;
+    char label[256];
+
+    matches = sscanf(bounds, "%d,%d,%d,%d", &x0, &y0, &x1, &y1) == 4 &&
+              (full = load_ppm(full_file, &width, &height)) != NULL &&
+              (region = load_ppm(region_file, &region_width, &region_height)) != NULL &&
+              region_width == x1 - x0 && region_height == y1 - y0;
+    for (y = y0; matches && y < y1; y++)
+    {
+        matches = memcmp(&full[3 * ((size_t)y * width + x0)],
+                         &region[3 * (size_t)(y - y0) * region_width], 3 * region_width) == 0;
+    }
+    sprintf(label, "Region %.64s rendered to %.128s", bounds, region_file);
+    test_bool(label, matches);
+    free(full);
+    free(region);
+}
+
+int connect_coordinator (char * host, char * port)
+/*! Connect to the coordinator, waiting for it to start */
+{
+    struct addrinfo hints = { 0 }, * addresses;
+    struct timespec wait = { 0, 50000000 };
+    int attempt, fd = -1;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addresses))
+    {
+        return -1;
+    }
+    for (attempt = 0; attempt < 200 && fd < 0; attempt++)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, addresses->ai_addr, addresses->ai_addrlen))
+        {
+            close(fd);
+            fd = -1;
+            nanosleep(&wait, NULL);
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+void send_line (int fd, char * line)
+{
+    if (write(fd, line, strlen(line)) != (ssize_t)strlen(line))
+    {
+        perror("Worker line");
+    }
+}
+
+bool read_line (int fd, char * line, size_t size)
+/*! Read a line from the coordinator, without its newline, or return false
+    if it hangs up first */
+{
+    size_t length = 0;
+
+    while (length + 1 < size && read(fd, &line[length], 1) == 1)
+    {
+        if (line[length] == '\n')
+        {
+            line[length] = '\0';
+            return true;
+        }
+        length++;
+    }
+    line[length] = '\0';
+    return false;
+}
+
+bool handed_region (char * host, char * port, int width, int height, int * fd_out)
+/*! Connect a worker and wait for its region */
+{
+    char line[128];
+    long id;
+    int x0, y0, x1, y1;
+
+    sprintf(line, "ready %d %d\n", width, height);
+    *fd_out = connect_coordinator(host, port);
+    if (*fd_out < 0)
+    {
+        return false;
+    }
+    send_line(*fd_out, line);
+    return read_line(*fd_out, line, sizeof(line)) &&
+           sscanf(line, "region %ld %d %d %d %d", &id, &x0, &y0, &x1, &y1) == 5;
+}
+
+void test_workers (char * host, char * port, int width, int height)
+{
+    char line[128];
+    int fd;
+
+    /* A worker of another scene is dropped before it is handed a region */
+    sprintf(line, "ready %d %d\n", width + 1, height);
+    fd = connect_coordinator(host, port);
+    send_line(fd, line);
+    test_bool("Worker of another resolution dropped", !read_line(fd, line, sizeof(line)));
+    close(fd);
+
+    test_bool("Worker hanging up handed a region", handed_region(host, port, width, height, &fd));
+    close(fd);
+
+    test_bool("Worker replying wrongly handed a region",
+              handed_region(host, port, width, height, &fd));
+    send_line(fd, "pixels 1000000 12\n");
+    test_bool("Worker replying wrongly dropped", !read_line(fd, line, sizeof(line)));
+    close(fd);
+}
+
+int main (int argc, char * argv[])
+{
+    tests_run = tests_passed = 0;
+    if (argc == 5 && strcmp(argv[1], "region") == 0)
+    {
+        test_region(argv[2], argv[3], argv[4]);
+    }
+    else if (argc == 6 && strcmp(argv[1], "workers") == 0)
+    {
+        test_workers(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]));
+    }
+    else
+    {
+        fprintf(stderr, "Usage: %s region <full_ppm> <region_ppm> <x0,y0,x1,y1>\n"
+                        "       %s workers <host> <port> <width> <height>\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    printf("%d out of %d tests passed.\n", tests_passed, tests_run);
+
+    if (tests_passed == tests_run)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/* Tests the heatmaps of renders:
+
+     test_heatmap total HEATMAP_PPM PFM TOTAL
+         The costs of the pixels must add up to the total, and the heatmap
+         must be an image of as many pixels
+
+     test_heatmap region FULL_PFM REGION_PFM X0,Y0,X1,Y1
+         The costs of the region's pixels must be those of the whole image's
+         pixels within it */
+
+static int tests_run;
+static int tests_passed;
+
+void test_bool (char * label, bool passed)
+{
+    printf("%s: %s\n", passed ? "Pass" : "Fail", label);
+    tests_passed += passed;
+    tests_run++;
+}
+
+float * load_pfm (char * filename, int * width_out, int * height_out)
+/*! Load a PFM image of little endian floats, with its rows from the top
+    down */
+{
+    FILE * file = fopen(filename, "rb");
+    float * values = NULL;
+    bool loaded = false;
+    int y;
+
+    if (file && fscanf(file, "Pf %d %d -1.0", width_out, height_out) == 2 &&
+        fgetc(file) == '\n')
+    {
+        values = malloc(sizeof(float) * *width_out * *height_out);
+        loaded = true;
+        for (y = *height_out - 1; y >= 0; y--)
+        {
+            loaded &= fread(&values[y * *width_out], sizeof(float), *width_out, file) ==
+                      (size_t)*width_out;
+        }
+    }
+    if (!loaded)
+    {
+        free(values);
+        values = NULL;
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+    return values;
+}
+
+bool ppm_size (char * filename, int * width_out, int * height_out)
+/*! Read the size of a PPM image, whose header may have comments */
+{
+    FILE * file = fopen(filename, "rb");
+    char line[256];
+    bool read = file && fgets(line, sizeof(line), file) && strcmp(line, "P6\n") == 0;
+
+    while (read && fgets(line, sizeof(line), file) && line[0] == '#')
+    {
+    }
+    read = read && sscanf(line, "%d %d", width_out, height_out) == 2;
+    if (file)
+    {
+        fclose(file);
+    }
+    return read;
+}
+
+void test_total (char * heatmap_file, char * pfm_file, char * total)
+{
+    float * costs;
+    double sum = 0;
+    int width, height, heatmap_width, heatmap_height, index;
+    char label[256];
+
+    costs = load_pfm(pfm_file, &width, &height);
+    for (index = 0; costs && index < width * height; index++)
+    {
+        sum += costs[index];
+    }
+    sprintf(label, "Costs of %.128s add up to %.32s", pfm_file, total);
+    test_bool(label, costs && sum == atof(total));
+    sprintf(label, "Heatmap %.128s of the image's size", heatmap_file);
+    test_bool(label, costs && ppm_size(heatmap_file, &heatmap_width, &heatmap_height) &&
+                         heatmap_width == width && heatmap_height == height);
+    free(costs);
+}
+
+void test_region (char * full_file, char * region_file, char * bounds)
+{
+    float * full = NULL, * region = NULL;
+    int width, height, region_width, region_height, x0, y0, x1, y1, y;
+    bool matches;
+    char label[256];
+
+    matches = sscanf(bounds, "%d,%d,%d,%d", &x0, &y0, &x1, &y1) == 4 &&
+              (full = load_pfm(full_file, &width, &height)) != NULL &&
+              (region = load_pfm(region_file, &region_width, &region_height)) != NULL &&
+              region_width == x1 - x0 && region_height == y1 - y0;
+    for (y = y0; matches && y < y1; y++)
+    {
+        matches = memcmp(&full[y * width + x0], &region[(y - y0) * region_width],
+                         sizeof(float) * region_width) == 0;
+    }
+    sprintf(label, "Costs of region %.64s in %.128s", bounds, region_file);
+    test_bool(label, matches);
+    free(full);
+    free(region);
+}
+
+int main (int argc, char * argv[])
+{
+    tests_run = tests_passed = 0;
+    if (argc == 5 && strcmp(argv[1], "total") == 0)
+    {
+        test_total(argv[2], argv[3], argv[4]);
+    }
+    else if (argc == 5 && strcmp(argv[1], "region") == 0)
+    {
+        test_region(argv[2], argv[3], argv[4]);
+    }
+    else
+    {
+        fprintf(stderr, "Usage: %s total <heatmap_ppm> <pfm> <total>\n"
+                        "       %s region <full_pfm> <region_pfm> <x0,y0,x1,y1>\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    printf("%d out of %d tests passed.\n", tests_passed, tests_run);
+
+    if (tests_passed == tests_run)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
@@ -1,6 +1,10 @@
 #include "scene.h"
+#include "input_file.h"
+#include "instance.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 /* Apparently ANSI C99 refuses to provide math constants:
@@ -12,14 +16,18 @@
     #define M_SQRT1_2 0.70710678118654752440
 #endif
 
+/* Only ever passed as NULL here */
+typedef struct word word;
+
+bool parse_float (char ** cursor, float * value_out);
 bool parse_angle (char ** cursor, float * radians_out);
 bool parse_vector (char ** cursor, vector * vector_out);
 bool parse_normal (char ** cursor, vector * normal_out);
 bool parse_resolution (char ** cursor, resolution * resolution_out);
 int parse_camera (char ** cursor, camera * camera_out);
 int parse_background (char ** cursor, color * background_color_out);
-int parse_frustum (char ** cursor, surface * surface_out);
-int parse_circle (char ** cursor, surface * surface_out);
+int parse_frustum (char ** cursor, surface * surface_out, word * group_out);
+int parse_circle (char ** cursor, surface * surface_out, word * group_out);
 
 static int tests_run;
 static int tests_passed;
@@ -192,7 +200,7 @@ void test_parse_frustum ()
     surface result;
     frustum * geometry = (frustum *)&result.geometry;
     
-    parse_frustum(&cursor, &result);
+    parse_frustum(&cursor, &result, NULL);
     
     test_vector("Frustum center 0", (vector){-10,  0, 10}, geometry->centers[0]);
     test_vector("Frustum center 1", (vector){ 20, 10, 10}, geometry->centers[1]);
@@ -211,7 +219,7 @@ void test_parse_circle ()
     surface result;
     circle * geometry = (circle *)&result.geometry;
 
-    parse_circle(&cursor, &result);
+    parse_circle(&cursor, &result, NULL);
     
     test_vector("Circle center", (vector){0, 1, 0}, geometry->center);
     test_vector("Circle normal", (vector){0, 0, -1}, geometry->normal);
@@ -221,8 +229,215 @@ void test_parse_circle ()
     test_float("Circle refraction index", 1.0, result.refraction_index);
 }
 
+void test_parse_float ()
+/* parse_float must get exactly the values and end positions strtof does */
+{
+    char * fixed[] = { "0", "-0", "+1", "1.5", ".25", "5.", "1e3", "-2.5E-3", "1e", "1e+",
+                       "0.1", "3.4028235e38", "3.5e38", "1e-39", "1e-50", "1.17549435e-38",
+                       "123456789012345678901234", "0.000000000000000000000000001",
+                       "inf", "-nan", "0x1p3", "-", ".", "abc", "1,2", "16777217",
+                       "0.30000001192092896", "33554431", "8.589973e9" };
+    int num_fixed = sizeof(fixed) / sizeof(fixed[0]);
+    char string[64];
+    char * cursor;
+    char * strtof_end;
+    float value, expected;
+    int index, mismatches = 0;
+
+    srand(1);
+    for (index = 0; index < 100000 + num_fixed; index++)
+    {
+        if (index < num_fixed)
+        {
+            strcpy(string, fixed[index]);
+        }
+        else if (index % 3 == 0)
+        {
+            sprintf(string, "%.*f", rand() % 10, (rand() - RAND_MAX / 2) / (double)(rand() + 1));
+        }
+        else if (index % 3 == 1)
+        {
+            sprintf(string, "%.*e", rand() % 12, (double)rand() * pow(10, rand() % 80 - 40));
+        }
+        else
+        {
+            sprintf(string, "%d.%de%d", rand() % 100000, rand(), rand() % 60 - 30);
+        }
+        cursor = string;
+        parse_float(&cursor, &value);
+        expected = strtof(string, &strtof_end);
+        if (cursor != strtof_end || memcmp(&value, &expected, sizeof(float)) != 0)
+        {
+            if (mismatches++ < 5)
+            {
+                printf("Fail: Float parsing: \"%s\" gives %.9g, strtof gives %.9g\n",
+                       string, value, expected);
+            }
+        }
+    }
+    if (mismatches == 0)
+    {
+        printf("Pass: Float parsing: %d decimals parsed exactly as strtof parses them\n", index);
+        tests_passed++;
+    }
+    tests_run++;
+}
+
+void test_load_scene (char * label, int page_size, thread_pool * pool)
+/* Load a scene with more light sources and surfaces than were once allowed,
+   padding its file to a multiple of page_size bytes if page_size isn't 0,
+   with the workers of "pool" if it isn't NULL */
+{
+    const int num_lights = 300;
+    const int num_spheres = 3000;
+    FILE * file = tmpfile();
+    scene result = {};
+    long size;
+    int index;
+    bool passed = true;
+
+    fprintf(file, "# A scene with many objects\ncamera resolution:(64, 48) view_angle:90\n");
+    for (index = 0; index < num_lights; index++)
+    {
+        fprintf(file, "light position:(%d, 0, 0) color:(0.5, 0.5, 0.5)\n", index);
+    }
+    for (index = 0; index < num_spheres; index++)
+    {
+        fprintf(file, "  sphere center:(0, %d, 0) radius : %d.5 # sphere %d\n\n",
+                index, index, index);
+    }
+    /* A later camera line only changes the properties it gives */
+    fprintf(file, "camera resolution:(80, 60)\n");
+    fprintf(file, "quad vertices:((0,0,0), (1,0,0), (0,1,0)) diffuse:(1,1,1)");
+    size = ftell(file);
+    if (page_size > 0)
+    {
+        fputs("\n#", file);
+        while (ftell(file) % page_size != 0)
+        {
+            fputc('-', file);
+        }
+        size = ftell(file);
+    }
+    rewind(file);
+
+    if (load_scene(file, NULL, &result, pool) != 0)
+    {
+        printf("Fail: %s: load_scene failed\n", label);
+        tests_run++;
+        return;
+    }
+    fclose(file);
+    for (index = 0; index < num_lights; index++)
+    {
+        passed = passed && result.light_sources[index].type == LIGHT_SOURCE_STANDARD &&
+                 result.light_sources[index].position.x == index;
+    }
+    for (index = 0; index < num_spheres; index++)
+    {
+        sphere * geometry = (sphere *)result.surfaces[index].geometry;
+        passed = passed && result.surfaces[index].class == surface_sphere &&
+                 geometry->center.y == index && geometry->radius == index + 0.5f;
+    }
+    passed = passed && result.surfaces[num_spheres].class == surface_quad &&
+             result.surfaces[num_spheres].diffuse_part.g == 1 &&
+             result.surfaces[num_spheres + 1].class == NULL &&
+             result.light_sources[num_lights].type == LIGHT_SOURCE_SENTINEL &&
+             result.camera.resolution.width == 80 &&
+             approx_equal(result.camera.view_angle, M_PI / 2);
+    if (passed)
+    {
+        printf("Pass: %s: %d light sources and %d surfaces from %ld bytes\n",
+               label, num_lights, num_spheres + 1, size);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: objects were not loaded as written\n", label);
+    }
+    tests_run++;
+    free_scene(&result);
+}
+
+void test_load_groups (char * label, thread_pool * pool)
+/* Load a scene of instances of two groups whose surfaces are spread
+   through the file, around the instances, with the workers of "pool" if it
+   isn't NULL */
+{
+    const int num_instances = 3000;
+    FILE * file = tmpfile();
+    scene result = {};
+    instance * cur_instance;
+    surface * members;
+    int index;
+    bool passed = true;
+
+    fprintf(file, "sphere center:(0, 0, 0) radius:1 group:ring\n");
+    fprintf(file, "quad vertices:((0,0,0), (1,0,0), (0,1,0)) group:ship\n");
+    for (index = 0; index < num_instances; index++)
+    {
+        fprintf(file, "instance group:%s position:(%d, 0, 0) scale:(2, 2, 2)\n",
+                index % 3 ? "ship" : "ring", index);
+    }
+    fprintf(file, "sphere center:(0, 1, 0) radius:2 group:ring\n");
+    fprintf(file, "sphere center:(0, 0, 0) radius:3\n");
+    rewind(file);
+
+    if (load_scene(file, NULL, &result, pool) != 0)
+    {
+        printf("Fail: %s: load_scene failed\n", label);
+        tests_run++;
+        return;
+    }
+    fclose(file);
+    for (index = 0; index < num_instances; index++)
+    {
+        cur_instance = (instance *)result.surfaces[index].geometry;
+        passed = passed && result.surfaces[index].class == surface_instance &&
+                 cur_instance->group == &result.groups[index % 3 ? 1 : 0] &&
+                 cur_instance->transform->to_world.translation.x == index &&
+                 cur_instance->transform->to_world.columns[0].x == 2;
+    }
+    members = result.num_groups == 2 ? result.groups[0].surfaces : NULL;
+    passed = passed && members && members[0].class == surface_sphere &&
+             ((sphere *)members[1].geometry)->radius == 2 && members[2].class == NULL &&
+             result.groups[1].surfaces[0].class == surface_quad &&
+             result.groups[1].surfaces[1].class == NULL &&
+             result.surfaces[num_instances].class == surface_sphere &&
+             result.surfaces[num_instances + 1].class == NULL;
+    if (passed)
+    {
+        printf("Pass: %s: %d instances of 2 groups\n", label, num_instances);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: groups and instances were not loaded as written\n", label);
+    }
+    tests_run++;
+    free_scene(&result);
+
+    file = tmpfile();
+    fprintf(file, "sphere center:(0, 0, 0) radius:1 group:ring\ninstance group:rings\n");
+    rewind(file);
+    if (load_scene(file, NULL, &result, pool) != 0)
+    {
+        printf("Pass: %s: instance of an unknown group rejected\n", label);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: instance of an unknown group loaded\n", label);
+        free_scene(&result);
+    }
+    tests_run++;
+    fclose(file);
+}
+
 int main ()
 {
+    thread_pool * pool;
+
     tests_run = tests_passed = 0;
     
     test_parse_angle();
@@ -233,6 +448,14 @@ int main ()
     test_parse_background();
     test_parse_frustum();
     test_parse_circle();
+    test_parse_float();
+    test_load_scene("Mapped scene", 0, NULL);
+    test_load_scene("Page sized scene", 4096, NULL);
+    pool = thread_pool_create(4);
+    test_load_scene("Scene parsed in parallel", 0, pool);
+    test_load_groups("Groups", NULL);
+    test_load_groups("Groups parsed in parallel", pool);
+    thread_pool_destroy(pool);
     
     printf("%d out of %d tests passed.\n", tests_passed, tests_run);
     
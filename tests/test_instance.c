@@ -0,0 +1,391 @@
+#include "scene.h"
+#include "primitives.h"
+#include "instance.h"
+#include "packet.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+surface * hit_surface (vector origin, vector ray, surface surfaces[],
+                       vector * intersection_out, vector * normal_out);
+
+static int tests_run;
+static int tests_passed;
+
+void test_int (char * label, int expected, int actual)
+{
+    if (expected == actual)
+    {
+        printf("Pass: %s: %d = %d\n", label, expected, actual);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: expected %d, got %d\n", label, expected, actual);
+    }
+    tests_run++;
+}
+
+void test_vector (char * label, vector expected, vector actual)
+{
+    if (vector_distance(expected, actual) < 1e-5f)
+    {
+        printf("Pass: %s: (%g, %g, %g)\n", label, expected.x, expected.y, expected.z);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: expected (%g, %g, %g), got (%g, %g, %g)\n", label,
+               expected.x, expected.y, expected.z, actual.x, actual.y, actual.z);
+    }
+    tests_run++;
+}
+
+float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+vector random_vector (float min, float max)
+{
+    return (vector){ random_float(min, max), random_float(min, max), random_float(min, max) };
+}
+
+vector apply (const affine_transform * transform, vector point)
+{
+    return vector_add(vector_add(vector_add(vector_multiply(point.x, transform->columns[0]),
+                                            vector_multiply(point.y, transform->columns[1])),
+                                 vector_multiply(point.z, transform->columns[2])),
+                      transform->translation);
+}
+
+surface * random_group (int count, bool only_quads)
+/*! Make a sentinel terminated array of "count" surfaces of every class, or
+    only quads, scattered through a cube of side 20 centered at the origin */
+{
+    surface * surfaces = calloc(count + 1, sizeof(surface));
+    int index;
+    vector center;
+
+    for (index = 0; index < count; index++)
+    {
+        center = random_vector(-10, 10);
+        switch (only_quads ? 3 : index % 4)
+        {
+            case 0:
+                surfaces[index].class = surface_sphere;
+                *(sphere *)surfaces[index].geometry = (sphere){ center, random_float(0.5, 3) };
+                break;
+            case 1:
+                surfaces[index].class = surface_frustum;
+                *(frustum *)surfaces[index].geometry =
+                    (frustum){ { center, vector_add(center, random_vector(-3, 3)) },
+                               { random_float(0, 2), random_float(0, 2) } };
+                break;
+            case 2:
+                surfaces[index].class = surface_circle;
+                *(circle *)surfaces[index].geometry =
+                    (circle){ center, vector_normalize(random_vector(-1, 1)), random_float(0.5, 3) };
+                break;
+            case 3:
+                surfaces[index].class = surface_quad;
+                *(quad *)surfaces[index].geometry =
+                    (quad){ { vector_add(center, random_vector(-3, 3)), center,
+                              vector_add(center, random_vector(-3, 3)) } };
+                break;
+        }
+    }
+    surfaces[count].class = NULL;
+    return surfaces;
+}
+
+surface copy_surface (surface original, const instance_transform * transform, float scale)
+/*! Move a surface by the transform of an instance, whose scale is "scale"
+    in every direction unless the surface is a quad */
+{
+    surface copy = original;
+    const affine_transform * to_world = &transform->to_world;
+    sphere * copy_sphere = (sphere *)copy.geometry;
+    frustum * copy_frustum = (frustum *)copy.geometry;
+    circle * copy_circle = (circle *)copy.geometry;
+    quad * copy_quad = (quad *)copy.geometry;
+    vector origin = apply(to_world, (vector){ 0, 0, 0 });
+    int index;
+
+    if (original.class == surface_sphere)
+    {
+        copy_sphere->center = apply(to_world, copy_sphere->center);
+        copy_sphere->radius *= scale;
+    }
+    else if (original.class == surface_frustum)
+    {
+        for (index = 0; index < 2; index++)
+        {
+            copy_frustum->centers[index] = apply(to_world, copy_frustum->centers[index]);
+            copy_frustum->radii[index] *= scale;
+        }
+    }
+    else if (original.class == surface_circle)
+    {
+        copy_circle->center = apply(to_world, copy_circle->center);
+        copy_circle->normal =
+            vector_normalize(vector_sub(apply(to_world, copy_circle->normal), origin));
+        copy_circle->radius *= scale;
+    }
+    else
+    {
+        for (index = 0; index < 3; index++)
+        {
+            copy_quad->vertices[index] = apply(to_world, copy_quad->vertices[index]);
+        }
+    }
+    return copy;
+}
+
+typedef struct
+{
+    instance_group group;
+    int group_size;
+    instance_transform * transforms;
+    /* The instances, and copies of the group moved by their transforms in
+       their place, both sentinel terminated */
+    surface * instances;
+    surface * copies;
+} instance_scene;
+
+void make_scene (instance_scene * scene_out, int group_size, int num_instances, bool uniform)
+/*! Place random copies of a random group, uniformly scaled and made of
+    surfaces of every class if "uniform", or scaled unevenly and made of
+    quads, whose copies are exact */
+{
+    surface * group_surfaces = random_group(group_size, !uniform);
+    vector scale;
+    instance * cur_instance;
+    int index, member;
+
+    instance_group_create(&scene_out->group, group_surfaces);
+    scene_out->group_size = group_size;
+    scene_out->transforms = malloc(sizeof(instance_transform) * num_instances);
+    scene_out->instances = calloc(num_instances + 1, sizeof(surface));
+    scene_out->copies = calloc(num_instances * group_size + 1, sizeof(surface));
+    for (index = 0; index < num_instances; index++)
+    {
+        scale.x = random_float(0.5, 3);
+        scale = uniform ? (vector){ scale.x, scale.x, scale.x } : random_vector(0.3, 3);
+        instance_transform_make(scale, random_vector(-M_PI, M_PI), random_vector(-100, 100),
+                                &scene_out->transforms[index]);
+        scene_out->instances[index].class = surface_instance;
+        cur_instance = (instance *)scene_out->instances[index].geometry;
+        cur_instance->group = &scene_out->group;
+        cur_instance->transform = &scene_out->transforms[index];
+        for (member = 0; member < group_size; member++)
+        {
+            scene_out->copies[index * group_size + member] =
+                copy_surface(group_surfaces[member], &scene_out->transforms[index], scale.x);
+        }
+    }
+}
+
+void free_instance_scene (instance_scene * scene)
+{
+    instance_group_free(&scene->group);
+    free(scene->group.surfaces);
+    free(scene->transforms);
+    free(scene->instances);
+    free(scene->copies);
+}
+
+void test_instance_fits_surface ()
+/*! An instance's pointers must fit in a surface's geometry bytes, and be
+    aligned there for reading them through an instance */
+{
+    test_int("Instance fits in a surface", 1,
+             sizeof(instance) <= sizeof(((surface *)NULL)->geometry));
+    test_int("Instance geometry alignment", 0, offsetof(surface, geometry) % sizeof(void *));
+}
+
+void test_transform ()
+{
+    instance_transform transform;
+    vector point = { 1, 0, 0 };
+
+    /* Stretched along x to (2, 0, 0), turned about z to (0, 2, 0), moved */
+    test_int("Transform made", 1,
+             instance_transform_make((vector){ 2, 1, 1 }, (vector){ 0, 0, M_PI / 2 },
+                                     (vector){ 1, 2, 3 }, &transform));
+    test_vector("Transform order", (vector){ 1, 4, 3 }, apply(&transform.to_world, point));
+    test_vector("Transform inverse", point, apply(&transform.to_object, (vector){ 1, 4, 3 }));
+
+    /* Turned about x, then about y: (0, 1, 0) -> (0, 0, 1) -> (1, 0, 0) */
+    instance_transform_make((vector){ 1, 1, 1 }, (vector){ M_PI / 2, M_PI / 2, 0 },
+                            (vector){ 0, 0, 0 }, &transform);
+    test_vector("Rotation order", (vector){ 1, 0, 0 },
+                apply(&transform.to_world, (vector){ 0, 1, 0 }));
+
+    test_int("Zero scale rejected", 0,
+             instance_transform_make((vector){ 1, 0, 1 }, (vector){ 0, 0, 0 },
+                                     (vector){ 0, 0, 0 }, &transform));
+}
+
+void test_transform_round_trip (int count)
+/*! Transform random points to world space and back, counting those that
+    don't come back */
+{
+    instance_transform transform;
+    vector point, back;
+    int index, mismatches = 0;
+
+    for (index = 0; index < count; index++)
+    {
+        instance_transform_make(random_vector(0.1, 10), random_vector(-M_PI, M_PI),
+                                random_vector(-100, 100), &transform);
+        point = random_vector(-10, 10);
+        back = apply(&transform.to_object, apply(&transform.to_world, point));
+        /* Rounding at the scale of the position, about 1e-5 */
+        mismatches += vector_distance(point, back) > 1e-3f;
+    }
+    test_int("Transform round trips", 0, mismatches);
+}
+
+void test_instances_match_copies (int group_size, int num_instances, int num_rays, bool uniform)
+/*! Trace random rays through instances of a group and through moved copies
+    of the group, and count the rays where the results differ by more than
+    rounding, which grows with the distance from the ray's origin and with
+    how closely the ray grazes the surface.  A few rays that graze an edge
+    may go either way. */
+{
+    instance_scene scene;
+    primitives * instances;
+    primitives * copies;
+    vector origin, ray, intersection, normal, copy_intersection, copy_normal;
+    surface * hit;
+    surface * copy_hit;
+    float distance;
+    int index, hits = 0, hit_mismatches = 0, shadow_mismatches = 0;
+    char label[80];
+
+    make_scene(&scene, group_size, num_instances, uniform);
+    instances = primitives_create(scene.instances);
+    copies = primitives_create(scene.copies);
+    for (index = 0; index < num_rays; index++)
+    {
+        origin = random_vector(-150, 150);
+        ray = vector_normalize(vector_sub(random_vector(-100, 100), origin));
+        hit = primitives_hit_surface(instances, origin, ray, &intersection, &normal);
+        copy_hit = primitives_hit_surface(copies, origin, ray, &copy_intersection, &copy_normal);
+        if ((hit == NULL) != (copy_hit == NULL) ||
+            (hit && ((copy_hit - scene.copies) % group_size != hit - scene.group.surfaces ||
+                     vector_distance(intersection, copy_intersection) >
+                         1e-3f * (1 + vector_distance(origin, intersection)) ||
+                     dot_product(normal, copy_normal) < 0.99f)))
+        {
+            hit_mismatches++;
+        }
+        hits += hit != NULL;
+
+        distance = random_float(0, 300);
+        shadow_mismatches += primitives_is_occluded(instances, origin, ray, distance, NULL) !=
+                             primitives_is_occluded(copies, origin, ray, distance, NULL);
+    }
+
+    printf("%d instances of %d surfaces: %d of %d rays hit\n", num_instances, group_size, hits,
+           num_rays);
+    sprintf(label, "Instances like copies, closest hits%s", uniform ? "" : ", stretched quads");
+    test_int(label, 1, hit_mismatches <= num_rays / 1000);
+    sprintf(label, "Instances like copies, shadow rays%s", uniform ? "" : ", stretched quads");
+    test_int(label, 1, shadow_mismatches <= num_rays / 1000);
+
+    primitives_free(instances);
+    primitives_free(copies);
+    free_instance_scene(&scene);
+}
+
+static bool same_vector (vector a, vector b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+void test_paths_agree (int num_instances, int num_packets)
+/*! Trace packets of random rays through instances with a linear search,
+    with the BVH one ray at a time, and in packets of every width supported,
+    and count the rays where the results differ at all */
+{
+    instance_scene scene;
+    primitives * primitives;
+    vector origin, direction, rays[13], intersection, normal;
+    vector linear_intersection, linear_normal, intersections[13], normals[13];
+    surface * hits[13];
+    surface * expected;
+    int packet, index, width, linear_mismatches = 0, packet_mismatches = 0;
+
+    make_scene(&scene, 20, num_instances, true);
+    primitives = primitives_create(scene.instances);
+    for (packet = 0; packet < num_packets; packet++)
+    {
+        origin = random_vector(-150, 150);
+        direction = vector_normalize(vector_sub(random_vector(-100, 100), origin));
+        for (index = 0; index < 13; index++)
+        {
+            rays[index] = vector_normalize(vector_add(direction, random_vector(-0.05f, 0.05f)));
+            expected = primitives_hit_surface(primitives, origin, rays[index],
+                                              &intersection, &normal);
+            if (expected != hit_surface(origin, rays[index], scene.instances,
+                                        &linear_intersection, &linear_normal) ||
+                (expected && (!same_vector(intersection, linear_intersection) ||
+                              !same_vector(normal, linear_normal))))
+            {
+                linear_mismatches++;
+            }
+        }
+        for (width = 4; width <= packet_width_supported(); width *= 2)
+        {
+            packet_hit_surfaces(primitives, width, origin, rays, 13, hits, intersections, normals);
+            for (index = 0; index < 13; index++)
+            {
+                expected = primitives_hit_surface(primitives, origin, rays[index],
+                                                  &intersection, &normal);
+                if (expected != hits[index] ||
+                    (expected && (!same_vector(intersection, intersections[index]) ||
+                                  !same_vector(normal, normals[index]))))
+                {
+                    packet_mismatches++;
+                }
+            }
+        }
+    }
+    test_int("Instances, linear search", 0, linear_mismatches);
+    test_int("Instances, packets", 0, packet_mismatches);
+
+    primitives_free(primitives);
+    free_instance_scene(&scene);
+}
+
+int main ()
+{
+    tests_run = tests_passed = 0;
+    srand(1);
+
+    test_instance_fits_surface();
+    test_transform();
+    test_transform_round_trip(10000);
+    test_instances_match_copies(20, 200, 20000, true);
+    test_instances_match_copies(20, 200, 20000, false);
+    test_paths_agree(200, 2000);
+
+    printf("%d out of %d tests passed.\n", tests_passed, tests_run);
+
+    if (tests_passed == tests_run)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
@@ -0,0 +1,432 @@
+#include "mesh.h"
+#include "intersect.h"
+#include "vector.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+static int tests_run;
+static int tests_passed;
+
+void test_int (char * label, int expected, int actual)
+{
+    if (expected == actual)
+    {
+        printf("Pass: %s: %d = %d\n", label, expected, actual);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: %s: expected %d, got %d\n", label, expected, actual);
+    }
+    tests_run++;
+}
+
+float random_float (float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+vector random_vector (float min, float max)
+{
+    return (vector){ random_float(min, max), random_float(min, max), random_float(min, max) };
+}
+
+triangle_mesh * grid_mesh (int size)
+/*! Make a mesh of a square grid of size by size cells in the plane z = 0,
+    from the origin to (size, size), with two triangles per cell */
+{
+    vector * vertices = malloc(sizeof(vector) * (size + 1) * (size + 1));
+    int * indices = malloc(sizeof(int) * 6 * size * size);
+    int x, y, corner, *triangle = indices;
+
+    for (y = 0; y <= size; y++)
+    {
+        for (x = 0; x <= size; x++)
+        {
+            vertices[y * (size + 1) + x] = (vector){ x, y, 0 };
+        }
+    }
+    for (y = 0; y < size; y++)
+    {
+        for (x = 0; x < size; x++)
+        {
+            corner = y * (size + 1) + x;
+            /* Alternate the diagonals so that vertices are shared by four to
+               eight triangles */
+            if ((x + y) % 2 == 0)
+            {
+                triangle[0] = corner, triangle[1] = corner + 1, triangle[2] = corner + size + 2;
+                triangle[3] = corner, triangle[4] = corner + size + 2, triangle[5] = corner + size + 1;
+            }
+            else
+            {
+                triangle[0] = corner, triangle[1] = corner + 1, triangle[2] = corner + size + 1;
+                triangle[3] = corner + 1, triangle[4] = corner + size + 2, triangle[5] = corner + size + 1;
+            }
+            triangle += 6;
+        }
+    }
+    return mesh_create(vertices, (size + 1) * (size + 1), indices, 2 * size * size);
+}
+
+void test_watertight (int size)
+/*! Rays through the edges and vertices shared by triangles of a grid, from
+    every direction, must never slip through it */
+{
+    triangle_mesh * mesh = grid_mesh(size);
+    int index, misses = 0, triangle;
+    float t;
+    vector target, origin, ray;
+
+    for (index = 0; index < 20000; index++)
+    {
+        /* Half of the targets are vertices, and half lie on the edges between
+           them, along both axes and the diagonals */
+        target = (vector){ (int)random_float(1, size), (int)random_float(1, size), 0 };
+        switch (index % 4)
+        {
+            case 1:
+                target.x += .5f;
+                break;
+            case 2:
+                target.y += .5f;
+                break;
+            case 3:
+                target.x += .5f;
+                target.y += .5f;
+                break;
+        }
+        origin = vector_add(target, random_vector(-size, size));
+        origin.z = random_float(.5f, size) * (index % 8 < 4 ? 1 : -1);
+        ray = vector_sub(target, origin);
+        if (!mesh_hit(mesh, origin, ray, 2, &triangle, &t))
+        {
+            misses++;
+        }
+    }
+    test_int("Rays through shared edges and vertices that miss the mesh", 0, misses);
+    mesh_free(mesh);
+}
+
+triangle_mesh * random_mesh (int num_vertices, int num_triangles)
+/*! Make a mesh of triangles scattered through a cube of side 200 centered at
+    the origin, many of them sharing vertices */
+{
+    vector * vertices = malloc(sizeof(vector) * num_vertices);
+    int * indices = malloc(sizeof(int) * 3 * num_triangles);
+    int index;
+
+    for (index = 0; index < num_vertices; index++)
+    {
+        vertices[index] = random_vector(-100, 100);
+    }
+    for (index = 0; index < num_triangles; index++)
+    {
+        /* Triangles are made of nearby vertices, so they stay small */
+        indices[3 * index] = rand() % (num_vertices - 2);
+        indices[3 * index + 1] = indices[3 * index] + 1;
+        indices[3 * index + 2] = indices[3 * index] + 2;
+        vertices[indices[3 * index] + 1] =
+            vector_add(vertices[indices[3 * index]], random_vector(-10, 10));
+        vertices[indices[3 * index] + 2] =
+            vector_add(vertices[indices[3 * index]], random_vector(-10, 10));
+    }
+    return mesh_create(vertices, num_vertices, indices, num_triangles);
+}
+
+bool linear_search (const triangle_mesh * mesh, vector origin, vector ray, float max_t,
+                    int * triangle_out, float * t_out)
+/*! Find the hit mesh_hit should find, by testing every triangle */
+{
+    triangle_ray sheared = triangle_ray_bake(ray);
+    int triangle, closest = -1;
+    float t, closest_t = max_t;
+    int * corners;
+
+    for (triangle = 0; triangle < mesh->num_triangles; triangle++)
+    {
+        corners = &mesh->indices[3 * triangle];
+        if (triangle_hit(origin, &sheared, mesh->vertices[corners[0]], mesh->vertices[corners[1]],
+                         mesh->vertices[corners[2]], &t) &&
+            (t < closest_t || (t == closest_t && closest < 0)))
+        {
+            closest_t = t;
+            closest = triangle;
+        }
+    }
+    *triangle_out = closest;
+    *t_out = closest_t;
+    return closest >= 0;
+}
+
+void test_mesh_matches_linear_search (int num_triangles, int num_rays)
+{
+    triangle_mesh * mesh = random_mesh(num_triangles + 2, num_triangles);
+    int index, mismatches = 0, blocking_mismatches = 0, hits = 0;
+    int expected_triangle, actual_triangle;
+    float expected_t, actual_t, max_t;
+    bool expected, actual;
+    vector origin, ray;
+    char label[100];
+
+    for (index = 0; index < num_rays; index++)
+    {
+        origin = random_vector(-150, 150);
+        ray = vector_normalize(vector_sub(random_vector(-50, 50), origin));
+        max_t = index % 2 ? 1000 : random_float(0, 300);
+        expected = linear_search(mesh, origin, ray, max_t, &expected_triangle, &expected_t);
+        actual = mesh_hit(mesh, origin, ray, max_t, &actual_triangle, &actual_t);
+        if (expected != actual ||
+            (expected && (expected_triangle != actual_triangle || expected_t != actual_t)))
+        {
+            mismatches++;
+        }
+        hits += expected;
+        /* A normalized ray's parameter is the distance, so a triangle hit
+           before max_t blocks it */
+        if (mesh_blocks(mesh, origin, ray, max_t) != (expected && expected_t < max_t))
+        {
+            blocking_mismatches++;
+        }
+    }
+    sprintf(label, "Mesh of %d triangles, %d hits, rays that differ from a linear search",
+            num_triangles, hits);
+    test_int(label, 0, mismatches);
+    sprintf(label, "Mesh of %d triangles, shadow rays that differ from a linear search",
+            num_triangles);
+    test_int(label, 0, blocking_mismatches);
+    mesh_free(mesh);
+}
+
+static char temporary_name[] = "/tmp/test_mesh_XXXXXX";
+
+triangle_mesh * load_text (const char * text, size_t size)
+/*! Load a mesh from a file holding the given contents */
+{
+    int file = mkstemp(strcpy(temporary_name, "/tmp/test_mesh_XXXXXX"));
+    triangle_mesh * mesh;
+
+    if (file < 0 || write(file, text, size) != (ssize_t)size)
+    {
+        perror("Temporary mesh file");
+        exit(1);
+    }
+    close(file);
+    mesh = mesh_load(temporary_name);
+    unlink(temporary_name);
+    return mesh;
+}
+
+/* A cube of side 2 centered at the origin, with quad faces, as an OBJ file
+   counting its indices from the end in places, with texture and normal
+   indices, and as PLY files */
+static const float cube_vertices[8][3] =
+{
+    { -1, -1, -1 }, { 1, -1, -1 }, { 1, 1, -1 }, { -1, 1, -1 },
+    { -1, -1, 1 }, { 1, -1, 1 }, { 1, 1, 1 }, { -1, 1, 1 }
+};
+static const int cube_faces[6][4] =
+{
+    { 0, 3, 2, 1 }, { 4, 5, 6, 7 }, { 0, 1, 5, 4 }, { 2, 3, 7, 6 }, { 1, 2, 6, 5 }, { 0, 4, 7, 3 }
+};
+static const char cube_obj[] =
+    "# Cube\n"
+    "o cube\n"
+    "v -1 -1 -1\nv 1 -1 -1\nv 1 1 -1\nv -1 1 -1\n"
+    "v -1 -1 1\nv 1 -1 1\nv 1 1 1\nv -1 1 1\n"
+    "vt 0 0\nvn 0 0 1\n"
+    "s off\n"
+    "f 1 4 3 2\n"
+    "f 5/1 6/1 7/1 8/1\n"
+    "f -8//1 -7//1 -3//1 -4//1\r\n"
+    "f 3/1/1 4/1/1 8/1/1 7/1/1\n"
+    "usemtl none\n"
+    "f 2 3 7 6\n"
+    "f 1 5 8 4\n";
+
+static void put_bytes (char ** cursor, const void * value, int size, bool big_endian)
+{
+    const unsigned char * bytes = value;
+    int index;
+    unsigned int one = 1;
+    bool native_big_endian = *(unsigned char *)&one == 0;
+
+    for (index = 0; index < size; index++)
+    {
+        *(*cursor)++ = bytes[native_big_endian == big_endian ? index : size - 1 - index];
+    }
+}
+
+size_t write_cube_ply (char * text, bool big_endian)
+/*! Write the cube as a binary PLY file with a vertex property and a face
+    element that must be skipped */
+{
+    char * cursor = text;
+    int vertex, face, corner;
+    unsigned char count = 4, flags = 7;
+    double weight = 1;
+
+    cursor += sprintf(cursor, "ply\nformat binary_%s_endian 1.0\ncomment cube\n"
+                              "element vertex 8\nproperty float x\nproperty float y\n"
+                              "property double weight\nproperty float z\n"
+                              "element face 6\nproperty uchar flags\n"
+                              "property list uchar int vertex_indices\n"
+                              "element edge 0\nproperty int vertex1\nproperty int vertex2\n"
+                              "end_header\n", big_endian ? "big" : "little");
+    for (vertex = 0; vertex < 8; vertex++)
+    {
+        put_bytes(&cursor, &cube_vertices[vertex][0], sizeof(float), big_endian);
+        put_bytes(&cursor, &cube_vertices[vertex][1], sizeof(float), big_endian);
+        put_bytes(&cursor, &weight, sizeof(double), big_endian);
+        put_bytes(&cursor, &cube_vertices[vertex][2], sizeof(float), big_endian);
+    }
+    for (face = 0; face < 6; face++)
+    {
+        put_bytes(&cursor, &flags, 1, big_endian);
+        put_bytes(&cursor, &count, 1, big_endian);
+        for (corner = 0; corner < 4; corner++)
+        {
+            put_bytes(&cursor, &cube_faces[face][corner], sizeof(int), big_endian);
+        }
+    }
+    return cursor - text;
+}
+
+int count_cube_mismatches (const triangle_mesh * mesh)
+/*! Count the rays whose hits on a loaded cube are not where they should be */
+{
+    int index, mismatches = 0, triangle;
+    float t;
+    vector origin, ray, point, normal;
+
+    for (index = 0; index < 1000; index++)
+    {
+        origin = vector_multiply(5, vector_normalize(random_vector(-1, 1)));
+        ray = vector_sub(random_vector(-.9f, .9f), origin);
+        if (!mesh_hit(mesh, origin, ray, 1, &triangle, &t))
+        {
+            mismatches++;
+            continue;
+        }
+        /* The ray must hit the side of the cube that faces it, from outside,
+           and the faces wind counterclockwise seen from outside */
+        point = vector_add(origin, vector_multiply(t, ray));
+        normal = mesh_triangle_normal(mesh, triangle);
+        if (fabsf(fmaxf(fmaxf(fabsf(point.x), fabsf(point.y)), fabsf(point.z)) - 1) > 1e-4f ||
+            dot_product(normal, point) < .99f || dot_product(normal, ray) >= 0)
+        {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+void test_load (char * label, const char * text, size_t size)
+{
+    triangle_mesh * mesh = load_text(text, size);
+    char full_label[100];
+
+    sprintf(full_label, "%s cube loaded", label);
+    test_int(full_label, 1, mesh != NULL);
+    if (mesh == NULL)
+    {
+        return;
+    }
+    sprintf(full_label, "%s cube vertices", label);
+    test_int(full_label, 8, mesh->num_vertices);
+    sprintf(full_label, "%s cube triangles", label);
+    test_int(full_label, 12, mesh->num_triangles);
+    sprintf(full_label, "%s cube rays that hit it wrongly", label);
+    test_int(full_label, 0, count_cube_mismatches(mesh));
+    mesh_free(mesh);
+}
+
+void test_loaders ()
+{
+    char ply[2000];
+    size_t size;
+
+    test_load("OBJ", cube_obj, strlen(cube_obj));
+    size = write_cube_ply(ply, false);
+    test_load("Little endian PLY", ply, size);
+    size = write_cube_ply(ply, true);
+    test_load("Big endian PLY", ply, size);
+}
+
+void test_rejected (char * label, const char * text, size_t size)
+{
+    triangle_mesh * mesh;
+    char full_label[100];
+
+    errno = 0;
+    mesh = load_text(text, size);
+    sprintf(full_label, "%s rejected", label);
+    test_int(full_label, 1, mesh == NULL && errno != 0);
+    mesh_free(mesh);
+}
+
+void test_bad_files ()
+{
+    char ply[2000];
+    size_t size;
+    triangle_mesh * mesh;
+
+    test_rejected("Empty file", "", 0);
+    test_rejected("OBJ file without faces", "v 0 0 0\nv 1 0 0\nv 0 1 0\n", 24);
+    test_rejected("OBJ file with an index out of range", "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 4\n", 32);
+    test_rejected("OBJ file with a relative index out of range",
+                  "v 0 0 0\nv 1 0 0\nv 0 1 0\nf -1 -2 -4\n", 35);
+    test_rejected("OBJ file with a bad vertex", "v 0 0 0\nv 1 zero 0\nv 0 1 0\nf 1 2 3\n", 35);
+    test_rejected("ASCII PLY file",
+                  "ply\nformat ascii 1.0\nelement vertex 0\nend_header\n", 49);
+    size = write_cube_ply(ply, false);
+    test_rejected("Truncated PLY file", ply, size - 3);
+
+    errno = 0;
+    mesh = mesh_load("/nonexistent/mesh.obj");
+    test_int("Missing mesh file rejected", 1, mesh == NULL && errno == ENOENT);
+}
+
+void test_geometry_fits_surface ()
+/*! The geometry of every class must fit in a surface's geometry bytes, and
+    a mesh's pointer must be aligned there for reading it through a mesh */
+{
+    size_t size = sizeof(((surface *)NULL)->geometry);
+    test_int("Sphere fits in a surface", 1, sizeof(sphere) <= size);
+    test_int("Frustum fits in a surface", 1, sizeof(frustum) <= size);
+    test_int("Circle fits in a surface", 1, sizeof(circle) <= size);
+    test_int("Quad fits in a surface", 1, sizeof(quad) <= size);
+    test_int("Mesh fits in a surface", 1, sizeof(mesh) <= size);
+    test_int("Mesh geometry alignment", 0, offsetof(surface, geometry) % sizeof(mesh *));
+}
+
+int main ()
+{
+    tests_run = tests_passed = 0;
+    srand(1);
+
+    test_watertight(16);
+    test_mesh_matches_linear_search(1, 1000);
+    test_mesh_matches_linear_search(100, 10000);
+    test_mesh_matches_linear_search(10000, 10000);
+    test_loaders();
+    test_bad_files();
+    test_geometry_fits_surface();
+
+    printf("%d out of %d tests passed.\n", tests_passed, tests_run);
+
+    if (tests_passed == tests_run)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
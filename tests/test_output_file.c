@@ -0,0 +1,184 @@
+#include "output_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+static int tests_run;
+static int tests_passed;
+
+void test_quantize_colors ()
+{
+    /* Odd counts leave some of the colors to the scalar code */
+    const int count = 1001;
+    float special[] = { .0f, -.0f, 1.0f, 255.0f / 256.0f, 254.999f / 256.0f, -1e-9f, 1e-9f,
+                        -1.0f, 2.0f, 1e10f, -1e10f, INFINITY, -INFINITY, NAN };
+    int num_special = sizeof(special) / sizeof(special[0]);
+    color * colors = malloc(sizeof(color) * count);
+    unsigned char * bytes = malloc(count * 3);
+    float * values = &colors[0].r;
+    int index, mismatches = 0;
+
+    for (index = 0; index < count * 3; index++)
+    {
+        values[index] = index < num_special ? special[index]
+                                            : -0.5f + 2.0f * (float)rand() / (float)RAND_MAX;
+    }
+    quantize_colors(colors, count, bytes);
+    for (index = 0; index < count * 3; index++)
+    {
+        if (bytes[index] != convert_to_8_bit(values[index]))
+        {
+            printf("Fail: quantize_colors: %g converts to %d, expected %d\n",
+                   values[index], bytes[index], convert_to_8_bit(values[index]));
+            mismatches++;
+        }
+    }
+    if (mismatches == 0)
+    {
+        printf("Pass: quantize_colors matches convert_to_8_bit for %d values\n", count * 3);
+        tests_passed++;
+    }
+    tests_run++;
+    free(colors);
+    free(bytes);
+}
+
+void test_ycbcr ()
+/*! Limited range BT.601: black and white are 16 and 235 with neutral
+    chroma, and chroma is the average of each 2 by 2 block, the blocks of an
+    odd edge being cut short */
+{
+    /* 3 by 3 pixels: white and black columns, then a red column */
+    unsigned char rgb[27];
+    unsigned char y[9], cb[4], cr[4];
+    const unsigned char expected_y[9] = { 235, 16, 82, 235, 16, 82, 235, 16, 82 };
+    const unsigned char expected_cb[4] = { 128, 90, 128, 90 };
+    const unsigned char expected_cr[4] = { 128, 240, 128, 240 };
+    int index;
+
+    for (index = 0; index < 9; index++)
+    {
+        memcpy(&rgb[index * 3], index % 3 == 0 ? "\xff\xff\xff" : index % 3 == 1 ? "\0\0\0"
+                                                                       : "\xff\0\0", 3);
+    }
+    convert_to_ycbcr(rgb, 3, 3, y, cb, cr);
+    if (memcmp(y, expected_y, 9) == 0 && memcmp(cb, expected_cb, 4) == 0 &&
+        memcmp(cr, expected_cr, 4) == 0)
+    {
+        printf("Pass: convert_to_ycbcr of white, black and red\n");
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: convert_to_ycbcr: Y %d %d %d, Cb %d %d, Cr %d %d\n",
+               y[0], y[1], y[2], cb[0], cb[1], cr[0], cr[1]);
+    }
+    tests_run++;
+}
+
+void test_video_streams ()
+/*! A Y4M stream is its header and a FRAME line and three planes per frame,
+    and a PAM stream is a whole PAM image per frame */
+{
+    const int width = 5, height = 3;
+    color image[15];
+    char header[64];
+    FILE * file;
+    long size, expected;
+    int index;
+
+    for (index = 0; index < width * height; index++)
+    {
+        image[index] = (color){ index / 15.0f, 0.5f, 1.0f };
+    }
+
+    file = tmpfile();
+    save_video_header(VIDEO_Y4M, width, height, 24, file);
+    save_video_frame(VIDEO_Y4M, image, width, height, file, NULL);
+    save_video_frame(VIDEO_Y4M, image, width, height, file, NULL);
+    size = ftell(file);
+    rewind(file);
+    fgets(header, sizeof(header), file);
+    expected = strlen(header) + 2 * (6 + width * height + 2 * 3 * 2);
+    if (strcmp(header, "YUV4MPEG2 W5 H3 F24:1 Ip A1:1 C420jpeg\n") == 0 && size == expected)
+    {
+        printf("Pass: Y4M stream of 2 frames, %ld bytes\n", size);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: Y4M stream: header %s, %ld bytes, expected %ld\n", header, size, expected);
+    }
+    tests_run++;
+    fclose(file);
+
+    file = tmpfile();
+    save_video_header(VIDEO_PAM, width, height, 24, file);
+    save_video_frame(VIDEO_PAM, image, width, height, file, NULL);
+    size = ftell(file);
+    expected = strlen("P7\nWIDTH 5\nHEIGHT 3\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n") +
+               width * height * 3;
+    if (size == expected)
+    {
+        printf("Pass: PAM frame, %ld bytes\n", size);
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: PAM frame: %ld bytes, expected %ld\n", size, expected);
+    }
+    tests_run++;
+    fclose(file);
+}
+
+void test_pfm ()
+/*! A PFM image lists its rows from the bottom up, after a header whose
+    scale is negative for little endian floats */
+{
+    const float values[6] = { 1, 2, 3, 4.5f, 5, 6e9f };
+    const float bottom_up[6] = { 4.5f, 5, 6e9f, 1, 2, 3 };
+    const unsigned int one = 1;
+    const char * header = *(const unsigned char *)&one ? "Pf\n3 2\n-1.0\n" : "Pf\n3 2\n1.0\n";
+    char read_header[32] = { 0 };
+    float read_values[6];
+    FILE * file = tmpfile();
+
+    save_pfm(values, 3, 2, file);
+    rewind(file);
+    if (fread(read_header, 1, strlen(header), file) == strlen(header) &&
+        strcmp(read_header, header) == 0 && fread(read_values, sizeof(float), 6, file) == 6 &&
+        fgetc(file) == EOF && memcmp(read_values, bottom_up, sizeof(bottom_up)) == 0)
+    {
+        printf("Pass: PFM image of 3 by 2 floats\n");
+        tests_passed++;
+    }
+    else
+    {
+        printf("Fail: PFM image: header %s\n", read_header);
+    }
+    tests_run++;
+    fclose(file);
+}
+
+int main ()
+{
+    tests_run = tests_passed = 0;
+
+    test_quantize_colors();
+    test_ycbcr();
+    test_video_streams();
+    test_pfm();
+
+    printf("%d out of %d tests passed.\n", tests_passed, tests_run);
+
+    if (tests_passed == tests_run)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/* Tests a server started with "ray_trace --serve" on the socket given as
+   the first argument: its renders of the scene given as the second argument
+   must be identical to the program's render of it, given as the third */
+
+static int tests_run;
+static int tests_passed;
+
+void test_bool (char * label, bool passed)
+{
+    printf("%s: %s\n", passed ? "Pass" : "Fail", label);
+    tests_passed += passed;
+    tests_run++;
+}
+
+int connect_server (char * socket_path)
+/*! Connect to the server, waiting for it to start */
+{
+    struct sockaddr_un address = { AF_UNIX };
+    struct timespec wait = { 0, 50000000 };
+    int attempt, fd = -1;
+
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    for (attempt = 0; attempt < 200 && fd < 0; attempt++)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)))
+        {
+            close(fd);
+            fd = -1;
+            nanosleep(&wait, NULL);
+        }
+    }
+    return fd;
+}
+
+void send_request (int fd, char * request)
+{
+    if (write(fd, request, strlen(request)) != (ssize_t)strlen(request))
+    {
+        perror("Request");
+    }
+}
+
+bool read_bytes (int fd, void * data, size_t size)
+{
+    char * bytes = data;
+    ssize_t received;
+
+    while (size > 0)
+    {
+        received = read(fd, bytes, size);
+        if (received <= 0)
+        {
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+void read_reply (int fd, char * line, size_t size)
+/*! Read a reply line, without its newline */
+{
+    size_t length = 0;
+
+    while (length + 1 < size && read_bytes(fd, &line[length], 1) && line[length] != '\n')
+    {
+        length++;
+    }
+    line[length] = '\0';
+}
+
+unsigned char * read_pixels (int fd, long id, int * width_out, int * height_out)
+/*! Read the reply to render request "id" and the pixels after it, or
+    return NULL if it isn't pixels */
+{
+    char line[256];
+    long reply_id;
+    unsigned long size;
+    unsigned char * pixels;
+
+    read_reply(fd, line, sizeof(line));
+    if (sscanf(line, "pixels %ld %d %d %lu", &reply_id, width_out, height_out, &size) != 4 ||
+        reply_id != id || size != 3ul * *width_out * *height_out)
+    {
+        printf("Unexpected reply: %s\n", line);
+        return NULL;
+    }
+    pixels = malloc(size);
+    if (!read_bytes(fd, pixels, size))
+    {
+        free(pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+unsigned char * load_ppm (char * filename, int * width_out, int * height_out)
+{
+    FILE * file = fopen(filename, "rb");
+    unsigned char * pixels = NULL;
+    size_t size;
+
+    if (file && fscanf(file, "P6 %d %d 255", width_out, height_out) == 2 && fgetc(file) == '\n')
+    {
+        size = 3ul * *width_out * *height_out;
+        pixels = malloc(size);
+        if (fread(pixels, 1, size, file) != size)
+        {
+            free(pixels);
+            pixels = NULL;
+        }
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+    return pixels;
+}
+
+bool region_matches (const unsigned char * image, int width, const unsigned char * region,
+                     int x0, int y0, int x1, int y1)
+/*! Determine if "region" holds the pixels of "image" from x0,y0 up to x1,y1 */
+{
+    int y;
+
+    for (y = y0; y < y1; y++)
+    {
+        if (memcmp(&image[3 * ((size_t)y * width + x0)], &region[3 * (size_t)(y - y0) * (x1 - x0)],
+                   3 * (x1 - x0)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_renders (int fd, char * scene, char * reference)
+/*! Whole images and regions, sent or put in shared memory, are the pixels
+    of the program's render */
+{
+    char request[512], line[256], shm_name[64];
+    unsigned char * expected, * pixels, * shared;
+    int width, height, expected_width, expected_height, shm_fd;
+
+    expected = load_ppm(reference, &expected_width, &expected_height);
+    if (expected == NULL)
+    {
+        test_bool("Reference image loaded", false);
+        return;
+    }
+
+    sprintf(request, "render 1 %s\n", scene);
+    send_request(fd, request);
+    pixels = read_pixels(fd, 1, &width, &height);
+    test_bool("Whole image", pixels && width == expected_width && height == expected_height &&
+                                 memcmp(pixels, expected, 3ul * width * height) == 0);
+    free(pixels);
+
+    sprintf(request, "render 2 %s region=10,20,100,50\n", scene);
+    send_request(fd, request);
+    pixels = read_pixels(fd, 2, &width, &height);
+    test_bool("Region", pixels && width == 90 && height == 30 &&
+                            region_matches(expected, expected_width, pixels, 10, 20, 100, 50));
+    free(pixels);
+
+    sprintf(shm_name, "/ray_trace_test_%d", (int)getpid());
+    shm_fd = shm_open(shm_name, O_CREAT | O_RDWR, 0600);
+    if (shm_fd < 0 || ftruncate(shm_fd, 3 * 64 * 48))
+    {
+        test_bool("Shared memory made", false);
+    }
+    else
+    {
+        sprintf(request, "render 3 %s region=300,200,364,248 shm=%s\n", scene, shm_name);
+        send_request(fd, request);
+        read_reply(fd, line, sizeof(line));
+        shared = mmap(NULL, 3 * 64 * 48, PROT_READ, MAP_SHARED, shm_fd, 0);
+        test_bool("Region in shared memory", strcmp(line, "pixels 3 64 48 shm") == 0 &&
+                                                 shared != MAP_FAILED &&
+                                                 region_matches(expected, expected_width, shared,
+                                                                300, 200, 364, 248));
+        munmap(shared, 3 * 64 * 48);
+        close(shm_fd);
+    }
+    shm_unlink(shm_name);
+    free(expected);
+}
+
+bool write_scene (char * filename, char * text)
+{
+    FILE * file = fopen(filename, "w");
+    bool written = file && fputs(text, file) >= 0;
+
+    return file && fclose(file) == 0 && written;
+}
+
+void test_overrides (int fd)
+/*! Requests override the camera of a scene like a scene file giving the
+    same camera */
+{
+    const char * surfaces =
+        "light position:(-10, 5, 10) color:(0.8,0.8,0.8)\n"
+        "sphere center:(0, 0, 0) radius:1 diffuse:(0.8,0.2,0.2) specular:(0.3,0.3,0.3)\n"
+        "quad vertices:((-3, -3, -1), (3, -3, -1), (3, 3, -1)) diffuse:(0.5,0.5,0.5)\n";
+    char text[1024];
+    unsigned char * overridden, * given;
+    int width, height, given_width, given_height;
+
+    sprintf(text, "camera position:(-5,0,0) view_angle:60 resolution:(64,48)\n%s", surfaces);
+    write_scene("server_camera.txt", text);
+    sprintf(text, "camera position:(-4,1,2) direction:(10,-20) view_angle:45 "
+                  "resolution:(40,30)\n%s", surfaces);
+    write_scene("server_given.txt", text);
+
+    send_request(fd, "render 4 server_camera.txt position=-4,1,2 direction=10,-20 "
+                     "view_angle=45 resolution=40,30\n"
+                     "render 5 server_given.txt\n");
+    overridden = read_pixels(fd, 4, &width, &height);
+    given = read_pixels(fd, 5, &given_width, &given_height);
+    test_bool("Camera given by the request", overridden && given && width == 40 &&
+                                                 height == 30 && given_width == 40 &&
+                                                 given_height == 30 &&
+                                                 memcmp(overridden, given, 3 * 40 * 30) == 0);
+    free(overridden);
+    free(given);
+
+    /* Only the request is rendered with its camera */
+    send_request(fd, "render 6 server_camera.txt\n");
+    overridden = read_pixels(fd, 6, &width, &height);
+    test_bool("Camera of the scene file", overridden && width == 64 && height == 48);
+    free(overridden);
+    remove("server_camera.txt");
+    remove("server_given.txt");
+}
+
+void test_reload (int fd)
+/*! A scene is loaded again once its file changes */
+{
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000000000, 0 } };
+    unsigned char * pixels;
+    int width, height;
+    bool red, blue;
+
+    write_scene("server_reload.txt", "camera resolution:(8,8)\nbackground color:(1,0,0)\n");
+    send_request(fd, "render 7 server_reload.txt\n");
+    pixels = read_pixels(fd, 7, &width, &height);
+    red = pixels && pixels[0] == 255 && pixels[2] == 0;
+    free(pixels);
+
+    /* The same size, and a different time, however fast the test runs */
+    write_scene("server_reload.txt", "camera resolution:(8,8)\nbackground color:(0,0,1)\n");
+    utimensat(AT_FDCWD, "server_reload.txt", times, 0);
+    send_request(fd, "render 8 server_reload.txt\n");
+    pixels = read_pixels(fd, 8, &width, &height);
+    blue = pixels && pixels[0] == 0 && pixels[2] == 255;
+    free(pixels);
+    test_bool("Scene loaded again once changed", red && blue);
+    remove("server_reload.txt");
+}
+
+void test_errors (int fd)
+{
+    char line[256];
+
+    send_request(fd, "render 9 missing.txt\n");
+    read_reply(fd, line, sizeof(line));
+    test_bool("Missing scene", strncmp(line, "error 9 ", 8) == 0);
+    send_request(fd, "render 10 missing.txt resolution=1000000,10\n");
+    read_reply(fd, line, sizeof(line));
+    test_bool("Bad resolution", strncmp(line, "error 10 Resolution", 19) == 0);
+    send_request(fd, "paint 11\n");
+    read_reply(fd, line, sizeof(line));
+    test_bool("Unknown request", strncmp(line, "error 0 Unknown request", 23) == 0);
+}
+
+void test_cancel (char * socket_path, int fd, char * scene, char * reference)
+/*! Requests are cancelled while they render or wait, and by the client
+    hanging up, and the server goes on to render the next */
+{
+    char request[512], line[256];
+    unsigned char * expected, * pixels;
+    int width, height, other;
+    bool cancelled;
+
+    other = connect_server(socket_path);
+    sprintf(request, "render 1 %s resolution=6000,4500\n", scene);
+    send_request(other, request);
+    close(other);
+
+    sprintf(request, "render 12 %s resolution=6000,4500\n"
+                     "render 13 %s resolution=6000,4500\n"
+                     "cancel 13\ncancel 12\n", scene, scene);
+    send_request(fd, request);
+    read_reply(fd, line, sizeof(line));
+    cancelled = strcmp(line, "cancelled 12") == 0;
+    read_reply(fd, line, sizeof(line));
+    test_bool("Requests cancelled", cancelled && strcmp(line, "cancelled 13") == 0);
+
+    expected = load_ppm(reference, &width, &height);
+    sprintf(request, "render 14 %s\n", scene);
+    send_request(fd, request);
+    pixels = read_pixels(fd, 14, &width, &height);
+    test_bool("Image after cancelling", pixels && expected &&
+                                            memcmp(pixels, expected, 3ul * width * height) == 0);
+    free(pixels);
+    free(expected);
+}
+
+void test_stalled_client (char * socket_path, int fd, char * scene, char * reference)
+/*! A client that doesn't read its image, too big for the socket to hold,
+    holds up no one else's requests */
+{
+    struct timeval timeout = { 60, 0 }, no_timeout = { 0, 0 };
+    char request[512];
+    unsigned char * expected, * pixels;
+    int width, height, other;
+
+    other = connect_server(socket_path);
+    sprintf(request, "render 15 %s resolution=2000,1500\n", scene);
+    send_request(other, request);
+
+    /* A server stuck sending to the other client would never reply */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    expected = load_ppm(reference, &width, &height);
+    sprintf(request, "render 16 %s\n", scene);
+    send_request(fd, request);
+    pixels = read_pixels(fd, 16, &width, &height);
+    test_bool("Image while another client stalls",
+              pixels && expected && memcmp(pixels, expected, 3ul * width * height) == 0);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    free(pixels);
+    free(expected);
+    close(other);
+}
+
+void test_cache (int fd)
+/*! The server is run with a cache too small for two scenes, so only the
+    last scene stays */
+{
+    char line[256];
+    int scenes;
+    unsigned long memory;
+
+    send_request(fd, "status\n");
+    read_reply(fd, line, sizeof(line));
+    test_bool("Least recently used scenes released",
+              sscanf(line, "status %d %lu", &scenes, &memory) == 2 && scenes == 1 && memory > 0);
+}
+
+int main (int argc, char * argv[])
+{
+    int fd;
+
+    tests_run = tests_passed = 0;
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s <socket> <scene_file> <reference_ppm_file>\n", argv[0]);
+        return 1;
+    }
+    fd = connect_server(argv[1]);
+    if (fd < 0)
+    {
+        perror("Connecting to the server");
+        return 1;
+    }
+
+    test_renders(fd, argv[2], argv[3]);
+    test_overrides(fd);
+    test_reload(fd);
+    test_errors(fd);
+    test_cancel(argv[1], fd, argv[2], argv[3]);
+    test_stalled_client(argv[1], fd, argv[2], argv[3]);
+    test_cache(fd);
+    close(fd);
+
+    printf("%d out of %d tests passed.\n", tests_passed, tests_run);
+
+    if (tests_passed == tests_run)
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}